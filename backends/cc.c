@@ -24,11 +24,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+
+#include <glib/gstdio.h>
 
 #include "../compiler-internals.h"
 #include "../compiler_types.h"
+#include "../bench.h"
+
+/* The state of writing the C code is per thread, so several mathmaps
+   can be compiled at the same time. */
+static __thread filter_code_t **filter_codes;
+/* if not NULL, the C code includes this header instead of the
+   template's prelude */
+static __thread char *prelude_header = NULL;
+
+/* Number of adjacent columns the vectorized pixel code handles per
+   iteration. */
+#define VECTOR_WIDTH		8
 
-static filter_code_t **filter_codes;
+static gboolean vectorize = TRUE;
+/* whether the code being written may be vectorized */
+static __thread gboolean vectorize_code = FALSE;
+/* set while emitting vectorized pixel code */
+static __thread gboolean output_lanes = FALSE;
 
 // defined in compiler-types.h
 MAKE_TYPE_C_TYPE_NAME
@@ -83,7 +102,7 @@ output_value_name (FILE *out, value_t *value, int for_decl)
 	    if ((value->const_type | CONST_T) == (CONST_X | CONST_Y | CONST_T))
 		fprintf(out, "xy_vars->");
 	    else if ((value->const_type | CONST_T) == (CONST_Y | CONST_T))
-		fprintf(out, "y_vars->");
+		fprintf(out, output_lanes ? "y_vars[lane]." : "y_vars->");
 	}
 #endif
 
@@ -91,6 +110,13 @@ output_value_name (FILE *out, value_t *value, int for_decl)
 	    fprintf(out, "var_%d_%d_%d", value->compvar->index, value->compvar->n, value->index);
 	else
 	    fprintf(out, "tmp_%d_%d", value->compvar->temp->number, value->index);
+
+#ifndef NO_CONSTANTS_ANALYSIS
+	/* in vectorized code all non-permanent values have one
+	   element per lane */
+	if (output_lanes && !for_decl && !compiler_is_permanent_const_value(value))
+	    fputs("[lane]", out);
+#endif
     }
 }
 
@@ -99,8 +125,17 @@ output_value_decl (FILE *out, value_t *value)
 {
     if (!value->have_defined && value->index >= 0)
     {
-	fprintf(out, "%s ", type_c_type_name(value->compvar->type));
+	int local_tuple_length = compiler_local_tuple_length(value);
+
+	if (local_tuple_length > 0)
+	    fputs("float ", out);
+	else
+	    fprintf(out, "%s ", type_c_type_name(value->compvar->type));
 	output_value_name(out, value, 1);
+	if (output_lanes)
+	    fprintf(out, "[%d]", VECTOR_WIDTH);
+	if (local_tuple_length > 0)
+	    fprintf(out, "[%d]", local_tuple_length);
 	fputs(";\n", out);
 	value->have_defined = 1;
     }
@@ -201,12 +236,32 @@ output_rhs (FILE *out, rhs_t *rhs)
 	case RHS_INTERNAL :
 	    fputs(rhs->v.internal->name, out);
 	    /* fprintf(out, "invocation->internals[%d].data[0]", rhs->v.internal->index); */
+	    if (output_lanes && !(rhs->v.internal->const_type & CONST_X))
+		fputs("[lane]", out);
 	    break;
 
 	case RHS_OP :
 	    {
 		int i;
 
+		if (output_lanes && rhs->v.op.op->index == OP_OUTPUT_TUPLE)
+		{
+		    fputs("((return_tuples[lane] = (", out);
+		    output_primary(out, &rhs->v.op.args[0]);
+		    fputs(")), 0)", out);
+		    break;
+		}
+
+		if (rhs->v.op.op->index == OP_OUTPUT_TUPLE
+		    && rhs->v.op.args[0].kind == PRIMARY_VALUE
+		    && compiler_local_tuple_length(rhs->v.op.args[0].v.value) > 0)
+		{
+		    fputs("OUTPUT_LOCAL_TUPLE(", out);
+		    output_primary(out, &rhs->v.op.args[0]);
+		    fputs(")", out);
+		    break;
+		}
+
 		fprintf(out, "%s(", rhs->v.op.op->name);
 		for (i = 0; i < rhs->v.op.op->num_args; ++i)
 		{
@@ -305,6 +360,46 @@ output_rhs (FILE *out, rhs_t *rhs)
     }
 }
 
+/* Tuples that are only taken apart or output are kept in local
+   arrays, which the C compiler can break up into registers, so
+   instead of allocating them we fill them in place. */
+static void
+output_local_tuple_assign (FILE *out, statement_t *stmt)
+{
+    value_t *lhs = stmt->v.assign.lhs;
+    rhs_t *rhs = stmt->v.assign.rhs;
+    int i;
+
+    switch (rhs->kind)
+    {
+	case RHS_TUPLE :
+	    for (i = 0; i < rhs->v.tuple.length; ++i)
+	    {
+		fputs("TUPLE_SET(", out);
+		output_value_name(out, lhs, 0);
+		fprintf(out, ", %d, ", i);
+		output_primary(out, &rhs->v.tuple.args[i]);
+		fputs(");\n", out);
+	    }
+	    break;
+
+	case RHS_OP :
+	    /* ORIG_VAL or APPLY_GRADIENT */
+	    fprintf(out, "%s_INTO(", rhs->v.op.op->name);
+	    output_value_name(out, lhs, 0);
+	    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+	    {
+		fputs(", ", out);
+		output_primary(out, &rhs->v.op.args[i]);
+	    }
+	    fputs(");\n", out);
+	    break;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
 static void
 output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
 {
@@ -356,6 +451,11 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 		    break;
 
 		case STMT_ASSIGN :
+		    if (compiler_local_tuple_length(stmt->v.assign.lhs) > 0)
+		    {
+			output_local_tuple_assign(out, stmt);
+			break;
+		    }
 		    output_value_name(out, stmt->v.assign.lhs, 0);
 		    fputs(" = ", out);
 		    output_rhs(out, stmt->v.assign.rhs);
@@ -447,17 +547,382 @@ output_all_code (filter_code_t *code, FILE *out)
     output_stmts(out, code->first_stmt, SLICE_IGNORE);
 }
 
+/*** row vectorization ***/
+
+/*
+ * The pixel code of a filter that does only arithmetic on ints and
+ * floats is also emitted in a form that evaluates VECTOR_WIDTH
+ * adjacent columns at once.  Every value becomes an array with one
+ * element per lane and every statement a loop over the lanes, which
+ * the C compiler turns into SIMD code.  Conditionals are
+ * if-converted: both branches are evaluated for all lanes and the
+ * phis select the result per lane.  Filters with loops or any other
+ * ops only get the scalar code.
+ */
+
+void
+cc_set_vectorize (gboolean _vectorize)
+{
+    vectorize = _vectorize;
+}
+
+gboolean
+cc_get_vectorize (void)
+{
+    return vectorize;
+}
+
+#ifndef NO_CONSTANTS_ANALYSIS
+static __thread int num_vector_output_tuples;
+static __thread int num_vector_conds;
+
+static gboolean
+type_is_vectorizable (type_t type)
+{
+    return type == TYPE_INT || type == TYPE_FLOAT;
+}
+
+static gboolean
+primary_is_vectorizable (primary_t *primary, type_t type)
+{
+    if (primary->kind == PRIMARY_VALUE)
+	return primary->v.value->compvar->type == type
+	    || (type == TYPE_FLOAT && primary->v.value->compvar->type == TYPE_INT);
+    else
+	return primary->const_type == type
+	    || (type == TYPE_FLOAT && primary->const_type == TYPE_INT);
+}
+
+static gboolean
+rhs_is_vectorizable (rhs_t *rhs, gboolean in_branch)
+{
+    int i;
+
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	    return primary_is_vectorizable(&rhs->v.primary, TYPE_FLOAT)
+		|| primary_is_vectorizable(&rhs->v.primary, TYPE_TUPLE);
+
+	case RHS_INTERNAL :
+	    /* x is the only internal with one value per lane */
+	    return (rhs->v.internal->const_type & CONST_X)
+		|| strcmp(rhs->v.internal->name, "x") == 0;
+
+	case RHS_TUPLE :
+	    for (i = 0; i < rhs->v.tuple.length; ++i)
+		if (!primary_is_vectorizable(&rhs->v.tuple.args[i], TYPE_FLOAT))
+		    return FALSE;
+	    return TRUE;
+
+	case RHS_OP :
+	    switch (rhs->v.op.op->index)
+	    {
+		case OP_OUTPUT_TUPLE :
+		    if (in_branch)
+			return FALSE;
+		    ++num_vector_output_tuples;
+		    return primary_is_vectorizable(&rhs->v.op.args[0], TYPE_TUPLE);
+
+		case OP_TUPLE_NTH :
+		    return primary_is_vectorizable(&rhs->v.op.args[0], TYPE_TUPLE)
+			&& primary_is_vectorizable(&rhs->v.op.args[1], TYPE_INT);
+
+		case OP_NOP :
+		case OP_INT_TO_FLOAT :
+		case OP_FLOAT_TO_INT :
+		case OP_ADD :
+		case OP_SUB :
+		case OP_NEG :
+		case OP_MUL :
+		case OP_DIV :
+		case OP_MOD :
+		case OP_ABS :
+		case OP_MIN :
+		case OP_MAX :
+		case OP_SQRT :
+		case OP_HYPOT :
+		case OP_SIN :
+		case OP_COS :
+		case OP_TAN :
+		case OP_ASIN :
+		case OP_ACOS :
+		case OP_ATAN :
+		case OP_ATAN2 :
+		case OP_POW :
+		case OP_EXP :
+		case OP_LOG :
+		case OP_SINH :
+		case OP_COSH :
+		case OP_TANH :
+		case OP_FLOOR :
+		case OP_CEIL :
+		case OP_EQ :
+		case OP_LESS :
+		case OP_LEQ :
+		case OP_NOT :
+		case OP_USERVAL_INT :
+		case OP_USERVAL_FLOAT :
+		case OP_USERVAL_BOOL :
+		case OP_LIBNOISE_PERLIN :
+		case OP_LIBNOISE_BILLOW :
+		case OP_LIBNOISE_RIDGED_MULTI :
+		case OP_LIBNOISE_VORONOI :
+		    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+			if (!primary_is_vectorizable(&rhs->v.op.args[i], TYPE_FLOAT))
+			    return FALSE;
+		    return TRUE;
+
+		default :
+		    return FALSE;
+	    }
+
+	default :
+	    return FALSE;
+    }
+}
+
+static gboolean
+assign_is_vectorizable (statement_t *stmt, gboolean in_branch)
+{
+    type_t type = stmt->v.assign.lhs->compvar->type;
+
+    if (!type_is_vectorizable(type) && type != TYPE_TUPLE)
+	return FALSE;
+    if (!rhs_is_vectorizable(stmt->v.assign.rhs, in_branch))
+	return FALSE;
+    if (stmt->kind == STMT_PHI_ASSIGN && !rhs_is_vectorizable(stmt->v.assign.rhs2, TRUE))
+	return FALSE;
+    return TRUE;
+}
+
+static gboolean
+stmts_are_vectorizable (statement_t *stmt, unsigned int slice_flag, gboolean in_branch)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+	if ((stmt->slice_flags & slice_flag) == 0)
+	    continue;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (!assign_is_vectorizable(stmt, in_branch))
+		    return FALSE;
+		break;
+
+	    case STMT_IF_COND :
+		if (!rhs_is_vectorizable(stmt->v.if_cond.condition, TRUE)
+		    || !stmts_are_vectorizable(stmt->v.if_cond.consequent, slice_flag, TRUE)
+		    || !stmts_are_vectorizable(stmt->v.if_cond.alternative, slice_flag, TRUE))
+		    return FALSE;
+		{
+		    statement_t *phi;
+
+		    for (phi = stmt->v.if_cond.exit; phi != 0; phi = phi->next)
+			if (phi->kind == STMT_PHI_ASSIGN && (phi->slice_flags & slice_flag)
+			    && !assign_is_vectorizable(phi, TRUE))
+			    return FALSE;
+		}
+		break;
+
+	    default :
+		return FALSE;
+	}
+    }
+
+    return TRUE;
+}
+#endif
+
+static gboolean
+filter_is_vectorizable (filter_code_t *code)
+{
+#ifdef NO_CONSTANTS_ANALYSIS
+    return FALSE;
+#else
+    if (!vectorize_code)
+	return FALSE;
+
+    compiler_slice_code_for_const(code->first_stmt, 0);
+
+    num_vector_output_tuples = 0;
+    return stmts_are_vectorizable(code->first_stmt, compiler_slice_flag_for_const_type(0), FALSE)
+	&& num_vector_output_tuples == 1;
+#endif
+}
+
+#ifndef NO_CONSTANTS_ANALYSIS
+static void
+output_lane_loop (FILE *out)
+{
+    fprintf(out, "for (lane = 0; lane < %d; ++lane)\n", VECTOR_WIDTH);
+}
+
+static gboolean
+primary_is_lane_invariant (primary_t *primary)
+{
+    if (primary->kind == PRIMARY_CONST)
+	return TRUE;
+    return compiler_is_permanent_const_value(primary->v.value)
+	&& (primary->v.value->const_type & CONST_X);
+}
+
+/* A libnoise call whose parameters are the same for all lanes is
+   done for the whole vector with one call of the row function, which
+   looks up the configured module only once. */
+static gboolean
+output_libnoise_row_call (FILE *out, statement_t *stmt)
+{
+    rhs_t *rhs = stmt->v.assign.rhs;
+    int num_params, i;
+
+    if (rhs->kind != RHS_OP)
+	return FALSE;
+
+    switch (rhs->v.op.op->index)
+    {
+	case OP_LIBNOISE_PERLIN :
+	case OP_LIBNOISE_BILLOW :
+	case OP_LIBNOISE_RIDGED_MULTI :
+	case OP_LIBNOISE_VORONOI :
+	    break;
+
+	default :
+	    return FALSE;
+    }
+
+    /* the last three arguments are the coordinates */
+    num_params = rhs->v.op.op->num_args - 3;
+    for (i = 0; i < num_params; ++i)
+	if (!primary_is_lane_invariant(&rhs->v.op.args[i]))
+	    return FALSE;
+
+    fprintf(out, "{\nfloat noise_x[%d], noise_y[%d], noise_z[%d];\n", VECTOR_WIDTH, VECTOR_WIDTH, VECTOR_WIDTH);
+    output_lane_loop(out);
+    fputs("{\nnoise_x[lane] = ", out);
+    output_primary(out, &rhs->v.op.args[num_params]);
+    fputs(";\nnoise_y[lane] = ", out);
+    output_primary(out, &rhs->v.op.args[num_params + 1]);
+    fputs(";\nnoise_z[lane] = ", out);
+    output_primary(out, &rhs->v.op.args[num_params + 2]);
+    fputs(";\n}\n", out);
+
+    fprintf(out, "%s_row(", rhs->v.op.op->name);
+    for (i = 0; i < num_params; ++i)
+    {
+	output_primary(out, &rhs->v.op.args[i]);
+	fputs(", ", out);
+    }
+    fputs("noise_x, noise_y, noise_z, ", out);
+    /* the result is a per-lane array, so print its bare name */
+    output_value_name(out, stmt->v.assign.lhs, 1);
+    fprintf(out, ", %d);\n}\n", VECTOR_WIDTH);
+
+    return TRUE;
+}
+
+static void
+output_vector_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+	if ((stmt->slice_flags & slice_flag) == 0)
+	    continue;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (output_libnoise_row_call(out, stmt))
+		    break;
+		output_lane_loop(out);
+		if (compiler_local_tuple_length(stmt->v.assign.lhs) > 0)
+		{
+		    fputs("{\n", out);
+		    output_local_tuple_assign(out, stmt);
+		    fputs("}\n", out);
+		    break;
+		}
+		output_value_name(out, stmt->v.assign.lhs, 0);
+		fputs(" = ", out);
+		output_rhs(out, stmt->v.assign.rhs);
+		fputs(";\n", out);
+		break;
+
+	    case STMT_IF_COND :
+		{
+		    int cond = num_vector_conds++;
+		    statement_t *phi;
+
+		    fprintf(out, "{\nint cond_%d[%d];\n", cond, VECTOR_WIDTH);
+		    output_lane_loop(out);
+		    fprintf(out, "cond_%d[lane] = ", cond);
+		    output_rhs(out, stmt->v.if_cond.condition);
+		    fputs(";\n", out);
+
+		    output_vector_stmts(out, stmt->v.if_cond.consequent, slice_flag);
+		    output_vector_stmts(out, stmt->v.if_cond.alternative, slice_flag);
+
+		    for (phi = stmt->v.if_cond.exit; phi != 0; phi = phi->next)
+		    {
+			if (phi->kind != STMT_PHI_ASSIGN || (phi->slice_flags & slice_flag) == 0)
+			    continue;
+
+			output_lane_loop(out);
+			output_value_name(out, phi->v.assign.lhs, 0);
+			fprintf(out, " = cond_%d[lane] ? (", cond);
+			output_rhs(out, phi->v.assign.rhs);
+			fputs(") : (", out);
+			output_rhs(out, phi->v.assign.rhs2);
+			fputs(");\n", out);
+		    }
+
+		    fputs("}\n", out);
+		}
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+#endif
+
+static void
+output_vector_code (filter_code_t *code, FILE *out)
+{
+#ifndef NO_CONSTANTS_ANALYSIS
+    g_assert(filter_is_vectorizable(code));
+
+    output_lanes = TRUE;
+    num_vector_conds = 0;
+
+    /* declarations */
+    compiler_reset_have_defined(code->first_stmt);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_value_if_needed_code, out, (void*)0);
+
+    /* code */
+    compiler_slice_code_for_const(code->first_stmt, 0);
+    output_vector_stmts(out, code->first_stmt, compiler_slice_flag_for_const_type(0));
+
+    output_lanes = FALSE;
+#endif
+}
+
 /*** template processing ***/
 
-static char *include_path = 0;
+static __thread const char *include_path = 0;
 
 static void
 set_include_path (const char *path)
 {
-    if (include_path != 0)
-	free(include_path);
-    include_path = strdup(path);
-    assert(include_path != 0);
+    include_path = path;
 }
 
 static int
@@ -477,6 +942,13 @@ filter_template_processor (mathmap_t *mathmap, const char *directive, const char
 	fputs(code->filter->name, out);
     else if (strcmp(directive, "m") == 0)
 	output_permanent_const_code(code, out, 0);
+    else if (strcmp(directive, "vector_width") == 0)
+	fprintf(out, "%d", filter_is_vectorizable(code) ? VECTOR_WIDTH : 0);
+    else if (strcmp(directive, "vector_m") == 0)
+    {
+	if (filter_is_vectorizable(code))
+	    output_vector_code(code, out);
+    }
     else if (strcmp(directive, "xy_decls") == 0)
     {
 #ifndef NO_CONSTANTS_ANALYSIS
@@ -555,6 +1027,15 @@ compiler_template_processor (mathmap_t *mathmap, const char *directive, const ch
     {
 	fprintf(out, "%d", mathmap->main_filter->num_uservals);
     }
+    else if (strcmp(directive, "prelude_begin") == 0)
+    {
+	g_assert(arg != 0);
+
+	if (prelude_header != NULL)
+	    fprintf(out, "#include \"%s\"\n", prelude_header);
+	else
+	    process_template(mathmap, arg, out, compiler_template_processor, data);
+    }
     else if (strcmp(directive, "native_filter_decls") == 0)
     {
 	filter_t *filter;
@@ -631,64 +1112,350 @@ exec_cmd (char *log_filename, char *format, ...)
 
 #define TMP_PREFIX		"/tmp/mathfunc"
 
-initfunc_t
-gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_filename, char *include_path,
-		     filter_code_t **the_filter_codes)
+/*** precompiled prelude ***/
+
+/* The part of the template between $prelude_begin and $prelude_end
+   is the same for all filters, so it's compiled only once, into a
+   precompiled header that the filters' C files include instead.  The
+   header and its precompiled version are kept in the prelude
+   subdirectory of the module cache, named by a hash of everything
+   that goes into them, so they're rebuilt when MathMap or the C
+   compiler flags change.  Without the module cache the prelude is
+   compiled with every filter.  If
+   gcc can't use the precompiled header it falls back to the header's
+   text, so the worst that can happen is that we're not faster. */
+
+#define PRELUDE_BEGIN		"$prelude_begin"
+#define PRELUDE_END		"$prelude_end"
+
+static gboolean precompiled_prelude = TRUE;
+
+void
+cc_set_precompiled_prelude (gboolean precompiled)
+{
+    precompiled_prelude = precompiled;
+}
+
+gboolean
+cc_get_precompiled_prelude (void)
+{
+    return precompiled_prelude;
+}
+
+static void
+checksum_update_file_contents (GChecksum *checksum, const char *filename)
 {
-    static int last_mathfunc = 0;
+    char *contents;
+    gsize length;
+
+    if (g_file_get_contents(filename, &contents, &length, NULL))
+    {
+	g_checksum_update(checksum, (const guchar*)contents, length);
+	g_free(contents);
+    }
+}
 
+/* Writes the prelude of the template to a memory buffer, which the
+   caller must free().  Returns NULL if the template has no
+   prelude. */
+static char*
+process_prelude (mathmap_t *mathmap, char *template_filename, char *include_path)
+{
+    char *template, *begin, *end;
+    char *prelude;
+    size_t prelude_size;
     FILE *out;
-    char *c_filename, *o_filename, *so_filename, *log_filename;
-    int pid = getpid();
-    initfunc_t initfunc;
-#ifndef OPENSTEP
-    void *initfunc_ptr;
-    GModule *module = 0;
-#endif
 
-    filter_codes = the_filter_codes;
+    if (!g_file_get_contents(template_filename, &template, NULL, NULL))
+	return NULL;
 
-    c_filename = g_strdup_printf("%s%d_%d.c", TMP_PREFIX, pid, ++last_mathfunc);
-    out = fopen(c_filename, "w");
-    if (out == 0)
+    begin = strstr(template, PRELUDE_BEGIN);
+    end = begin == NULL ? NULL : strstr(begin, PRELUDE_END);
+    if (end == NULL)
     {
-	sprintf(error_string, _("Could not write temporary file `%s'"), c_filename);
-	return 0;
+	g_free(template);
+	return NULL;
+    }
+
+    *end = '\0';
+
+    out = open_memstream(&prelude, &prelude_size);
+    if (out == NULL)
+    {
+	g_free(template);
+	return NULL;
     }
 
     set_include_path(include_path);
-    if (!process_template_file(mathmap, template_filename, out, &compiler_template_processor, 0))
+    process_template(mathmap, begin + strlen(PRELUDE_BEGIN), out, compiler_template_processor, 0);
+    set_include_path(NULL);
+    fclose(out);
+
+    g_free(template);
+
+    return prelude;
+}
+
+/* Returns the name of the prelude header for the template, building
+   it and its precompiled version first if necessary, or NULL if
+   there is none. */
+static char*
+get_prelude_header (mathmap_t *mathmap, char *template_filename, char *include_path)
+{
+    static GStaticMutex mutex = G_STATIC_MUTEX_INIT;
+    static char *last_template_filename = NULL;
+    static char *last_header = NULL;
+
+    char *prelude;
+    GChecksum *checksum;
+    char *filename, *dir, *header, *gch, *tmp_filename, *log_filename;
+    gboolean success;
+
+    g_static_mutex_lock(&mutex);
+
+    /* the template doesn't change while we're running */
+    if (last_template_filename != NULL && strcmp(last_template_filename, template_filename) == 0)
     {
-	sprintf(error_string, _("Could not process template file `%s'"), template_filename);
-	return 0;
+	header = g_strdup(last_header);
+	g_static_mutex_unlock(&mutex);
+	return header;
+    }
+
+    dir = module_cache_get_subdirectory("prelude");
+    if (dir == NULL)
+    {
+	g_static_mutex_unlock(&mutex);
+	return NULL;
+    }
+
+    prelude = process_prelude(mathmap, template_filename, include_path);
+    if (prelude == NULL)
+    {
+	g_free(dir);
+	g_static_mutex_unlock(&mutex);
+	return NULL;
+    }
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar*)CGEN_CC, strlen(CGEN_CC) + 1);
+    g_checksum_update(checksum, (const guchar*)prelude, strlen(prelude) + 1);
+    filename = g_strdup_printf("%s/%s", include_path, OPMACROS_FILENAME);
+    checksum_update_file_contents(checksum, filename);
+    g_free(filename);
+    filename = g_strdup_printf("%s/pools.h", include_path);
+    checksum_update_file_contents(checksum, filename);
+    g_free(filename);
+
+    header = g_strdup_printf("%s/prelude-%s.h", dir, g_checksum_get_string(checksum));
+    gch = g_strdup_printf("%s.gch", header);
+
+    g_checksum_free(checksum);
+
+    if (g_access(header, R_OK) == 0 && g_access(gch, R_OK) == 0)
+    {
+	g_free(prelude);
+	g_free(dir);
+	g_free(gch);
+	goto done;
+    }
+
+    bench_end_phase(BENCH_PHASE_BACKEND);
+    bench_begin_phase(BENCH_PHASE_PRELUDE);
+
+    success = FALSE;
+    log_filename = g_strdup_printf("%s%d_prelude.log", TMP_PREFIX, getpid());
+    /* writers rename their files into place, so concurrent processes
+       never see half-written ones */
+    tmp_filename = g_strdup_printf("%s.%d.tmp", gch, getpid());
+
+    if (g_mkdir_with_parents(dir, 0755) != 0)
+	g_warning("Cannot create prelude directory `%s': %s", dir, strerror(errno));
+    else if (!g_file_set_contents(header, prelude, -1, NULL))
+	g_warning("Cannot write prelude header `%s'", header);
+    else if (exec_cmd(log_filename, "%s %s -x c-header %s", CGEN_CC, tmp_filename, header) != 0)
+	g_warning("Could not compile prelude header.  See logfile `%s'.", log_filename);
+    else if (g_rename(tmp_filename, gch) != 0)
+	g_warning("Cannot rename precompiled prelude to `%s': %s", gch, strerror(errno));
+    else
+	success = TRUE;
+
+    if (success)
+	unlink(log_filename);
+    unlink(tmp_filename);
+
+    bench_end_phase(BENCH_PHASE_PRELUDE);
+    bench_begin_phase(BENCH_PHASE_BACKEND);
+
+    g_free(tmp_filename);
+    g_free(log_filename);
+    g_free(prelude);
+    g_free(dir);
+    g_free(gch);
+
+    if (!success)
+    {
+	g_free(header);
+	header = NULL;
     }
 
+ done:
+    g_free(last_template_filename);
+    g_free(last_header);
+    last_template_filename = g_strdup(template_filename);
+    last_header = header;
+
+    header = g_strdup(last_header);
+
+    g_static_mutex_unlock(&mutex);
+
+    return header;
+}
+
+gboolean
+cc_write_c_code (mathmap_t *mathmap, char *template_filename, char *include_path,
+		 filter_code_t **the_filter_codes, gboolean allow_vectorize, FILE *out)
+{
+    gboolean success;
+
+    filter_codes = the_filter_codes;
+    vectorize_code = vectorize && allow_vectorize;
+
+    set_include_path(include_path);
+    success = process_template_file(mathmap, template_filename, out, &compiler_template_processor, 0);
+    if (!success)
+	sprintf(error_string, _("Could not process template file `%s'"), template_filename);
+
+    set_include_path(NULL);
     filter_codes = 0;
 
+    return success;
+}
+
+/* The files of one run of the C compiler. */
+typedef struct
+{
+    char *c_filename;
+    char *o_filename;
+    char *so_filename;
+    char *log_filename;
+    char *cache_key;
+} c_build_t;
+
+static void
+free_c_build (c_build_t *build)
+{
+#ifndef DONT_UNLINK_SO
+    unlink(build->so_filename);
+#endif
+    g_free(build->so_filename);
+
+    unlink(build->o_filename);
+    g_free(build->o_filename);
+
+#ifndef DONT_UNLINK_C
+    unlink(build->c_filename);
+#endif
+    g_free(build->c_filename);
+
+    unlink(build->log_filename);
+    g_free(build->log_filename);
+
+    g_free(build->cache_key);
+
+    g_free(build);
+}
+
+/* Writes the C file for the filter codes.  Returns NULL and sets
+   error_string on failure. */
+static c_build_t*
+write_c_file (mathmap_t *mathmap, char *template_filename, char *include_path,
+	      filter_code_t **the_filter_codes, const char *cache_key)
+{
+    static volatile gint last_mathfunc = 0;
+
+    c_build_t *build;
+    FILE *out;
+    gboolean success;
+    int pid = getpid();
+    int number = g_atomic_int_exchange_and_add(&last_mathfunc, 1) + 1;
+
+    build = g_new0(c_build_t, 1);
+    build->c_filename = g_strdup_printf("%s%d_%d.c", TMP_PREFIX, pid, number);
+    build->o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, number);
+    build->so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, number);
+    build->log_filename = g_strdup_printf("%s%d_%d.log", TMP_PREFIX, pid, number);
+    build->cache_key = g_strdup(cache_key);
+
+    out = fopen(build->c_filename, "w");
+    if (out == 0)
+    {
+	sprintf(error_string, _("Could not write temporary file `%s'"), build->c_filename);
+	free_c_build(build);
+	return NULL;
+    }
+
+    if (precompiled_prelude)
+	prelude_header = get_prelude_header(mathmap, template_filename, include_path);
+
+    success = cc_write_c_code(mathmap, template_filename, include_path, the_filter_codes, TRUE, out);
+
+    g_free(prelude_header);
+    prelude_header = NULL;
+
     fclose(out);
 
-    o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, last_mathfunc);
-    log_filename = g_strdup_printf("%s%d_%d.log", TMP_PREFIX, pid, last_mathfunc);
+    if (!success)
+    {
+	free_c_build(build);
+	return NULL;
+    }
+
+    return build;
+}
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_CC, o_filename, c_filename) != 0)
+/* Compiles, links and loads the C file.  Doesn't touch any global
+   state of the compiler, so it can run in a thread of its own.  On
+   failure, returns 0 and writes the reason to error, which must have
+   room for ERROR_STRING_LENGTH characters. */
+static initfunc_t
+build_and_load (c_build_t *build, void **module_info, char *error, gboolean bench)
+{
+    initfunc_t initfunc;
+#ifndef OPENSTEP
+    void *initfunc_ptr;
+    GModule *module = 0;
+#endif
+
+    if (exec_cmd(build->log_filename, "%s %s %s", CGEN_CC, build->o_filename, build->c_filename) != 0)
     {
-	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
+	g_snprintf(error, ERROR_STRING_LENGTH, _("C compiler failed.  See logfile `%s'."), build->log_filename);
 	return 0;
     }
 
-    so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, last_mathfunc);
-
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_LD, so_filename, o_filename) != 0)
+    if (exec_cmd(build->log_filename, "%s %s %s", CGEN_LD, build->so_filename, build->o_filename) != 0)
     {
-	sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
+	g_snprintf(error, ERROR_STRING_LENGTH, _("Linker failed.  See logfile `%s'."), build->log_filename);
 	return 0;
     }
 
 #ifndef OPENSTEP
-    module = g_module_open(so_filename, 0);
+    if (build->cache_key != NULL)
+	module_cache_store(build->cache_key, build->so_filename);
+#endif
+
+    if (bench)
+    {
+	bench_end_phase(BENCH_PHASE_BACKEND);
+	bench_begin_phase(BENCH_PHASE_LOAD);
+    }
+
+#ifndef OPENSTEP
+
+    module = g_module_open(build->so_filename, 0);
     if (module == 0)
     {
-	sprintf(error_string, _("Could not load module `%s': %s."), so_filename, g_module_error());
+	g_snprintf(error, ERROR_STRING_LENGTH, _("Could not load module `%s': %s."),
+		   build->so_filename, g_module_error());
 	return 0;
     }
 
@@ -707,7 +1474,7 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
         const char *moduleName = "Johnny";
         NSSymbol symbol;
 
-        NSCreateObjectFileImageFromFile(so_filename, &objectFileImage);
+        NSCreateObjectFileImageFromFile(build->so_filename, &objectFileImage);
 	if (objectFileImage == 0)
 	{
 	    fprintf(stderr, "NSCreateObjectFileImageFromFile() failed\n");
@@ -738,25 +1505,157 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
     }
 #endif
 
-#ifndef DONT_UNLINK_SO
-    unlink(so_filename);
-#endif
-    g_free(so_filename);
+    return initfunc;
+}
 
-    unlink(o_filename);
-    g_free(o_filename);
+initfunc_t
+gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_filename, char *include_path,
+		     filter_code_t **the_filter_codes, const char *cache_key)
+{
+    c_build_t *build;
+    initfunc_t initfunc;
 
-#ifndef DONT_UNLINK_C
-    unlink(c_filename);
-#endif
-    g_free(c_filename);
+    build = write_c_file(mathmap, template_filename, include_path, the_filter_codes, cache_key);
+    if (build == NULL)
+	return 0;
 
-    unlink(log_filename);
-    g_free(log_filename);
+    initfunc = build_and_load(build, module_info, error_string, TRUE);
+
+    free_c_build(build);
+
+    return initfunc;
+}
+
+/*** background compiling ***/
+
+struct _c_code_job_t
+{
+    c_build_t *build;
+
+    GMutex *mutex;
+    GCond *done_cond;
+    gboolean done;
+    gboolean abandoned;
+
+    initfunc_t initfunc;
+    void *module_info;
+    char error[ERROR_STRING_LENGTH];
+};
+
+static void
+free_c_code_job (c_code_job_t *job)
+{
+    free_c_build(job->build);
+    g_mutex_free(job->mutex);
+    g_cond_free(job->done_cond);
+    g_free(job);
+}
+
+static gpointer
+c_code_job_thread (gpointer data)
+{
+    c_code_job_t *job = data;
+    gboolean abandoned;
+
+    job->initfunc = build_and_load(job->build, &job->module_info, job->error, FALSE);
+
+    g_mutex_lock(job->mutex);
+    job->done = TRUE;
+    abandoned = job->abandoned;
+    g_cond_broadcast(job->done_cond);
+    g_mutex_unlock(job->mutex);
+
+    /* nobody wants the result anymore, so we have to clean up */
+    if (abandoned)
+    {
+	if (job->initfunc != 0)
+	    unload_c_code(job->module_info);
+	free_c_code_job(job);
+    }
+
+    return NULL;
+}
+
+c_code_job_t*
+gen_c_code_in_background (mathmap_t *mathmap, char *template_filename, char *include_path,
+			  filter_code_t **the_filter_codes, const char *cache_key)
+{
+    c_code_job_t *job;
+    c_build_t *build;
+
+    build = write_c_file(mathmap, template_filename, include_path, the_filter_codes, cache_key);
+    if (build == NULL)
+	return NULL;
+
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    job = g_new0(c_code_job_t, 1);
+    job->build = build;
+    job->mutex = g_mutex_new();
+    job->done_cond = g_cond_new();
+
+    if (g_thread_create(c_code_job_thread, job, FALSE, NULL) == NULL)
+    {
+	sprintf(error_string, _("Could not start the C compiler thread"));
+	free_c_code_job(job);
+	return NULL;
+    }
+
+    return job;
+}
+
+gboolean
+c_code_job_is_done (c_code_job_t *job)
+{
+    gboolean done;
+
+    g_mutex_lock(job->mutex);
+    done = job->done;
+    g_mutex_unlock(job->mutex);
+
+    return done;
+}
+
+initfunc_t
+c_code_job_finish (c_code_job_t *job, void **module_info)
+{
+    initfunc_t initfunc;
+
+    g_mutex_lock(job->mutex);
+    while (!job->done)
+	g_cond_wait(job->done_cond, job->mutex);
+    g_mutex_unlock(job->mutex);
+
+    initfunc = job->initfunc;
+    if (initfunc != 0)
+	*module_info = job->module_info;
+    else
+	strcpy(error_string, job->error);
+
+    free_c_code_job(job);
 
     return initfunc;
 }
 
+void
+c_code_job_abandon (c_code_job_t *job)
+{
+    gboolean done;
+
+    g_mutex_lock(job->mutex);
+    done = job->done;
+    job->abandoned = TRUE;
+    g_mutex_unlock(job->mutex);
+
+    if (done)
+    {
+	if (job->initfunc != 0)
+	    unload_c_code(job->module_info);
+	free_c_code_job(job);
+    }
+}
+
 void
 unload_c_code (void *module_info)
 {
@@ -800,7 +1699,7 @@ generate_plug_in (char *filter, char *output_filename,
 	return 0;
     }
 
-    compiler_generate_ir_code(mathmap->main_filter, analyze_constants, 0, -1, FALSE);
+    compiler_generate_ir_code(mathmap, mathmap->main_filter, analyze_constants, 0, -1, FALSE);
 
     out = fopen(output_filename, "w");
 
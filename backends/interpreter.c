@@ -0,0 +1,962 @@
+/*
+ * interpreter.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * A register-based interpreter for the final IR code of a filter.
+ * It renders while the C backend compiles the filter in the
+ * background, so that editing a filter doesn't have to wait for the
+ * C compiler.
+ *
+ * Every SSA value, constant and internal gets a register.  Like the
+ * C backend, the code is split by the constants analysis into four
+ * programs: one for the xy-constant values, run once per frame, one
+ * for the y-constant values, run once per column of a slice, one for
+ * the x-constant values, run once per row, and one for the rest, run
+ * per pixel.  The frame's registers are in the frame's xy_vars, and
+ * the y-constant registers of every column are kept in the slice's
+ * y_vars.
+ *
+ * Ops are applied by functions generated from ops.lisp, which use the
+ * same macros as the compiled code.  Filters that call or make
+ * closures of other filters, or use tree vectors, aren't supported -
+ * interpreter_compile_filter() returns NULL for those.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include <glib.h>
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_sf_gamma.h>
+#include <gsl/gsl_sf_ellint.h>
+#include <gsl/gsl_sf_elljac.h>
+
+#include "../internals.h"
+#include "../opmacros.h"
+#include "../compiler-internals.h"
+#include "../compiler_types.h"
+#include "../tree_vectors.h"
+#include "../builtins/builtins.h"
+#include "../builtins/libnoise.h"
+#include "../builtins/spec_func.h"
+
+#define INSN_OP			1
+#define INSN_MOVE		2
+#define INSN_CONVERT		3
+#define INSN_TUPLE		4
+#define INSN_JUMP		5
+#define INSN_JUMP_UNLESS	6
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    mathmap_pools_t *pools;
+    userval_t *arguments;
+    float *return_tuple;
+} interpreter_context_t;
+
+typedef void (*interpreter_op_func_t) (interpreter_context_t *ctx, runtime_value_t *result,
+				       runtime_value_t *regs, int *args);
+
+typedef struct _interpreter_insn_t interpreter_insn_t;
+typedef struct _interpreter_code_t interpreter_code_t;
+
+struct _interpreter_insn_t
+{
+    int kind;
+    interpreter_op_func_t func;	/* INSN_OP */
+    int result;
+    int num_args;
+    int *args;
+    /* INSN_CONVERT converts from type to to_type, INSN_JUMP_UNLESS
+       tests a value of type */
+    int type, to_type;
+    int target;			/* INSN_JUMP, INSN_JUMP_UNLESS */
+};
+
+typedef struct
+{
+    int num_insns;
+    interpreter_insn_t *insns;
+} interpreter_program_t;
+
+/* The internals the interpreter provides.  The compiler types all
+   internals as floats. */
+#define INTERNAL_X		0
+#define INTERNAL_Y		1
+#define INTERNAL_T		2
+#define INTERNAL_R		3
+#define INTERNAL_CANVAS_W	4
+#define INTERNAL_CANVAS_H	5
+#define INTERNAL_RENDER_W	6
+#define INTERNAL_RENDER_H	7
+#define INTERNAL_FRAME		8
+#define NUM_INTERNALS		9
+
+static const char *internal_names[NUM_INTERNALS] = {
+    "x", "y", "t", "R", "__canvasPixelW", "__canvasPixelH", "__renderPixelW", "__renderPixelH", "frame"
+};
+
+struct _interpreter_code_t
+{
+    int num_regs;
+    /* the constants, everything else zero */
+    runtime_value_t *initial_regs;
+
+    /* the registers of the y-constant values */
+    int num_y_regs;
+    int *y_regs;
+
+    interpreter_program_t xy_program;
+    interpreter_program_t y_program;
+    interpreter_program_t x_program;
+    interpreter_program_t pixel_program;
+};
+
+#define INTERPRETER_OP_PROLOGUE \
+    mathmap_invocation_t *invocation G_GNUC_UNUSED = ctx->invocation; \
+    mathmap_pools_t *pools G_GNUC_UNUSED = ctx->pools; \
+    orig_val_pixel_func_t get_orig_val_pixel_func G_GNUC_UNUSED = invocation->orig_val_func
+
+#undef ARG
+#define ARG(i)				(ctx->arguments[(i)])
+
+#define ORIG_VAL_INTERPRETER(x,y,i,f)		ORIG_VAL((x),(y),(i),(f))
+#define APPLY_GRADIENT_INTERPRETER(g,p)		APPLY_GRADIENT((g),(p))
+#define RENDER_INTERPRETER(i,w,h)		RENDER((i),(w),(h))
+#define RENDER_FRAME_INTERPRETER(i,w,h,t)	RENDER_FRAME((i),(w),(h),(t))
+#define OUTPUT_TUPLE_INTERPRETER(t)		((ctx->return_tuple = (t)), 0)
+#define RESIZE_IMAGE_INTERPRETER(i,xf,yf)	RESIZE_IMAGE((i),(xf),(yf))
+#define STRIP_RESIZE_INTERPRETER(i)		STRIP_RESIZE((i))
+
+#include "../interpreter-ops.h"
+
+/*** compiling ***/
+
+typedef struct
+{
+    GHashTable *value_regs;
+    GArray *initial_regs;
+    GArray *insns;
+    gboolean failed;
+} interpreter_compiler_t;
+
+static int
+new_reg (interpreter_compiler_t *compiler)
+{
+    int reg = compiler->initial_regs->len;
+
+    g_array_set_size(compiler->initial_regs, reg + 1);
+    memset(&g_array_index(compiler->initial_regs, runtime_value_t, reg), 0, sizeof(runtime_value_t));
+
+    return reg;
+}
+
+static int
+value_reg (interpreter_compiler_t *compiler, value_t *value)
+{
+    gpointer reg_ptr;
+
+    if (g_hash_table_lookup_extended(compiler->value_regs, value, NULL, &reg_ptr))
+	return GPOINTER_TO_INT(reg_ptr);
+
+    reg_ptr = GINT_TO_POINTER(new_reg(compiler));
+    g_hash_table_insert(compiler->value_regs, value, reg_ptr);
+
+    return GPOINTER_TO_INT(reg_ptr);
+}
+
+static int
+emit_insn (interpreter_compiler_t *compiler, int kind, int result, int num_args)
+{
+    interpreter_insn_t insn;
+
+    memset(&insn, 0, sizeof(interpreter_insn_t));
+    insn.kind = kind;
+    insn.result = result;
+    insn.num_args = num_args;
+    if (num_args > 0)
+	insn.args = g_new(int, num_args);
+
+    g_array_append_val(compiler->insns, insn);
+
+    return compiler->insns->len - 1;
+}
+
+#define INSN(i)		(&g_array_index(compiler->insns, interpreter_insn_t, (i)))
+
+static gboolean
+type_is_numeric (int type)
+{
+    return type == TYPE_INT || type == TYPE_FLOAT || type == TYPE_COMPLEX;
+}
+
+/* Makes src of type available in to as type to_type. */
+static void
+emit_move (interpreter_compiler_t *compiler, int to, int to_type, int src, int type)
+{
+    int insn;
+
+    if (type == to_type)
+    {
+	if (to != src)
+	{
+	    insn = emit_insn(compiler, INSN_MOVE, to, 1);
+	    INSN(insn)->args[0] = src;
+	}
+	return;
+    }
+
+    if (!type_is_numeric(type) || !type_is_numeric(to_type))
+    {
+	compiler->failed = TRUE;
+	return;
+    }
+
+    insn = emit_insn(compiler, INSN_CONVERT, to, 1);
+    INSN(insn)->args[0] = src;
+    INSN(insn)->type = type;
+    INSN(insn)->to_type = to_type;
+}
+
+static int
+primary_type (primary_t *primary)
+{
+    switch (primary->kind)
+    {
+	case PRIMARY_VALUE :
+	    return primary->v.value->compvar->type;
+
+	case PRIMARY_CONST :
+	    return primary->const_type;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+/* Like rhs_type() in the compiler, for the rhs kinds we support. */
+static int
+rhs_type (rhs_t *rhs)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	    return primary_type(&rhs->v.primary);
+
+	case RHS_INTERNAL :
+	    return TYPE_FLOAT;
+
+	case RHS_OP :
+	    if (rhs->v.op.op->type_prop == TYPE_PROP_CONST)
+		return rhs->v.op.op->const_type;
+	    else
+	    {
+		int max = TYPE_INT;
+		int i;
+
+		for (i = 0; i < rhs->v.op.op->num_args; ++i)
+		    max = MAX(max, primary_type(&rhs->v.op.args[i]));
+
+		return max;
+	    }
+
+	case RHS_TUPLE :
+	    return TYPE_TUPLE;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static int
+primary_reg (interpreter_compiler_t *compiler, primary_t *primary)
+{
+    int reg;
+
+    switch (primary->kind)
+    {
+	case PRIMARY_VALUE :
+	    /* uninitialized values are zero, like in the C code */
+	    if (primary->v.value->index < 0)
+		return new_reg(compiler);
+	    return value_reg(compiler, primary->v.value);
+
+	case PRIMARY_CONST :
+	    reg = new_reg(compiler);
+	    g_array_index(compiler->initial_regs, runtime_value_t, reg) = primary->v.constant;
+	    return reg;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+/* Returns a register with the primary's value as type. */
+static int
+primary_reg_as (interpreter_compiler_t *compiler, primary_t *primary, int type)
+{
+    int reg = primary_reg(compiler, primary);
+    int converted;
+
+    if (primary_type(primary) == type)
+	return reg;
+
+    converted = new_reg(compiler);
+    emit_move(compiler, converted, type, reg, primary_type(primary));
+    return converted;
+}
+
+static void
+compile_op_rhs (interpreter_compiler_t *compiler, rhs_t *rhs, int to, int to_type)
+{
+    operation_t *op = rhs->v.op.op;
+    int type = rhs_type(rhs);
+    int args[MAX_OP_ARGS];
+    int i, insn, result;
+
+    if ((op->type_prop == TYPE_PROP_MAX && !type_is_numeric(type))
+	|| (op->type_prop == TYPE_PROP_MAX_FLOAT && type != TYPE_INT && type != TYPE_FLOAT))
+    {
+	compiler->failed = TRUE;
+	return;
+    }
+
+    /* the argument conversions must come before the op */
+    for (i = 0; i < op->num_args; ++i)
+	args[i] = primary_reg_as(compiler, &rhs->v.op.args[i],
+				 op->type_prop == TYPE_PROP_CONST ? op->arg_types[i] : type);
+
+    result = type == to_type ? to : new_reg(compiler);
+
+    insn = emit_insn(compiler, INSN_OP, result, op->num_args);
+    INSN(insn)->func = interpreter_op_func(op->index, type);
+    memcpy(INSN(insn)->args, args, sizeof(int) * op->num_args);
+
+    emit_move(compiler, to, to_type, result, type);
+}
+
+static void
+compile_rhs (interpreter_compiler_t *compiler, rhs_t *rhs, int to, int to_type)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	    emit_move(compiler, to, to_type, primary_reg(compiler, &rhs->v.primary),
+		      primary_type(&rhs->v.primary));
+	    break;
+
+	case RHS_INTERNAL :
+	    {
+		int i;
+
+		for (i = 0; i < NUM_INTERNALS; ++i)
+		    if (strcmp(rhs->v.internal->name, internal_names[i]) == 0)
+			break;
+		if (i == NUM_INTERNALS)
+		    compiler->failed = TRUE;
+		else
+		    emit_move(compiler, to, to_type, i, TYPE_FLOAT);
+	    }
+	    break;
+
+	case RHS_OP :
+	    compile_op_rhs(compiler, rhs, to, to_type);
+	    break;
+
+	case RHS_TUPLE :
+	    {
+		int *args = g_new(int, rhs->v.tuple.length);
+		int i, insn;
+
+		if (to_type != TYPE_TUPLE)
+		{
+		    compiler->failed = TRUE;
+		    g_free(args);
+		    break;
+		}
+
+		for (i = 0; i < rhs->v.tuple.length; ++i)
+		    args[i] = primary_reg_as(compiler, &rhs->v.tuple.args[i], TYPE_FLOAT);
+
+		insn = emit_insn(compiler, INSN_TUPLE, to, rhs->v.tuple.length);
+		memcpy(INSN(insn)->args, args, sizeof(int) * rhs->v.tuple.length);
+		g_free(args);
+	    }
+	    break;
+
+	default :
+	    compiler->failed = TRUE;
+	    break;
+    }
+}
+
+/* Returns the instruction index of the jump. */
+static int
+compile_condition (interpreter_compiler_t *compiler, rhs_t *condition)
+{
+    int type = rhs_type(condition);
+    int reg = new_reg(compiler);
+    int insn;
+
+    if (!type_is_numeric(type))
+    {
+	compiler->failed = TRUE;
+	type = TYPE_INT;
+    }
+
+    compile_rhs(compiler, condition, reg, type);
+
+    insn = emit_insn(compiler, INSN_JUMP_UNLESS, -1, 1);
+    INSN(insn)->args[0] = reg;
+    INSN(insn)->type = type;
+
+    return insn;
+}
+
+static void
+compile_phis (interpreter_compiler_t *compiler, statement_t *phis, int branch, unsigned int slice_flag)
+{
+    for (; phis != NULL; phis = phis->next)
+    {
+	rhs_t *rhs;
+
+	if (phis->kind == STMT_NIL || (phis->slice_flags & slice_flag) == 0)
+	    continue;
+
+	g_assert(phis->kind == STMT_PHI_ASSIGN);
+
+	rhs = branch == 0 ? phis->v.assign.rhs : phis->v.assign.rhs2;
+
+	if (rhs->kind != RHS_PRIMARY
+	    || rhs->v.primary.kind != PRIMARY_VALUE
+	    || rhs->v.primary.v.value != phis->v.assign.lhs)
+	    compile_rhs(compiler, rhs, value_reg(compiler, phis->v.assign.lhs),
+			phis->v.assign.lhs->compvar->type);
+    }
+}
+
+static void
+compile_stmts (interpreter_compiler_t *compiler, statement_t *stmt, unsigned int slice_flag)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+	if ((stmt->slice_flags & slice_flag) == 0)
+	    continue;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		compile_rhs(compiler, stmt->v.assign.rhs, value_reg(compiler, stmt->v.assign.lhs),
+			    stmt->v.assign.lhs->compvar->type);
+		break;
+
+	    case STMT_IF_COND :
+		{
+		    int jump_unless = compile_condition(compiler, stmt->v.if_cond.condition);
+		    int jump_to_end;
+
+		    compile_stmts(compiler, stmt->v.if_cond.consequent, slice_flag);
+		    compile_phis(compiler, stmt->v.if_cond.exit, 0, slice_flag);
+		    jump_to_end = emit_insn(compiler, INSN_JUMP, -1, 0);
+
+		    INSN(jump_unless)->target = compiler->insns->len;
+		    compile_stmts(compiler, stmt->v.if_cond.alternative, slice_flag);
+		    compile_phis(compiler, stmt->v.if_cond.exit, 1, slice_flag);
+
+		    INSN(jump_to_end)->target = compiler->insns->len;
+		}
+		break;
+
+	    case STMT_WHILE_LOOP :
+		{
+		    int top, jump_unless, jump_to_top;
+
+		    compile_phis(compiler, stmt->v.while_loop.entry, 0, slice_flag);
+		    top = compiler->insns->len;
+		    jump_unless = compile_condition(compiler, stmt->v.while_loop.invariant);
+		    compile_stmts(compiler, stmt->v.while_loop.body, slice_flag);
+		    compile_phis(compiler, stmt->v.while_loop.entry, 1, slice_flag);
+		    jump_to_top = emit_insn(compiler, INSN_JUMP, -1, 0);
+		    INSN(jump_to_top)->target = top;
+
+		    INSN(jump_unless)->target = compiler->insns->len;
+		}
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+
+static void
+compile_program (interpreter_compiler_t *compiler, filter_code_t *code, int const_type,
+		 interpreter_program_t *program)
+{
+    compiler->insns = g_array_new(FALSE, FALSE, sizeof(interpreter_insn_t));
+
+    compiler_slice_code_for_const(code->first_stmt, const_type);
+    compile_stmts(compiler, code->first_stmt, compiler_slice_flag_for_const_type(const_type));
+
+    program->num_insns = compiler->insns->len;
+    program->insns = (interpreter_insn_t*)g_array_free(compiler->insns, FALSE);
+    compiler->insns = NULL;
+}
+
+static void
+free_program (interpreter_program_t *program)
+{
+    int i;
+
+    for (i = 0; i < program->num_insns; ++i)
+	g_free(program->insns[i].args);
+    g_free(program->insns);
+}
+
+static void
+_collect_y_reg (value_t *value, statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(interpreter_compiler_t*, compiler, 0);
+    CLOSURE_VAR(GArray*, y_regs, 1);
+    int reg;
+    int i;
+
+    if (value->index < 0
+	|| !compiler_is_permanent_const_value(value)
+	|| (value->const_type | CONST_T) != (CONST_Y | CONST_T))
+	return;
+
+    reg = value_reg(compiler, value);
+    for (i = 0; i < y_regs->len; ++i)
+	if (g_array_index(y_regs, int, i) == reg)
+	    return;
+    g_array_append_val(y_regs, reg);
+}
+
+static gboolean
+_rhs_is_supported (rhs_t *rhs)
+{
+    return rhs->kind != RHS_FILTER && rhs->kind != RHS_CLOSURE && rhs->kind != RHS_TREE_VECTOR;
+}
+
+static gboolean
+stmts_are_supported (statement_t *stmt)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (!_rhs_is_supported(stmt->v.assign.rhs))
+		    return FALSE;
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		if (!_rhs_is_supported(stmt->v.assign.rhs) || !_rhs_is_supported(stmt->v.assign.rhs2))
+		    return FALSE;
+		break;
+
+	    case STMT_IF_COND :
+		if (!_rhs_is_supported(stmt->v.if_cond.condition)
+		    || !stmts_are_supported(stmt->v.if_cond.consequent)
+		    || !stmts_are_supported(stmt->v.if_cond.alternative)
+		    || !stmts_are_supported(stmt->v.if_cond.exit))
+		    return FALSE;
+		break;
+
+	    case STMT_WHILE_LOOP :
+		if (!_rhs_is_supported(stmt->v.while_loop.invariant)
+		    || !stmts_are_supported(stmt->v.while_loop.entry)
+		    || !stmts_are_supported(stmt->v.while_loop.body))
+		    return FALSE;
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+
+    return TRUE;
+}
+
+interpreter_code_t*
+interpreter_compile_filter (filter_code_t *filter_code)
+{
+    interpreter_compiler_t compiler;
+    interpreter_code_t *code;
+    GArray *y_regs;
+    int i;
+
+    if (!stmts_are_supported(filter_code->first_stmt))
+	return NULL;
+
+    code = g_new0(interpreter_code_t, 1);
+
+    compiler.value_regs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    compiler.initial_regs = g_array_new(FALSE, FALSE, sizeof(runtime_value_t));
+    compiler.insns = NULL;
+    compiler.failed = FALSE;
+
+    /* the internals are the first registers */
+    for (i = 0; i < NUM_INTERNALS; ++i)
+	new_reg(&compiler);
+
+    compile_program(&compiler, filter_code, CONST_X | CONST_Y, &code->xy_program);
+    compile_program(&compiler, filter_code, CONST_Y, &code->y_program);
+    compile_program(&compiler, filter_code, CONST_X, &code->x_program);
+    compile_program(&compiler, filter_code, 0, &code->pixel_program);
+
+    y_regs = g_array_new(FALSE, FALSE, sizeof(int));
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(filter_code->first_stmt, &_collect_y_reg, &compiler, y_regs);
+    code->num_y_regs = y_regs->len;
+    code->y_regs = (int*)g_array_free(y_regs, FALSE);
+
+    code->num_regs = compiler.initial_regs->len;
+    code->initial_regs = (runtime_value_t*)g_array_free(compiler.initial_regs, FALSE);
+
+    g_hash_table_destroy(compiler.value_regs);
+
+    if (compiler.failed)
+    {
+	interpreter_free_code(code);
+	return NULL;
+    }
+
+    return code;
+}
+
+void
+interpreter_free_code (interpreter_code_t *code)
+{
+    free_program(&code->xy_program);
+    free_program(&code->y_program);
+    free_program(&code->x_program);
+    free_program(&code->pixel_program);
+
+    g_free(code->y_regs);
+    g_free(code->initial_regs);
+    g_free(code);
+}
+
+/*** running ***/
+
+static void
+convert_value (runtime_value_t *to, int to_type, runtime_value_t *from, int type)
+{
+    float _Complex value;
+
+    switch (type)
+    {
+	case TYPE_INT :
+	    value = from->int_value;
+	    break;
+	case TYPE_FLOAT :
+	    value = from->float_value;
+	    break;
+	case TYPE_COMPLEX :
+	    value = from->complex_value;
+	    break;
+	default :
+	    g_assert_not_reached();
+    }
+
+    switch (to_type)
+    {
+	case TYPE_INT :
+	    to->int_value = (int)crealf(value);
+	    break;
+	case TYPE_FLOAT :
+	    to->float_value = crealf(value);
+	    break;
+	case TYPE_COMPLEX :
+	    to->complex_value = value;
+	    break;
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static gboolean
+value_is_true (runtime_value_t *value, int type)
+{
+    switch (type)
+    {
+	case TYPE_INT :
+	    return value->int_value != 0;
+	case TYPE_FLOAT :
+	    return value->float_value != 0.0;
+	case TYPE_COMPLEX :
+	    return value->complex_value != 0.0;
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static void
+run_program (interpreter_program_t *program, interpreter_context_t *ctx, runtime_value_t *regs)
+{
+    interpreter_insn_t *insns = program->insns;
+    int num_insns = program->num_insns;
+    int pc = 0;
+
+    while (pc < num_insns)
+    {
+	interpreter_insn_t *insn = &insns[pc++];
+
+	switch (insn->kind)
+	{
+	    case INSN_OP :
+		insn->func(ctx, &regs[insn->result], regs, insn->args);
+		break;
+
+	    case INSN_MOVE :
+		regs[insn->result] = regs[insn->args[0]];
+		break;
+
+	    case INSN_CONVERT :
+		convert_value(&regs[insn->result], insn->to_type, &regs[insn->args[0]], insn->type);
+		break;
+
+	    case INSN_TUPLE :
+		{
+		    float *tuple = (float*)mathmap_pools_alloc(ctx->pools, sizeof(float) * insn->num_args);
+		    int i;
+
+		    for (i = 0; i < insn->num_args; ++i)
+			tuple[i] = regs[insn->args[i]].float_value;
+		    regs[insn->result].tuple_value = tuple;
+		}
+		break;
+
+	    case INSN_JUMP :
+		pc = insn->target;
+		break;
+
+	    case INSN_JUMP_UNLESS :
+		if (!value_is_true(&regs[insn->args[0]], insn->type))
+		    pc = insn->target;
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+
+static interpreter_code_t*
+frame_code (mathmap_frame_t *frame)
+{
+    interpreter_code_t *code = frame->invocation->mathmap->interpreter_code;
+
+    g_assert(code != NULL);
+
+    return code;
+}
+
+static void
+init_context (interpreter_context_t *ctx, mathmap_invocation_t *invocation, image_t *closure, mathmap_pools_t *pools)
+{
+    ctx->invocation = invocation;
+    ctx->pools = pools;
+    ctx->arguments = closure->v.closure.args;
+    ctx->return_tuple = NULL;
+}
+
+/* Returns a copy of the frame's registers, which the caller must
+   free. */
+static runtime_value_t*
+copy_frame_regs (mathmap_frame_t *frame)
+{
+    interpreter_code_t *code = frame_code(frame);
+
+    return g_memdup(frame->xy_vars, sizeof(runtime_value_t) * code->num_regs);
+}
+
+static void
+interpreter_init_frame (mathmap_frame_t *frame, image_t *closure)
+{
+    mathmap_invocation_t *invocation = frame->invocation;
+    interpreter_code_t *code = frame_code(frame);
+    runtime_value_t *regs = mathmap_pools_alloc(&frame->pools, sizeof(runtime_value_t) * code->num_regs);
+    interpreter_context_t ctx;
+
+    memcpy(regs, code->initial_regs, sizeof(runtime_value_t) * code->num_regs);
+
+    regs[INTERNAL_T].float_value = frame->current_t;
+    regs[INTERNAL_R].float_value = invocation->image_R;
+    regs[INTERNAL_CANVAS_W].float_value = invocation->img_width;
+    regs[INTERNAL_CANVAS_H].float_value = invocation->img_height;
+    regs[INTERNAL_RENDER_W].float_value = invocation->render_width;
+    regs[INTERNAL_RENDER_H].float_value = invocation->render_height;
+    regs[INTERNAL_FRAME].float_value = frame->current_frame;
+
+    init_context(&ctx, invocation, closure, &frame->pools);
+    run_program(&code->xy_program, &ctx, regs);
+
+    frame->xy_vars = regs;
+}
+
+static void
+interpreter_init_slice (mathmap_slice_t *slice, image_t *closure)
+{
+    mathmap_frame_t *frame = slice->frame;
+    interpreter_code_t *code = frame_code(frame);
+    runtime_value_t *regs = copy_frame_regs(frame);
+    runtime_value_t *y_vars;
+    interpreter_context_t ctx;
+    int col, i;
+
+    y_vars = mathmap_pools_alloc(&slice->pools,
+				 sizeof(runtime_value_t) * MAX(code->num_y_regs, 1) * slice->region_width);
+
+    init_context(&ctx, frame->invocation, closure, &slice->pools);
+
+    for (col = 0; col < slice->region_width; ++col)
+    {
+	regs[INTERNAL_X].float_value = CALC_VIRTUAL_X(col + slice->region_x, frame->frame_render_width,
+						      slice->sampling_offset_x);
+
+	run_program(&code->y_program, &ctx, regs);
+
+	for (i = 0; i < code->num_y_regs; ++i)
+	    y_vars[col * code->num_y_regs + i] = regs[code->y_regs[i]];
+    }
+
+    slice->y_vars = y_vars;
+
+    g_free(regs);
+}
+
+static void
+interpreter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row, int last_row, void *q, int floatmap)
+{
+    mathmap_frame_t *frame = slice->frame;
+    mathmap_invocation_t *invocation = frame->invocation;
+    interpreter_code_t *code = frame_code(frame);
+    runtime_value_t *regs = copy_frame_regs(frame);
+    runtime_value_t *y_vars = slice->y_vars;
+    int output_bpp = invocation->output_bpp;
+    int is_bw = output_bpp == 1 || output_bpp == 2;
+    int need_alpha = output_bpp == 2 || output_bpp == 4;
+    int alpha_index = output_bpp - 1;
+    mathmap_pools_t pixel_pools;
+    interpreter_context_t ctx;
+    int row, col, i;
+
+    mathmap_pools_init_local(&pixel_pools);
+    init_context(&ctx, invocation, closure, &slice->pools);
+
+    first_row = MAX(0, first_row);
+    last_row = MIN(last_row, slice->region_y + slice->region_height);
+
+    for (row = first_row - slice->region_y; row < last_row - slice->region_y; ++row)
+    {
+	unsigned char *p = q;
+	float *fp = q;
+
+	regs[INTERNAL_Y].float_value = CALC_VIRTUAL_Y(row + slice->region_y, frame->frame_render_height,
+						      slice->sampling_offset_y);
+
+	ctx.pools = &slice->pools;
+	run_program(&code->x_program, &ctx, regs);
+
+	ctx.pools = &pixel_pools;
+
+	for (col = 0; col < slice->region_width; ++col)
+	{
+	    float *return_tuple;
+
+	    for (i = 0; i < code->num_y_regs; ++i)
+		regs[code->y_regs[i]] = y_vars[col * code->num_y_regs + i];
+	    regs[INTERNAL_X].float_value = CALC_VIRTUAL_X(col + slice->region_x, frame->frame_render_width,
+							  slice->sampling_offset_x);
+
+	    mathmap_pools_reset(&pixel_pools);
+
+	    ctx.return_tuple = NULL;
+	    run_program(&code->pixel_program, &ctx, regs);
+	    return_tuple = ctx.return_tuple;
+	    g_assert(return_tuple != NULL);
+
+	    if (floatmap)
+	    {
+		for (i = 0; i < NUM_FLOATMAP_CHANNELS; ++i)
+		    fp[i] = return_tuple[i];
+	    }
+	    else
+	    {
+		if (is_bw)
+		    p[0] = (TUPLE_RED(return_tuple) * 0.299
+			    + TUPLE_GREEN(return_tuple) * 0.587
+			    + TUPLE_BLUE(return_tuple) * 0.114) * 255.0;
+		else
+		{
+		    p[0] = TUPLE_RED(return_tuple) * 255.0;
+		    p[1] = TUPLE_GREEN(return_tuple) * 255.0;
+		    p[2] = TUPLE_BLUE(return_tuple) * 255.0;
+		}
+		if (need_alpha)
+		    p[alpha_index] = TUPLE_ALPHA(return_tuple) * 255.0;
+	    }
+
+	    p += output_bpp;
+	    fp += NUM_FLOATMAP_CHANNELS;
+	}
+
+	if (floatmap)
+	    q = (float*)q + frame->frame_render_width * NUM_FLOATMAP_CHANNELS;
+	else
+	    q = (unsigned char*)q + invocation->row_stride;
+
+	if (!invocation->supersampling && !floatmap)
+	    invocation->rows_finished[row] = 1;
+    }
+
+    mathmap_pools_free(&pixel_pools);
+
+    g_free(regs);
+}
+
+static mathfuncs_t interpreter_funcs = {
+    interpreter_init_frame,
+    interpreter_init_slice,
+    interpreter_calc_lines
+};
+
+mathfuncs_t*
+interpreter_mathfuncs (void)
+{
+    return &interpreter_funcs;
+}
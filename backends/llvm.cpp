@@ -1,9 +1,9 @@
 /*
- * llvm.c
+ * llvm.cpp
  *
  * MathMap
  *
- * Copyright (C) 2009 Mark Probst
+ * Copyright (C) 2009-2010 Mark Probst
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -20,25 +20,37 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/*
+ * This backend compiles the filter code in-process with LLVM's ORC
+ * JIT.  The generated IR is linked against the runtime functions in
+ * llvm_template.o, a bitcode file built by clang, and optimized as a
+ * whole module for the host CPU.  Machine code is then generated
+ * lazily, one function at a time, when it is first called.  It
+ * requires LLVM 14 or later.
+ */
+
 #include <iostream>
 #include <map>
+#include <memory>
 #include <complex>
 
-#include <llvm/Module.h>
-#include <llvm/Function.h>
-#include <llvm/PassManager.h>
-#include <llvm/CallingConv.h>
-#include <llvm/Analysis/Verifier.h>
-#include <llvm/Assembly/PrintModulePass.h>
-#include <llvm/Support/IRBuilder.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/MemoryBuffer.h>
-#include <llvm/Bitcode/ReaderWriter.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/IPO.h>
-#include <llvm/Target/TargetData.h>
-#include <llvm/ModuleProvider.h>
-#include <llvm/TypeSymbolTable.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
 
 #include "../compiler-internals.h"
 #include "../compiler_types.h"
@@ -67,6 +79,7 @@ private:
     filter_t *filter;
     filter_code_t *filter_code;
     Module *module;
+    LLVMContext &context;
 
     Function *init_frame_function;
     Function *current_function;
@@ -74,6 +87,7 @@ private:
     IRBuilder<> *builder;
 
     Value *invocation_arg;
+    Value *slice_arg;		// only in slice functions
     Value *frame_arg;
     Value *closure_arg;
     Value *pools_arg;
@@ -87,8 +101,6 @@ private:
     Value *xy_vars_var;
     Value *ret_var;
 
-    Value *complex_copy_var;
-
     map<value_t*, Value*> value_map;
     map<string, Value*> internal_map;
     map<value_t*, PHINode*> phi_map;
@@ -97,6 +109,12 @@ private:
 
     map<value_t*, Value*> saved_set_values;
 
+    Function* get_function (const char *name);
+    Value* create_entry_alloca (Type *type);
+    Value* coerce (Value *val, Type *type);
+    Value* emit_call (Function *func, ArrayRef<Value*> args);
+    Value* emit_call (const char *name, ArrayRef<Value*> args);
+
     void set_value (value_t *value, Value *llvm_value, bool commit = true);
     void commit_set_const_value (value_t *value, Value *llvm_value);
     void commit_set_const_values ();
@@ -108,25 +126,25 @@ private:
 
     Value* promote (Value *val, int type);
 
-    void alloc_complex_copy_var ();
-    Value* convert_complex_return_value (Value *result);
-
     void build_const_value_info (value_t *value, statement_t *stmt, int const_type,
-				 vector<const Type*> *struct_elems);
+				 vector<Type*> *struct_elems);
     static void _build_const_value_info (value_t *value, statement_t *stmt, void *info);
     StructType* build_const_value_infos (int const_type);
 
-    Value* emit_const_value_addr (value_t *value);
+    Value* emit_const_value_addr (value_t *value, Type **type = NULL);
 
     void fetch_all_const_values ();
 
     Value* emit_sizeof (Type *type);
+    Value* emit_condition (Value *number);
 
     void emit_stmts (statement_t *stmt, unsigned int slice_flag);
     void emit_phi_rhss (statement_t *stmt, bool left, map<rhs_t*, Value*> *rhs_map, int slice_flag);
     void emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *right_bb,
 		    map<rhs_t*, Value*> &rhs_map, int slice_flag);
     Value* emit_rhs (rhs_t *rhs);
+    Value* emit_local_tuple (rhs_t *rhs, int length);
+    Value* emit_output_tuple (primary_t *primary);
     Value* emit_primary (primary_t *primary, bool need_float = false);
     Value* emit_closure (filter_t *filter, primary_t *args);
 
@@ -227,61 +245,107 @@ lookup_init_y_function (Module *module, filter_t *filter)
 }
 
 static Value*
-make_int_const (int x)
+make_int_const (LLVMContext &context, int x)
 {
-    return ConstantInt::get(Type::Int32Ty, x, true);
+    return ConstantInt::get(Type::getInt32Ty(context), x, true);
 }
 
 static Value*
-make_float_const (float x)
+make_float_const (LLVMContext &context, float x)
 {
-    return ConstantFP::get(Type::FloatTy, x);
+    return ConstantFP::get(Type::getFloatTy(context), x);
 }
 
-static const Type*
-get_void_ptr_type ()
+static Type*
+get_void_ptr_type (LLVMContext &context)
 {
-    return PointerType::getUnqual(Type::Int8Ty);
+    return PointerType::getUnqual(Type::getInt8Ty(context));
 }
 
-static const Type*
-get_invocation_ptr_type (Module *module)
-{
-    const Type *invocation_type = module->getTypeByName(string("struct.mathmap_invocation_t"));
-    g_assert(invocation_type);
-    return PointerType::getUnqual(invocation_type);
+/* clang only emits the struct types the template actually uses, and
+   names them after the struct tag if there is one.  Calls into the
+   template coerce pointer arguments, so if we can't find the type
+   any pointer will do. */
+static Type*
+get_struct_ptr_type (Module *module, const char *name)
+{
+    LLVMContext &context = module->getContext();
+    StructType *type = StructType::getTypeByName(context, string("struct._") + string(name));
+
+    if (type == NULL)
+	type = StructType::getTypeByName(context, string("struct.") + string(name));
+    if (type == NULL)
+	return get_void_ptr_type(context);
+    return PointerType::getUnqual(type);
 }
 
-static const Type*
-get_frame_ptr_type (Module *module)
+static Type*
+get_invocation_ptr_type (Module *module)
 {
-    const Type *frame_type = module->getTypeByName(string("struct.mathmap_frame_t"));
-    g_assert(frame_type);
-    return PointerType::getUnqual(frame_type);
+    return get_struct_ptr_type(module, "mathmap_invocation_t");
 }
 
-static const Type*
+static Type*
 get_slice_ptr_type (Module *module)
 {
-    const Type *slice_type = module->getTypeByName(string("struct._mathmap_slice_t"));
-    g_assert(slice_type);
-    return PointerType::getUnqual(slice_type);
+    return get_struct_ptr_type(module, "mathmap_slice_t");
 }
 
-static const Type*
+static Type*
 get_pools_ptr_type (Module *module)
 {
-    const Type *pools_type = module->getTypeByName(string("struct.mathmap_pools_t"));
-    g_assert(pools_type);
-    return PointerType::getUnqual(pools_type);
+    return get_struct_ptr_type(module, "mathmap_pools_t");
+}
+
+static Type*
+llvm_type_for_type (Module *module, type_t type)
+{
+    LLVMContext &context = module->getContext();
+
+    switch (type)
+    {
+	case TYPE_INT :
+	    return Type::getInt32Ty(context);
+	case TYPE_FLOAT :
+	    return Type::getFloatTy(context);
+	case TYPE_COMPLEX :
+	    {
+		/* The representation of complex numbers depends on
+		   the ABI, so we use whatever the template returns
+		   them as. */
+		Function *make_complex = module->getFunction(string("make_complex"));
+
+		g_assert(make_complex != NULL);
+
+		return make_complex->getReturnType();
+	    }
+	case TYPE_IMAGE :
+	    return get_struct_ptr_type(module, "image_t");
+	case TYPE_TUPLE :
+	    return PointerType::getUnqual(Type::getFloatTy(context));
+	case TYPE_TREE_VECTOR :
+	    return get_struct_ptr_type(module, "tree_vector_t");
+	case TYPE_COLOR :
+	    return Type::getInt32Ty(context);
+	case TYPE_CURVE :
+	    return get_struct_ptr_type(module, "curve_t");
+	case TYPE_GRADIENT :
+	    return get_struct_ptr_type(module, "gradient_t");
+	default :
+	    g_assert_not_reached();
+    }
 }
 
 code_emitter::code_emitter (Module *_module, filter_t *_filter, filter_code_t *code)
+    : context(_module->getContext())
 {
     module = _module;
     filter_code = code;
     filter = _filter;
 
+    builder = NULL;
+    slice_arg = NULL;
+
     x_vars_type = y_vars_type = xy_vars_type = NULL;
     x_vars_var = y_vars_var = xy_vars_var = NULL;
 
@@ -293,29 +357,121 @@ code_emitter::~code_emitter ()
 {
 }
 
+Function*
+code_emitter::get_function (const char *name)
+{
+    Function *func = module->getFunction(string(name));
+
+    if (func == NULL)
+	throw compiler_error(string("Function `") + string(name) + string("' is missing from the LLVM template."));
+
+    return func;
+}
+
 Value*
-code_emitter::emit_const_value_addr (value_t *value)
+code_emitter::create_entry_alloca (Type *type)
 {
-    g_assert(const_value_index_map.find(value) != const_value_index_map.end());
+    BasicBlock &entry = builder->GetInsertBlock()->getParent()->getEntryBlock();
+    IRBuilder<> entry_builder(&entry, entry.begin());
 
-    int index = const_value_index_map[value];
-    vector<Value*> indices;
+    return entry_builder.CreateAlloca(type);
+}
+
+/* Converts a value to the type a template function expects.  Apart
+   from pointer casts this is only needed for complex numbers, which
+   some ABIs pass differently than they return them. */
+Value*
+code_emitter::coerce (Value *val, Type *type)
+{
+    Type *val_type = val->getType();
+
+    if (val_type == type)
+	return val;
+
+    if (val_type->isPointerTy() && type->isPointerTy())
+	return builder->CreateBitCast(val, type);
+
+    if (val_type->isIntegerTy() && type->isIntegerTy())
+	return builder->CreateSExtOrTrunc(val, type);
+    if (val_type->isIntegerTy() && type->isFloatingPointTy())
+	return builder->CreateSIToFP(val, type);
+    if (val_type->isFloatingPointTy() && type->isIntegerTy())
+	return builder->CreateFPToSI(val, type);
+    if (val_type->isFloatingPointTy() && type->isFloatingPointTy())
+	return builder->CreateFPCast(val, type);
+
+    if (type->isPointerTy())
+    {
+	/* passed by reference */
+	Value *copy = create_entry_alloca(val_type);
+
+	builder->CreateStore(val, copy);
+	return builder->CreateBitCast(copy, type);
+    }
+
+    const DataLayout &layout = module->getDataLayout();
+
+    g_assert(layout.getTypeStoreSize(val_type) == layout.getTypeStoreSize(type));
+
+    Type *copy_type = layout.getTypeAllocSize(type) > layout.getTypeAllocSize(val_type) ? type : val_type;
+    AllocaInst *copy = cast<AllocaInst>(create_entry_alloca(copy_type));
+
+    copy->setAlignment(std::max(layout.getABITypeAlign(type), layout.getABITypeAlign(val_type)));
+    builder->CreateStore(val, builder->CreateBitCast(copy, PointerType::getUnqual(val_type)));
+    return builder->CreateLoad(type, builder->CreateBitCast(copy, PointerType::getUnqual(type)));
+}
+
+Value*
+code_emitter::emit_call (Function *func, ArrayRef<Value*> args)
+{
+    FunctionType *type = func->getFunctionType();
+    vector<Value*> coerced_args;
+
+    g_assert(args.size() == type->getNumParams());
+
+    for (unsigned int i = 0; i < args.size(); ++i)
+	coerced_args.push_back(coerce(args[i], type->getParamType(i)));
+
+    return builder->CreateCall(type, func, coerced_args);
+}
 
-    indices.push_back(make_int_const(0));
-    indices.push_back(make_int_const(index));
+Value*
+code_emitter::emit_call (const char *name, ArrayRef<Value*> args)
+{
+    return emit_call(get_function(name), args);
+}
 
+Value*
+code_emitter::emit_const_value_addr (value_t *value, Type **type)
+{
+    g_assert(const_value_index_map.find(value) != const_value_index_map.end());
+
+    int index = const_value_index_map[value];
     Value *const_var = NULL;
+    StructType *vars_type = NULL;
 
     if ((value->const_type | CONST_T) == (CONST_X | CONST_Y | CONST_T))
+    {
 	const_var = xy_vars_var;
+	vars_type = xy_vars_type;
+    }
     else if ((value->const_type | CONST_T) == (CONST_X | CONST_T))
+    {
 	const_var = x_vars_var;
+	vars_type = x_vars_type;
+    }
     else if ((value->const_type | CONST_T) == (CONST_Y | CONST_T))
+    {
 	const_var = y_vars_var;
+	vars_type = y_vars_type;
+    }
     else
 	g_assert_not_reached();
 
-    return builder->CreateGEP(const_var, indices.begin(), indices.end());
+    if (type != NULL)
+	*type = vars_type->getElementType(index);
+
+    return builder->CreateStructGEP(vars_type, const_var, index);
 }
 
 static void
@@ -360,9 +516,10 @@ code_emitter::commit_set_const_value (value_t *value, Value *llvm_value)
     printf("storing value ");
     compiler_print_value(value);
     printf(" with llvm value ");
-    llvm_value->dump();
+    llvm_value->print(errs());
     printf(" at addr ");
-    addr->dump();
+    addr->print(errs());
+    errs() << "\n";
 #endif
 
     builder->CreateStore(llvm_value, addr);
@@ -389,7 +546,11 @@ code_emitter::lookup_value (value_t *value)
 	return value_map[value];
 
     g_assert(compiler_is_permanent_const_value(value));
-    return builder->CreateLoad(emit_const_value_addr(value));
+
+    Type *type;
+    Value *addr = emit_const_value_addr(value, &type);
+
+    return builder->CreateLoad(type, addr);
 }
 
 void
@@ -424,42 +585,26 @@ code_emitter::promote (Value *val, int type)
     switch (type)
     {
 	case TYPE_FLOAT :
-	    if (val->getType() == Type::Int32Ty)
-		val = builder->CreateCall(module->getFunction(string("promote_int_to_float")), val);
+	    if (val->getType()->isIntegerTy(32))
+		val = emit_call("promote_int_to_float", val);
 	    else
-		assert(val->getType() == Type::FloatTy);
+		assert(val->getType()->isFloatTy());
 	    break;
 
 	case TYPE_COMPLEX :
-	    if (val->getType() == Type::Int32Ty)
-		val = builder->CreateCall(module->getFunction(string("promote_int_to_complex")), val);
-	    else if (val->getType() == Type::FloatTy)
-		val = builder->CreateCall(module->getFunction(string("promote_float_to_complex")), val);
+	    if (val->getType()->isIntegerTy(32))
+		val = emit_call("promote_int_to_complex", val);
+	    else if (val->getType()->isFloatTy())
+		val = emit_call("promote_float_to_complex", val);
 	    break;
-    }
-    return val;
-}
 
-Value*
-code_emitter::convert_complex_return_value (Value *result)
-{
-    /* The result is complex, whose representation
-       differs between archs, and we need to transform
-       it into another arch-dependent
-       representation. */
-    if (sizeof(gpointer) == 4)
-    {
-	Value *local = complex_copy_var;
-	Value *local_ptr = builder->CreateBitCast(local, PointerType::getUnqual(Type::Int64Ty));
-	builder->CreateStore(result, local_ptr);
-	result = builder->CreateLoad(local);
+	default :
+	    /* the template might use a different pointer type */
+	    if (val->getType()->isPointerTy())
+		val = coerce(val, llvm_type_for_type(module, (type_t)type));
+	    break;
     }
-    else if (sizeof(gpointer) == 8)
-	result = builder->CreateExtractValue(result, 0);
-    else
-	g_assert_not_reached();
-
-    return result;
+    return val;
 }
 
 Value*
@@ -473,11 +618,11 @@ code_emitter::emit_primary (primary_t *primary, bool need_float)
 		switch (primary->v.value->compvar->type)
 		{
 		    case TYPE_INT :
-			return make_int_const(0);
+			return make_int_const(context, 0);
 		    case TYPE_FLOAT :
-			return make_float_const(0.0);
+			return make_float_const(context, 0.0);
 		    case TYPE_IMAGE :
-			return builder->CreateCall(module->getFunction(string("get_uninited_image")));
+			return emit_call("get_uninited_image", ArrayRef<Value*>());
 		    default :
 			g_assert_not_reached();
 		}
@@ -495,26 +640,23 @@ code_emitter::emit_primary (primary_t *primary, bool need_float)
 	    switch (primary->const_type) {
 		case TYPE_INT :
 		    if (need_float)
-			return make_float_const((float)primary->v.constant.int_value);
+			return make_float_const(context, (float)primary->v.constant.int_value);
 		    else
-			return make_int_const(primary->v.constant.int_value);
+			return make_int_const(context, primary->v.constant.int_value);
 		case TYPE_FLOAT :
-		    return make_float_const(primary->v.constant.float_value);
+		    return make_float_const(context, primary->v.constant.float_value);
 		case TYPE_COMPLEX :
-		    {
-			assert(!need_float);
-			Value *val = builder->CreateCall2(module->getFunction(string("make_complex")),
-							  make_float_const(__real__ primary->v.constant.complex_value),
-							  make_float_const(__imag__ primary->v.constant.complex_value));
-			return convert_complex_return_value(val);
-		    }
+		    assert(!need_float);
+		    return emit_call("make_complex",
+				     { make_float_const(context, __real__ primary->v.constant.complex_value),
+				       make_float_const(context, __imag__ primary->v.constant.complex_value) });
 		case TYPE_COLOR :
 		    assert(!need_float);
-		    return builder->CreateCall4(module->getFunction(string("make_color")),
-						make_int_const(RED(primary->v.constant.color_value)),
-						make_int_const(GREEN(primary->v.constant.color_value)),
-						make_int_const(BLUE(primary->v.constant.color_value)),
-						make_int_const(ALPHA(primary->v.constant.color_value)));
+		    return emit_call("make_color",
+				     { make_int_const(context, RED(primary->v.constant.color_value)),
+				       make_int_const(context, GREEN(primary->v.constant.color_value)),
+				       make_int_const(context, BLUE(primary->v.constant.color_value)),
+				       make_int_const(context, ALPHA(primary->v.constant.color_value)) });
 		default :
 		    g_assert_not_reached();
 	    }
@@ -560,24 +702,23 @@ code_emitter::emit_closure (filter_t *closure_filter, primary_t *args)
 
     if (closure_filter->kind == FILTER_MATHMAP)
     {
-	vector<Value*> args;
-
-	args.push_back(invocation_arg);
-	args.push_back(pools_arg);
-	args.push_back(make_int_const(num_args));
-	args.push_back(lookup_filter_function(module, closure_filter));
-	args.push_back(lookup_init_frame_function(module, closure_filter));
-	args.push_back(lookup_main_filter_function(module, closure_filter));
-	args.push_back(lookup_init_x_function(module, closure_filter));
-	args.push_back(lookup_init_y_function(module, closure_filter));
-
-	closure = builder->CreateCall(module->getFunction(string("alloc_closure_image")), args.begin(), args.end());
-	uservals = builder->CreateCall(module->getFunction(string("get_closure_uservals")), closure);
+	vector<Value*> closure_args;
+
+	closure_args.push_back(invocation_arg);
+	closure_args.push_back(pools_arg);
+	closure_args.push_back(make_int_const(context, num_args));
+	closure_args.push_back(lookup_filter_function(module, closure_filter));
+	closure_args.push_back(lookup_init_frame_function(module, closure_filter));
+	closure_args.push_back(lookup_main_filter_function(module, closure_filter));
+	closure_args.push_back(lookup_init_x_function(module, closure_filter));
+	closure_args.push_back(lookup_init_y_function(module, closure_filter));
+
+	closure = emit_call("alloc_closure_image", closure_args);
+	uservals = emit_call("get_closure_uservals", closure);
     }
     else
-	uservals = builder->CreateCall2(module->getFunction(string("alloc_uservals")),
-					pools_arg,
-					make_int_const(compiler_num_filter_args(closure_filter) - 3));
+	uservals = emit_call("alloc_uservals",
+			     { pools_arg, make_int_const(context, compiler_num_filter_args(closure_filter) - 3) });
 
     for (i = 0, info = closure_filter->userval_infos;
 	 info != 0;
@@ -590,104 +731,23 @@ code_emitter::emit_closure (filter_t *closure_filter, primary_t *args)
 	if (info->type == USERVAL_BOOL_CONST)
 	    arg = promote(arg, TYPE_FLOAT);
 
-	builder->CreateCall3(module->getFunction(string(set_func_name)), uservals, make_int_const(i), arg);
+	emit_call(set_func_name, { uservals, make_int_const(context, i), arg });
     }
     g_assert(i == num_args);
 
     if (closure_filter->kind == FILTER_MATHMAP)
     {
-	builder->CreateCall3(module->getFunction(string("set_closure_pixel_size")),
-			     closure, lookup_internal("__canvasPixelW"), lookup_internal("__canvasPixelH"));
+	emit_call("set_closure_pixel_size",
+		  { closure, lookup_internal("__canvasPixelW"), lookup_internal("__canvasPixelH") });
 	return closure;
     }
     else
     {
 	string filter_func_name = string("llvm_") + string(closure_filter->v.native.func_name);
-	return builder->CreateCall3(module->getFunction(filter_func_name),
-				    invocation_arg, uservals, pools_arg);
+	return emit_call(filter_func_name.c_str(), { invocation_arg, uservals, pools_arg });
     }
 }
 
-static bool
-is_complex_return_type (const Type *type)
-{
-    if (sizeof(gpointer) == 4)
-	return type == Type::Int64Ty;
-    else if (sizeof(gpointer) == 8)
-    {
-	static Type *ret_type;
-
-	if (!ret_type)
-	{
-	    vector<const Type*> elems;
-
-	    elems.push_back(Type::DoubleTy);
-
-	    ret_type = StructType::get(elems);
-	}
-
-	g_assert(ret_type);
-
-	return type == ret_type;
-    }
-    else
-	g_assert_not_reached();
-}
-
-static const Type*
-llvm_type_for_type (Module *module, type_t type)
-{
-    switch (type)
-    {
-	case TYPE_INT :
-	    return Type::Int32Ty;
-	case TYPE_FLOAT :
-	    return Type::FloatTy;
-	case TYPE_COMPLEX :
-	    if (sizeof(gpointer) == 4)
-	    {
-		static const Type *result;
-
-		vector<const Type*> elems;
-
-		if (result)
-		    return result;
-
-		elems.push_back(Type::FloatTy);
-		elems.push_back(Type::FloatTy);
-
-		result = StructType::get(elems);
-
-		g_assert(result != NULL);
-		return result;
-	    }
-	    else if (sizeof(gpointer) == 8)
-		return Type::DoubleTy;
-	    else
-		g_assert_not_reached();
-	case TYPE_IMAGE :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct._image_t")));
-	case TYPE_TUPLE :
-	    return PointerType::getUnqual(Type::FloatTy);
-	case TYPE_TREE_VECTOR :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.tree_vector_t")));
-	case TYPE_COLOR :
-	    return Type::Int32Ty;
-	case TYPE_CURVE :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.curve_t")));
-	case TYPE_GRADIENT :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.gradient_t")));
-	default :
-	    g_assert_not_reached();
-    }
-}
-
-void
-code_emitter::alloc_complex_copy_var ()
-{
-    complex_copy_var = builder->CreateAlloca(llvm_type_for_type(module, TYPE_COMPLEX));
-}
-
 Value*
 code_emitter::emit_rhs (rhs_t *rhs)
 {
@@ -707,8 +767,7 @@ code_emitter::emit_rhs (rhs_t *rhs)
 		if (op->type_prop != TYPE_PROP_CONST)
 		    assert(promotion_type != TYPE_NIL);
 
-		Function *func = module->getFunction(string(function_name));
-		g_assert(func);
+		Function *func = get_function(function_name);
 		vector<Value*> args;
 		args.push_back(invocation_arg);
 		args.push_back(closure_arg);
@@ -718,29 +777,16 @@ code_emitter::emit_rhs (rhs_t *rhs)
 		    Value *val = emit_primary(&rhs->v.op.args[i], type == TYPE_FLOAT);
 		    val = promote(val, type);
 
-#ifndef __MINGW32__
-		    if (sizeof(gpointer) == 4 && val->getType() == llvm_type_for_type(module, TYPE_COMPLEX))
-		    {
-			Value *copy = builder->CreateAlloca(llvm_type_for_type(module, TYPE_COMPLEX));
-			builder->CreateStore(val, copy);
-			val = copy;
-		    }
-#endif
-
 #ifdef DEBUG_OUTPUT
-		    val->dump();
+		    val->print(errs());
+		    errs() << "\n";
 #endif
 		    args.push_back(val);
 		}
 #ifdef DEBUG_OUTPUT
-		func->dump();
+		func->print(errs());
 #endif
-		Value *result = builder->CreateCall(func, args.begin(), args.end());
-		/* FIXME: this is ugly - we should check for the type
-		   of the operation or resulting value */
-		if (is_complex_return_type(result->getType()))
-		    result = convert_complex_return_value(result);
-		return result;
+		return emit_call(func, args);
 	    }
 
 	case RHS_FILTER :
@@ -757,7 +803,7 @@ code_emitter::emit_rhs (rhs_t *rhs)
 		args.push_back(emit_primary(&rhs->v.filter.args[num_args - 1]));
 		args.push_back(pools_arg);
 
-		return builder->CreateCall(func, args.begin(), args.end());
+		return emit_call(func, args);
 	    }
 
 	case RHS_CLOSURE :
@@ -766,24 +812,20 @@ code_emitter::emit_rhs (rhs_t *rhs)
 	case RHS_TUPLE :
 	case RHS_TREE_VECTOR :
 	    {
-		Function *set_func = module->getFunction(string("tuple_set"));
-		Value *tuple = builder->CreateCall2(module->getFunction(string("alloc_tuple")),
-						    pools_arg,
-						    make_int_const(rhs->v.tuple.length));
+		Function *set_func = get_function("tuple_set");
+		Value *tuple = emit_call("alloc_tuple", { pools_arg, make_int_const(context, rhs->v.tuple.length) });
 		int i;
 
 		for (i = 0; i < rhs->v.tuple.length; ++i)
 		{
 		    Value *val = emit_primary(&rhs->v.tuple.args[i], true);
-		    builder->CreateCall3(set_func, tuple, make_int_const(i), val);
+		    emit_call(set_func, { tuple, make_int_const(context, i), val });
 		}
 
 		if (rhs->kind == RHS_TREE_VECTOR)
 		{
-		    return builder->CreateCall3(module->getFunction(string("alloc_tree_vector")),
-						pools_arg,
-						make_int_const(rhs->v.tuple.length),
-						tuple);
+		    return emit_call("alloc_tree_vector",
+				     { pools_arg, make_int_const(context, rhs->v.tuple.length), tuple });
 		}
 		else
 		    return tuple;
@@ -794,6 +836,66 @@ code_emitter::emit_rhs (rhs_t *rhs)
     }
 }
 
+/* A tuple that's only taken apart or output lives in a stack slot
+   instead of the pools.  Once the template functions are inlined
+   SROA breaks it up into registers. */
+Value*
+code_emitter::emit_local_tuple (rhs_t *rhs, int length)
+{
+    ArrayType *array_type = ArrayType::get(Type::getFloatTy(context), length);
+    Value *array = create_entry_alloca(array_type);
+    Value *tuple = builder->CreateConstInBoundsGEP2_32(array_type, array, 0, 0);
+
+    if (rhs->kind == RHS_TUPLE)
+    {
+	Function *set_func = get_function("tuple_set");
+	int i;
+
+	for (i = 0; i < length; ++i)
+	{
+	    Value *val = emit_primary(&rhs->v.tuple.args[i], true);
+	    emit_call(set_func, { tuple, make_int_const(context, i), val });
+	}
+    }
+    else
+    {
+	operation_t *op = rhs->v.op.op;
+	vector<Value*> args;
+
+	g_assert(rhs->kind == RHS_OP
+		 && (op->index == OP_ORIG_VAL || op->index == OP_APPLY_GRADIENT));
+
+	args.push_back(invocation_arg);
+	args.push_back(closure_arg);
+	args.push_back(pools_arg);
+	args.push_back(tuple);
+	for (int i = 0; i < op->num_args; ++i)
+	    args.push_back(promote(emit_primary(&rhs->v.op.args[i], op->arg_types[i] == TYPE_FLOAT),
+				   op->arg_types[i]));
+
+	emit_call(op->index == OP_ORIG_VAL ? "orig_val_into" : "apply_gradient_into", args);
+    }
+
+    return tuple;
+}
+
+/* The result must outlive the function, so a tuple in a stack slot
+   is copied - for the main filter function into the slice, whose
+   caller stores it right away, otherwise into the pools. */
+Value*
+code_emitter::emit_output_tuple (primary_t *primary)
+{
+    Value *tuple = emit_primary(primary);
+
+    if (primary->kind != PRIMARY_VALUE || compiler_local_tuple_length(primary->v.value) == 0)
+	return tuple;
+
+    if (slice_arg != NULL)
+	return emit_call("copy_slice_return_tuple", { slice_arg, tuple });
+    else
+	return emit_call("copy_tuple", { pools_arg, tuple });
+}
+
 static gboolean
 must_emit_stmt (statement_t *stmt, int slice_flag)
 {
@@ -853,7 +955,7 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 		    Value *left = NULL;
 		    Value *right = NULL;
 		    int compvar_type = stmt->v.assign.lhs->compvar->type;
-		    const Type *type = llvm_type_for_type(module, compvar_type);
+		    Type *type = llvm_type_for_type(module, (type_t)compvar_type);
 
 #ifdef DEBUG_OUTPUT
 		    compiler_print_assign_statement(stmt);
@@ -866,7 +968,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 			g_assert(left != NULL);
 #ifdef DEBUG_OUTPUT
 			printf("left:\n");
-			left->dump();
+			left->print(errs());
+			errs() << "\n";
 #endif
 		    }
 		    if (right_bb)
@@ -875,7 +978,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 			g_assert(right != NULL);
 #ifdef DEBUG_OUTPUT
 			printf("right:\n");
-			right->dump();
+			right->print(errs());
+			errs() << "\n";
 #endif
 		    }
 
@@ -883,8 +987,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 
 		    if (left_bb)
 		    {
-			phi = builder->CreatePHI(type);
-			phi->addIncoming(promote(left, compvar_type), left_bb);
+			phi = builder->CreatePHI(type, 2);
+			phi->addIncoming(left, left_bb);
 			set_value(stmt->v.assign.lhs, phi, false);
 			phi_map[stmt->v.assign.lhs] = phi;
 		    }
@@ -896,11 +1000,12 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 
 #ifdef DEBUG_OUTPUT
 		    printf("phi:\n");
-		    phi->dump();
+		    phi->print(errs());
+		    errs() << "\n";
 #endif
 
 		    if (right_bb)
-			phi->addIncoming(promote(right, compvar_type), right_bb);
+			phi->addIncoming(right, right_bb);
 		}
 		break;
 
@@ -912,6 +1017,17 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
     commit_set_const_values();
 }
 
+Value*
+code_emitter::emit_condition (Value *number)
+{
+    if (number->getType()->isIntegerTy(32))
+	return builder->CreateICmpNE(number, make_int_const(context, 0));
+    else if (number->getType()->isFloatTy())
+	return builder->CreateFCmpONE(number, make_float_const(context, 0.0));
+    else
+	g_assert_not_reached();
+}
+
 void
 code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 {
@@ -933,27 +1049,27 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 #endif
 		if (stmt->v.assign.rhs->kind == RHS_OP
 		    && stmt->v.assign.rhs->v.op.op->index == OP_OUTPUT_TUPLE)
-		    builder->CreateRet(emit_primary(&stmt->v.assign.rhs->v.op.args[0]));
+		    builder->CreateRet(coerce(emit_output_tuple(&stmt->v.assign.rhs->v.op.args[0]),
+					      current_function->getReturnType()));
 		else
-		    set_value(stmt->v.assign.lhs, emit_rhs(stmt->v.assign.rhs));
+		{
+		    int local_tuple_length = compiler_local_tuple_length(stmt->v.assign.lhs);
+
+		    if (local_tuple_length > 0)
+			set_value(stmt->v.assign.lhs, emit_local_tuple(stmt->v.assign.rhs, local_tuple_length));
+		    else
+			set_value(stmt->v.assign.lhs, emit_rhs(stmt->v.assign.rhs));
+		}
 		break;
 
 	    case STMT_IF_COND :
 		{
-		    Value *condition_number = emit_rhs(stmt->v.if_cond.condition);
-		    Value *condition;
+		    Value *condition = emit_condition(emit_rhs(stmt->v.if_cond.condition));
 		    map<rhs_t*, Value*> rhs_map;
 
-		    if (condition_number->getType() == Type::Int32Ty)
-			condition = builder->CreateICmpNE(condition_number, make_int_const(0));
-		    else if (condition_number->getType() == Type::FloatTy)
-			condition = builder->CreateFCmpONE(condition_number, make_float_const(0.0));
-		    else
-			g_assert_not_reached();
-
-		    BasicBlock *then_bb = BasicBlock::Create("then", current_function);
-		    BasicBlock *else_bb = BasicBlock::Create("else");
-		    BasicBlock *merge_bb = BasicBlock::Create("ifcont");
+		    BasicBlock *then_bb = BasicBlock::Create(context, "then", current_function);
+		    BasicBlock *else_bb = BasicBlock::Create(context, "else");
+		    BasicBlock *merge_bb = BasicBlock::Create(context, "ifcont");
 
 		    builder->CreateCondBr(condition, then_bb, else_bb);
 
@@ -963,14 +1079,14 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 		    builder->CreateBr(merge_bb);
 		    then_bb = builder->GetInsertBlock();
 
-		    current_function->getBasicBlockList().push_back(else_bb);
+		    else_bb->insertInto(current_function);
 		    builder->SetInsertPoint(else_bb);
 		    emit_stmts(stmt->v.if_cond.alternative, slice_flag);
 		    emit_phi_rhss(stmt->v.if_cond.exit, false, &rhs_map, slice_flag);
 		    builder->CreateBr(merge_bb);
 		    else_bb = builder->GetInsertBlock();
 
-		    current_function->getBasicBlockList().push_back(merge_bb);
+		    merge_bb->insertInto(current_function);
 		    builder->SetInsertPoint(merge_bb);
 
 		    emit_phis(stmt->v.if_cond.exit, then_bb, else_bb, rhs_map, slice_flag);
@@ -980,9 +1096,9 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 	    case STMT_WHILE_LOOP:
 		{
 		    BasicBlock *start_bb = builder->GetInsertBlock();
-		    BasicBlock *entry_bb = BasicBlock::Create("entry", current_function);
-		    BasicBlock *body_bb = BasicBlock::Create("body");
-		    BasicBlock *exit_bb = BasicBlock::Create("exit");
+		    BasicBlock *entry_bb = BasicBlock::Create(context, "entry", current_function);
+		    BasicBlock *body_bb = BasicBlock::Create(context, "body");
+		    BasicBlock *exit_bb = BasicBlock::Create(context, "exit");
 		    map<rhs_t*, Value*> rhs_map;
 
 		    emit_phi_rhss(stmt->v.while_loop.entry, true, &rhs_map, slice_flag);
@@ -993,19 +1109,11 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 
 		    emit_phis(stmt->v.while_loop.entry, start_bb, NULL, rhs_map, slice_flag);
 
-		    Value *invariant_number = emit_rhs(stmt->v.while_loop.invariant);
-		    Value *invariant;
-
-		    if (invariant_number->getType() == Type::Int32Ty)
-			invariant = builder->CreateICmpNE(invariant_number, make_int_const(0));
-		    else if (invariant_number->getType() == Type::FloatTy)
-			invariant = builder->CreateFCmpONE(invariant_number, make_float_const(0.0));
-		    else
-			g_assert_not_reached();
+		    Value *invariant = emit_condition(emit_rhs(stmt->v.while_loop.invariant));
 
 		    builder->CreateCondBr(invariant, body_bb, exit_bb);
 
-		    current_function->getBasicBlockList().push_back(body_bb);
+		    body_bb->insertInto(current_function);
 		    builder->SetInsertPoint(body_bb);
 		    emit_stmts(stmt->v.while_loop.body, slice_flag);
 		    body_bb = builder->GetInsertBlock();
@@ -1013,7 +1121,7 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 		    emit_phis(stmt->v.while_loop.entry, NULL, body_bb, rhs_map, slice_flag);
 		    builder->CreateBr(entry_bb);
 
-		    current_function->getBasicBlockList().push_back(exit_bb);
+		    exit_bb->insertInto(current_function);
 		    builder->SetInsertPoint(exit_bb);
 		}
 		break;
@@ -1027,7 +1135,7 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 
 void
 code_emitter::build_const_value_info (value_t *value, statement_t *stmt, int const_type,
-				      vector<const Type*> *struct_elems)
+				      vector<Type*> *struct_elems)
 {
     if ((value->const_type | CONST_T) == (const_type | CONST_T)
 	&& compiler_is_permanent_const_value(value))
@@ -1049,7 +1157,7 @@ code_emitter::_build_const_value_info (value_t *value, statement_t *stmt, void *
 {
     CLOSURE_VAR(code_emitter*, emitter, 0);
     CLOSURE_VAR(int, const_type, 1);
-    CLOSURE_VAR(vector<const Type*>*, struct_elems, 2);
+    CLOSURE_VAR(vector<Type*>*, struct_elems, 2);
 
     emitter->build_const_value_info(value, stmt, const_type, struct_elems);
 }
@@ -1073,21 +1181,21 @@ void
 code_emitter::set_internals_from_invocation (Value *invocation_arg)
 {
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__canvasPixelW", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_img_width")), invocation_arg));
+		 emit_call("get_invocation_img_width", invocation_arg));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__canvasPixelH", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_img_height")), invocation_arg));
+		 emit_call("get_invocation_img_height", invocation_arg));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__renderPixelW", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_render_width")), invocation_arg));
+		 emit_call("get_invocation_render_width", invocation_arg));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__renderPixelH", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_render_height")), invocation_arg));
+		 emit_call("get_invocation_render_height", invocation_arg));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "R", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_image_R")), invocation_arg));
+		 emit_call("get_invocation_image_R", invocation_arg));
 }
 
 void
 code_emitter::set_xy_vars_from_frame ()
 {
-    Value *xy_vars_untyped = builder->CreateCall(module->getFunction(string("get_frame_xy_vars")), frame_arg);
+    Value *xy_vars_untyped = emit_call("get_frame_xy_vars", frame_arg);
     xy_vars_var = builder->CreateBitCast(xy_vars_untyped, PointerType::getUnqual(xy_vars_type));
 }
 
@@ -1095,8 +1203,8 @@ void
 code_emitter::setup_xy_vars_from_closure ()
 {
     Value *t_var = lookup_internal(::lookup_internal(filter->v.mathmap.internals, "t", true));
-    Value *xy_vars_untyped = builder->CreateCall4(module->getFunction(string("calc_closure_xy_vars")),
-						  invocation_arg, closure_arg, t_var, init_frame_function);
+    Value *xy_vars_untyped = emit_call("calc_closure_xy_vars",
+				       { invocation_arg, closure_arg, t_var, init_frame_function });
     xy_vars_var = builder->CreateBitCast(xy_vars_untyped, PointerType::getUnqual(xy_vars_type));
 }
 
@@ -1107,34 +1215,34 @@ code_emitter::setup_filter_function (bool is_main_filter_function)
 	? lookup_main_filter_function(module, filter)
 	: lookup_filter_function(module, filter);
     Function::arg_iterator args = filter_function->arg_begin();
-    Value *slice_arg = NULL;
 
+    slice_arg = NULL;
     if (is_main_filter_function)
     {
-	slice_arg = args++;
+	slice_arg = &*args++;
 	slice_arg->setName("slice");
     }
     else
     {
-	invocation_arg = args++;
+	invocation_arg = &*args++;
 	invocation_arg->setName("invocation");
     }
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
     if (is_main_filter_function)
     {
-	x_vars_var = args++;
+	x_vars_var = &*args++;
 	x_vars_var->setName("x_vars");
-	y_vars_var = args++;
+	y_vars_var = &*args++;
 	y_vars_var->setName("y_vars");
     }
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "x", true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "y", true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), args++);
-    pools_arg = args++;
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "x", true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "y", true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), &*args++);
+    pools_arg = &*args++;
     pools_arg->setName("pools");
 
-    BasicBlock *block = BasicBlock::Create("entry", filter_function);
+    BasicBlock *block = BasicBlock::Create(context, "entry", filter_function);
 
     builder = new IRBuilder<> (block);
 
@@ -1142,8 +1250,8 @@ code_emitter::setup_filter_function (bool is_main_filter_function)
     {
 	x_vars_var = builder->CreateBitCast(x_vars_var, PointerType::getUnqual(x_vars_type));
 	y_vars_var = builder->CreateBitCast(y_vars_var, PointerType::getUnqual(y_vars_type));
-	frame_arg = builder->CreateCall(module->getFunction(string("get_slice_frame")), slice_arg);
-	invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
+	frame_arg = emit_call("get_slice_frame", slice_arg);
+	invocation_arg = emit_call("get_frame_invocation", frame_arg);
     }
 
     set_internals_from_invocation(invocation_arg);
@@ -1153,18 +1261,15 @@ code_emitter::setup_filter_function (bool is_main_filter_function)
     else
 	setup_xy_vars_from_closure ();
 
-    alloc_complex_copy_var();
-
     current_function = filter_function;
 }
 
 Value*
 code_emitter::emit_sizeof (Type *type)
 {
-    Value *size = builder->CreateGEP(ConstantPointerNull::get(PointerType::getUnqual(type)),
-				     make_int_const(1));
+    const DataLayout &layout = module->getDataLayout();
 
-    return builder->CreatePtrToInt(size, sizeof(gpointer) == 4 ? Type::Int32Ty : Type::Int64Ty);
+    return ConstantInt::get(layout.getIntPtrType(context), layout.getTypeAllocSize(type));
 }
 
 void
@@ -1173,72 +1278,64 @@ code_emitter::setup_init_frame_function ()
     Value *t_arg;
     Function::arg_iterator args = init_frame_function->arg_begin();
 
-    invocation_arg = args++;
+    invocation_arg = &*args++;
     invocation_arg->setName("invocation");
-    //frame_arg = args++;
+    //frame_arg = &*args++;
     //frame_arg->setName("frame");
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
-    t_arg = args++;
+    t_arg = &*args++;
     t_arg->setName("t");
-    pools_arg = args++;
+    pools_arg = &*args++;
     pools_arg->setName("pools");
 
-    BasicBlock *block = BasicBlock::Create("entry", init_frame_function);
+    BasicBlock *block = BasicBlock::Create(context, "entry", init_frame_function);
 
     builder = new IRBuilder<> (block);
 
-    //invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
-    //pools_arg = builder->CreateCall(module->getFunction(string("get_frame_pools")), frame_arg);
+    //invocation_arg = emit_call("get_frame_invocation", frame_arg);
+    //pools_arg = emit_call("get_frame_pools", frame_arg);
 
     set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), t_arg);
 
     set_internals_from_invocation(invocation_arg);
 
-    ret_var = builder->CreateCall2(module->getFunction(string("_mathmap_pools_alloc")),
-				   pools_arg, emit_sizeof(xy_vars_type));
+    ret_var = emit_call("_mathmap_pools_alloc", { pools_arg, emit_sizeof(xy_vars_type) });
     xy_vars_var = builder->CreateBitCast(ret_var, PointerType::getUnqual(xy_vars_type));
 
-    alloc_complex_copy_var();
-
     current_function = init_frame_function;
 }
 
 Value*
 code_emitter::setup_init_x_or_y_function (string function_name, const char *internal_name, StructType *vars_type)
 {
-    current_function = module->getFunction(function_name);
-
-    Value *slice_arg;
+    current_function = get_function(function_name.c_str());
 
     Function::arg_iterator args = current_function->arg_begin();
 
-    slice_arg = args++;
+    slice_arg = &*args++;
     slice_arg->setName("slice");
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
-    set_internal(::lookup_internal(filter->v.mathmap.internals, internal_name, true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, internal_name, true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), &*args++);
 
-    BasicBlock *block = BasicBlock::Create("entry", current_function);
+    BasicBlock *block = BasicBlock::Create(context, "entry", current_function);
 
     builder = new IRBuilder<> (block);
 
-    frame_arg = builder->CreateCall(module->getFunction(string("get_slice_frame")), slice_arg);
-    invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
-    pools_arg = builder->CreateCall(module->getFunction("get_slice_pools"), slice_arg);
+    frame_arg = emit_call("get_slice_frame", slice_arg);
+    invocation_arg = emit_call("get_frame_invocation", frame_arg);
+    pools_arg = emit_call("get_slice_pools", slice_arg);
 
     set_internals_from_invocation(invocation_arg);
 
     set_xy_vars_from_frame();
 
-    ret_var = builder->CreateCall2(module->getFunction(string("_mathmap_pools_alloc")),
-				   pools_arg, emit_sizeof(vars_type));
+    ret_var = emit_call("_mathmap_pools_alloc", { pools_arg, emit_sizeof(vars_type) });
 
     Value *vars_var = builder->CreateBitCast(ret_var, PointerType::getUnqual(vars_type));
 
-    alloc_complex_copy_var();
-
     return vars_var;
 }
 
@@ -1257,8 +1354,6 @@ code_emitter::finish_function ()
     xy_vars_var = NULL;
     ret_var = NULL;
 
-    complex_copy_var = NULL;
-
     value_map.clear();
     internal_map.clear();
     phi_map.clear();
@@ -1273,14 +1368,14 @@ code_emitter::finish_function ()
 StructType*
 code_emitter::build_const_value_infos (int const_type)
 {
-    vector<const Type*> struct_elems;
+    vector<Type*> struct_elems;
 
     compiler_reset_have_defined(filter_code->first_stmt);
     next_const_value_index = 0;
     COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(filter_code->first_stmt, &_build_const_value_info,
 					  CLOSURE_ARG(this), CLOSURE_ARG((void*)const_type), CLOSURE_ARG(&struct_elems));
 
-    return StructType::get(struct_elems);
+    return StructType::get(context, struct_elems);
 }
 
 void
@@ -1295,7 +1390,7 @@ code_emitter::emit_init_frame_function ()
     setup_init_frame_function();
     compiler_slice_code_for_const(filter_code->first_stmt, CONST_X | CONST_Y);
     emit_stmts(filter_code->first_stmt, SLICE_XY_CONST);
-    builder->CreateRet(ret_var);
+    builder->CreateRet(coerce(ret_var, current_function->getReturnType()));
     finish_function();
 }
 
@@ -1309,13 +1404,13 @@ code_emitter::emit_filter_function ()
     setup_filter_function(false);
 
     x_vars_type = build_const_value_infos(CONST_X);
-    x_vars_var = builder->CreateAlloca(x_vars_type);
+    x_vars_var = create_entry_alloca(x_vars_type);
     compiler_slice_code_for_const(filter_code->first_stmt, CONST_X);
     emit_stmts(filter_code->first_stmt, SLICE_X_CONST);
     value_map.clear();
 
     y_vars_type = build_const_value_infos(CONST_Y);
-    y_vars_var = builder->CreateAlloca(y_vars_type);
+    y_vars_var = create_entry_alloca(y_vars_type);
     compiler_slice_code_for_const(filter_code->first_stmt, CONST_Y);
     emit_stmts(filter_code->first_stmt, SLICE_Y_CONST);
     value_map.clear();
@@ -1336,7 +1431,7 @@ code_emitter::emit_main_filter_funcs ()
     x_vars_var = setup_init_x_or_y_function(init_x_function_name(filter), "y", x_vars_type);
     compiler_slice_code_for_const(filter_code->first_stmt, CONST_X);
     emit_stmts(filter_code->first_stmt, SLICE_X_CONST);
-    builder->CreateRet(ret_var);
+    builder->CreateRet(coerce(ret_var, current_function->getReturnType()));
     finish_function();
 
     // init y
@@ -1346,7 +1441,7 @@ code_emitter::emit_main_filter_funcs ()
     y_vars_var = setup_init_x_or_y_function(init_y_function_name(filter), "x", y_vars_type);
     compiler_slice_code_for_const(filter_code->first_stmt, CONST_Y);
     emit_stmts(filter_code->first_stmt, SLICE_Y_CONST);
-    builder->CreateRet(ret_var);
+    builder->CreateRet(coerce(ret_var, current_function->getReturnType()));
     finish_function();
 
     // filter
@@ -1360,86 +1455,278 @@ code_emitter::emit_main_filter_funcs ()
     finish_function();
 }
 
+static Function*
+make_function (Module *module, string name, Type *ret_type, ArrayRef<Type*> arg_types)
+{
+    FunctionCallee callee = module->getOrInsertFunction(name, FunctionType::get(ret_type, arg_types, false));
+
+    return cast<Function>(callee.getCallee());
+}
+
 static Function*
 make_filter_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(filter_function_name(filter),
-							   llvm_type_for_type(module, TYPE_TUPLE), // ret type
-							   get_invocation_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // x
-							   Type::FloatTy, // y
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    LLVMContext &context = module->getContext();
+
+    return make_function(module, filter_function_name(filter),
+			 llvm_type_for_type(module, TYPE_TUPLE), // ret type
+			 { get_invocation_ptr_type(module), // invocation
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   Type::getFloatTy(context), // x
+			   Type::getFloatTy(context), // y
+			   Type::getFloatTy(context), // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 static Function*
 make_init_frame_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(init_frame_function_name(filter),
-							   get_void_ptr_type(), // ret type
-							   get_invocation_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    LLVMContext &context = module->getContext();
+
+    return make_function(module, init_frame_function_name(filter),
+			 get_void_ptr_type(context), // ret type
+			 { get_invocation_ptr_type(module), // invocation
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   Type::getFloatTy(context), // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 static Function*
 make_init_x_or_y_function (Module *module, filter_t *filter, string function_name)
 {
-    Constant *function_const = module->getOrInsertFunction(function_name,
-							   get_void_ptr_type(),	// ret type
-							   get_slice_ptr_type(module), // slice
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // x/y
-							   Type::FloatTy, // t
-							   NULL);
-    return cast<Function>(function_const);
+    LLVMContext &context = module->getContext();
+
+    return make_function(module, function_name,
+			 get_void_ptr_type(context), // ret type
+			 { get_slice_ptr_type(module), // slice
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   Type::getFloatTy(context), // x/y
+			   Type::getFloatTy(context) }); // t
 }
 
 static Function*
 make_main_filter_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(main_filter_function_name(filter),
-							   llvm_type_for_type(module, TYPE_TUPLE), // ret type
-							   get_slice_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   get_void_ptr_type(), // x_vars
-							   get_void_ptr_type(), // y_vars
-							   Type::FloatTy, // x
-							   Type::FloatTy, // y
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    LLVMContext &context = module->getContext();
+
+    return make_function(module, main_filter_function_name(filter),
+			 llvm_type_for_type(module, TYPE_TUPLE), // ret type
+			 { get_slice_ptr_type(module), // slice
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   get_void_ptr_type(context), // x_vars
+			   get_void_ptr_type(context), // y_vars
+			   Type::getFloatTy(context), // x
+			   Type::getFloatTy(context), // y
+			   Type::getFloatTy(context), // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 void* lazy_creator (const std::string &name);
 
+/* Resolves the symbols the filter code refers to.  Symbols MathMap
+   doesn't export dynamically are found by lazy_creator(), which is
+   generated from exported_symbols. */
+class mathmap_symbol_generator : public orc::DefinitionGenerator
+{
+public:
+    mathmap_symbol_generator (char _global_prefix) : global_prefix(_global_prefix) { }
+
+    Error
+    tryToGenerate (orc::LookupState &state, orc::LookupKind kind, orc::JITDylib &dylib,
+		   orc::JITDylibLookupFlags flags, const orc::SymbolLookupSet &symbols)
+    {
+	orc::SymbolMap new_symbols;
+
+	for (orc::SymbolLookupSet::const_iterator iter = symbols.begin(); iter != symbols.end(); ++iter)
+	{
+	    StringRef name = *iter->first;
+	    void *address;
+
+	    if (global_prefix != '\0')
+	    {
+		if (name.empty() || name.front() != global_prefix)
+		    continue;
+		name = name.drop_front();
+	    }
+
+	    address = sys::DynamicLibrary::SearchForAddressOfSymbol(name.str());
+	    if (address == NULL)
+		address = lazy_creator(name.str());
+	    if (address == NULL)
+		continue;
+
+#if LLVM_VERSION_MAJOR >= 17
+	    new_symbols[iter->first] = orc::ExecutorSymbolDef(orc::ExecutorAddr::fromPtr(address),
+							      JITSymbolFlags::Exported);
+#else
+	    new_symbols[iter->first] = JITEvaluatedSymbol(pointerToJITTargetAddress(address),
+							  JITSymbolFlags::Exported);
+#endif
+	}
+
+	if (new_symbols.empty())
+	    return Error::success();
+	return dylib.define(orc::absoluteSymbols(std::move(new_symbols)));
+    }
+
+private:
+    char global_prefix;
+};
+
+#define ERROR_STRING_SIZE	1024
+
+/* The JIT is shared by all filters, so mathmaps compiled by different
+   threads generate and unload their code one at a time. */
+static GStaticMutex jit_mutex = G_STATIC_MUTEX_INIT;
+static std::unique_ptr<orc::LLLazyJIT> jit;
+/* only used for optimizing */
+static std::unique_ptr<TargetMachine> target_machine;
+static std::unique_ptr<MemoryBuffer> template_buffer;
+static int num_dylibs = 0;
+
+static void
+set_error_string (const char *what, Error error)
+{
+    string message = toString(std::move(error));
+
+    snprintf(error_string, ERROR_STRING_SIZE, "%s: %s", what, message.c_str());
+}
+
+/* Code is generated for the host CPU, so it can use AVX2 or AVX-512
+   if they're available. */
+static bool
+init_jit ()
+{
+    if (jit)
+	return true;
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    sys::DynamicLibrary::LoadLibraryPermanently(NULL);
+
+    Expected<orc::JITTargetMachineBuilder> machine_builder = orc::JITTargetMachineBuilder::detectHost();
+    if (!machine_builder)
+    {
+	set_error_string("Cannot detect host machine", machine_builder.takeError());
+	return false;
+    }
+#if LLVM_VERSION_MAJOR >= 18
+    machine_builder->setCodeGenOptLevel(CodeGenOptLevel::Aggressive);
+#else
+    machine_builder->setCodeGenOptLevel(CodeGenOpt::Aggressive);
+#endif
+
+    Expected<std::unique_ptr<TargetMachine> > machine = machine_builder->createTargetMachine();
+    if (!machine)
+    {
+	set_error_string("Cannot create target machine", machine.takeError());
+	return false;
+    }
+
+    Expected<std::unique_ptr<orc::LLLazyJIT> > new_jit = orc::LLLazyJITBuilder()
+	.setJITTargetMachineBuilder(*machine_builder)
+	.create();
+    if (!new_jit)
+    {
+	set_error_string("Cannot create JIT", new_jit.takeError());
+	return false;
+    }
+
+    target_machine = std::move(*machine);
+    jit = std::move(*new_jit);
+
+    /* compile each function when it's first called */
+    jit->setPartitionFunction(orc::CompileOnDemandLayer::compileRequested);
+
+    return true;
+}
+
+/* The whole module is optimized up front so that the template
+   functions can be inlined into the filter functions.  Machine code
+   is only generated for the functions that are actually called. */
+static void
+optimize_module (Module *module)
+{
+    LoopAnalysisManager loop_am;
+    FunctionAnalysisManager function_am;
+    CGSCCAnalysisManager cgscc_am;
+    ModuleAnalysisManager module_am;
+    PassBuilder pass_builder(target_machine.get());
+
+    pass_builder.registerModuleAnalyses(module_am);
+    pass_builder.registerCGSCCAnalyses(cgscc_am);
+    pass_builder.registerFunctionAnalyses(function_am);
+    pass_builder.registerLoopAnalyses(loop_am);
+    pass_builder.crossRegisterProxies(loop_am, function_am, cgscc_am, module_am);
+
+    ModulePassManager pass_manager = pass_builder.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+
+    pass_manager.run(*module, module_am);
+}
+
+static void*
+lookup_function (orc::JITDylib &dylib, const string &name)
+{
+    auto symbol = jit->lookup(dylib, name);
+
+    if (!symbol)
+    {
+	set_error_string("Cannot look up filter function", symbol.takeError());
+	return NULL;
+    }
+
+#if LLVM_VERSION_MAJOR >= 15
+    return symbol->toPtr<void*>();
+#else
+    return jitTargetAddressToPointer<void*>(symbol->getAddress());
+#endif
+}
+
 typedef struct
 {
-    ExecutionEngine *ee;
+    orc::JITDylib *dylib;
     mathfuncs_t mathfuncs;
 } module_info_t;
 
-extern "C"
-void
-gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code_t **filter_codes)
+static void
+gen_and_load_code (mathmap_t *mathmap, char *template_filename, filter_code_t **filter_codes)
 {
-    MemoryBuffer *buffer = MemoryBuffer::getFile(template_filename, NULL);
-
-    g_assert(buffer != NULL);
-
-    Module *module = ParseBitcodeFile (buffer, NULL);
     int i;
     filter_t *filter;
 
-    assert(module != NULL);
-    delete buffer;
+    if (!init_jit())
+	return;
+
+    if (!template_buffer)
+    {
+	ErrorOr<std::unique_ptr<MemoryBuffer> > buffer = MemoryBuffer::getFile(template_filename);
+
+	if (!buffer)
+	{
+	    snprintf(error_string, ERROR_STRING_SIZE, "Cannot read `%s': %s",
+		     template_filename, buffer.getError().message().c_str());
+	    return;
+	}
+
+	template_buffer = std::move(*buffer);
+    }
+
+    /* every filter gets its own context, so they can be compiled
+       concurrently */
+    std::unique_ptr<LLVMContext> context(new LLVMContext);
+    Expected<std::unique_ptr<Module> > parsed_module = parseBitcodeFile(template_buffer->getMemBufferRef(), *context);
+
+    if (!parsed_module)
+    {
+	set_error_string("Cannot parse LLVM template", parsed_module.takeError());
+	return;
+    }
+
+    std::unique_ptr<Module> module_ptr = std::move(*parsed_module);
+    Module *module = module_ptr.get();
+
+    module->setDataLayout(jit->getDataLayout());
+    module->setTargetTriple(target_machine->getTargetTriple().str());
 
     for (i = 0, filter = mathmap->filters;
 	 filter != 0;
@@ -1477,49 +1764,62 @@ gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code
 	catch (compiler_error error)
 	{
 	    delete emitter;
-	    delete module;
 
-	    strcpy(error_string, error.info.c_str());
+	    snprintf(error_string, ERROR_STRING_SIZE, "%s", error.info.c_str());
 	    return;
 	}
 	delete emitter;
     }
 
-    PassManager pm;
-
-    pm.add(new TargetData(module));
-    pm.add(createFunctionInliningPass());
-    pm.add(createInstructionCombiningPass());
-    pm.add(createReassociatePass());
-    pm.add(createLowerSetJmpPass());
-    pm.add(createRaiseAllocationsPass());
-    pm.add(createGVNPass());
-    pm.add(createCFGSimplificationPass());
-    pm.add(createPromoteMemoryToRegisterPass());
-    pm.add(createGlobalOptimizerPass());
-    pm.add(createGlobalDCEPass());
+    if (verifyModule(*module, &errs()))
+    {
+	strcpy(error_string, "The LLVM backend generated an invalid module.");
+	return;
+    }
 
-    pm.run(*module);
+    optimize_module(module);
 
 #ifdef DEBUG_OUTPUT
-    module->dump();
-
-    verifyModule(*module, PrintMessageAction);
+    module->print(errs(), NULL);
 #endif
 
-    ExecutionEngine *ee = ExecutionEngine::create (module);
+    char *dylib_name = g_strdup_printf("mathmap-%d", ++num_dylibs);
+    Expected<orc::JITDylib&> dylib = jit->createJITDylib(dylib_name);
 
-    ee->InstallLazyFunctionCreator(lazy_creator);
+    g_free(dylib_name);
 
-    module_info_t *module_info = g_new0(module_info_t, 1);
+    if (!dylib)
+    {
+	set_error_string("Cannot create JIT dylib", dylib.takeError());
+	return;
+    }
+
+    dylib->addGenerator(std::unique_ptr<orc::DefinitionGenerator>
+			(new mathmap_symbol_generator(jit->getDataLayout().getGlobalPrefix())));
+
+    if (Error error = jit->addLazyIRModule(*dylib, orc::ThreadSafeModule(std::move(module_ptr), std::move(context))))
+    {
+	set_error_string("Cannot add module to JIT", std::move(error));
+	cantFail(jit->getExecutionSession().removeJITDylib(*dylib));
+	return;
+    }
 
-    module_info->ee = ee;
+    /* these are only stubs - the functions are compiled on their
+       first call */
+    void *init_frame_fptr = lookup_function(*dylib, init_frame_function_name(mathmap->main_filter));
+    void *main_filter_fptr = lookup_function(*dylib, main_filter_function_name(mathmap->main_filter));
+    void *init_x_fptr = lookup_function(*dylib, init_x_function_name(mathmap->main_filter));
+    void *init_y_fptr = lookup_function(*dylib, init_y_function_name(mathmap->main_filter));
 
-    void *init_frame_fptr = ee->getPointerToFunction(lookup_init_frame_function(module, mathmap->main_filter));
-    void *main_filter_fptr = ee->getPointerToFunction(lookup_main_filter_function(module, mathmap->main_filter));
-    void *init_x_fptr = ee->getPointerToFunction(lookup_init_x_function(module, mathmap->main_filter));
-    void *init_y_fptr = ee->getPointerToFunction(lookup_init_y_function(module, mathmap->main_filter));
-    g_assert(main_filter_fptr && init_x_fptr && init_y_fptr);
+    if (!init_frame_fptr || !main_filter_fptr || !init_x_fptr || !init_y_fptr)
+    {
+	cantFail(jit->getExecutionSession().removeJITDylib(*dylib));
+	return;
+    }
+
+    module_info_t *module_info = g_new0(module_info_t, 1);
+
+    module_info->dylib = &*dylib;
 
     module_info->mathfuncs.llvm_init_frame_func = (llvm_init_frame_func_t)init_frame_fptr;
     module_info->mathfuncs.main_filter_func = (llvm_filter_func_t)main_filter_fptr;
@@ -1531,6 +1831,15 @@ gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code
     mathmap->mathfuncs = &module_info->mathfuncs;
 }
 
+extern "C"
+void
+gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code_t **filter_codes)
+{
+    g_static_mutex_lock(&jit_mutex);
+    gen_and_load_code(mathmap, template_filename, filter_codes);
+    g_static_mutex_unlock(&jit_mutex);
+}
+
 extern "C"
 void
 unload_llvm_code (mathmap_t *mathmap)
@@ -1539,6 +1848,10 @@ unload_llvm_code (mathmap_t *mathmap)
 
     mathmap->module_info = NULL;
 
-    delete info->ee;
+    g_static_mutex_lock(&jit_mutex);
+    if (Error error = jit->getExecutionSession().removeJITDylib(*info->dylib))
+	logAllUnhandledErrors(std::move(error), errs(), "Cannot unload filter: ");
+    g_static_mutex_unlock(&jit_mutex);
+
     g_free(info);
 }
@@ -0,0 +1,367 @@
+/*
+ * module_cache.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * On-disk cache of compiled filter modules.  A module is stored as
+ * <key>.so in the cache directory, where the key is a SHA-256 hash
+ * of everything that goes into producing it: the filter source, the
+ * template, opmacros.h and pools.h, the compiler command lines, the
+ * optimization timeout, whether vectorized code is emitted, whether
+ * closures are materialized and the MathMap version.
+ *
+ * Writers never modify a published file.  The module is written to
+ * a temporary file next to its final name and then renamed into
+ * place (that's what g_file_set_contents() does), so concurrent
+ * processes either see a complete module or none at all.  Two
+ * writers racing for the same key produce identical modules, so the
+ * last rename simply wins.
+ *
+ * Hits bump the file's modification time, and eviction removes the
+ * least recently used modules once the total size exceeds the
+ * budget.  Unlinking a module another process has loaded is safe.
+ *
+ * Other build products of the C backend, like the precompiled
+ * prelude, are kept in subdirectories, which eviction leaves alone.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gmodule.h>
+
+#include "../mathmap.h"
+
+#define MODULE_CACHE_DEFAULT_MAX_SIZE	(128 * 1024 * 1024)
+#define MODULE_CACHE_SUFFIX		".so"
+/* stale temporary files of writers that died are removed after this
+   many seconds */
+#define MODULE_CACHE_STALE_TMP_AGE	3600
+
+static gboolean module_cache_enabled = TRUE;
+static char *module_cache_dir = NULL;
+static gint64 module_cache_max_size = MODULE_CACHE_DEFAULT_MAX_SIZE;
+
+void
+module_cache_set_directory (const char *dir)
+{
+    g_free(module_cache_dir);
+    module_cache_dir = g_strdup(dir);
+}
+
+void
+module_cache_set_enabled (gboolean enabled)
+{
+    module_cache_enabled = enabled;
+}
+
+void
+module_cache_set_max_size (long max_size)
+{
+    g_assert(max_size >= 0);
+    module_cache_max_size = max_size;
+}
+
+/* The cache only applies to the C backend. */
+#if !defined(OPENSTEP) && !defined(USE_LLVM)
+
+static const char*
+get_cache_dir (void)
+{
+    if (!module_cache_enabled)
+	return NULL;
+
+    if (module_cache_dir == NULL)
+	module_cache_dir = g_build_filename(g_get_user_cache_dir(), "mathmap", "modules", NULL);
+
+    if (g_mkdir_with_parents(module_cache_dir, 0755) != 0)
+    {
+	g_warning("Cannot create module cache directory `%s': %s", module_cache_dir, strerror(errno));
+	module_cache_enabled = FALSE;
+	return NULL;
+    }
+
+    return module_cache_dir;
+}
+
+static void
+checksum_update_string (GChecksum *checksum, const char *str)
+{
+    /* include the terminating NUL so that adjacent strings can't
+       be shifted into each other */
+    g_checksum_update(checksum, (const guchar*)str, strlen(str) + 1);
+}
+
+static void
+checksum_update_file (GChecksum *checksum, const char *filename)
+{
+    char *contents;
+    gsize length;
+
+    checksum_update_string(checksum, filename);
+
+    if (g_file_get_contents(filename, &contents, &length, NULL))
+    {
+	g_checksum_update(checksum, (const guchar*)contents, length);
+	g_free(contents);
+    }
+}
+
+char*
+module_cache_make_key (const char *expression, const char *template_filename, const char *include_path, int timeout)
+{
+    GChecksum *checksum;
+    char *filename;
+    char *key;
+
+    if (get_cache_dir() == NULL)
+	return NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+    checksum_update_string(checksum, MATHMAP_VERSION);
+    checksum_update_string(checksum, CGEN_CC);
+    checksum_update_string(checksum, CGEN_LD);
+#ifdef NO_CONSTANTS_ANALYSIS
+    checksum_update_string(checksum, "no-constants-analysis");
+#else
+    checksum_update_string(checksum, "constants-analysis");
+#endif
+    g_checksum_update(checksum, (const guchar*)&timeout, sizeof(timeout));
+    checksum_update_string(checksum, cc_get_vectorize() ? "vectorize" : "no-vectorize");
+    checksum_update_string(checksum, compiler_get_tuple_phi_splitting() ? "split-tuple-phis" : "no-split-tuple-phis");
+    checksum_update_string(checksum, compiler_get_materialize_closures() ? "materialize" : "no-materialize");
+
+    checksum_update_file(checksum, template_filename);
+
+    filename = g_strdup_printf("%s/%s", include_path, OPMACROS_FILENAME);
+    checksum_update_file(checksum, filename);
+    g_free(filename);
+
+    filename = g_strdup_printf("%s/pools.h", include_path);
+    checksum_update_file(checksum, filename);
+    g_free(filename);
+
+    checksum_update_string(checksum, expression);
+
+    key = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+
+    return key;
+}
+
+/* Returns the name of the subdirectory of the cache for other build
+   products, which the caller must free, or NULL if the cache is
+   disabled. */
+char*
+module_cache_get_subdirectory (const char *name)
+{
+    const char *dir = get_cache_dir();
+
+    if (dir == NULL)
+	return NULL;
+    return g_build_filename(dir, name, NULL);
+}
+
+static char*
+module_filename (const char *key)
+{
+    const char *dir = get_cache_dir();
+
+    if (dir == NULL)
+	return NULL;
+    return g_strdup_printf("%s/%s%s", dir, key, MODULE_CACHE_SUFFIX);
+}
+
+initfunc_t
+module_cache_load (const char *key, void **module_info)
+{
+    char *filename = module_filename(key);
+    GModule *module;
+    void *initfunc_ptr;
+
+    if (filename == NULL)
+	return NULL;
+
+    if (g_access(filename, R_OK) != 0)
+    {
+	g_free(filename);
+	return NULL;
+    }
+
+    module = g_module_open(filename, 0);
+    if (module == NULL)
+    {
+	/* a corrupt module - get rid of it so that it will be
+	   rebuilt */
+	g_warning("Could not load cached module `%s': %s", filename, g_module_error());
+	g_unlink(filename);
+	g_free(filename);
+	return NULL;
+    }
+
+    if (!g_module_symbol(module, "mathmapinit", &initfunc_ptr))
+    {
+	g_module_close(module);
+	g_unlink(filename);
+	g_free(filename);
+	return NULL;
+    }
+
+    /* mark as recently used */
+    utime(filename, NULL);
+
+#ifdef DEBUG_OUTPUT
+    printf("loaded cached module %s\n", filename);
+#endif
+
+    g_free(filename);
+
+    *module_info = module;
+    return (initfunc_t)initfunc_ptr;
+}
+
+typedef struct
+{
+    char *filename;
+    time_t mtime;
+    gint64 size;
+} cache_file_t;
+
+static gint
+compare_cache_files (gconstpointer _a, gconstpointer _b)
+{
+    const cache_file_t *a = _a, *b = _b;
+
+    if (a->mtime < b->mtime)
+	return -1;
+    if (a->mtime > b->mtime)
+	return 1;
+    return 0;
+}
+
+static void
+evict (const char *dir)
+{
+    GDir *gdir = g_dir_open(dir, 0, NULL);
+    const char *name;
+    GSList *files = NULL, *list;
+    gint64 total_size = 0;
+    time_t now = time(NULL);
+
+    if (gdir == NULL)
+	return;
+
+    while ((name = g_dir_read_name(gdir)) != NULL)
+    {
+	char *filename = g_build_filename(dir, name, NULL);
+	struct stat buf;
+
+	if (g_stat(filename, &buf) != 0 || S_ISDIR(buf.st_mode))
+	{
+	    g_free(filename);
+	    continue;
+	}
+
+	if (!g_str_has_suffix(name, MODULE_CACHE_SUFFIX))
+	{
+	    /* temporary file of a writer - only remove it if its
+	       writer must be long dead */
+	    if (now - buf.st_mtime > MODULE_CACHE_STALE_TMP_AGE)
+		g_unlink(filename);
+	    g_free(filename);
+	    continue;
+	}
+
+	{
+	    cache_file_t *file = g_new(cache_file_t, 1);
+
+	    file->filename = filename;
+	    file->mtime = buf.st_mtime;
+	    file->size = buf.st_size;
+
+	    files = g_slist_prepend(files, file);
+	    total_size += file->size;
+	}
+    }
+
+    g_dir_close(gdir);
+
+    files = g_slist_sort(files, compare_cache_files);
+
+    for (list = files; list != NULL; list = list->next)
+    {
+	cache_file_t *file = list->data;
+
+	if (total_size > module_cache_max_size
+	    && g_unlink(file->filename) == 0)
+	    total_size -= file->size;
+
+	g_free(file->filename);
+	g_free(file);
+    }
+
+    g_slist_free(files);
+}
+
+gboolean
+module_cache_store (const char *key, const char *so_filename)
+{
+    char *filename = module_filename(key);
+    char *contents;
+    gsize length;
+    GError *error = NULL;
+
+    if (filename == NULL)
+	return FALSE;
+
+    if (!g_file_get_contents(so_filename, &contents, &length, NULL))
+    {
+	g_free(filename);
+	return FALSE;
+    }
+
+    if (!g_file_set_contents(filename, contents, length, &error))
+    {
+	g_warning("Could not store module in cache: %s", error->message);
+	g_error_free(error);
+	g_free(contents);
+	g_free(filename);
+	return FALSE;
+    }
+
+    g_free(contents);
+    g_free(filename);
+
+    evict(get_cache_dir());
+
+    return TRUE;
+}
+
+#endif
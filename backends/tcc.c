@@ -0,0 +1,134 @@
+/*
+ * tcc.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Compiles the code of the C backend in memory with libtcc.  The
+ * source is written to a memory stream and the code is relocated
+ * into the process, so there are no temporary files and no child
+ * processes.  The functions the filter code calls are resolved from
+ * the table generated from exported_symbols, like for the LLVM
+ * backend.
+ *
+ * tcc doesn't do vector extensions, so the code is generated without
+ * the vectorized pixel loop, and it doesn't do complex numbers, so
+ * compiling filters that use them fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtcc.h>
+
+#include "../compiler-internals.h"
+
+typedef struct
+{
+    const char *name;
+    void *address;
+} tcc_symbol_t;
+
+/* generated by make_tcc_symbols.pl */
+extern tcc_symbol_t tcc_symbols[];
+
+static void
+tcc_error_handler (void *opaque, const char *msg)
+{
+    GString *errors = opaque;
+
+    if (errors->len > 0)
+	g_string_append_c(errors, '\n');
+    g_string_append(errors, msg);
+}
+
+initfunc_t
+gen_and_load_tcc_code (mathmap_t *mathmap, void **module_info, char *template_filename, char *include_path,
+		       filter_code_t **filter_codes)
+{
+    char *source;
+    size_t source_size;
+    FILE *out;
+    gboolean success;
+    TCCState *state;
+    GString *errors;
+    void *initfunc_ptr;
+    int i;
+
+    out = open_memstream(&source, &source_size);
+    if (out == NULL)
+    {
+	sprintf(error_string, _("Could not allocate memory for the C code"));
+	return 0;
+    }
+
+    success = cc_write_c_code(mathmap, template_filename, include_path, filter_codes, FALSE, out);
+
+    fclose(out);
+
+    if (!success)
+    {
+	free(source);
+	return 0;
+    }
+
+    errors = g_string_new("");
+
+    state = tcc_new();
+    tcc_set_error_func(state, errors, tcc_error_handler);
+    tcc_set_output_type(state, TCC_OUTPUT_MEMORY);
+    tcc_add_include_path(state, include_path);
+
+    for (i = 0; tcc_symbols[i].name != NULL; ++i)
+	tcc_add_symbol(state, tcc_symbols[i].name, tcc_symbols[i].address);
+
+    success = tcc_compile_string(state, source) == 0;
+    free(source);
+
+#ifdef TCC_RELOCATE_AUTO
+    success = success && tcc_relocate(state, TCC_RELOCATE_AUTO) >= 0;
+#else
+    success = success && tcc_relocate(state) >= 0;
+#endif
+
+    if (!success)
+    {
+	g_snprintf(error_string, ERROR_STRING_LENGTH, _("libtcc failed:\n%s"), errors->str);
+	g_string_free(errors, TRUE);
+	tcc_delete(state);
+	return 0;
+    }
+
+    g_string_free(errors, TRUE);
+
+    initfunc_ptr = tcc_get_symbol(state, "mathmapinit");
+    g_assert(initfunc_ptr != NULL);
+
+    *module_info = state;
+
+    return (initfunc_t)initfunc_ptr;
+}
+
+void
+unload_tcc_code (void *module_info)
+{
+    tcc_delete((TCCState*)module_info);
+}
@@ -0,0 +1,139 @@
+/*
+ * bench.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+
+#include "bench.h"
+
+typedef struct
+{
+    double wall_start, cpu_start;
+    gboolean running;
+} phase_start_t;
+
+typedef struct
+{
+    double wall, cpu;
+} phase_times_t;
+
+static const char *phase_names[NUM_BENCH_PHASES] = {
+    "parse", "optimize", "prelude", "backend", "load", "render"
+};
+
+/* Phases are begun and ended per thread, so background compiles and
+   parallel jobs don't end each other's phases.  The totals are shared. */
+static GStaticPrivate phase_starts_key = G_STATIC_PRIVATE_INIT;
+static phase_times_t phases[NUM_BENCH_PHASES];
+static GStaticMutex phases_mutex = G_STATIC_MUTEX_INIT;
+
+static double
+wall_time (void)
+{
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double
+rusage_seconds (int who)
+{
+    struct rusage usage;
+
+    if (getrusage(who, &usage) != 0)
+	return 0.0;
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0
+	+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static double
+cpu_time (void)
+{
+    return rusage_seconds(RUSAGE_SELF) + rusage_seconds(RUSAGE_CHILDREN);
+}
+
+/* Returns the calling thread's phase starts. */
+static phase_start_t*
+get_phase_starts (void)
+{
+    phase_start_t *phase_starts = g_static_private_get(&phase_starts_key);
+
+    if (phase_starts == NULL)
+    {
+	phase_starts = g_new0(phase_start_t, NUM_BENCH_PHASES);
+	g_static_private_set(&phase_starts_key, phase_starts, g_free);
+    }
+
+    return phase_starts;
+}
+
+void
+bench_begin_phase (bench_phase_t phase)
+{
+    phase_start_t *phase_starts = get_phase_starts();
+
+    g_assert(phase >= 0 && phase < NUM_BENCH_PHASES);
+
+    phase_starts[phase].wall_start = wall_time();
+    phase_starts[phase].cpu_start = cpu_time();
+    phase_starts[phase].running = TRUE;
+}
+
+void
+bench_end_phase (bench_phase_t phase)
+{
+    phase_start_t *phase_starts = get_phase_starts();
+    double wall, cpu;
+
+    g_assert(phase >= 0 && phase < NUM_BENCH_PHASES);
+
+    if (!phase_starts[phase].running)
+	return;
+
+    phase_starts[phase].running = FALSE;
+    wall = wall_time() - phase_starts[phase].wall_start;
+    cpu = cpu_time() - phase_starts[phase].cpu_start;
+
+    g_static_mutex_lock(&phases_mutex);
+    phases[phase].wall += wall;
+    phases[phase].cpu += cpu;
+    g_static_mutex_unlock(&phases_mutex);
+}
+
+/* One line per phase with its wall and CPU time in seconds, then the
+   number of pixels rendered.  tests/run_bench.pl reads this. */
+void
+bench_print_results (FILE *out, long num_pixels)
+{
+    int i;
+
+    g_static_mutex_lock(&phases_mutex);
+    for (i = 0; i < NUM_BENCH_PHASES; ++i)
+	fprintf(out, "bench %s %.6f %.6f\n", phase_names[i], phases[i].wall, phases[i].cpu);
+    g_static_mutex_unlock(&phases_mutex);
+    fprintf(out, "bench pixels %ld\n", num_pixels);
+}
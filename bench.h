@@ -0,0 +1,53 @@
+/*
+ * bench.h
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+
+typedef enum
+{
+    BENCH_PHASE_PARSE,
+    BENCH_PHASE_OPTIMIZE,
+    /* building the precompiled prelude of the C backend, which is
+       only done once per installation */
+    BENCH_PHASE_PRELUDE,
+    BENCH_PHASE_BACKEND,
+    BENCH_PHASE_LOAD,
+    BENCH_PHASE_RENDER,
+    NUM_BENCH_PHASES
+} bench_phase_t;
+
+/* Phases can be entered several times - their times add up.  A
+   phase is begun and ended by the same thread, but several threads
+   can be in the same phase at once.  CPU time includes all threads as
+   well as child processes, like the C compiler.  Ending a phase that
+   isn't running in the calling thread does nothing, so callers can
+   end a phase unconditionally after code that might have ended it
+   early. */
+void bench_begin_phase (bench_phase_t phase);
+void bench_end_phase (bench_phase_t phase);
+
+void bench_print_results (FILE *out, long num_pixels);
+
+#endif
@@ -264,9 +264,45 @@ get_floatmap_pixel (mathmap_invocation_t *invocation, image_t *image, float x, f
     return image->v.floatmap.data + (iy * image->pixel_width + ix) * 4;
 }
 
+/* Samples rows [first_row, last_row) of image into floatmap. */
+void
+render_image_rows (mathmap_invocation_t *invocation, image_t *image, image_t *floatmap,
+		   int first_row, int last_row, mathmap_pools_t *pools)
+{
+    color_t (*get_orig_val_pixel_func) (mathmap_invocation_t*, float, float, image_t*, int) = get_orig_val_pixel;
+    float ax = floatmap->v.floatmap.ax;
+    float bx = floatmap->v.floatmap.bx;
+    float ay = floatmap->v.floatmap.ay;
+    float by = floatmap->v.floatmap.by;
+    int width = floatmap->pixel_width;
+    float *p = floatmap->v.floatmap.data + first_row * width * 4;
+    int x, y;
+
+    for (y = first_row; y < last_row; ++y)
+    {
+	float fy = ((float)y - by) / ay;
+
+	for (x = 0; x < width; ++x)
+	{
+	    float fx = ((float)x - bx) / ax;
+	    float *tuple;
+
+	    mathmap_pools_reset(pools);
+	    tuple = ORIG_VAL(fx, fy, image, 0.0);
+
+	    memcpy(p, tuple, sizeof(float) * 4);
+
+	    p += 4;
+	}
+    }
+}
+
+/* Like render_image(), but renders a closure at time t instead of at
+   time 0. */
 CALLBACK_SYMBOL
 image_t*
-render_image (mathmap_invocation_t *invocation, image_t *image, int width, int height, mathmap_pools_t *pools, int force)
+render_image_frame (mathmap_invocation_t *invocation, image_t *image, int width, int height, float t,
+		    mathmap_pools_t *pools, int force)
 {
     image_t *new_image;
 
@@ -282,65 +318,34 @@ render_image (mathmap_invocation_t *invocation, image_t *image, int width, int h
     if (image->type == IMAGE_CLOSURE)
     {
 	mathmap_frame_t *frame;
-	mathmap_slice_t slice;
 
 #ifdef DEBUG_OUTPUT
 	g_print("image is closure\n");
 #endif
 
-	frame = invocation_new_frame(invocation, image, 0, 0.0);
+	frame = invocation_new_frame(invocation, image, 0, t);
 	frame->frame_render_width = width;
 	frame->frame_render_height = height;
 
-	invocation_init_slice(&slice, image, frame, 0, 0, width, height, 0.0, 0.0);
-
-	image->v.closure.funcs->calc_lines(&slice, image, 0, height, new_image->v.floatmap.data, 1);
-
-	invocation_deinit_slice(&slice);
+	render_floatmap_parallel_and_join(invocation, frame, image, new_image);
 
 	invocation_free_frame(frame);
     }
     else
     {
-	float ax, bx, ay, by;
-	color_t (*get_orig_val_pixel_func) (mathmap_invocation_t*, float, float, image_t*, int) = get_orig_val_pixel;
-	int x, y;
-	float *p;
-	mathmap_pools_t filter_pools;
-
 #ifdef DEBUG_OUTPUT
 	g_print("image is not closure: %d\n", image->type);
 #endif
 
-	ax = new_image->v.floatmap.ax;
-	bx = new_image->v.floatmap.bx;
-	ay = new_image->v.floatmap.ay;
-	by = new_image->v.floatmap.by;
-
-	mathmap_pools_init_local(&filter_pools);
-	pools = &filter_pools;
-
-	p = new_image->v.floatmap.data;
-	for (y = 0; y < height; ++y)
-	{
-	    float fy = ((float)y - by) / ay;
-
-	    for (x = 0; x < width; ++x)
-	    {
-		float fx = ((float)x - bx) / ax;
-		float *tuple;
-
-		mathmap_pools_reset(&filter_pools);
-		tuple = ORIG_VAL(fx, fy, image, 0.0);
-
-		memcpy(p, tuple, sizeof(float) * 4);
-
-		p += 4;
-	    }
-	}
-
-	mathmap_pools_free(&filter_pools);
+	render_floatmap_parallel_and_join(invocation, NULL, image, new_image);
     }
 
     return new_image;
 }
+
+CALLBACK_SYMBOL
+image_t*
+render_image (mathmap_invocation_t *invocation, image_t *image, int width, int height, mathmap_pools_t *pools, int force)
+{
+    return render_image_frame(invocation, image, width, height, 0.0, pools, force);
+}
@@ -46,8 +46,13 @@ float* get_floatmap_pixel (struct _mathmap_invocation_t *invocation, struct _ima
 
 struct _image_t* render_image (struct _mathmap_invocation_t *invocation, struct _image_t *image,
 			       int width, int height, mathmap_pools_t *pools, int force);
+struct _image_t* render_image_frame (struct _mathmap_invocation_t *invocation, struct _image_t *image,
+				     int width, int height, float t, mathmap_pools_t *pools, int force);
 /* END */
 
+void render_image_rows (struct _mathmap_invocation_t *invocation, struct _image_t *image, struct _image_t *floatmap,
+			int first_row, int last_row, mathmap_pools_t *pools);
+
 void init_builtins (void);
 
 #endif
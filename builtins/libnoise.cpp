@@ -3,7 +3,7 @@
  *
  * MathMap
  *
- * Copyright (C) 2009 Mark Probst
+ * Copyright (C) 2009-2010 Mark Probst
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -28,20 +28,158 @@
 
 using namespace noise;
 
+/* Configured modules are kept in a small per-thread cache, keyed by
+   their parameters.  Filters usually call a noise function with the
+   same parameters for every pixel, so setting up a module per call
+   would be a waste. */
+#define NOISE_CACHE_SIZE	4
+
+typedef struct
+{
+    int num_octaves;
+    float persistence;
+    float lacunarity;
+    float displacement;
+} noise_params_t;
+
+static void
+configure_module (module::Perlin &m, const noise_params_t &params)
+{
+    m.SetNoiseQuality (QUALITY_BESTEST);
+    m.SetOctaveCount (params.num_octaves);
+    m.SetLacunarity (params.lacunarity);
+    m.SetPersistence (params.persistence);
+}
+
+static void
+configure_module (module::Billow &m, const noise_params_t &params)
+{
+    m.SetNoiseQuality (QUALITY_BESTEST);
+    m.SetOctaveCount (params.num_octaves);
+    m.SetLacunarity (params.lacunarity);
+    m.SetPersistence (params.persistence);
+}
+
+static void
+configure_module (module::RidgedMulti &m, const noise_params_t &params)
+{
+    m.SetNoiseQuality (QUALITY_BESTEST);
+    m.SetOctaveCount (params.num_octaves);
+    m.SetLacunarity (params.lacunarity);
+}
+
+static void
+configure_module (module::Voronoi &m, const noise_params_t &params)
+{
+    m.SetDisplacement (params.displacement);
+}
+
+template <class Module>
+class module_cache_t
+{
+public:
+    module_cache_t () : next (0)
+    {
+	for (int i = 0; i < NOISE_CACHE_SIZE; ++i)
+	    valid[i] = false;
+    }
+
+    Module&
+    lookup (const noise_params_t &p)
+    {
+	int i;
+
+	for (i = 0; i < NOISE_CACHE_SIZE; ++i)
+	    if (valid[i]
+		&& params[i].num_octaves == p.num_octaves
+		&& params[i].persistence == p.persistence
+		&& params[i].lacunarity == p.lacunarity
+		&& params[i].displacement == p.displacement)
+		return modules[i];
+
+	/* replace round-robin */
+	i = next;
+	next = (next + 1) % NOISE_CACHE_SIZE;
+
+	/* libnoise rejects some parameters with an exception, in
+	   which case the entry must not be marked valid */
+	valid[i] = false;
+	configure_module (modules[i], p);
+	params[i] = p;
+	valid[i] = true;
+
+	return modules[i];
+    }
+
+private:
+    bool valid[NOISE_CACHE_SIZE];
+    noise_params_t params[NOISE_CACHE_SIZE];
+    Module modules[NOISE_CACHE_SIZE];
+    int next;
+};
+
+typedef struct
+{
+    module_cache_t<module::Perlin> perlin;
+    module_cache_t<module::Billow> billow;
+    module_cache_t<module::RidgedMulti> ridged_multi;
+    module_cache_t<module::Voronoi> voronoi;
+} noise_caches_t;
+
+static GStaticPrivate noise_caches_key = G_STATIC_PRIVATE_INIT;
+
+static void
+free_noise_caches (gpointer data)
+{
+    delete (noise_caches_t*)data;
+}
+
+static noise_caches_t*
+get_noise_caches (void)
+{
+    noise_caches_t *caches = (noise_caches_t*)g_static_private_get(&noise_caches_key);
+
+    if (caches == NULL)
+    {
+	caches = new noise_caches_t;
+	g_static_private_set(&noise_caches_key, caches, free_noise_caches);
+    }
+
+    return caches;
+}
+
+static noise_params_t
+make_params (int num_octaves, float persistence, float lacunarity, float displacement)
+{
+    noise_params_t params;
+
+    params.num_octaves = num_octaves;
+    params.persistence = persistence;
+    params.lacunarity = lacunarity;
+    params.displacement = displacement;
+
+    return params;
+}
+
+template <class Module>
+static void
+get_row_values (Module &m, const float *x, const float *y, const float *z, float *result, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+	result[i] = m.GetValue (x[i], y[i], z[i]);
+}
+
 extern "C"
 CALLBACK_SYMBOL
 float
 libnoise_perlin (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Perlin p;
-
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
+    noise_params_t params = make_params (num_octaves, persistence, lacunarity, 0.0);
 
-    return p.GetValue (x, y, z);
+    return get_noise_caches ()->perlin.lookup (params).GetValue (x, y, z);
 }
 
 extern "C"
@@ -50,14 +188,9 @@ float
 libnoise_billow (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Billow p;
+    noise_params_t params = make_params (num_octaves, persistence, lacunarity, 0.0);
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
-
-    return p.GetValue (x, y, z);
+    return get_noise_caches ()->billow.lookup (params).GetValue (x, y, z);
 }
 
 extern "C"
@@ -66,13 +199,9 @@ float
 libnoise_ridged_multi (int num_octaves, float lacunarity,
 		       float x, float y, float z)
 {
-    module::RidgedMulti p;
-
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
+    noise_params_t params = make_params (num_octaves, 0.0, lacunarity, 0.0);
 
-    return p.GetValue (x, y, z);
+    return get_noise_caches ()->ridged_multi.lookup (params).GetValue (x, y, z);
 }
 
 extern "C"
@@ -80,9 +209,51 @@ CALLBACK_SYMBOL
 float
 libnoise_voronoi (float displacement, float x, float y, float z)
 {
-    module::Voronoi p;
+    noise_params_t params = make_params (0, 0.0, 0.0, displacement);
+
+    return get_noise_caches ()->voronoi.lookup (params).GetValue (x, y, z);
+}
+
+extern "C"
+CALLBACK_SYMBOL
+void
+libnoise_perlin_row (int num_octaves, float persistence, float lacunarity,
+		     const float *x, const float *y, const float *z, float *result, int n)
+{
+    noise_params_t params = make_params (num_octaves, persistence, lacunarity, 0.0);
 
-    p.SetDisplacement (displacement);
+    get_row_values (get_noise_caches ()->perlin.lookup (params), x, y, z, result, n);
+}
+
+extern "C"
+CALLBACK_SYMBOL
+void
+libnoise_billow_row (int num_octaves, float persistence, float lacunarity,
+		     const float *x, const float *y, const float *z, float *result, int n)
+{
+    noise_params_t params = make_params (num_octaves, persistence, lacunarity, 0.0);
+
+    get_row_values (get_noise_caches ()->billow.lookup (params), x, y, z, result, n);
+}
+
+extern "C"
+CALLBACK_SYMBOL
+void
+libnoise_ridged_multi_row (int num_octaves, float lacunarity,
+			   const float *x, const float *y, const float *z, float *result, int n)
+{
+    noise_params_t params = make_params (num_octaves, 0.0, lacunarity, 0.0);
+
+    get_row_values (get_noise_caches ()->ridged_multi.lookup (params), x, y, z, result, n);
+}
+
+extern "C"
+CALLBACK_SYMBOL
+void
+libnoise_voronoi_row (float displacement,
+		      const float *x, const float *y, const float *z, float *result, int n)
+{
+    noise_params_t params = make_params (0, 0.0, 0.0, displacement);
 
-    return p.GetValue (x, y, z);
+    get_row_values (get_noise_caches ()->voronoi.lookup (params), x, y, z, result, n);
 }
@@ -35,6 +35,16 @@ extern float libnoise_billow (int num_octaves, float persistence, float lacunari
 extern float libnoise_ridged_multi (int num_octaves, float lacunarity,
 				    float x, float y, float z);
 extern float libnoise_voronoi (float displacement, float x, float y, float z);
+
+/* evaluate n points at once with the same parameters */
+extern void libnoise_perlin_row (int num_octaves, float persistence, float lacunarity,
+				 const float *x, const float *y, const float *z, float *result, int n);
+extern void libnoise_billow_row (int num_octaves, float persistence, float lacunarity,
+				 const float *x, const float *y, const float *z, float *result, int n);
+extern void libnoise_ridged_multi_row (int num_octaves, float lacunarity,
+				       const float *x, const float *y, const float *z, float *result, int n);
+extern void libnoise_voronoi_row (float displacement,
+				  const float *x, const float *y, const float *z, float *result, int n);
 /* END */
 
 #ifdef __cplusplus
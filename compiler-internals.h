@@ -59,6 +59,7 @@ typedef struct _compvar_t
     variable_t *var;		/* 0 if compvar is a temporary */
     temporary_t *temp;		/* 0 if compvar is a variable */
     int n;			/* n/a if compvar is a temporary */
+    int last_index;		/* n/a if compvar is a temporary */
     type_t type;
     struct _value_t *current;
     struct _value_t *values;
@@ -272,6 +273,11 @@ extern rhs_t* make_primary_rhs (primary_t primary);
 extern rhs_t* make_value_rhs (value_t *val);
 #define compiler_make_value_rhs make_value_rhs
 rhs_t* compiler_make_internal_rhs (internal_t *internal);
+extern primary_t make_value_primary (value_t *value);
+#define compiler_make_value_primary make_value_primary
+extern primary_t* get_rhs_primaries (rhs_t *rhs, int *num_primaries);
+#define compiler_get_rhs_primaries get_rhs_primaries
+extern gboolean compiler_primaries_equal (primary_t *prim1, primary_t *prim2);
 
 extern void compiler_reset_have_defined (statement_t *stmt);
 
@@ -280,6 +286,8 @@ extern gboolean compiler_is_temporary_const_value (value_t *value);
 extern gboolean compiler_is_const_type_within (int const_type, int lower_bound, int upper_bound);
 extern gboolean compiler_is_value_needed_for_const (value_t *value, int const_type);
 
+extern int compiler_local_tuple_length (value_t *value);
+
 extern char* compiler_get_value_name (value_t *val);
 extern void compiler_print_value (value_t *val);
 extern void compiler_print_assign_statement (statement_t *stmt);
@@ -323,7 +331,7 @@ extern void compiler_for_each_value_in_statement (statement_t *stmt,
 extern int compiler_slice_code (statement_t *stmt, unsigned int slice_flag,
 				int (*predicate) (statement_t *stmt, void *info), void *info);
 
-extern filter_code_t* compiler_generate_ir_code (filter_t *filter, int constant_analysis,
+extern filter_code_t* compiler_generate_ir_code (mathmap_t *mathmap, filter_t *filter, int constant_analysis,
 						 int convert_types, int timeout, gboolean debug_output);
 
 extern filter_code_t** compiler_compile_filters (mathmap_t *mathmap, int timeout);
@@ -338,6 +346,7 @@ extern gboolean compiler_opt_orig_val_resize (statement_t **first_stmt);
 extern gboolean compiler_opt_strip_resize (statement_t **first_stmt);
 extern gboolean compiler_opt_loop_invariant_code_motion (statement_t **first_stmt);
 extern gboolean compiler_opt_simplify (filter_t *filter, statement_t *first_stmt);
+extern gboolean compiler_opt_materialize_closures (filter_t *filter, statement_t **first_stmt);
 
 #define COMPILER_FOR_EACH_VALUE_IN_RHS(rhs,func,...) do { long __clos[] = { __VA_ARGS__ }; compiler_for_each_value_in_rhs((rhs),(func),__clos); } while (0)
 #define COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(stmt,func,...) do { long __clos[] = { __VA_ARGS__ }; compiler_for_each_value_in_statements((stmt),(func),__clos); } while (0)
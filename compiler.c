@@ -97,6 +97,7 @@ static type_t primary_type (primary_t *primary);
 #define APPLY_GRADIENT_INTERPRETER(g,p)	NULL
 
 #define RENDER_INTERPRETER(i,w,h)	NULL
+#define RENDER_FRAME_INTERPRETER(i,w,h,t)	NULL
 
 #define OUTPUT_TUPLE_INTERPRETER(t)	0
 
@@ -107,29 +108,48 @@ static type_t primary_type (primary_t *primary);
 
 #include "opfuncs.h"
 
-static pools_t compiler_pools;
-
 static operation_t ops[NUM_OPS];
 
-static int next_temp_number = 1;
-static int next_compvar_number = 1;
-
-static statement_t *first_stmt = NULL;
-static statement_t **emit_loc = &first_stmt;
 static statement_t dummy_stmt = { STMT_NIL };
 
-static inlining_history_t *inlining_history = NULL;
+#define STMT_STACK_SIZE            64
+
+/* The state of compiling one filter.  Every thread compiling has its
+   own current context, so filters can be compiled concurrently.  The
+   code of a filter lives in the pools of its context, so the contexts
+   are kept in the mathmap until compiler_free_pools(). */
+typedef struct _compiler_context_t
+{
+    pools_t pools;
 
-static binding_values_t *binding_values = NULL;
+    int next_temp_number;
+    int next_compvar_number;
 
-static GHashTable *vector_variables = NULL;
+    /* This is updated by new_value.  We assume that no new values are
+     * generated at the time value sets are used.  */
+    int next_value_global_index;
 
-#define STMT_STACK_SIZE            64
+    statement_t *first_stmt;
+    statement_t **emit_loc;
+
+    inlining_history_t *inlining_history;
+
+    binding_values_t *binding_values;
 
-static statement_t *stmt_stack[STMT_STACK_SIZE];
-static int stmt_stackp = 0;
+    GHashTable *vector_variables;
 
-#define CURRENT_STACK_TOP       ((stmt_stackp > 0) ? stmt_stack[stmt_stackp - 1] : 0)
+    /* the compvars of each variable, indexed by the element */
+    GHashTable *variable_compvars;
+
+    statement_t *stmt_stack[STMT_STACK_SIZE];
+    int stmt_stackp;
+
+    struct _compiler_context_t *next;
+} compiler_context_t;
+
+static __thread compiler_context_t *context = NULL;
+
+#define CURRENT_STACK_TOP       ((context->stmt_stackp > 0) ? context->stmt_stack[context->stmt_stackp - 1] : 0)
 #define UNSAFE_EMIT_STMT(s,l) \
     ({ (s)->parent = CURRENT_STACK_TOP; \
        (s)->next = (l); (l) = (s); })
@@ -157,14 +177,10 @@ direct_hash_table_copy (GHashTable *table)
 
 /*** value sets ***/
 
-/* This is updated by new_value.  We assume that no new values are generated
- * at the time value sets are used.  */
-static int next_value_global_index = 0;
-
 value_set_t*
 compiler_new_value_set (void)
 {
-    return new_bit_vector(next_value_global_index, 0);
+    return new_bit_vector(context->next_value_global_index, 0);
 }
 
 void
@@ -229,11 +245,11 @@ compiler_op_index (operation_t *op)
     return op - ops;
 }
 
-#define alloc_stmt()               ((statement_t*)pools_alloc(&compiler_pools, sizeof(statement_t)))
-#define alloc_value()              ((value_t*)pools_alloc(&compiler_pools, sizeof(value_t)))
-#define alloc_rhs()                ((rhs_t*)pools_alloc(&compiler_pools, sizeof(rhs_t)))
-#define alloc_compvar()            (compvar_t*)pools_alloc(&compiler_pools, sizeof(compvar_t))
-#define alloc_primary()            (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t))
+#define alloc_stmt()               ((statement_t*)pools_alloc(&context->pools, sizeof(statement_t)))
+#define alloc_value()              ((value_t*)pools_alloc(&context->pools, sizeof(value_t)))
+#define alloc_rhs()                ((rhs_t*)pools_alloc(&context->pools, sizeof(rhs_t)))
+#define alloc_compvar()            (compvar_t*)pools_alloc(&context->pools, sizeof(compvar_t))
+#define alloc_primary()            (primary_t*)pools_alloc(&context->pools, sizeof(primary_t))
 
 static value_t*
 new_value (compvar_t *compvar)
@@ -241,7 +257,7 @@ new_value (compvar_t *compvar)
     value_t *val = alloc_value();
 
     val->compvar = compvar;	/* dummy value */
-    val->global_index = next_value_global_index++;
+    val->global_index = context->next_value_global_index++;
     val->index = -1;
     val->def = &dummy_stmt;
     val->uses = 0;
@@ -257,14 +273,14 @@ new_value (compvar_t *compvar)
 compvar_t*
 make_temporary (type_t type)
 {
-    temporary_t *temp = (temporary_t*)pools_alloc(&compiler_pools, sizeof(temporary_t));
+    temporary_t *temp = (temporary_t*)pools_alloc(&context->pools, sizeof(temporary_t));
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    temp->number = next_temp_number++;
+    temp->number = context->next_temp_number++;
     temp->last_index = 0;
 
-    compvar->index = next_compvar_number++;
+    compvar->index = context->next_compvar_number++;
     compvar->var = 0;
     compvar->temp = temp;
     compvar->type = type;
@@ -288,10 +304,11 @@ make_variable (variable_t *var, int n)
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    compvar->index = next_compvar_number++;
+    compvar->index = context->next_compvar_number++;
     compvar->var = var;
     compvar->temp = 0;
     compvar->n = n;
+    compvar->last_index = 0;
     compvar->type = compiler_type_from_tuple_info(&var->type);
     compvar->current = val;
     compvar->values = val;
@@ -305,10 +322,11 @@ make_tree_vector_variable (variable_t *var)
     compvar_t *compvar = alloc_compvar();
     value_t *val = new_value(compvar);
 
-    compvar->index = next_compvar_number++;
+    compvar->index = context->next_compvar_number++;
     compvar->var = var;
     compvar->temp = 0;
     compvar->n = 0;
+    compvar->last_index = 0;
     compvar->type = TYPE_TREE_VECTOR;
     compvar->current = val;
     compvar->values = val;
@@ -330,7 +348,7 @@ make_lhs (compvar_t *compvar)
 statement_list_t*
 prepend_statement (statement_t *stmt, statement_list_t *rest)
 {
-    statement_list_t *lst = (statement_list_t*)pools_alloc(&compiler_pools, sizeof(statement_list_t));
+    statement_list_t *lst = (statement_list_t*)pools_alloc(&context->pools, sizeof(statement_list_t));
 
     lst->stmt = stmt;
     lst->next = rest;
@@ -404,7 +422,7 @@ void
 assign_value_index_and_make_current (value_t *val)
 {
     if (val->compvar->var != 0)
-	val->index = ++val->compvar->var->last_index[val->compvar->n];
+	val->index = ++val->compvar->last_index;
     else
 	val->index = ++val->compvar->temp->last_index;
 
@@ -527,7 +545,7 @@ make_tuple_rhs_from_array (int length, primary_t *args)
 
     rhs->kind = RHS_TUPLE;
     rhs->v.tuple.length = length;
-    rhs->v.tuple.args = pools_alloc(&compiler_pools, sizeof(primary_t) * length);
+    rhs->v.tuple.args = pools_alloc(&context->pools, sizeof(primary_t) * length);
 
     memcpy(rhs->v.tuple.args, args, sizeof(primary_t) * length);
 
@@ -556,7 +574,7 @@ make_tree_vector_rhs (int length, primary_t *args)
 
     rhs->kind = RHS_TREE_VECTOR;
     rhs->v.tuple.length = length;
-    rhs->v.tuple.args = pools_alloc(&compiler_pools, sizeof(primary_t) * length);
+    rhs->v.tuple.args = pools_alloc(&context->pools, sizeof(primary_t) * length);
 
     memcpy(rhs->v.tuple.args, args, sizeof(primary_t) * length);
 
@@ -578,7 +596,7 @@ make_filter_rhs (filter_t *filter, primary_t *args)
     rhs->kind = RHS_FILTER;
     rhs->v.filter.filter = filter;
     rhs->v.filter.args = args;
-    rhs->v.filter.history = inlining_history;
+    rhs->v.filter.history = context->inlining_history;
 
     return rhs;
 }
@@ -591,7 +609,7 @@ make_closure_rhs (filter_t *filter, primary_t *args)
     rhs->kind = RHS_CLOSURE;
     rhs->v.closure.filter = filter;
     rhs->v.closure.args = args;
-    rhs->v.closure.history = inlining_history;
+    rhs->v.closure.history = context->inlining_history;
 
     return rhs;
 }
@@ -1014,9 +1032,9 @@ commit_assign (statement_t *stmt)
 {
     statement_t *tos;
 
-    if (stmt_stackp > 0)
+    if (context->stmt_stackp > 0)
     {
-	tos = stmt_stack[stmt_stackp - 1];
+	tos = context->stmt_stack[context->stmt_stackp - 1];
 
 	switch (tos->kind)
 	{
@@ -1167,8 +1185,8 @@ emit_stmt (statement_t *stmt)
 {
     stmt->parent = CURRENT_STACK_TOP;
 
-    insert_stmt_before(stmt, emit_loc);
-    emit_loc = &stmt->next;
+    insert_stmt_before(stmt, context->emit_loc);
+    context->emit_loc = &stmt->next;
 
     record_stmt_def_uses(stmt);
 }
@@ -1235,9 +1253,9 @@ start_if_cond (rhs_t *condition)
     stmt->v.if_cond.exit = 0;
 
     emit_stmt(stmt);
-    stmt_stack[stmt_stackp++] = stmt;
+    context->stmt_stack[context->stmt_stackp++] = stmt;
 
-    emit_loc = &stmt->v.if_cond.consequent;
+    context->emit_loc = &stmt->v.if_cond.consequent;
 }
 
 static void
@@ -1259,9 +1277,9 @@ switch_if_branch (void)
 {
     statement_t *stmt;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[stmt_stackp - 1];
+    stmt = context->stmt_stack[context->stmt_stackp - 1];
 
     assert(stmt->kind == STMT_IF_COND && stmt->v.if_cond.alternative == 0);
 
@@ -1270,7 +1288,7 @@ switch_if_branch (void)
 
     reset_values_for_phis(stmt->v.if_cond.exit, 0);
 
-    emit_loc = &stmt->v.if_cond.alternative;
+    context->emit_loc = &stmt->v.if_cond.alternative;
 }
 
 void
@@ -1278,9 +1296,9 @@ end_if_cond (void)
 {
     statement_t *stmt, *phi;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[stmt_stackp - 1];
+    stmt = context->stmt_stack[context->stmt_stackp - 1];
 
     assert(stmt->kind == STMT_IF_COND && stmt->v.if_cond.consequent != 0);
 
@@ -1296,7 +1314,7 @@ end_if_cond (void)
 	UNSAFE_EMIT_STMT(nil, stmt->v.if_cond.exit);
     }
 
-    --stmt_stackp;
+    --context->stmt_stackp;
 
     reset_values_for_phis(stmt->v.if_cond.exit, 1);
 
@@ -1307,7 +1325,7 @@ end_if_cond (void)
 	commit_assign(phi);
     }
 
-    emit_loc = &stmt->next;
+    context->emit_loc = &stmt->next;
 }
 
 void
@@ -1344,11 +1362,11 @@ start_while_loop (rhs_t *invariant)
     stmt->v.while_loop.invariant = make_value_rhs(current_value(value->compvar));
 
     emit_stmt(stmt);
-    stmt_stack[stmt_stackp++] = stmt;
+    context->stmt_stack[context->stmt_stackp++] = stmt;
 
     UNSAFE_EMIT_STMT(phi_assign, stmt->v.while_loop.entry);
 
-    emit_loc = &stmt->v.while_loop.body;
+    context->emit_loc = &stmt->v.while_loop.body;
 }
 
 void
@@ -1356,9 +1374,9 @@ end_while_loop (void)
 {
     statement_t *stmt, *phi;
 
-    assert(stmt_stackp > 0);
+    assert(context->stmt_stackp > 0);
 
-    stmt = stmt_stack[--stmt_stackp];
+    stmt = context->stmt_stack[--context->stmt_stackp];
 
     assert(stmt->kind == STMT_WHILE_LOOP);
 
@@ -1374,7 +1392,7 @@ end_while_loop (void)
 	commit_assign(phi);
     }
 
-    emit_loc = &stmt->next;
+    context->emit_loc = &stmt->next;
 }
 
 /*** inline history ***/
@@ -1382,7 +1400,7 @@ end_while_loop (void)
 static inlining_history_t*
 push_inlined_filter (filter_t *filter, inlining_history_t *old)
 {
-    inlining_history_t *new = (inlining_history_t*)pools_alloc(&compiler_pools, sizeof(inlining_history_t));
+    inlining_history_t *new = (inlining_history_t*)pools_alloc(&context->pools, sizeof(inlining_history_t));
 
     new->filter = filter;
     new->next = old;
@@ -1420,7 +1438,7 @@ lookup_binding_values (int kind, gpointer key)
 {
     binding_values_t *bv;
 
-    for (bv = binding_values; bv != NULL; bv = bv->next)
+    for (bv = context->binding_values; bv != NULL; bv = bv->next)
 	if (bv->kind == kind && bv->key == key)
 	    return bv;
     return NULL;
@@ -1772,21 +1790,45 @@ resize_image_if_necessary (primary_t image, int flags)
     return current_value(resized_image);
 }
 
+static compvar_t**
+variable_compvars (variable_t *var)
+{
+    compvar_t **compvars = g_hash_table_lookup(context->variable_compvars, var);
+
+    if (compvars == NULL)
+    {
+	compvars = (compvar_t**)pools_alloc(&context->pools, sizeof(compvar_t*) * var->type.length);
+	memset(compvars, 0, sizeof(compvar_t*) * var->type.length);
+	g_hash_table_insert(context->variable_compvars, var, compvars);
+    }
+
+    return compvars;
+}
+
+/* An inlined filter gets new compvars every time it's inlined. */
+static void
+reset_variable_compvars (variable_t *vars)
+{
+    for (; vars != 0; vars = vars->next)
+	g_hash_table_remove(context->variable_compvars, vars);
+}
+
 static void
 alloc_var_compvars_if_needed (variable_t *var)
 {
+    compvar_t **compvars = variable_compvars(var);
     int i;
 
-    if (g_hash_table_lookup(vector_variables, var))
+    if (g_hash_table_lookup(context->vector_variables, var))
     {
-	if (var->compvar[0] == NULL)
-	    var->compvar[0] = make_tree_vector_variable(var);
+	if (compvars[0] == NULL)
+	    compvars[0] = make_tree_vector_variable(var);
 	return;
     }
 
     for (i = 0; i < var->type.length; ++i)
-	if (var->compvar[i] == NULL)
-	    var->compvar[i] = make_variable(var, i);
+	if (compvars[i] == NULL)
+	    compvars[i] = make_variable(var, i);
 }
 
 static void gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced);
@@ -1803,13 +1845,13 @@ gen_args (filter_t *filter, exprtree *arg_trees, int **_arglengths, int **_argnu
     for (arg = arg_trees; arg != 0; arg = arg->next)
 	++num_args;
 
-    args = (compvar_t***)pools_alloc(&compiler_pools, num_args * sizeof(compvar_t**));
-    arglengths = (int*)pools_alloc(&compiler_pools, num_args * sizeof(int));
-    argnumbers = (int*)pools_alloc(&compiler_pools, num_args * sizeof(int));
+    args = (compvar_t***)pools_alloc(&context->pools, num_args * sizeof(compvar_t**));
+    arglengths = (int*)pools_alloc(&context->pools, num_args * sizeof(int));
+    argnumbers = (int*)pools_alloc(&context->pools, num_args * sizeof(int));
 
     for (i = 0, arg = arg_trees; i < num_args; ++i, arg = arg->next)
     {
-	args[i] = (compvar_t**)pools_alloc(&compiler_pools, arg->result.length * sizeof(compvar_t*));
+	args[i] = (compvar_t**)pools_alloc(&context->pools, arg->result.length * sizeof(compvar_t*));
 	arglengths[i] = arg->result.length;
 	argnumbers[i] = arg->result.number;
 	gen_code(filter, arg, args[i], 0);
@@ -1839,9 +1881,9 @@ gen_deconstruct_color (compvar_t *color, compvar_t **dest, gboolean is_alloced)
 static compvar_t*
 gen_tree_vector (filter_t *filter, exprtree *tree, compvar_t **dest, gboolean is_alloced)
 {
-    if (tree->type == EXPR_VARIABLE && g_hash_table_lookup(vector_variables, tree->val.var))
+    if (tree->type == EXPR_VARIABLE && g_hash_table_lookup(context->vector_variables, tree->val.var))
     {
-	compvar_t *tree_vector = tree->val.var->compvar[0];
+	compvar_t *tree_vector = variable_compvars(tree->val.var)[0];
 	int i;
 
 	for (i = 0; i < tree->result.length; ++i)
@@ -1916,7 +1958,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 		int i;
 		compvar_t *tree_vector = NULL;
 
-		if (g_hash_table_lookup(vector_variables, tree))
+		if (g_hash_table_lookup(context->vector_variables, tree))
 		    tree_vector = gen_tree_vector(filter, tree->val.select.tuple, temps, FALSE);
 		else
 		    gen_code(filter, tree->val.select.tuple, temps, FALSE);
@@ -1959,21 +2001,21 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 	case EXPR_VARIABLE :
 	    alloc_var_compvars_if_needed(tree->val.var);
-	    if (g_hash_table_lookup(vector_variables, tree->val.var))
+	    if (g_hash_table_lookup(context->vector_variables, tree->val.var))
 		for (i = 0; i < tree->val.var->type.length; ++i)
 		{
 		    if (!is_alloced)
 			dest[i] = make_temporary(TYPE_INT);
 		    emit_assign(make_lhs(dest[i]), make_op_rhs(OP_TREE_VECTOR_NTH,
 							       make_int_const_primary(i),
-							       make_compvar_primary(tree->val.var->compvar[0])));
+							       make_compvar_primary(variable_compvars(tree->val.var)[0])));
 		}
 	    else
 		for (i = 0; i < tree->val.var->type.length; ++i)
 		    if (!is_alloced)
-			dest[i] = tree->val.var->compvar[i];
+			dest[i] = variable_compvars(tree->val.var)[i];
 		    else
-			emit_assign(make_lhs(dest[i]), make_compvar_rhs(tree->val.var->compvar[i]));
+			emit_assign(make_lhs(dest[i]), make_compvar_rhs(variable_compvars(tree->val.var)[i]));
 	    break;
 
 	case EXPR_INTERNAL :
@@ -1992,19 +2034,19 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 	case EXPR_ASSIGNMENT :
 	    alloc_var_compvars_if_needed(tree->val.assignment.var);
-	    if (g_hash_table_lookup(vector_variables, tree->val.assignment.var))
+	    if (g_hash_table_lookup(context->vector_variables, tree->val.assignment.var))
 	    {
 		compvar_t *tree_vector = gen_tree_vector(filter, tree->val.assignment.value, dest, is_alloced);
-		emit_assign(make_lhs(tree->val.assignment.var->compvar[0]), make_compvar_rhs(tree_vector));
+		emit_assign(make_lhs(variable_compvars(tree->val.assignment.var)[0]), make_compvar_rhs(tree_vector));
 	    }
 	    else
 	    {
-		gen_code(filter, tree->val.assignment.value, tree->val.assignment.var->compvar, TRUE);
+		gen_code(filter, tree->val.assignment.value, variable_compvars(tree->val.assignment.var), TRUE);
 		for (i = 0; i < tree->result.length; ++i)
 		    if (is_alloced)
-			emit_assign(make_lhs(dest[i]), make_compvar_rhs(tree->val.assignment.var->compvar[i]));
+			emit_assign(make_lhs(dest[i]), make_compvar_rhs(variable_compvars(tree->val.assignment.var)[i]));
 		    else
-			dest[i] = tree->val.assignment.var->compvar[i];
+			dest[i] = variable_compvars(tree->val.assignment.var)[i];
 	    }
 	    break;
 
@@ -2013,7 +2055,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 		compvar_t *temps[tree->val.sub_assignment.value->result.length];
 		exprtree *sub;
 		int i;
-		gboolean is_tree_vector = g_hash_table_lookup(vector_variables, tree->val.sub_assignment.var) != NULL;
+		gboolean is_tree_vector = g_hash_table_lookup(context->vector_variables, tree->val.sub_assignment.var) != NULL;
 
 		alloc_var_compvars_if_needed(tree->val.sub_assignment.var);
 
@@ -2026,7 +2068,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 		    if (is_tree_vector)
 		    {
-			compvar_t *tree_vector = tree->val.sub_assignment.var->compvar[0];
+			compvar_t *tree_vector = variable_compvars(tree->val.sub_assignment.var)[0];
 			compvar_t *subscript;
 
 			gen_code(filter, sub, &subscript, FALSE);
@@ -2043,7 +2085,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 			if (subscript >= tree->val.sub_assignment.var->type.length)
 			    subscript = tree->val.sub_assignment.var->type.length - 1;
 
-			emit_assign(make_lhs(tree->val.sub_assignment.var->compvar[subscript]), make_compvar_rhs(temps[i]));
+			emit_assign(make_lhs(variable_compvars(tree->val.sub_assignment.var)[subscript]), make_compvar_rhs(temps[i]));
 		    }
 		    else
 			g_assert_not_reached ();
@@ -2176,7 +2218,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 
 		args = gen_args(filter, tree->val.filter_closure.args, &arglengths, &argnumbers);
 
-		arg_primaries = (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t) * num_args);
+		arg_primaries = (primary_t*)pools_alloc(&context->pools, sizeof(primary_t) * num_args);
 
 		for (i = 0, info = infos;
 		     i < num_args;
@@ -2229,7 +2271,7 @@ gen_code (filter_t *filter, exprtree *tree, compvar_t **dest, int is_alloced)
 static binding_values_t*
 new_binding_values (int kind, gpointer key, binding_values_t *next, int num_values, int var_type)
 {
-    binding_values_t *bv = (binding_values_t*)pools_alloc(&compiler_pools, sizeof(binding_values_t)
+    binding_values_t *bv = (binding_values_t*)pools_alloc(&context->pools, sizeof(binding_values_t)
 							  + num_values * sizeof(value_t*));
     int i;
 
@@ -2547,9 +2589,9 @@ find_all_vector_variables (exprtree *tree)
 		find_all_vector_variables(sub);
 		if (!is_exprtree_single_const(sub, NULL, NULL))
 		{
-		    g_hash_table_insert(vector_variables, tree, GINT_TO_POINTER(1));
+		    g_hash_table_insert(context->vector_variables, tree, GINT_TO_POINTER(1));
 		    if (var)
-			g_hash_table_insert(vector_variables, var, GINT_TO_POINTER(1));
+			g_hash_table_insert(context->vector_variables, var, GINT_TO_POINTER(1));
 		}
 	    }
 	    break;
@@ -2565,7 +2607,7 @@ find_all_vector_variables (exprtree *tree)
 	    {
 		find_all_vector_variables(sub);
 		if (!is_exprtree_single_const(sub, NULL, NULL))
-		    g_hash_table_insert(vector_variables, var, GINT_TO_POINTER(1));
+		    g_hash_table_insert(context->vector_variables, var, GINT_TO_POINTER(1));
 	    }
 	    break;
 
@@ -2610,34 +2652,34 @@ find_all_vector_variables (exprtree *tree)
 static statement_t*
 gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tuple_rhs, inlining_history_t *history)
 {
-    statement_t *first_stmt_save = first_stmt;
-    inlining_history_t *history_save = inlining_history;
+    statement_t *first_stmt_save = context->first_stmt;
+    inlining_history_t *history_save = context->inlining_history;
     statement_t *stmt;
     compvar_t *result[filter->v.mathmap.decl->v.filter.body->result.length];
     rhs_t *rhs;
-    binding_values_t *binding_values_save = binding_values;
+    binding_values_t *binding_values_save = context->binding_values;
 
-    compiler_reset_variables(filter->v.mathmap.variables);
+    reset_variable_compvars(filter->v.mathmap.variables);
 
-    inlining_history = push_inlined_filter(filter, history);
+    context->inlining_history = push_inlined_filter(filter, history);
 
-    first_stmt = NULL;
-    emit_loc = &first_stmt;
-    binding_values = gen_binding_values_for_limits(filter, NULL);
+    context->first_stmt = NULL;
+    context->emit_loc = &context->first_stmt;
+    context->binding_values = gen_binding_values_for_limits(filter, NULL);
     if (args != NULL)
-	binding_values = gen_binding_values_from_filter_args(filter, args, binding_values);
+	context->binding_values = gen_binding_values_from_filter_args(filter, args, context->binding_values);
     else
     {
-	binding_values = gen_binding_values_from_userval_infos(filter->userval_infos, binding_values);
+	context->binding_values = gen_binding_values_from_userval_infos(filter->userval_infos, context->binding_values);
 	if (needs_xy_scaling(filter_flags(filter)))
-	    binding_values = gen_binding_values_for_xy(filter,
+	    context->binding_values = gen_binding_values_for_xy(filter,
 						       get_internal_value(filter, "x", FALSE),
 						       get_internal_value(filter, "y", FALSE),
-						       binding_values);
+						       context->binding_values);
     }
 
     if (does_filter_use_ra(filter))
-	binding_values = gen_ra_binding_values(filter, binding_values);
+	context->binding_values = gen_ra_binding_values(filter, context->binding_values);
 
     find_all_vector_variables(filter->v.mathmap.decl->v.filter.body);
 
@@ -2652,13 +2694,13 @@ gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tu
     if (tuple != NULL)
 	emit_assign(make_lhs(tuple), rhs);
 
-    stmt = first_stmt;
+    stmt = context->first_stmt;
 
-    first_stmt = first_stmt_save;
-    emit_loc = NULL;
-    binding_values = binding_values_save;
+    context->first_stmt = first_stmt_save;
+    context->emit_loc = NULL;
+    context->binding_values = binding_values_save;
 
-    inlining_history = history_save;
+    context->inlining_history = history_save;
 
     return stmt;
 }
@@ -2861,7 +2903,7 @@ propagate_types_worker (statement_t *stmt, statement_list_t *worklist, void *inf
 static void
 propagate_types (void)
 {
-    PERFORM_WORKLIST_DFA(first_stmt, &propagate_types_builder, &propagate_types_worker);
+    PERFORM_WORKLIST_DFA(context->first_stmt, &propagate_types_builder, &propagate_types_worker);
 }
 
 /*** constants analysis ***/
@@ -3210,27 +3252,27 @@ analyze_constants (void)
 {
     int changed;
 
-    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(first_stmt, &_init_const_type);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(context->first_stmt, &_init_const_type);
 
     do
     {
 	changed = 0;
-	analyze_stmts_constants(first_stmt, &changed, CONST_MAX);
+	analyze_stmts_constants(context->first_stmt, &changed, CONST_MAX);
     } while (changed);
 
-    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(first_stmt, &_init_least_const_types);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(context->first_stmt, &_init_least_const_types);
 
     do
     {
 	value_set_t *set = compiler_new_value_set();
 
 	changed = 0;
-	analyze_least_const_type_multiply_used_in(first_stmt, 0, set, &changed);
+	analyze_least_const_type_multiply_used_in(context->first_stmt, 0, set, &changed);
 
 	compiler_free_value_set(set);
     } while (changed);
 
-    analyze_least_const_type_directly_used_in(first_stmt);
+    analyze_least_const_type_directly_used_in(context->first_stmt);
 }
 
 /*** closure application ***/
@@ -3259,7 +3301,7 @@ optimize_closure_application (statement_t *stmt)
 		    {
 			filter_t *filter = def->v.assign.rhs->v.filter.filter;
 			int num_args = compiler_num_filter_args(filter);
-			primary_t *args = (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t) * num_args);
+			primary_t *args = (primary_t*)pools_alloc(&context->pools, sizeof(primary_t) * num_args);
 			int i;
 
 			for (i = 0; i < num_args - 3; ++i)
@@ -3375,7 +3417,7 @@ copy_propagation (void)
 
     assert(copy_hash != 0);
 
-    copy_propagate_recursively(first_stmt, copy_hash, &changed);
+    copy_propagate_recursively(context->first_stmt, copy_hash, &changed);
 
     return changed;
 }
@@ -3452,7 +3494,7 @@ constant_folding (void)
 {
     int changed = 0;
 
-    fold_constants_recursively(first_stmt, &changed);
+    fold_constants_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -3576,7 +3618,7 @@ simplify_ops (void)
 {
     int changed = 0;
 
-    simplify_ops_recursively(first_stmt, &changed);
+    simplify_ops_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -3738,7 +3780,7 @@ remove_dead_branches (void)
 {
     int changed = 0;
 
-    remove_dead_branches_recursively(first_stmt, &changed);
+    remove_dead_branches_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -3800,7 +3842,7 @@ remove_dead_controls (void)
 {
     int changed = 0;
 
-    remove_dead_controls_recursively(first_stmt, &changed);
+    remove_dead_controls_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -3872,6 +3914,12 @@ primaries_equal (primary_t *prim1, primary_t *prim2)
     return 0;
 }
 
+gboolean
+compiler_primaries_equal (primary_t *prim1, primary_t *prim2)
+{
+    return primaries_equal(prim1, prim2);
+}
+
 static int
 rhss_equal (rhs_t *rhs1, rhs_t *rhs2)
 {
@@ -4059,7 +4107,7 @@ common_subexpression_elimination (void)
 {
     int changed = 0;
 
-    cse_recursively(first_stmt, &changed);
+    cse_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -4123,7 +4171,7 @@ optimize_tuple_nth (void)
 {
     gboolean changed = FALSE;
 
-    optimize_tuple_nth_recursively(first_stmt, &changed);
+    optimize_tuple_nth_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -4209,7 +4257,240 @@ optimize_make_tuple (void)
 {
     gboolean changed = FALSE;
 
-    optimize_make_tuple_recursively(first_stmt, &changed);
+    optimize_make_tuple_recursively(context->first_stmt, &changed);
+
+    return changed;
+}
+
+/*** scalar replacement of tuples ***/
+
+/*
+ * A tuple lives in the pools of the generated code, so every tuple
+ * that's constructed costs an allocation and every element access a
+ * load.  Most tuples, however, are only ever taken apart with
+ * tuple_nth or output at the end, and optimize_tuple_nth() already
+ * takes care of tuples that are constructed right before that.
+ *
+ * What's left are tuples that flow through phis, like the result of
+ * "if c then rgba:[...] else rgba:[...] end" or of an inlined filter
+ * with a conditional.  We split such a phi into one phi per element
+ * and construct the tuple again after the conditional, where
+ * optimize_tuple_nth() can pick it up.  If one of the incoming tuples
+ * isn't constructed with make_tuple, we take it apart at the end of
+ * its branch.
+ *
+ * Tuples that remain after that but are never passed anywhere are
+ * kept in local storage by the backends, see
+ * compiler_local_tuple_length().
+ */
+
+static gboolean
+tuple_is_only_taken_apart_or_output (value_t *value)
+{
+    statement_list_t *lst;
+
+    for (lst = value->uses; lst != NULL; lst = lst->next)
+	if (!compiler_stmt_is_assign_with_op(lst->stmt, OP_TUPLE_NTH)
+	    && !compiler_stmt_is_assign_with_op(lst->stmt, OP_OUTPUT_TUPLE))
+	    return FALSE;
+
+    return TRUE;
+}
+
+int
+compiler_local_tuple_length (value_t *value)
+{
+    rhs_t *rhs;
+
+    if (value->index < 0
+	|| value->compvar->type != TYPE_TUPLE
+	|| value->def->kind != STMT_ASSIGN)
+	return 0;
+
+    /* permanent const values are stored between pixels */
+    if (compiler_is_permanent_const_value(value))
+	return 0;
+
+    if (!tuple_is_only_taken_apart_or_output(value))
+	return 0;
+
+    rhs = value->def->v.assign.rhs;
+    if (rhs->kind == RHS_TUPLE)
+	return rhs->v.tuple.length;
+    if (rhs->kind == RHS_OP
+	&& (compiler_op_index(rhs->v.op.op) == OP_ORIG_VAL
+	    || compiler_op_index(rhs->v.op.op) == OP_APPLY_GRADIENT))
+	return 4;
+
+    return 0;
+}
+
+static rhs_t*
+phi_rhs_make_tuple (rhs_t *rhs)
+{
+    statement_t *def;
+
+    if (rhs->kind != RHS_PRIMARY || rhs->v.primary.kind != PRIMARY_VALUE)
+	return NULL;
+
+    def = rhs->v.primary.v.value->def;
+    if (def->kind != STMT_ASSIGN || def->v.assign.rhs->kind != RHS_TUPLE)
+	return NULL;
+
+    return def->v.assign.rhs;
+}
+
+/* Returns the elements of the tuple coming into a phi from one
+   branch.  If it's not constructed with make_tuple we take it apart
+   at the end of the branch. */
+static primary_t*
+phi_rhs_tuple_elements (rhs_t *rhs, int length, statement_t *branch)
+{
+    rhs_t *tuple_rhs = phi_rhs_make_tuple(rhs);
+    statement_t *last;
+    primary_t *elements;
+    int i;
+
+    if (tuple_rhs != NULL)
+	return tuple_rhs->v.tuple.args;
+
+    g_assert(rhs->kind == RHS_PRIMARY && rhs->v.primary.kind == PRIMARY_VALUE);
+
+    last = last_stmt_of_block(branch);
+    elements = (primary_t*)pools_alloc(&context->pools, sizeof(primary_t) * length);
+
+    for (i = 0; i < length; ++i)
+    {
+	value_t *element = make_lhs(make_temporary(TYPE_FLOAT));
+	statement_t *stmt = make_assign(element,
+					make_op_rhs(OP_TUPLE_NTH, rhs->v.primary,
+						    make_int_const_primary(i)));
+
+	stmt->parent = last->parent;
+	insert_stmt_before(stmt, &last->next);
+	record_stmt_def_uses(stmt);
+	assign_value_index_and_make_current(element);
+	last = stmt;
+
+	elements[i] = make_value_primary(element);
+    }
+
+    return elements;
+}
+
+static void
+split_tuple_phi (statement_t *if_stmt, statement_t *phi, int length)
+{
+    value_t *tuple = phi->v.assign.lhs;
+    primary_t *elements1 = phi_rhs_tuple_elements(phi->v.assign.rhs, length, if_stmt->v.if_cond.consequent);
+    primary_t *elements2 = phi_rhs_tuple_elements(phi->v.assign.rhs2, length, if_stmt->v.if_cond.alternative);
+    primary_t args[length];
+    statement_t *stmt;
+    int i;
+
+    for (i = 0; i < length; ++i)
+    {
+	/* propagate_types() will make this float if either
+	   element is */
+	value_t *element = make_lhs(make_temporary(TYPE_INT));
+	statement_t *element_phi = alloc_stmt();
+
+	element_phi->kind = STMT_PHI_ASSIGN;
+	element_phi->v.assign.lhs = element;
+	element_phi->v.assign.rhs = make_primary_rhs(elements1[i]);
+	element_phi->v.assign.rhs2 = make_primary_rhs(elements2[i]);
+	element_phi->v.assign.old_value = NULL;
+	element_phi->parent = if_stmt;
+	element_phi->next = NULL;
+
+	insert_stmt_before(element_phi, &if_stmt->v.if_cond.exit);
+	record_stmt_def_uses(element_phi);
+	assign_value_index_and_make_current(element);
+
+	args[i] = make_value_primary(element);
+    }
+
+    compiler_remove_uses_in_rhs(phi->v.assign.rhs, phi);
+    compiler_remove_uses_in_rhs(phi->v.assign.rhs2, phi);
+    phi->kind = STMT_NIL;
+
+    /* the tuple keeps its value, so its uses stay valid */
+    stmt = make_assign(tuple, make_tuple_rhs_from_array(length, args));
+    stmt->parent = if_stmt->parent;
+    insert_stmt_before(stmt, &if_stmt->next);
+    record_stmt_def_uses(stmt);
+}
+
+static void
+split_tuple_phis_recursively (statement_t *stmt, gboolean *changed)
+{
+    while (stmt != NULL)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+	    case STMT_ASSIGN :
+	    case STMT_PHI_ASSIGN :
+		break;
+
+	    case STMT_IF_COND :
+		{
+		    statement_t *phi;
+
+		    split_tuple_phis_recursively(stmt->v.if_cond.consequent, changed);
+		    split_tuple_phis_recursively(stmt->v.if_cond.alternative, changed);
+
+		    for (phi = stmt->v.if_cond.exit; phi != NULL; phi = phi->next)
+		    {
+			rhs_t *tuple1, *tuple2;
+			int length;
+
+			if (phi->kind != STMT_PHI_ASSIGN
+			    || phi->v.assign.lhs->compvar->type != TYPE_TUPLE)
+			    continue;
+
+			tuple1 = phi_rhs_make_tuple(phi->v.assign.rhs);
+			tuple2 = phi_rhs_make_tuple(phi->v.assign.rhs2);
+
+			if (tuple1 == NULL && tuple2 == NULL)
+			    continue;
+			length = (tuple1 != NULL) ? tuple1->v.tuple.length : tuple2->v.tuple.length;
+			if (tuple1 != NULL && tuple2 != NULL && tuple1->v.tuple.length != tuple2->v.tuple.length)
+			    continue;
+
+			/* Taking a tuple apart only to construct it
+			   again is a loss if it's passed on anyway. */
+			if ((tuple1 == NULL || tuple2 == NULL)
+			    && !tuple_is_only_taken_apart_or_output(phi->v.assign.lhs))
+			    continue;
+
+			split_tuple_phi(stmt, phi, length);
+
+			*changed = TRUE;
+		    }
+		}
+		break;
+
+	    case STMT_WHILE_LOOP :
+		/* loop phis are left alone - the tuple that comes
+		   around the loop would have to be split, too */
+		split_tuple_phis_recursively(stmt->v.while_loop.body, changed);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	stmt = stmt->next;
+    }
+}
+
+static gboolean
+split_tuple_phis (void)
+{
+    gboolean changed = FALSE;
+
+    split_tuple_phis_recursively(context->first_stmt, &changed);
 
     return changed;
 }
@@ -4326,7 +4607,7 @@ do_inlining (void)
 {
     gboolean changed = FALSE;
 
-    do_inlining_recursively(&first_stmt, &changed);
+    do_inlining_recursively(&context->first_stmt, &changed);
 
     return changed;
 }
@@ -4650,11 +4931,67 @@ compiler_slice_code_for_const (statement_t *stmt, int const_type)
 #endif
 
 #ifdef PEDANTIC_CHECK_SSA
-#define CHECK_SSA	check_ssa(first_stmt)
+#define CHECK_SSA	check_ssa(context->first_stmt)
 #else
 #define CHECK_SSA	do ; while (0)
 #endif
 
+static gboolean tuple_phi_splitting = TRUE;
+
+void
+compiler_set_tuple_phi_splitting (gboolean split)
+{
+    tuple_phi_splitting = split;
+}
+
+gboolean
+compiler_get_tuple_phi_splitting (void)
+{
+    return tuple_phi_splitting;
+}
+
+static gboolean materialize_closures = FALSE;
+
+void
+compiler_set_materialize_closures (gboolean materialize)
+{
+    materialize_closures = materialize;
+}
+
+gboolean
+compiler_get_materialize_closures (void)
+{
+    return materialize_closures;
+}
+
+static gboolean background_backend = FALSE;
+
+void
+compiler_set_background_backend (gboolean background)
+{
+    background_backend = background;
+}
+
+gboolean
+compiler_get_background_backend (void)
+{
+    return background_backend;
+}
+
+static gboolean tcc_backend = FALSE;
+
+void
+compiler_set_tcc_backend (gboolean tcc)
+{
+    tcc_backend = tcc;
+}
+
+gboolean
+compiler_get_tcc_backend (void)
+{
+    return tcc_backend;
+}
+
 static gboolean
 optimization_time_out (struct timeval *start, int timeout)
 {
@@ -4672,8 +5009,28 @@ optimization_time_out (struct timeval *start, int timeout)
     return FALSE;
 }
 
+/* Makes a new context and adds it to the mathmap's.  This can be
+   called from several threads at the same time. */
+static compiler_context_t*
+new_context (mathmap_t *mathmap)
+{
+    compiler_context_t *ctx = g_new0(compiler_context_t, 1);
+
+    init_pools(&ctx->pools);
+    ctx->vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx->variable_compvars = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    do
+    {
+	ctx->next = g_atomic_pointer_get((gpointer*)&mathmap->compiler_contexts);
+    } while (!g_atomic_pointer_compare_and_exchange((gpointer*)&mathmap->compiler_contexts, ctx->next, ctx));
+
+    return ctx;
+}
+
 filter_code_t*
-compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_types, int timeout, gboolean debug_output)
+compiler_generate_ir_code (mathmap_t *mathmap, filter_t *filter, int constant_analysis, int convert_types,
+			   int timeout, gboolean debug_output)
 {
     gboolean changed;
     filter_code_t *code;
@@ -4684,39 +5041,52 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 
     gettimeofday(&tv, NULL);
 
-    next_temp_number = 1;
-    next_compvar_number = 1;
-    next_value_global_index = 0;
-    inlining_history = NULL;
+    g_assert(context == NULL);
+    context = new_context(mathmap);
+
+    context->next_temp_number = 1;
+    context->next_compvar_number = 1;
+    context->next_value_global_index = 0;
+    context->inlining_history = NULL;
 
     tuple_tmp = make_temporary(TYPE_TUPLE);
-    first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history);
+    context->first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, context->inlining_history);
 
-    emit_loc = &(last_stmt_of_block(first_stmt)->next);
+    context->emit_loc = &(last_stmt_of_block(context->first_stmt)->next);
 
     dummy = make_temporary(TYPE_INT);
     emit_assign(make_lhs(dummy), make_op_rhs(OP_OUTPUT_TUPLE, make_compvar_primary(tuple_tmp)));
 
-    emit_loc = NULL;
+    context->emit_loc = NULL;
 
     changed = TRUE;
     while (changed && !optimization_time_out(&tv, timeout))
     {
 #ifdef DEBUG_OUTPUT
-	check_ssa(first_stmt);
+	check_ssa(context->first_stmt);
 #endif
 
 	if (debug_output)
 	{
 	    printf("--------------------------------\n");
-	    dump_code(first_stmt, 0);
+	    dump_code(context->first_stmt, 0);
 	}
 
-	optimize_closure_application(first_stmt);
-	CHECK_SSA;
-
 	changed = FALSE;
 
+#ifndef NO_CONSTANTS_ANALYSIS
+	/* needs constants analysis to compute the rendered closures
+	   only once per frame */
+	if (constant_analysis && materialize_closures)
+	{
+	    changed = compiler_opt_materialize_closures(filter, &context->first_stmt) || changed;
+	    CHECK_SSA;
+	}
+#endif
+
+	optimize_closure_application(context->first_stmt);
+	CHECK_SSA;
+
 	changed = do_inlining() || changed;
 	CHECK_SSA;
 	changed = copy_propagation() || changed;
@@ -4725,8 +5095,13 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	CHECK_SSA;
 	changed = optimize_make_tuple() || changed;
 	CHECK_SSA;
+	if (tuple_phi_splitting)
+	{
+	    changed = split_tuple_phis() || changed;
+	    CHECK_SSA;
+	}
 	/*
-	changed = compiler_opt_loop_invariant_code_motion(&first_stmt) || changed;
+	changed = compiler_opt_loop_invariant_code_motion(&context->first_stmt) || changed;
 	CHECK_SSA;
 	*/
 	changed = common_subexpression_elimination() || changed;
@@ -4741,22 +5116,22 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	if (debug_output)
 	{
 	    printf("-------------------------------- before resize\n");
-	    dump_code(first_stmt, 0);
+	    dump_code(context->first_stmt, 0);
 	}
-	changed = compiler_opt_orig_val_resize(&first_stmt) || changed;
+	changed = compiler_opt_orig_val_resize(&context->first_stmt) || changed;
 	CHECK_SSA;
 	if (debug_output)
 	{
 	    printf("-------------------------------- after resize\n");
-	    dump_code(first_stmt, 0);
+	    dump_code(context->first_stmt, 0);
 	}
 
-	changed = compiler_opt_strip_resize(&first_stmt) || changed;
+	changed = compiler_opt_strip_resize(&context->first_stmt) || changed;
 	CHECK_SSA;
-	changed = compiler_opt_simplify(filter, first_stmt) || changed;
+	changed = compiler_opt_simplify(filter, context->first_stmt) || changed;
 	CHECK_SSA;
 
-	changed = compiler_opt_remove_dead_assignments(first_stmt) || changed;
+	changed = compiler_opt_remove_dead_assignments(context->first_stmt) || changed;
 	CHECK_SSA;
 	changed = remove_dead_branches() || changed;
 	CHECK_SSA;
@@ -4767,7 +5142,7 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
     propagate_types();
 
 #ifdef DEBUG_OUTPUT
-    check_ssa(first_stmt);
+    check_ssa(context->first_stmt);
 #endif
 
 #ifndef NO_CONSTANTS_ANALYSIS
@@ -4778,64 +5153,120 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
     if (debug_output)
     {
 	printf("----------- final ---------------------\n");
-	dump_code(first_stmt, 0);
+	dump_code(context->first_stmt, 0);
     }
-    check_ssa(first_stmt);
+    check_ssa(context->first_stmt);
 
     /* no statement reordering after this point */
 
-    code = (filter_code_t*)pools_alloc(&compiler_pools, sizeof(filter_code_t));
+    code = (filter_code_t*)pools_alloc(&context->pools, sizeof(filter_code_t));
 
     code->filter = filter;
-    code->first_stmt = first_stmt;
+    code->first_stmt = context->first_stmt;
 
-    first_stmt = 0;
+    context = NULL;
 
     return code;
 }
 
-filter_code_t**
-compiler_compile_filters (mathmap_t *mathmap, int timeout)
+/* The filters of a mathmap are independent of each other, so they're
+   compiled by several threads, each taking the next filter. */
+typedef struct
 {
+    mathmap_t *mathmap;
+    filter_t **filters;
     filter_code_t **filter_codes;
-    int num_filters, i;
-    filter_t *filter;
+    int num_filters;
+    volatile gint next_filter;
+    int timeout;
+} compile_filters_job_t;
+
+static void
+compile_filters_worker (gpointer data)
+{
+    compile_filters_job_t *job = data;
 #ifdef DEBUG_OUTPUT
     gboolean debug_output = TRUE;
 #else
     gboolean debug_output = FALSE;
 #endif
+    int i;
 
-    init_pools(&compiler_pools);
-    vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
-
-    num_filters = 0;
-    for (filter = mathmap->filters; filter != 0; filter = filter->next)
-	++num_filters;
-
-    filter_codes = (filter_code_t**)pools_alloc(&compiler_pools, sizeof(filter_code_t*) * num_filters);
-
-    for (i = 0, filter = mathmap->filters;
-	 filter != 0;
-	 ++i, filter = filter->next)
+    while ((i = g_atomic_int_exchange_and_add(&job->next_filter, 1)) < job->num_filters)
     {
+	filter_t *filter = job->filters[i];
+
 	if (filter->kind != FILTER_MATHMAP)
 	    continue;
 
 #ifdef DEBUG_OUTPUT
 	g_print("compiling filter %s\n", filter->name);
 #endif
-	filter_codes[i] = compiler_generate_ir_code(filter, 1, 0, timeout, debug_output && filter == mathmap->main_filter);
+	job->filter_codes[i] = compiler_generate_ir_code(job->mathmap, filter, 1, 0, job->timeout,
+							 debug_output && filter == job->mathmap->main_filter);
+    }
+}
+
+filter_code_t**
+compiler_compile_filters (mathmap_t *mathmap, int timeout)
+{
+    compile_filters_job_t job;
+    int num_mathmap_filters, num_threads, i;
+    thread_handle_t *threads;
+    filter_t *filter;
+
+    job.mathmap = mathmap;
+    job.next_filter = 0;
+    job.timeout = timeout;
+
+    job.num_filters = num_mathmap_filters = 0;
+    for (filter = mathmap->filters; filter != 0; filter = filter->next)
+    {
+	++job.num_filters;
+	if (filter->kind == FILTER_MATHMAP)
+	    ++num_mathmap_filters;
     }
 
-    return filter_codes;
+    /* the array of codes lives as long as the codes */
+    job.filter_codes = (filter_code_t**)pools_alloc(&new_context(mathmap)->pools,
+						    sizeof(filter_code_t*) * job.num_filters);
+
+    job.filters = g_new(filter_t*, job.num_filters);
+    for (i = 0, filter = mathmap->filters; filter != 0; ++i, filter = filter->next)
+	job.filters[i] = filter;
+
+    /* this thread is one of the workers */
+    num_threads = MIN(num_mathmap_filters, get_num_cpus()) - 1;
+    threads = g_new(thread_handle_t, MAX(num_threads, 1));
+
+    for (i = 0; i < num_threads; ++i)
+	threads[i] = mathmap_thread_start(compile_filters_worker, &job);
+    compile_filters_worker(&job);
+    for (i = 0; i < num_threads; ++i)
+	mathmap_thread_join(threads[i]);
+
+    g_free(threads);
+    g_free(job.filters);
+
+    return job.filter_codes;
 }
 
 void
 compiler_free_pools (mathmap_t *mathmap)
 {
-    g_hash_table_unref(vector_variables);
-    free_pools(&compiler_pools);
+    compiler_context_t *ctx, *next;
+
+    for (ctx = mathmap->compiler_contexts; ctx != NULL; ctx = next)
+    {
+	next = ctx->next;
+
+	g_hash_table_unref(ctx->vector_variables);
+	g_hash_table_unref(ctx->variable_compvars);
+	free_pools(&ctx->pools);
+	g_free(ctx);
+    }
+
+    mathmap->compiler_contexts = NULL;
 }
 
 /*** inits ***/
@@ -78,8 +78,82 @@ int compiler_template_processor (struct _mathmap_t *mathmap, const char *directi
 
 initfunc_t gen_and_load_c_code (struct _mathmap_t *mathmap, void **module_info,
 				char *template_filename, char *include_path,
-				struct _filter_code_t **filter_codes);
+				struct _filter_code_t **filter_codes, const char *cache_key);
 void unload_c_code (void *module_info);
+/* Writes the C code for the filters to out.  The pixel loop is only
+   vectorized if allow_vectorize is set and vectorizing is enabled.
+   Returns FALSE and sets error_string on failure. */
+gboolean cc_write_c_code (struct _mathmap_t *mathmap, char *template_filename, char *include_path,
+			  struct _filter_code_t **filter_codes, gboolean allow_vectorize, FILE *out);
+
+/* Runs the C compiler and linker for a mathmap in a thread of its
+   own.  A job must be either finished or abandoned. */
+typedef struct _c_code_job_t c_code_job_t;
+
+c_code_job_t* gen_c_code_in_background (struct _mathmap_t *mathmap, char *template_filename, char *include_path,
+					struct _filter_code_t **filter_codes, const char *cache_key);
+gboolean c_code_job_is_done (c_code_job_t *job);
+/* Waits for the job and frees it.  Returns 0 and sets error_string
+   if it failed. */
+initfunc_t c_code_job_finish (c_code_job_t *job, void **module_info);
+void c_code_job_abandon (c_code_job_t *job);
+
+/* Whether tuple phis at the exit of conditionals are split into
+   element phis.  Only turned off to test that it doesn't change the
+   result. */
+void compiler_set_tuple_phi_splitting (gboolean split);
+gboolean compiler_get_tuple_phi_splitting (void);
+
+/* Whether closures sampled many times per pixel are rendered to a
+   floatmap once per frame.  Off by default, because the floatmap is
+   sampled nearest neighbor, which changes the result. */
+void compiler_set_materialize_closures (gboolean materialize);
+gboolean compiler_get_materialize_closures (void);
+
+/* Whether compile_mathmap() runs the C backend in the background and
+   interprets the filter until it's done. */
+void compiler_set_background_backend (gboolean background);
+gboolean compiler_get_background_backend (void);
+
+/* Whether compile_mathmap() tries libtcc before the C backend.  Only
+   has an effect if built with USE_LIBTCC. */
+void compiler_set_tcc_backend (gboolean tcc);
+gboolean compiler_get_tcc_backend (void);
+
+/* Whether the C backend also emits row-vectorized pixel code. */
+void cc_set_vectorize (gboolean vectorize);
+gboolean cc_get_vectorize (void);
+
+/* Whether the C backend compiles the template's prelude into a
+   precompiled header once instead of with every filter. */
+void cc_set_precompiled_prelude (gboolean precompiled);
+gboolean cc_get_precompiled_prelude (void);
+
+void module_cache_set_directory (const char *dir);
+void module_cache_set_enabled (gboolean enabled);
+void module_cache_set_max_size (long max_size);
+/* Returns NULL if the cache is disabled. */
+char* module_cache_make_key (const char *expression, const char *template_filename,
+			     const char *include_path, int timeout);
+initfunc_t module_cache_load (const char *key, void **module_info);
+gboolean module_cache_store (const char *key, const char *so_filename);
+char* module_cache_get_subdirectory (const char *name);
+
+struct _interpreter_code_t;
+
+/* Returns NULL if the filter can't be interpreted. */
+struct _interpreter_code_t* interpreter_compile_filter (struct _filter_code_t *code);
+void interpreter_free_code (struct _interpreter_code_t *code);
+mathfuncs_t* interpreter_mathfuncs (void);
+
+/* Compiles the C code in memory with libtcc, without temporary files
+   or running the C compiler.  The code is much quicker to make but
+   slower than gcc's.  tcc doesn't support complex numbers, so
+   filters that use them can't be compiled this way. */
+initfunc_t gen_and_load_tcc_code (struct _mathmap_t *mathmap, void **module_info,
+				  char *template_filename, char *include_path,
+				  struct _filter_code_t **filter_codes);
+void unload_tcc_code (void *module_info);
 
 void gen_and_load_llvm_code (struct _mathmap_t *mathmap, char *template_filename,
 			     struct _filter_code_t **filter_codes);
@@ -0,0 +1,459 @@
+/*
+ * materialize.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2010 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <glib.h>
+
+#include "../compiler-internals.h"
+
+/*** automatic closure materialization ***/
+
+/*
+ * Sampling a closure evaluates its filter, so a filter that samples
+ * a closure many times per pixel, like a blur over a composed image,
+ * evaluates the inner filter many times per pixel, too.  If such a
+ * closure doesn't depend on the pixel we render it to a floatmap
+ * once per frame, exactly like render() would, and sample the
+ * floatmap instead.
+ *
+ * Samples inside a loop count as MATERIALIZE_LOOP_WEIGHT samples.
+ * The cost of a closure is estimated from the size of its filter's
+ * expression tree.  Sampling a floatmap is nearest neighbor, and
+ * only the render area is rendered, so this changes the result.
+ * That's why it's only done if turned on with
+ * compiler_set_materialize_closures().
+ */
+
+#define MATERIALIZE_LOOP_WEIGHT		8
+#define MATERIALIZE_MIN_SAMPLES		4
+#define MATERIALIZE_MIN_COST		16
+/* how deep we look into closures' filters and the definitions of
+   closure arguments */
+#define MATERIALIZE_MAX_DEPTH		8
+
+typedef struct _closure_samples_t
+{
+    value_t *closure;
+    int num_samples;
+    gboolean materialize;
+
+    struct _closure_samples_t *next;
+} closure_samples_t;
+
+typedef struct _rendered_closure_t
+{
+    value_t *closure;
+    primary_t frame;
+    value_t *floatmap;
+
+    struct _rendered_closure_t *next;
+} rendered_closure_t;
+
+static int exprtree_cost (exprtree *tree, int depth);
+
+static int
+exprtree_list_cost (exprtree *list, int depth)
+{
+    int cost = 0;
+
+    for (; list != NULL; list = list->next)
+	cost += exprtree_cost(list, depth);
+
+    return cost;
+}
+
+static int
+filter_cost (filter_t *filter, int depth)
+{
+    if (filter->kind != FILTER_MATHMAP || depth >= MATERIALIZE_MAX_DEPTH)
+	return 0;
+
+    return exprtree_cost(filter->v.mathmap.decl->v.filter.body, depth + 1);
+}
+
+static int
+exprtree_cost (exprtree *tree, int depth)
+{
+    if (tree == NULL)
+	return 0;
+
+    switch (tree->type)
+    {
+	case EXPR_INT_CONST :
+	case EXPR_FLOAT_CONST :
+	case EXPR_TUPLE_CONST :
+	case EXPR_INTERNAL :
+	case EXPR_VARIABLE :
+	case EXPR_USERVAL :
+	    return 0;
+
+	case EXPR_FUNC :
+	    return 1 + exprtree_list_cost(tree->val.func.args, depth);
+
+	case EXPR_SEQUENCE :
+	    return exprtree_cost(tree->val.op.left, depth) + exprtree_cost(tree->val.op.right, depth);
+
+	case EXPR_ASSIGNMENT :
+	    return exprtree_cost(tree->val.assignment.value, depth);
+
+	case EXPR_SUB_ASSIGNMENT :
+	    return exprtree_list_cost(tree->val.sub_assignment.subscripts, depth)
+		+ exprtree_cost(tree->val.sub_assignment.value, depth);
+
+	case EXPR_IF_THEN :
+	case EXPR_IF_THEN_ELSE :
+	    return 1 + exprtree_cost(tree->val.ifExpr.condition, depth)
+		+ exprtree_cost(tree->val.ifExpr.consequent, depth)
+		+ exprtree_cost(tree->val.ifExpr.alternative, depth);
+
+	case EXPR_WHILE :
+	case EXPR_DO_WHILE :
+	    return MATERIALIZE_LOOP_WEIGHT * (1 + exprtree_cost(tree->val.whileExpr.invariant, depth)
+					      + exprtree_cost(tree->val.whileExpr.body, depth));
+
+	case EXPR_TUPLE :
+	    return exprtree_list_cost(tree->val.tuple.elems, depth);
+
+	case EXPR_SELECT :
+	    return 1 + exprtree_cost(tree->val.select.tuple, depth)
+		+ exprtree_list_cost(tree->val.select.subscripts, depth);
+
+	case EXPR_CAST :
+	    return exprtree_cost(tree->val.cast.tuple, depth);
+
+	case EXPR_CONVERT :
+	    return 1 + exprtree_cost(tree->val.convert.tuple, depth);
+
+	case EXPR_FILTER_CLOSURE :
+	    /* the closure is sampled by the __origVal call it's an
+	       argument of */
+	    return exprtree_list_cost(tree->val.filter_closure.args, depth)
+		+ filter_cost(tree->val.filter_closure.filter, depth);
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static gboolean primary_is_pixel_invariant (primary_t *primary, int depth);
+
+static gboolean
+rhs_args_are_pixel_invariant (rhs_t *rhs, int depth)
+{
+    int num_primaries;
+    primary_t *primaries = compiler_get_rhs_primaries(rhs, &num_primaries);
+    int i;
+
+    for (i = 0; i < num_primaries; ++i)
+	if (!primary_is_pixel_invariant(&primaries[i], depth + 1))
+	    return FALSE;
+
+    return TRUE;
+}
+
+/* Whether the primary has the same value for all pixels of a
+   frame. */
+static gboolean
+primary_is_pixel_invariant (primary_t *primary, int depth)
+{
+    rhs_t *rhs;
+
+    if (primary->kind == PRIMARY_CONST)
+	return TRUE;
+
+    g_assert(primary->kind == PRIMARY_VALUE);
+
+    if (depth >= MATERIALIZE_MAX_DEPTH
+	|| primary->v.value->def->kind != STMT_ASSIGN)
+	return FALSE;
+
+    rhs = primary->v.value->def->v.assign.rhs;
+    switch (rhs->kind)
+    {
+	case RHS_INTERNAL :
+	    return (rhs->v.internal->const_type & (CONST_X | CONST_Y)) == (CONST_X | CONST_Y);
+
+	case RHS_CLOSURE :
+	    if (rhs->v.closure.filter->kind == FILTER_NATIVE
+		&& !rhs->v.closure.filter->v.native.is_pure)
+		return FALSE;
+	    return rhs_args_are_pixel_invariant(rhs, depth);
+
+	case RHS_OP :
+	    if (!rhs->v.op.op->is_pure)
+		return FALSE;
+	    return rhs_args_are_pixel_invariant(rhs, depth);
+
+	case RHS_PRIMARY :
+	case RHS_TUPLE :
+	case RHS_TREE_VECTOR :
+	    return rhs_args_are_pixel_invariant(rhs, depth);
+
+	default :
+	    return FALSE;
+    }
+}
+
+/* The rendered closure is computed at the top level, before the
+   statement that contains the sampling, so all its inputs must be
+   defined by then. */
+static gboolean
+primary_is_available_at_top_level (primary_t *primary)
+{
+    statement_t *def;
+
+    if (primary->kind == PRIMARY_CONST)
+	return TRUE;
+
+    def = primary->v.value->def;
+    return def->kind == STMT_ASSIGN && def->parent == NULL;
+}
+
+static gboolean
+closure_can_be_materialized (value_t *closure)
+{
+    primary_t primary = compiler_make_value_primary(closure);
+    statement_t *def = closure->def;
+
+    return def->kind == STMT_ASSIGN
+	&& def->v.assign.rhs->kind == RHS_CLOSURE
+	&& def->v.assign.rhs->v.closure.filter->kind == FILTER_MATHMAP
+	&& primary_is_available_at_top_level(&primary)
+	&& primary_is_pixel_invariant(&primary, 0);
+}
+
+static gboolean
+stmt_samples_closure (statement_t *stmt)
+{
+    if (!compiler_stmt_is_assign_with_op(stmt, OP_ORIG_VAL)
+	|| compiler_stmt_op_assign_arg(stmt, 2).kind != PRIMARY_VALUE)
+	return FALSE;
+
+    return compiler_stmt_is_assign_with_rhs(compiler_stmt_op_assign_arg(stmt, 2).v.value->def, RHS_CLOSURE);
+}
+
+static closure_samples_t*
+lookup_closure_samples (closure_samples_t *samples, value_t *closure)
+{
+    for (; samples != NULL; samples = samples->next)
+	if (samples->closure == closure)
+	    return samples;
+    return NULL;
+}
+
+static void
+count_samples (statement_t *stmt, int weight, closure_samples_t **samples)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+	    case STMT_PHI_ASSIGN :
+		break;
+
+	    case STMT_ASSIGN :
+		if (stmt_samples_closure(stmt))
+		{
+		    value_t *closure = compiler_stmt_op_assign_arg(stmt, 2).v.value;
+		    closure_samples_t *s = lookup_closure_samples(*samples, closure);
+
+		    if (s == NULL)
+		    {
+			s = g_new0(closure_samples_t, 1);
+			s->closure = closure;
+			s->next = *samples;
+			*samples = s;
+		    }
+
+		    s->num_samples += weight;
+		}
+		break;
+
+	    case STMT_IF_COND :
+		count_samples(stmt->v.if_cond.consequent, weight, samples);
+		count_samples(stmt->v.if_cond.alternative, weight, samples);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		count_samples(stmt->v.while_loop.body, weight * MATERIALIZE_LOOP_WEIGHT, samples);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+
+static value_t*
+emit_internal_before (filter_t *filter, const char *name, statement_t ***top_loc)
+{
+    internal_t *internal = lookup_internal(filter->v.mathmap.internals, name, TRUE);
+    value_t *value;
+
+    g_assert(internal != NULL);
+
+    value = compiler_make_lhs(compiler_make_temporary(TYPE_INT));
+    *top_loc = compiler_emit_stmt_before(compiler_make_assign(value, compiler_make_internal_rhs(internal)),
+					 *top_loc, NULL);
+
+    return value;
+}
+
+static value_t*
+rendered_closure (filter_t *filter, value_t *closure, primary_t frame,
+		  statement_t ***top_loc, rendered_closure_t **rendered)
+{
+    rendered_closure_t *r;
+    value_t *width, *height;
+
+    for (r = *rendered; r != NULL; r = r->next)
+	if (r->closure == closure && compiler_primaries_equal(&r->frame, &frame))
+	    return r->floatmap;
+
+    width = emit_internal_before(filter, "__renderPixelW", top_loc);
+    height = emit_internal_before(filter, "__renderPixelH", top_loc);
+
+    r = g_new0(rendered_closure_t, 1);
+    r->closure = closure;
+    r->frame = frame;
+    r->floatmap = compiler_make_lhs(compiler_make_temporary(TYPE_IMAGE));
+    r->next = *rendered;
+    *rendered = r;
+
+    *top_loc = compiler_emit_stmt_before(compiler_make_assign(r->floatmap,
+							      compiler_make_op_rhs(OP_RENDER_FRAME,
+										   compiler_make_value_primary(closure),
+										   compiler_make_value_primary(width),
+										   compiler_make_value_primary(height),
+										   frame)),
+					 *top_loc, NULL);
+
+    return r->floatmap;
+}
+
+static void rewrite_samples_in_stmt (filter_t *filter, statement_t *stmt, statement_t ***top_loc,
+				     closure_samples_t *samples, rendered_closure_t **rendered, gboolean *changed);
+
+static void
+rewrite_samples (filter_t *filter, statement_t *stmt, statement_t ***top_loc,
+		 closure_samples_t *samples, rendered_closure_t **rendered, gboolean *changed)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+	rewrite_samples_in_stmt(filter, stmt, top_loc, samples, rendered, changed);
+}
+
+/* Rendered closures are emitted before *top_loc, which is the
+   top-level statement that contains stmt. */
+static void
+rewrite_samples_in_stmt (filter_t *filter, statement_t *stmt, statement_t ***top_loc,
+			 closure_samples_t *samples, rendered_closure_t **rendered, gboolean *changed)
+{
+    switch (stmt->kind)
+    {
+	case STMT_NIL :
+	case STMT_PHI_ASSIGN :
+	    break;
+
+	case STMT_ASSIGN :
+	    if (stmt_samples_closure(stmt))
+	    {
+		value_t *closure = compiler_stmt_op_assign_arg(stmt, 2).v.value;
+		primary_t frame = compiler_stmt_op_assign_arg(stmt, 3);
+		closure_samples_t *s = lookup_closure_samples(samples, closure);
+		value_t *floatmap;
+
+		if (s == NULL || !s->materialize
+		    || !primary_is_available_at_top_level(&frame)
+		    || !primary_is_pixel_invariant(&frame, 0))
+		    break;
+
+		floatmap = rendered_closure(filter, closure, frame, top_loc, rendered);
+		compiler_replace_op_rhs_arg(stmt, 2, compiler_make_value_primary(floatmap));
+
+#ifdef DEBUG_OUTPUT
+		printf("materializing closure %s\n", compiler_get_value_name(closure));
+#endif
+
+		*changed = TRUE;
+	    }
+	    break;
+
+	case STMT_IF_COND :
+	    rewrite_samples(filter, stmt->v.if_cond.consequent, top_loc, samples, rendered, changed);
+	    rewrite_samples(filter, stmt->v.if_cond.alternative, top_loc, samples, rendered, changed);
+	    break;
+
+	case STMT_WHILE_LOOP :
+	    rewrite_samples(filter, stmt->v.while_loop.body, top_loc, samples, rendered, changed);
+	    break;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+gboolean
+compiler_opt_materialize_closures (filter_t *filter, statement_t **first_stmt)
+{
+    closure_samples_t *samples = NULL, *s;
+    rendered_closure_t *rendered = NULL, *r;
+    gboolean changed = FALSE;
+    gboolean any = FALSE;
+    statement_t **loc;
+
+    count_samples(*first_stmt, 1, &samples);
+
+    for (s = samples; s != NULL; s = s->next)
+    {
+	if (s->num_samples < MATERIALIZE_MIN_SAMPLES
+	    || !closure_can_be_materialized(s->closure))
+	    continue;
+
+	if (filter_cost(s->closure->def->v.assign.rhs->v.closure.filter, 0) < MATERIALIZE_MIN_COST)
+	    continue;
+
+	s->materialize = TRUE;
+	any = TRUE;
+    }
+
+    if (any)
+    {
+	for (loc = first_stmt; *loc != NULL; loc = &(*loc)->next)
+	    rewrite_samples_in_stmt(filter, *loc, &loc, samples, &rendered, &changed);
+    }
+
+    while (samples != NULL)
+    {
+	s = samples->next;
+	g_free(samples);
+	samples = s;
+    }
+
+    while (rendered != NULL)
+    {
+	r = rendered->next;
+	g_free(rendered);
+	rendered = r;
+    }
+
+    return changed;
+}
@@ -41,6 +41,8 @@ image_new_id (void)
 #define MAX_INPUT_DRAWABLES 64
 
 static input_drawable_t input_drawables[MAX_INPUT_DRAWABLES];
+/* the render server allocates drawables from several threads */
+static GStaticRecMutex input_drawables_mutex = G_STATIC_REC_MUTEX_INIT;
 
 input_drawable_t*
 alloc_input_drawable (int kind, int width, int height)
@@ -48,11 +50,16 @@ alloc_input_drawable (int kind, int width, int height)
     int i;
     input_drawable_t *drawable;
 
+    g_static_rec_mutex_lock(&input_drawables_mutex);
+
     for (i = 0; i < MAX_INPUT_DRAWABLES; ++i)
 	if (!input_drawables[i].used)
 	    break;
     if (i == MAX_INPUT_DRAWABLES)
+    {
+	g_static_rec_mutex_unlock(&input_drawables_mutex);
 	return 0;
+    }
 
     drawable = &input_drawables[i];
 
@@ -60,6 +67,7 @@ alloc_input_drawable (int kind, int width, int height)
 
     drawable->used = TRUE;
     drawable->kind = kind;
+    drawable->content_id = image_new_id();
 
     drawable->image.type = IMAGE_DRAWABLE;
     drawable->image.id = image_new_id();
@@ -67,23 +75,36 @@ alloc_input_drawable (int kind, int width, int height)
     drawable->image.pixel_height = height;
     drawable->image.v.drawable = drawable;
 
+    g_static_rec_mutex_unlock(&input_drawables_mutex);
+
     return drawable;
 }
 
+void
+lock_input_drawables (void)
+{
+    g_static_rec_mutex_lock(&input_drawables_mutex);
+}
+
+void
+unlock_input_drawables (void)
+{
+    g_static_rec_mutex_unlock(&input_drawables_mutex);
+}
+
 void
 free_input_drawable (input_drawable_t *drawable)
 {
+    g_static_rec_mutex_lock(&input_drawables_mutex);
+
     g_assert(drawable->used);
 
     switch (drawable->kind)
     {
 #ifndef OPENSTEP
 	case INPUT_DRAWABLE_GIMP :
-	    if (drawable->v.gimp.tile != 0)
-	    {
-		gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-		drawable->v.gimp.tile = 0;
-	    }
+	    unref_gimp_drawable_tiles(drawable);
+	    free_input_copy(drawable);
 	    if (drawable->v.gimp.fast_image_source != 0)
 	    {
 		g_free(drawable->v.gimp.fast_image_source);
@@ -97,8 +118,11 @@ free_input_drawable (input_drawable_t *drawable)
 	    break;
 
 	case INPUT_DRAWABLE_CMDLINE_IMAGE :
+#ifdef MOVIES
+	case INPUT_DRAWABLE_CMDLINE_MOVIE :
+#endif
 	    g_free(drawable->v.cmdline.image_filename);
-	    g_free(drawable->v.cmdline.cache_entries);
+	    free_cmdline_input_image(drawable);
 	    break;
 
 	default :
@@ -106,6 +130,8 @@ free_input_drawable (input_drawable_t *drawable)
     }
 
     drawable->used = FALSE;
+
+    g_static_rec_mutex_unlock(&input_drawables_mutex);
 }
 
 void
@@ -139,27 +165,35 @@ copy_input_drawable (input_drawable_t *drawable)
 #endif
 
 	case INPUT_DRAWABLE_CMDLINE_IMAGE :
-	    copy = alloc_cmdline_image_input_drawable(drawable->v.cmdline.image_filename);
-	    break;
-
 #ifdef MOVIES
 	case INPUT_DRAWABLE_CMDLINE_MOVIE :
-	    copy = alloc_cmdline_movie_input_drawable(drawable->v.cmdline.image_filename);
-	    break;
 #endif
+	    copy = copy_cmdline_image_input_drawable(drawable);
+	    break;
 
 	default :
 	    g_assert_not_reached();
     }
 
+    if (copy == 0)
+	return 0;
+
     copy->scale_x = drawable->scale_x;
     copy->scale_y = drawable->scale_y;
     copy->middle_x = drawable->middle_x;
     copy->middle_y = drawable->middle_y;
 
+    copy->content_id = drawable->content_id;
+
     return copy;
 }
 
+void
+input_drawable_content_changed (input_drawable_t *drawable)
+{
+    drawable->content_id = image_new_id();
+}
+
 #ifndef OPENSTEP
 input_drawable_t*
 get_default_input_drawable (void)
@@ -177,6 +211,23 @@ get_default_input_drawable (void)
 	    return &input_drawables[i];
     return 0;
 }
+
+/* Like copy_input_drawable(get_default_input_drawable()), but the
+   default drawable can't be freed by another thread in between.
+   Returns 0 if there is no default drawable. */
+input_drawable_t*
+copy_default_input_drawable (void)
+{
+    input_drawable_t *drawable, *copy = 0;
+
+    g_static_rec_mutex_lock(&input_drawables_mutex);
+    drawable = get_default_input_drawable();
+    if (drawable != 0)
+	copy = copy_input_drawable(drawable);
+    g_static_rec_mutex_unlock(&input_drawables_mutex);
+
+    return copy;
+}
 #endif
 
 int
@@ -42,7 +42,7 @@
 #define INPUT_DRAWABLE_CMDLINE_MOVIE		3
 #define INPUT_DRAWABLE_OPENSTEP			4
 
-struct _cache_entry_t;
+struct _input_image_t;
 
 /* TEMPLATE image_types */
 #define IMAGE_DRAWABLE		1
@@ -131,6 +131,10 @@ typedef struct _input_drawable_t {
 
     int kind;
 
+    /* Identifies the drawable's pixels.  Copies of a drawable share
+       it, and it changes when the pixels might have changed. */
+    int content_id;
+
     float scale_x;
     float scale_y;
     float middle_x;
@@ -151,9 +155,7 @@ typedef struct _input_drawable_t {
 	    gboolean has_selection; /* only used for copying the drawable */
 	    gint x0, y0;	    /* is honored whatever the value of has_selection */
 	    gint bpp;
-	    gint row;
-	    gint col;
-	    GimpTile *tile;
+	    color_t *copy;	    /* flat copy of the input region, or 0 */
 	    int fast_image_source_width;
 	    int fast_image_source_height;
 	    color_t *fast_image_source;
@@ -162,11 +164,8 @@ typedef struct _input_drawable_t {
 	struct
 	{
 	    int num_frames;
-	    struct _cache_entry_t **cache_entries;
+	    struct _input_image_t *input_image;
 	    char *image_filename;
-#ifdef MOVIES
-	    quicktime_t *movie;
-#endif
 	} cmdline;
     } v;
 
@@ -181,8 +180,16 @@ input_drawable_t* alloc_input_drawable (int kind, int width, int height);
 
 void free_input_drawable (input_drawable_t *drawable);
 
+/* Keeps other threads from allocating, freeing or copying drawables,
+   so a drawable can be set up completely before anybody sees it.
+   Can be nested. */
+void lock_input_drawables (void);
+void unlock_input_drawables (void);
+
 input_drawable_t* copy_input_drawable (input_drawable_t *drawable);
 
+void input_drawable_content_changed (input_drawable_t *drawable);
+
 void for_each_input_drawable (void (*) (input_drawable_t *drawable));
 
 int get_num_input_drawables (void);
@@ -191,11 +198,16 @@ input_drawable_t* get_nth_input_drawable (int n);
 #ifndef OPENSTEP
 input_drawable_t* alloc_gimp_input_drawable (GimpDrawable *drawable, gboolean honor_selection);
 GimpDrawable* get_gimp_input_drawable (input_drawable_t *drawable);
+void unref_gimp_drawable_tiles (input_drawable_t *drawable);
+void free_input_copy (input_drawable_t *drawable);
 
 input_drawable_t* get_default_input_drawable (void);
+input_drawable_t* copy_default_input_drawable (void);
 #endif
 
 input_drawable_t* alloc_cmdline_image_input_drawable (const char *filename);
+input_drawable_t* copy_cmdline_image_input_drawable (input_drawable_t *drawable);
+void free_cmdline_input_image (input_drawable_t *drawable);
 #ifdef MOVIES
 input_drawable_t* alloc_cmdline_movie_input_drawable (const char *filename);
 #endif
@@ -37,15 +37,15 @@
 
 #define MAX_GENSYM_LEN	64
 
-char error_string[1024];
-scanner_region_t error_region;
+__thread char error_string[ERROR_STRING_LENGTH];
+__thread scanner_region_t error_region;
 
 static char*
 gensym (char *buf)
 {
-    static int index = 0;
+    static volatile gint index = 0;
 
-    sprintf(buf, "___tmp___%d___", index++);
+    sprintf(buf, "___tmp___%d___", g_atomic_int_exchange_and_add(&index, 1));
 
     return buf;
 }
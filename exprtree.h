@@ -29,8 +29,12 @@
 #include "macros.h"
 #include "scanner.h"
 
-extern char error_string[];
-extern scanner_region_t error_region;
+#define ERROR_STRING_LENGTH    1024
+
+/* per thread, so compiling in one thread doesn't clobber the error
+   of another */
+extern __thread char error_string[];
+extern __thread scanner_region_t error_region;
 
 #define LIMITS_INT             1
 #define LIMITS_FLOAT           2
@@ -24,4 +24,4 @@
 
 #include "jump.h"
 
-jmp_buf *topmostJmpBuf = 0;
+__thread jmp_buf *topmostJmpBuf = 0;
@@ -28,7 +28,8 @@
 
 #include <setjmp.h>
 
-extern jmp_buf *topmostJmpBuf;
+/* Every thread has its own chain of jump handlers. */
+extern __thread jmp_buf *topmostJmpBuf;
 
 #define DO_JUMP_CODE              { \
                                       jmp_buf jmpBuf, \
@@ -65,61 +65,37 @@ lookup_variable_macro (const char *name, tuple_info_t *info)
     return 0;
 }
 
-static scanner_ident_t*
-get_xy_ident (void)
-{
-    static scanner_ident_t *ident = NULL;
-    if (ident == NULL)
-	ident = scanner_make_ident(scanner_null_region, "xy");
-    return ident;
-}
-
-static scanner_ident_t*
-get_ra_ident (void)
-{
-    static scanner_ident_t *ident = NULL;
-    if (ident == NULL)
-	ident = scanner_make_ident(scanner_null_region, "ra");
-    return ident;
-}
-
-static scanner_ident_t*
-get_ri_ident (void)
-{
-    static scanner_ident_t *ident = NULL;
-    if (ident == NULL)
-	ident = scanner_make_ident(scanner_null_region, "ri");
-    return ident;
-}
+/* made by init_macros, so parsing threads don't race to make them */
+static scanner_ident_t *xy_ident, *ra_ident, *ri_ident;
 
 exprtree*
 macro_var_xy (exprtree *args)
 {
-    return make_cast(get_xy_ident(), make_tuple_exprtree(exprlist_append(make_var_from_string("x"), make_var_from_string("y"))));
+    return make_cast(xy_ident, make_tuple_exprtree(exprlist_append(make_var_from_string("x"), make_var_from_string("y"))));
 }
 
 exprtree*
 macro_var_ra (exprtree *args)
 {
-    return make_cast(get_ra_ident(), make_tuple_exprtree(exprlist_append(make_var_from_string("r"), make_var_from_string("a"))));
+    return make_cast(ra_ident, make_tuple_exprtree(exprlist_append(make_var_from_string("r"), make_var_from_string("a"))));
 }
 
 exprtree*
 macro_var_big_xy (exprtree *args)
 {
-    return make_cast(get_xy_ident(), make_tuple_exprtree(exprlist_append(make_var_from_string("X"), make_var_from_string("Y"))));
+    return make_cast(xy_ident, make_tuple_exprtree(exprlist_append(make_var_from_string("X"), make_var_from_string("Y"))));
 }
 
 exprtree*
 macro_var_big_wh (exprtree *args)
 {
-    return make_cast(get_xy_ident(), make_tuple_exprtree(exprlist_append(make_var_from_string("W"), make_var_from_string("H"))));
+    return make_cast(xy_ident, make_tuple_exprtree(exprlist_append(make_var_from_string("W"), make_var_from_string("H"))));
 }
 
 exprtree*
 macro_var_big_i (exprtree *args)
 {
-    return make_cast(get_ri_ident(), make_tuple_exprtree(exprlist_append(make_int_number(0, scanner_null_region),
+    return make_cast(ri_ident, make_tuple_exprtree(exprlist_append(make_int_number(0, scanner_null_region),
 									 make_int_number(1, scanner_null_region))));
 }
 
@@ -180,6 +156,10 @@ macro_func_origValImageFrame (exprtree *args)
 void
 init_macros (void)
 {
+    xy_ident = scanner_make_ident(scanner_null_region, "xy");
+    ra_ident = scanner_make_ident(scanner_null_region, "ra");
+    ri_ident = scanner_make_ident(scanner_null_region, "ri");
+
     register_variable_macro("xy", macro_var_xy, make_tuple_info(xy_tag_number, 2));
     register_variable_macro("ra", macro_var_ra, make_tuple_info(ra_tag_number, 2));
     register_variable_macro("XY", macro_var_big_xy, make_tuple_info(xy_tag_number, 2));
@@ -0,0 +1,21 @@
+#!/usr/bin/perl
+
+use strict;
+
+my @names = ();
+
+while (<>) {
+    chomp;
+    push @names, $_;
+}
+
+print "#include <stddef.h>\n";
+foreach my $name (@names) {
+    print "extern void $name (void);\n";
+}
+print "struct { const char *name; void *address; } tcc_symbols[] = {\n";
+foreach my $name (@names) {
+    print "{ \"$name\", (void*)$name },\n";
+}
+print "{ NULL, NULL }\n";
+print "};\n";
@@ -137,6 +137,7 @@
 #define FLAG_SUPERSAMPLING      2
 #define FLAG_ANIMATION          4
 #define FLAG_PERIODIC           8
+#define FLAG_COPY_INPUT         16
 
 #define MAX_EXPRESSION_LENGTH   65536
 
@@ -185,6 +186,7 @@ static void dialog_text_changed (GtkTextBuffer * buffer, gpointer user_data);
 static void dialog_text_update (void);
 static void dialog_antialiasing_update (GtkWidget *widget, gpointer data);
 static void dialog_supersampling_update (GtkWidget *widget, gpointer data);
+static void dialog_copy_input_update (GtkWidget *widget, gpointer data);
 static void dialog_auto_preview_update (GtkWidget *widget, gpointer data);
 static void dialog_fast_preview_update (GtkWidget *widget, gpointer data);
 static void dialog_edge_behaviour_update (GtkWidget *widget, gpointer data);
@@ -198,6 +200,7 @@ static void dialog_preview_size_allocate (GtkWidget *widget, GtkAllocation *allo
 static void dialog_preview_callback (GtkWidget *widget, gpointer data);
 /*static void dialog_preview_click (GtkWidget *widget, GdkEvent *event);*/
 static void refresh_preview (void);
+static void cancel_preview_render (void);
 
 static void dialog_load_callback (GtkWidget *widget, gpointer data);
 static void dialog_save_callback (GtkWidget *widget, gpointer data);
@@ -268,12 +271,43 @@ GtkWidget *mathmap_dialog_window,
     *notebook;
 
 #ifdef THREADED_FINAL_RENDER
-pthread_mutex_t get_gimp_pixel_mutex;
+/* libgimp's tile functions are not thread-safe, so every call into
+   them must hold this lock.  Pixel reads from tiles a thread already
+   holds don't need it. */
+pthread_mutex_t gimp_tile_mutex;
+#define LOCK_GIMP_TILES()		pthread_mutex_lock(&gimp_tile_mutex)
+#define UNLOCK_GIMP_TILES()		pthread_mutex_unlock(&gimp_tile_mutex)
 #define NUM_FINAL_RENDER_CPUS		(get_num_cpus())
 #else
+#define LOCK_GIMP_TILES()
+#define UNLOCK_GIMP_TILES()
 #define NUM_FINAL_RENDER_CPUS		1
 #endif
 
+/* Number of tiles each rendering thread keeps referenced.  Must be a
+   power of two. */
+#define TILE_CACHE_SIZE			16
+
+typedef struct _tile_cache_entry_t
+{
+    input_drawable_t *drawable;
+    gint row;
+    gint col;
+    GimpTile *tile;
+} tile_cache_entry_t;
+
+typedef struct _tile_cache_t
+{
+    tile_cache_entry_t entries[TILE_CACHE_SIZE];
+    struct _tile_cache_t *next;
+} tile_cache_t;
+
+/* the caches of all threads, protected by the tile lock */
+static tile_cache_t *tile_caches = NULL;
+#ifdef THREADED_FINAL_RENDER
+static GStaticPrivate tile_cache_key = G_STATIC_PRIVATE_INIT;
+#endif
+
 int previewing = 0, auto_preview = 1, fast_preview = 1;
 int expression_changed = 1;
 color_t gradient_samples[USER_GRADIENT_POINTS];
@@ -489,7 +523,7 @@ register_expression_db (expression_db_t *edb, char *symbol_prefix, char *menu_pr
 		{ GIMP_PDB_INT32,      "run_mode",         "Interactive, non-interactive" },
 		{ GIMP_PDB_IMAGE,      "image",            "Input image" },
 		{ GIMP_PDB_DRAWABLE,   "drawable",         "Input drawable" },
-		{ GIMP_PDB_INT32,      "flags",            "1: Antialiasing 2: Supersampling 4: Animate 8: Periodic" },
+		{ GIMP_PDB_INT32,      "flags",            "1: Antialiasing 2: Supersampling 4: Animate 8: Periodic 16: Copy input" },
 		{ GIMP_PDB_INT32,      "frames",           "Number of frames" },
 		{ GIMP_PDB_FLOAT,      "param_t",          "The parameter t (if not animating)" },
 		{ GIMP_PDB_STRING,     "expression",       "The expression" }
@@ -584,7 +618,7 @@ query(void)
 	{ GIMP_PDB_INT32,      "run_mode",         "Interactive, non-interactive" },
 	{ GIMP_PDB_IMAGE,      "image",            "Input image" },
 	{ GIMP_PDB_DRAWABLE,   "drawable",         "Input drawable" },
-	{ GIMP_PDB_INT32,      "flags",            "1: Antialiasing 2: Supersampling 4: Animate 8: Periodic" },
+	{ GIMP_PDB_INT32,      "flags",            "1: Antialiasing 2: Supersampling 4: Animate 8: Periodic 16: Copy input" },
 	{ GIMP_PDB_INT32,      "frames",           "Number of frames" },
 	{ GIMP_PDB_FLOAT,      "param_t",          "The parameter t (if not animating)" },
 	{ GIMP_PDB_STRING,     "expression",       "MathMap expression" }
@@ -681,7 +715,7 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
     init_compiler();
 
 #ifdef THREADED_FINAL_RENDER
-    pthread_mutex_init(&get_gimp_pixel_mutex, NULL);
+    pthread_mutex_init(&gimp_tile_mutex, NULL);
 #endif
 
     /* See how we will run */
@@ -744,9 +778,11 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 
 	update_gradient();
 
-	/* Set the tile cache size */
+	/* Set the tile cache size.  Each rendering thread keeps its own
+	   set of tiles referenced, so leave room for those. */
 	gimp_tile_cache_ntiles((gimp_drawable->width + gimp_tile_width() - 1)
-			       / gimp_tile_width());
+			       / gimp_tile_width()
+			       + NUM_FINAL_RENDER_CPUS * TILE_CACHE_SIZE);
 
 	/* Run! */
 
@@ -782,6 +818,8 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 	    do_mathmap(-1, mmvals.param_t);
 	}
 
+	for_each_input_drawable(free_input_copy);
+
 	/* If run mode is interactive, flush displays */
 
 	if (run_mode != GIMP_RUN_NONINTERACTIVE)
@@ -967,9 +1005,53 @@ update_gradient (void)
 
 /*****/
 
+/* While the dialog is open the C compiler runs in the background and
+   the preview uses code from libtcc or the interpreter until the
+   native code is loaded. */
+#define NATIVE_CODE_POLL_INTERVAL	100 /* milliseconds */
+
+static guint native_code_timeout_id = 0;
+
+/* Swaps in the native code if the C backend is done with it.
+   Returns FALSE if it's still compiling. */
+static gboolean
+finish_native_code (gboolean wait)
+{
+    if (mathmap == 0 || mathmap->c_code_job == NULL)
+	return TRUE;
+
+    if (!mathmap_finish_background_backend(mathmap, wait))
+	return FALSE;
+
+    /* the preview render uses the old functions */
+    cancel_preview_render();
+    invocation_reload_mathfuncs(invocation);
+
+    return TRUE;
+}
+
+static gboolean
+poll_native_code (gpointer data)
+{
+    if (mathmap != 0 && mathmap->c_code_job != NULL)
+    {
+	if (!finish_native_code(FALSE))
+	    return TRUE;
+
+	if (auto_preview)
+	    dialog_update_preview();
+    }
+
+    native_code_timeout_id = 0;
+    return FALSE;
+}
+
 static gboolean
 generate_code (void)
 {
+    /* the preview render must not outlive the invocation it uses */
+    cancel_preview_render();
+
     if (expression_changed)
     {
 	static char *support_paths[3];
@@ -1029,6 +1111,9 @@ generate_code (void)
 
 	    expression_changed = 0;
 
+	    if (mathmap->c_code_job != NULL && native_code_timeout_id == 0)
+		native_code_timeout_id = g_timeout_add(NATIVE_CODE_POLL_INTERVAL, poll_native_code, NULL);
+
 	    update_userval_table();
 	}
 
@@ -1040,6 +1125,9 @@ generate_code (void)
     {
 	invocation_set_antialiasing(invocation, mmvals.flags & FLAG_ANTIALIASING);
 	invocation->supersampling = mmvals.flags & FLAG_SUPERSAMPLING;
+	/* input pixels can only be fetched from several threads if
+	   the tile access is locked */
+	invocation->num_threads = NUM_FINAL_RENDER_CPUS;
 
 	invocation->edge_behaviour_x = edge_behaviour_x_mode;
 	invocation->edge_behaviour_y = edge_behaviour_y_mode;
@@ -1052,22 +1140,139 @@ generate_code (void)
 
 /*****/
 
-static void
-unref_drawable_tiles (input_drawable_t *drawable)
+static tile_cache_t*
+get_tile_cache (void)
 {
-    g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
+#ifdef THREADED_FINAL_RENDER
+    tile_cache_t *cache = g_static_private_get(&tile_cache_key);
+#else
+    tile_cache_t *cache = tile_caches;
+#endif
 
-    if (drawable->v.gimp.tile != 0)
+    if (cache == NULL)
     {
-	gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-	drawable->v.gimp.tile = 0;
+	cache = g_new0(tile_cache_t, 1);
+
+	LOCK_GIMP_TILES();
+	cache->next = tile_caches;
+	tile_caches = cache;
+	UNLOCK_GIMP_TILES();
+
+#ifdef THREADED_FINAL_RENDER
+	g_static_private_set(&tile_cache_key, cache, NULL);
+#endif
     }
+
+    return cache;
+}
+
+/* Must not be called while a render is in progress. */
+void
+unref_gimp_drawable_tiles (input_drawable_t *drawable)
+{
+    tile_cache_t *cache;
+    int i;
+
+    LOCK_GIMP_TILES();
+    for (cache = tile_caches; cache != NULL; cache = cache->next)
+	for (i = 0; i < TILE_CACHE_SIZE; ++i)
+	{
+	    tile_cache_entry_t *entry = &cache->entries[i];
+
+	    if (entry->tile == NULL || (drawable != NULL && entry->drawable != drawable))
+		continue;
+
+	    gimp_tile_unref(entry->tile, FALSE);
+	    entry->tile = NULL;
+	    entry->drawable = NULL;
+	}
+    UNLOCK_GIMP_TILES();
 }
 
 static void
 unref_tiles (void)
 {
-    for_each_input_drawable(unref_drawable_tiles);
+    unref_gimp_drawable_tiles(NULL);
+}
+
+static color_t
+gimp_pixel_to_color (guchar *p, int bpp)
+{
+    guchar r, g, b, a;
+
+    if (bpp == 1 || bpp == 2)
+	r = g = b = p[0];
+    else if (bpp == 3 || bpp == 4)
+    {
+	r = p[0];
+	g = p[1];
+	b = p[2];
+    }
+    else
+	assert(0);
+
+    if (bpp == 1 || bpp == 3)
+	a = 255;
+    else
+	a = p[bpp - 1];
+
+    return MAKE_RGBA_COLOR(r, g, b, a);
+}
+
+/* Copies the input region into a flat buffer so that the render can
+   read it without touching tiles at all.  If there's not enough
+   memory we just keep reading from tiles. */
+static void
+build_input_copy (input_drawable_t *drawable)
+{
+    GimpPixelRgn rgn;
+    int width = drawable->image.pixel_width;
+    int height = drawable->image.pixel_height;
+    int bpp = drawable->v.gimp.bpp;
+    color_t *pixels;
+    guchar *buf;
+    int y;
+
+    g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
+
+    if (drawable->v.gimp.copy != NULL)
+	return;
+
+    pixels = g_try_malloc((gsize)width * height * sizeof(color_t));
+    if (pixels == NULL)
+	return;
+
+    buf = g_malloc(width * tile_height * bpp);
+
+    gimp_pixel_rgn_init(&rgn, drawable->v.gimp.drawable, drawable->v.gimp.x0, drawable->v.gimp.y0,
+			width, height, FALSE, FALSE);
+
+    for (y = 0; y < height; y += tile_height)
+    {
+	int h = MIN(tile_height, height - y);
+	int i;
+
+	gimp_pixel_rgn_get_rect(&rgn, buf, drawable->v.gimp.x0, drawable->v.gimp.y0 + y, width, h);
+
+	for (i = 0; i < width * h; ++i)
+	    pixels[y * width + i] = gimp_pixel_to_color(buf + i * bpp, bpp);
+    }
+
+    g_free(buf);
+
+    drawable->v.gimp.copy = pixels;
+}
+
+void
+free_input_copy (input_drawable_t *drawable)
+{
+    g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
+
+    g_free(drawable->v.gimp.copy);
+    drawable->v.gimp.copy = NULL;
+
+    /* the filter's result might have been written to it */
+    input_drawable_content_changed(drawable);
 }
 
 input_drawable_t*
@@ -1101,9 +1306,7 @@ alloc_gimp_input_drawable (GimpDrawable *gimp_drawable, gboolean honor_selection
     drawable->v.gimp.x0 = x;
     drawable->v.gimp.y0 = y;
     drawable->v.gimp.bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(gimp_drawable));
-    drawable->v.gimp.row = -1;
-    drawable->v.gimp.col = -1;
-    drawable->v.gimp.tile = 0;
+    drawable->v.gimp.copy = 0;
     drawable->v.gimp.fast_image_source = 0;
 
     drawable->v.gimp.fast_image_source_width =
@@ -1124,31 +1327,69 @@ get_gimp_input_drawable (input_drawable_t *drawable)
 
 /*****/
 
+typedef struct
+{
+    int bpp;
+    gint progress, max_progress;
+} output_tiles_t;
+
+/* Called by the render threads with a rendered tile, which is also a
+   tile of the output drawable. */
+static void
+emit_output_tile (render_tile_t *tile, unsigned char *pixels, gpointer data)
+{
+    output_tiles_t *output = (output_tiles_t*)data;
+    int x = sel_x1 + tile->x;
+    int y = sel_y1 + tile->y;
+    GimpTile *gimp_tile;
+    guchar *dest;
+    int row;
+
+    LOCK_GIMP_TILES();
+    gimp_tile = gimp_drawable_get_tile(output_drawable, TRUE, y / tile_height, x / tile_width);
+    assert(gimp_tile != 0);
+    gimp_tile_ref(gimp_tile);
+    UNLOCK_GIMP_TILES();
+
+    dest = gimp_tile->data + ((y % tile_height) * gimp_tile->ewidth + x % tile_width) * output->bpp;
+    for (row = 0; row < tile->height; ++row)
+	memcpy(dest + row * gimp_tile->ewidth * output->bpp,
+	       pixels + row * invocation->row_stride,
+	       tile->width * output->bpp);
+
+    LOCK_GIMP_TILES();
+    gimp_tile_unref(gimp_tile, TRUE);
+
+    output->progress += tile->width * tile->height;
+    gimp_progress_update((double) output->progress / output->max_progress);
+    UNLOCK_GIMP_TILES();
+}
+
 static void
 do_mathmap (int frame_num, float current_t)
 {
-    GimpPixelRgn dest_rgn;
-    gpointer pr;
-    gint progress, max_progress;
     gchar progress_info[30];
 
     assert(invocation != 0);
 
     previewing = 0;
 
-    if (generate_code())
+    if (generate_code() && finish_native_code(TRUE))
     {
 	mathmap_frame_t *frame;
 	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
 					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
 					       sel_width, sel_height);
+	output_tiles_t output;
+	render_tile_t *tiles;
+	int num_tiles;
+	int first_col = sel_x1 / tile_width, last_col = (sel_x2 - 1) / tile_width;
+	int first_row = sel_y1 / tile_height, last_row = (sel_y2 - 1) / tile_height;
+	int col, row;
 
-	/* Initialize pixel region */
-	gimp_pixel_rgn_init(&dest_rgn, output_drawable, sel_x1, sel_y1, sel_width, sel_height,
-			    TRUE, TRUE);
-
-	progress = 0;
-	max_progress = sel_width * sel_height;
+	output.bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(output_drawable));
+	output.progress = 0;
+	output.max_progress = sel_width * sel_height;
 
 	if (frame_num >= 0)
 	    sprintf(progress_info, _("Mathmapping frame %d..."), frame_num + 1);
@@ -1156,30 +1397,40 @@ do_mathmap (int frame_num, float current_t)
 	    strcpy(progress_info, _("Mathmapping..."));
 	gimp_progress_init(progress_info);
 
-	frame = invocation_new_frame(invocation, closure,
-				     frame_num, current_t);
+	if (mmvals.flags & FLAG_COPY_INPUT)
+	    for_each_input_drawable(build_input_copy);
 
-	for (pr = gimp_pixel_rgns_register(1, &dest_rgn);
-	     pr != NULL; pr = gimp_pixel_rgns_process(pr))
-	{
-	    int region_x = dest_rgn.x - sel_x1;
-	    int region_y = dest_rgn.y - sel_y1;
-	    int region_width = dest_rgn.w;
-	    int region_height = dest_rgn.h;
+	/* The render threads render the drawable's tiles within the
+	   selection, column by column, so that they can reuse the
+	   y-constants of a column. */
+	tiles = g_new(render_tile_t, (last_col - first_col + 1) * (last_row - first_row + 1));
+	num_tiles = 0;
+	for (col = first_col; col <= last_col; ++col)
+	    for (row = first_row; row <= last_row; ++row)
+	    {
+		int x1 = MAX(col * tile_width, sel_x1), x2 = MIN((col + 1) * tile_width, sel_x2);
+		int y1 = MAX(row * tile_height, sel_y1), y2 = MIN((row + 1) * tile_height, sel_y2);
+		render_tile_t *tile = &tiles[num_tiles++];
+
+		tile->x = x1 - sel_x1;
+		tile->y = y1 - sel_y1;
+		tile->width = x2 - x1;
+		tile->height = y2 - y1;
+	    }
 
-	    invocation->row_stride = dest_rgn.rowstride;
-	    invocation->output_bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(output_drawable));
+	invocation->row_stride = tile_width * output.bpp;
+	invocation->output_bpp = output.bpp;
 
-	    call_invocation_parallel_and_join(frame, closure, region_x, region_y, region_width, region_height,
-					      dest_rgn.data, NUM_FINAL_RENDER_CPUS);
+	frame = invocation_new_frame(invocation, closure,
+				     frame_num, current_t);
 
-	    /* Update progress */
-	    progress += region_width * region_height;
-	    gimp_progress_update((double) progress / max_progress);
-	}
+	call_invocation_tiles_and_join(frame, closure, num_tiles, tiles, NUM_FINAL_RENDER_CPUS,
+				       emit_output_tile, &output);
 
 	invocation_free_frame(frame);
 
+	g_free(tiles);
+
 	unref_tiles();
 
 	gimp_drawable_flush(output_drawable);
@@ -1197,9 +1448,8 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
 {
     gint newcol, newrow;
     gint newcoloff, newrowoff;
-    guchar *p;
-    guchar r, g, b, a;
-    int bpp;
+    tile_cache_entry_t *entry;
+    GimpTile *tile;
 
     ++num_pixels_requested;
 
@@ -1213,6 +1463,9 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
 
     g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
 
+    if (drawable->v.gimp.copy != NULL)
+	return drawable->v.gimp.copy[x + y * drawable->image.pixel_width];
+
     x += drawable->v.gimp.x0;
     y += drawable->v.gimp.y0;
 
@@ -1221,48 +1474,32 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
     newrow = y / tile_height;
     newrowoff = y % tile_height;
 
-#ifdef THREADED_FINAL_RENDER
-    pthread_mutex_lock(&get_gimp_pixel_mutex);
-#endif
+    /* The cache is private to this thread, so a hit needs no
+       locking. */
+    entry = &get_tile_cache()->entries[(newrow * 31 + newcol + drawable->image.id * 7) & (TILE_CACHE_SIZE - 1)];
 
-    if (drawable->v.gimp.col != newcol || drawable->v.gimp.row != newrow || drawable->v.gimp.tile == NULL)
+    if (entry->drawable != drawable || entry->row != newrow || entry->col != newcol || entry->tile == NULL)
     {
-	if (drawable->v.gimp.tile != NULL)
-	    gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-
-	drawable->v.gimp.tile = gimp_drawable_get_tile(drawable->v.gimp.drawable, FALSE, newrow, newcol);
-	assert(drawable->v.gimp.tile != 0);
-	gimp_tile_ref(drawable->v.gimp.tile);
+	LOCK_GIMP_TILES();
 
-	drawable->v.gimp.col = newcol;
-	drawable->v.gimp.row = newrow;
-    }
+	if (entry->tile != NULL)
+	    gimp_tile_unref(entry->tile, FALSE);
 
-    p = drawable->v.gimp.tile->data + drawable->v.gimp.tile->bpp * (drawable->v.gimp.tile->ewidth * newrowoff + newcoloff);
+	entry->tile = gimp_drawable_get_tile(drawable->v.gimp.drawable, FALSE, newrow, newcol);
+	assert(entry->tile != 0);
+	gimp_tile_ref(entry->tile);
 
-    bpp = drawable->v.gimp.bpp;
+	UNLOCK_GIMP_TILES();
 
-    if (bpp == 1 || bpp == 2)
-	r = g = b = p[0];
-    else if (bpp == 3 || bpp == 4)
-    {
-	r = p[0];
-	g = p[1];
-	b = p[2];
+	entry->drawable = drawable;
+	entry->row = newrow;
+	entry->col = newcol;
     }
-    else
-	assert(0);
 
-    if (bpp == 1 || bpp == 3)
-	a = 255;
-    else
-	a = p[bpp - 1];
-
-#ifdef THREADED_FINAL_RENDER
-    pthread_mutex_unlock(&get_gimp_pixel_mutex);
-#endif
+    tile = entry->tile;
 
-    return MAKE_RGBA_COLOR(r, g, b, a);
+    return gimp_pixel_to_color(tile->data + tile->bpp * (tile->ewidth * newrowoff + newcoloff),
+			       drawable->v.gimp.bpp);
 }
 
 static void
@@ -1713,6 +1950,9 @@ mathmap_dialog (int mutable_expression)
 
     gimp_ui_init("mathmap", TRUE);
 
+    compiler_set_background_backend(TRUE);
+    compiler_set_tcc_backend(TRUE);
+
     alloc_preview_pixbuf(DEFAULT_PREVIEW_SIZE, DEFAULT_PREVIEW_SIZE);
 
     mathmap_dialog_window = gimp_dialog_new("MathMap", "mathmap",
@@ -1866,7 +2106,7 @@ mathmap_dialog (int mutable_expression)
 
             /* Sampling */
 
-            table = gtk_table_new(2, 1, FALSE);
+            table = gtk_table_new(3, 1, FALSE);
 	    gtk_container_border_width(GTK_CONTAINER(table), 6);
 	    gtk_table_set_row_spacings(GTK_TABLE(table), 4);
     
@@ -1898,6 +2138,16 @@ mathmap_dialog (int mutable_expression)
 				   (GtkSignalFunc)dialog_supersampling_update, 0);
 		gtk_widget_show(toggle);
 
+		/* Copy Input */
+
+		toggle = gtk_check_button_new_with_label(_("Copy Input Before Rendering"));
+		gtk_toggle_button_set_state(GTK_TOGGLE_BUTTON(toggle),
+					    mmvals.flags & FLAG_COPY_INPUT);
+		gtk_table_attach(GTK_TABLE(table), toggle, 0, 1, 2, 3, GTK_FILL, 0, 0, 0);
+		gtk_signal_connect(GTK_OBJECT(toggle), "toggled",
+				   (GtkSignalFunc)dialog_copy_input_update, 0);
+		gtk_widget_show(toggle);
+
 	    /* Preview Options */
 
             table = gtk_table_new(2, 1, FALSE);
@@ -2095,6 +2345,16 @@ mathmap_dialog (int mutable_expression)
     gtk_main();
     gdk_flush();
 
+    cancel_preview_render();
+
+    compiler_set_background_backend(FALSE);
+    compiler_set_tcc_backend(FALSE);
+    if (native_code_timeout_id != 0)
+    {
+	g_source_remove(native_code_timeout_id);
+	native_code_timeout_id = 0;
+    }
+
     unref_tiles();
 
     g_free(wint.wimage);
@@ -2139,6 +2399,236 @@ calculate_and_print_fps (void)
 }
 #endif
 
+/*
+ * The preview is rendered progressively: first at
+ * 1/PREVIEW_COARSEST_SCALE of its resolution, then at twice that, and
+ * so on, up to full resolution.  Each level is rendered in the
+ * background by the render threads.  A timeout polls the render and
+ * copies every row that has been finished, according to the
+ * invocation's rows_finished, into the preview.  Any change cancels
+ * the render in progress at tile granularity, and the preview starts
+ * over at the coarsest level.
+ */
+#define PREVIEW_COARSEST_SCALE		8
+#define PREVIEW_POLL_INTERVAL		30 /* milliseconds */
+
+static struct
+{
+    int scale;			/* 0 if no render is in progress */
+    int width, height;
+    int preview_width, preview_height;
+    guchar *buf;
+    unsigned char *rows_copied;
+    image_t *closure;
+    mathmap_frame_t *frame;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    gpointer call;
+#endif
+    int old_render_width, old_render_height;
+    guint timeout_id;
+} preview_render;
+
+/* Copies the rows first_row to last_row of the level being rendered
+   into the preview, scaling them up to fill it. */
+static void
+copy_preview_rows (int first_row, int last_row)
+{
+    int scale = preview_render.scale;
+    int preview_width = preview_render.preview_width;
+    int y, x;
+
+    for (y = first_row * scale; y < MIN(last_row * scale, preview_render.preview_height); ++y)
+    {
+	guchar *row = preview_render.buf + (y / scale) * preview_render.width * 4;
+	guchar *p_ul = wint.wimage + y * preview_width * 3;
+	gint check, check_0, check_1;
+
+	if ((y / CHECK_SIZE) & 1) {
+	    check_0 = CHECK_DARK;
+	    check_1 = CHECK_LIGHT;
+	} else {
+	    check_0 = CHECK_LIGHT;
+	    check_1 = CHECK_DARK;
+	}
+
+	for (x = 0; x < preview_width; x++)
+	{
+	    guchar *p = row + MIN(x / scale, preview_render.width - 1) * 4;
+
+	    if ((output_bpp == 2 || output_bpp == 4) && p[3] != 255)
+	    {
+		float alphaf = (float)p[3] / 255.0;
+
+		if (((x) / CHECK_SIZE) & 1)
+		    check = check_0;
+		else
+		    check = check_1;
+
+		p_ul[0] = check + (p[0] - check) * alphaf;
+		p_ul[1] = check + (p[1] - check) * alphaf;
+		p_ul[2] = check + (p[2] - check) * alphaf;
+	    }
+	    else
+	    {
+		p_ul[0] = p[0];
+		p_ul[1] = p[1];
+		p_ul[2] = p[2];
+	    }
+
+	    p_ul += 3;
+	}
+    }
+}
+
+/* Copies all newly finished rows into the preview.  Returns whether
+   any were copied. */
+static gboolean
+copy_finished_preview_rows (gboolean all_finished)
+{
+    gboolean copied = FALSE;
+    int row, first_row = -1;
+
+    for (row = 0; row <= preview_render.height; ++row)
+    {
+	gboolean copy = row < preview_render.height && !preview_render.rows_copied[row]
+	    && (all_finished || invocation->rows_finished[row]);
+
+	if (copy)
+	{
+	    preview_render.rows_copied[row] = 1;
+	    if (first_row < 0)
+		first_row = row;
+	}
+	else if (first_row >= 0)
+	{
+	    copy_preview_rows(first_row, row);
+	    first_row = -1;
+	    copied = TRUE;
+	}
+    }
+
+    return copied;
+}
+
+static void
+start_preview_level (int scale)
+{
+    int width = MAX(1, (preview_render.preview_width + scale - 1) / scale);
+    int height = MAX(1, (preview_render.preview_height + scale - 1) / scale);
+
+    preview_render.scale = scale;
+    preview_render.width = width;
+    preview_render.height = height;
+    preview_render.buf = (guchar*)malloc(4 * width * height);
+    assert(preview_render.buf != 0);
+    preview_render.rows_copied = g_new0(unsigned char, height);
+
+    invocation->row_stride = width * 4;
+    invocation->output_bpp = 4;
+
+    if (previewing)
+    {
+	invocation->render_width = width;
+	invocation->render_height = height;
+    }
+    else
+    {
+	invocation->render_width = invocation->img_width;
+	invocation->render_height = invocation->img_height;
+    }
+
+    preview_render.closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+						 invocation->mathmap->main_filter->num_uservals, invocation->uservals,
+						 width, height);
+    preview_render.frame = invocation_new_frame(invocation, preview_render.closure, 0, mmvals.param_t);
+
+    preview_render.frame->frame_render_width = width;
+    preview_render.frame->frame_render_height = height;
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    preview_render.call = call_invocation_parallel(preview_render.frame, preview_render.closure,
+						   0, 0, width, height, preview_render.buf,
+						   previewing ? get_num_cpus() : NUM_FINAL_RENDER_CPUS);
+#else
+    call_invocation_parallel_and_join(preview_render.frame, preview_render.closure,
+				      0, 0, width, height, preview_render.buf,
+				      previewing ? get_num_cpus() : NUM_FINAL_RENDER_CPUS);
+#endif
+}
+
+static void
+end_preview_level (void)
+{
+    invocation_free_frame(preview_render.frame);
+    closure_image_free(preview_render.closure);
+    free(preview_render.buf);
+    g_free(preview_render.rows_copied);
+
+    invocation->render_width = preview_render.old_render_width;
+    invocation->render_height = preview_render.old_render_height;
+
+    preview_render.scale = 0;
+}
+
+static void
+cancel_preview_render (void)
+{
+    if (preview_render.timeout_id != 0)
+    {
+	g_source_remove(preview_render.timeout_id);
+	preview_render.timeout_id = 0;
+    }
+
+    if (preview_render.scale == 0)
+	return;
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    kill_invocation_call(preview_render.call);
+#endif
+    end_preview_level();
+}
+
+static gboolean
+poll_preview_render (gpointer data)
+{
+    gboolean is_done;
+    gboolean copied;
+
+    g_assert(preview_render.scale > 0);
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    is_done = invocation_call_is_done(preview_render.call);
+    if (is_done)
+	join_invocation_call(preview_render.call);
+#else
+    is_done = TRUE;
+#endif
+
+    copied = copy_finished_preview_rows(is_done);
+
+    if (copied)
+    {
+	refresh_preview();
+	gtk_widget_draw(wint.preview, NULL);
+    }
+
+    if (!is_done)
+	return TRUE;
+
+    if (preview_render.scale > 1)
+    {
+	int scale = preview_render.scale / 2;
+
+	end_preview_level();
+	start_preview_level(scale);
+	return TRUE;
+    }
+
+    end_preview_level();
+    preview_render.timeout_id = 0;
+    return FALSE;
+}
+
 static gboolean
 recalculate_preview (void)
 {
@@ -2155,26 +2645,10 @@ recalculate_preview (void)
 
     if (generate_code())
     {
-	int preview_width = gdk_pixbuf_get_width(wint.pixbuf);
-	int preview_height = gdk_pixbuf_get_height(wint.pixbuf);
-	int x, y;
-	guchar *p_ul, *p;
-	gint check, check_0, check_1;
-	guchar *buf = (guchar*)malloc(4 * preview_width * preview_height);
-	int old_render_width, old_render_height;
-	mathmap_frame_t *frame;
-	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
-					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
-					       preview_width, preview_height);
-	assert(buf != 0);
-
 	update_uservals(mathmap->main_filter->userval_infos, invocation->uservals);
 
 	previewing = fast_preview;
 
-	invocation->row_stride = preview_width * 4;
-	invocation->output_bpp = 4;
-
 	/*
 	if (debug_tuples)
 	{
@@ -2188,91 +2662,16 @@ recalculate_preview (void)
 	*/
 	    disable_debugging(invocation);
 
-	old_render_width = invocation->render_width;
-	old_render_height = invocation->render_height;
-
-	if (previewing)
-	{
-	    invocation->render_width = preview_width;
-	    invocation->render_height = preview_height;
-	}
-	else
-	{
-	    invocation->render_width = invocation->img_width;
-	    invocation->render_height = invocation->img_height;
-	}
-
 	if (previewing)
 	    for_each_input_drawable(build_fast_image_source);
 
-	frame = invocation_new_frame(invocation, closure, 0, mmvals.param_t);
-
-	frame->frame_render_width = preview_width;
-	frame->frame_render_height = preview_height;
-
-	if (previewing)
-	    call_invocation_parallel_and_join(frame, closure, 0, 0, preview_width, preview_height,
-					      buf, get_num_cpus());
-	else
-	    call_invocation_parallel_and_join(frame, closure, 0, 0, preview_width, preview_height,
-					      buf, NUM_FINAL_RENDER_CPUS);
-
-	invocation_free_frame(frame);
-
-	invocation->render_width = old_render_width;
-	invocation->render_height = old_render_height;
-
-	p = buf;
-	p_ul = wint.wimage;
-
-	for (y = 0; y < preview_height; y++)
-	{
-	    if ((y / CHECK_SIZE) & 1) {
-		check_0 = CHECK_DARK;
-		check_1 = CHECK_LIGHT;
-	    } else {
-		check_0 = CHECK_LIGHT;
-		check_1 = CHECK_DARK;
-	    }
-
-	    for (x = 0; x < preview_width; x++)
-	    {
-		if (output_bpp == 2 || output_bpp == 4 )
-		{
-		    if (((x) / CHECK_SIZE) & 1)
-			check = check_0;
-		    else
-			check = check_1;
-
-		    if (p[3] == 255)
-		    {
-			p_ul[0] = p[0];
-			p_ul[1] = p[1];
-			p_ul[2] = p[2];
-		    }
-		    else if (p[3] != 255)
-		    {
-			float alphaf = (float)p[3] / 255.0;
-
-			p_ul[0] = check + (p[0] - check) * alphaf;
-			p_ul[1] = check + (p[1] - check) * alphaf;
-			p_ul[2] = check + (p[2] - check) * alphaf;
-		    }
-		}
-		else
-		{
-		    p_ul[0] = p[0];
-		    p_ul[1] = p[1];
-		    p_ul[2] = p[2];
-		}
-
-		p_ul += 3;
-		p += 4;
-	    }
-	}
+	preview_render.preview_width = gdk_pixbuf_get_width(wint.pixbuf);
+	preview_render.preview_height = gdk_pixbuf_get_height(wint.pixbuf);
+	preview_render.old_render_width = invocation->render_width;
+	preview_render.old_render_height = invocation->render_height;
 
-	free(buf);
-	closure_image_free(closure);
+	start_preview_level(PREVIEW_COARSEST_SCALE);
+	preview_render.timeout_id = g_timeout_add(PREVIEW_POLL_INTERVAL, poll_preview_render, NULL);
 
 	--in_recalculate;
 
@@ -2393,6 +2792,17 @@ dialog_supersampling_update (GtkWidget *widget, gpointer data)
 
 /*****/
 
+static void
+dialog_copy_input_update (GtkWidget *widget, gpointer data)
+{
+    mmvals.flags &= ~FLAG_COPY_INPUT;
+
+    if (GTK_TOGGLE_BUTTON(widget)->active)
+	mmvals.flags |= FLAG_COPY_INPUT;
+}
+
+/*****/
+
 static void
 dialog_auto_preview_update (GtkWidget *widget, gpointer data)
 {
@@ -2529,6 +2939,10 @@ alloc_preview_pixbuf (int max_width, int max_height)
 	    return FALSE;
 	g_object_unref(G_OBJECT(wint.pixbuf));
     }
+
+    /* the render in progress copies into the old image */
+    cancel_preview_render();
+
     if (wint.wimage != 0)
 	g_free(wint.wimage);
 
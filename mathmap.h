@@ -109,6 +109,17 @@ typedef struct _mathmap_t
     struct _mathfuncs_t *mathfuncs;
 
     void *module_info;
+    /* for libtcc - kept until the mathmap is unloaded, even if the C
+       backend replaced its code */
+    void *tcc_module_info;
+
+    /* While the C backend is running in the background, the filter
+       is interpreted. */
+    struct _interpreter_code_t *interpreter_code;
+    struct _c_code_job_t *c_code_job;
+
+    /* the contexts the compiler made for this mathmap */
+    struct _compiler_context_t *compiler_contexts;
 
     struct _mathmap_t *next;
 } mathmap_t;
@@ -118,10 +129,9 @@ typedef struct _mathmap_t
    line. */
 extern int cmd_line_mode;
 
-/* This variable is set by the compiler.  It's ok that it is global
-   because the compiler is non-reentrant (which is ok because it's
-   fast and more convenient to write). */
-extern mathmap_t *the_mathmap;
+/* The mathmap being parsed.  Each thread has its own, so several
+   mathmaps can be parsed at the same time. */
+extern __thread mathmap_t *the_mathmap;
 
 #ifndef OPENSTEP
 extern color_t gradient_samples[USER_GRADIENT_POINTS];
@@ -152,12 +162,21 @@ typedef color_t (*orig_val_pixel_func_t) (struct _mathmap_invocation_t*, float,
 
 typedef struct _native_filter_cache_entry_t
 {
-    filter_t *filter;
-    userval_t *args;
+    native_filter_func_t func;
+    int key_length;
+    gint64 *key;
+    guint hash;
+
     image_t *image;		/* NULL if not done */
-    struct _native_filter_cache_entry_t *next;
+    mathmap_pools_t pools;	/* the image must be allocated here */
+    long size;
+
+    int last_used_epoch;
+    GList *lru_link;		/* NULL if not done or evicted */
 } native_filter_cache_entry_t;
 
+#define DEFAULT_TILE_ROWS	8
+
 /* TEMPLATE invocation_frame_slice */
 typedef struct _mathmap_invocation_t
 {
@@ -186,12 +205,16 @@ typedef struct _mathmap_invocation_t
 
     int row_stride;
 
-    unsigned char * volatile rows_finished;
+    /* Parallel renders are split into tiles of this many rows, which
+       are then distributed among the render threads.  0 means
+       DEFAULT_TILE_ROWS. */
+    int tile_rows;
 
-    mathmap_pools_t pools;	/* used exclusively for the native filter cache */
-    GMutex *native_filter_cache_mutex;
-    GCond *native_filter_cache_cond;
-    native_filter_cache_entry_t *native_filter_cache;
+    /* Number of threads for rendering intermediate images, like the
+       inputs of native filters.  0 means one per CPU. */
+    int num_threads;
+
+    unsigned char * volatile rows_finished;
 
     /* FIXME: remove - it's in the closure */
     mathfuncs_t mathfuncs;
@@ -212,6 +235,8 @@ typedef struct _mathmap_frame_t
 
     void *xy_vars;
     mathmap_pools_t pools;
+
+    int native_filter_cache_epoch;
 } mathmap_frame_t;
 
 typedef struct _mathmap_slice_t
@@ -223,6 +248,10 @@ typedef struct _mathmap_slice_t
 
     void *y_vars;
     mathmap_pools_t pools;
+
+    /* the result of the LLVM backend's main filter function, if it
+       computed it in local storage */
+    float return_tuple[4];
 } mathmap_slice_t;
 /* END */
 
@@ -274,6 +303,9 @@ void finish_parsing_filter (mathmap_t *mathmap);
 int check_mathmap (char *expression);
 mathmap_t* parse_mathmap (char *expression);
 mathmap_t* compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend);
+/* Swaps in the native code once the background C backend is done.
+   Returns FALSE if it's still running and wait is FALSE. */
+gboolean mathmap_finish_background_backend (mathmap_t *mathmap, gboolean wait);
 mathmap_invocation_t* invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template_invocation,
 				      int img_width, int img_height, gboolean copy_first_image);
 
@@ -285,6 +317,8 @@ void invocation_init_slice (mathmap_slice_t *slice, image_t *image, mathmap_fram
 			    int region_width, int region_height, float sampling_offset_x, float sampling_offset_y);
 void invocation_deinit_slice (mathmap_slice_t *slice);
 
+/* Must be called when no frame of the invocation is rendering. */
+void invocation_reload_mathfuncs (mathmap_invocation_t *invocation);
 void invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialising);
 
 gpointer call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
@@ -293,8 +327,46 @@ gpointer call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 void call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 					int region_x, int region_y, int region_width, int region_height,
 					unsigned char *q, int num_threads);
+/* Like call_invocation_parallel_and_join, but stores the wall-clock
+   render time of each thread in thread_times, which must have room
+   for num_threads entries. */
+void call_invocation_parallel_and_join_timed (mathmap_frame_t *frame, image_t *closure,
+					      int region_x, int region_y, int region_width, int region_height,
+					      unsigned char *q, int num_threads, double *thread_times);
+
+/* Renders image into floatmap, which must be a floatmap, using
+   invocation->num_threads threads.  If image is a closure, frame
+   must be a frame for it, otherwise it is ignored. */
+void render_floatmap_parallel_and_join (mathmap_invocation_t *invocation, mathmap_frame_t *frame,
+					image_t *image, image_t *floatmap);
+
+/* Calls func for consecutive ranges [first, last) of at most
+   chunk_size of the items [0, num_items), on invocation->num_threads
+   threads, and waits until all of them are done. */
+void invocation_parallel_for_and_join (mathmap_invocation_t *invocation, int num_items, int chunk_size,
+				       void (*func) (int first, int last, gpointer data), gpointer data);
+
+/* A rectangle of a tiled render, in pixels of the closure. */
+typedef struct
+{
+    int x, y, width, height;
+} render_tile_t;
+
+/* Renders the tiles on num_threads threads and waits until all of
+   them are done.  Each thread renders a tile into a private buffer
+   with a row stride of invocation->row_stride and then passes it to
+   emit, which can be called from any of the threads.  Threads keep
+   their slices across tiles in the same columns, so tiles should be
+   ordered column by column. */
+void call_invocation_tiles_and_join (mathmap_frame_t *frame, image_t *closure,
+				     int num_tiles, render_tile_t *tiles, int num_threads,
+				     void (*emit) (render_tile_t *tile, unsigned char *pixels, gpointer data),
+				     gpointer data);
 
 void join_invocation_call (gpointer *_call);
+/* Like join_invocation_call, but stores the render time of each
+   thread in thread_times, if it's not NULL. */
+void join_invocation_call_with_times (gpointer *_call, double *thread_times);
 void kill_invocation_call (gpointer *_call);
 gboolean invocation_call_is_done (gpointer *_call);
 
@@ -303,6 +375,16 @@ native_filter_cache_entry_t* invocation_lookup_native_filter_invocation (mathmap
 void native_filter_cache_entry_set_image (mathmap_invocation_t *invocation,
 					  native_filter_cache_entry_t *cache_entry,
 					  image_t *image);
+/* Results of native filters can only be freed when no frame that
+   might use them is alive anymore, so frames must be registered with
+   the cache. */
+int native_filter_cache_begin_frame (void);
+void native_filter_cache_end_frame (int epoch);
+#define DEFAULT_NATIVE_FILTER_CACHE_MEGABYTES	256
+/* Sets the number of bytes native filter results can take up in the
+   cache. */
+void native_filter_cache_set_budget (long bytes);
+void native_filter_cache_get_stats (long *hits, long *misses, long *evictions, long *bytes);
 
 void carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_invocation_t *template_invocation,
 					gboolean copy_first_image);
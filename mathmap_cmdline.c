@@ -28,8 +28,19 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include "getopt.h"
 
@@ -44,10 +55,14 @@
 #include "jump.h"
 #include "mathmap.h"
 #include "drawable.h"
+#include "bench.h"
 #include "rwimg/readimage.h"
 #include "rwimg/writeimage.h"
 
 #include "generators/blender/blender.h"
+#ifdef HAVE_FFTW
+#include "native-filters/native-filters.h"
+#endif
 
 typedef struct _define_t
 {
@@ -56,284 +71,951 @@ typedef struct _define_t
     struct _define_t *next;
 } define_t;
 
-typedef struct _cache_entry_t
+/*
+ * Command-line input images are decoded lazily, in strips of
+ * INPUT_STRIP_ROWS rows, because the image readers can only decode
+ * sequentially.  Decoded strips of all images share a cache that
+ * holds at most cache_budget bytes.  Raw PPM and PAM files with 8 bit
+ * RGB pixels aren't decoded at all but mapped into memory.
+ *
+ * Looking up a strip that's already resident doesn't take a lock.
+ * The strip pointers of an image are read atomically, and a strip is
+ * only written to, to mark it as used, if it isn't already marked,
+ * so hot strips aren't bounced between CPU caches.  Strips are
+ * evicted with the clock algorithm under cache_mutex.  Another thread
+ * might still be reading pixels from a strip that was just evicted,
+ * so evicted strips are not freed right away but put on the retired
+ * list.  Every render is bracketed by begin_input_render() and
+ * end_input_render(), which hand out increasing epochs, and a retired
+ * strip is freed once all renders that were running when it was
+ * retired have ended.  Decoding takes the image's own mutex, so
+ * different images can be decoded in parallel.
+ *
+ * A reader can't seek, so a strip above the reader's position is
+ * decoded by reopening the file and reading from the top.  If the
+ * strips an image is sampled from didn't fit into the cache, every
+ * such miss would decode the image again, so the cache always holds
+ * at least the largest decoded image opened so far (or the largest
+ * movie frame), even if that's more than cache_budget.
+ *
+ * Movies are images with the strips of all frames in one array.  A
+ * movie frame can only be decoded as a whole, so a miss decodes all
+ * strips of its frame.
+ *
+ * Images are reference counted.  Every drawable using an image holds
+ * a reference.  In server mode the list of resident images holds one,
+ * too, so the images of recent jobs stay open and keep their strips.
+ */
+#define INPUT_STRIP_ROWS		32
+#define DEFAULT_CACHE_MEGABYTES		512
+
+typedef struct _input_strip_t
 {
-    input_drawable_t *drawable;
-    int frame;
+    struct _input_image_t *image;
+    int index;
     guchar *data;
-    int timestamp;
-} cache_entry_t;
+    int referenced;
+    int retired_epoch;
+} input_strip_t;
 
-static int cache_size = 16;
-static cache_entry_t *cache = 0;
-static int current_time = 0;
-
-static cache_entry_t*
-get_free_cache_entry (void)
+typedef struct _input_image_t
 {
-    int lru_index = -1;
-    int i;
+    volatile gint refcount;
 
-    if (cache == 0)
-	cache = g_new0(cache_entry_t, cache_size);
-    g_assert(cache != 0);
+    int width;
+    int height;
 
-    for (i = 0; i < cache_size; ++i)
-	if (cache[i].drawable == 0)
-	{
-	    lru_index = i;
-	    break;
-	}
-	else
-	    if (lru_index < 0 || cache[i].timestamp < cache[lru_index].timestamp)
-		lru_index = i;
+    /* set if the file is mapped */
+    guchar *map;
+    size_t map_length;
+    guchar *pixels;
+    int bpp;
+
+    /* otherwise */
+    char *filename;
+    int num_frames;
+    int num_strips;		/* per frame */
+    input_strip_t **strips;
+    GMutex *decode_mutex;
+    image_reader_t *reader;
+#ifdef MOVIES
+    quicktime_t *movie;
+#endif
+} input_image_t;
+
+static long cache_budget = (long)DEFAULT_CACHE_MEGABYTES << 20;
+static long min_cache_budget = 0;
+static long cache_bytes = 0;
+static GPtrArray *resident_strips = NULL;
+static int clock_hand = 0;
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
+static GSList *retired_strips = NULL;
+static int render_epoch = 0;
+static GSList *active_render_epochs = NULL;
 
-    if (cache[lru_index].drawable != 0)
-	cache[lru_index].drawable->v.cmdline.cache_entries[cache[lru_index].frame] = 0;
+static void
+free_strip (input_strip_t *strip)
+{
+    g_free(strip->data);
+    g_free(strip);
+}
 
-    if (cache[lru_index].data != 0)
-    {
-	free(cache[lru_index].data);
-	cache[lru_index].data = 0;
-    }
+static int
+strip_rows (input_image_t *image, int index)
+{
+    return MIN(INPUT_STRIP_ROWS, image->height - (index % image->num_strips) * INPUT_STRIP_ROWS);
+}
 
-    return &cache[lru_index];
+static long
+strip_bytes (input_image_t *image, int index)
+{
+    return (long)strip_rows(image, index) * image->width * 3;
 }
 
-static cache_entry_t*
-get_cache_entry_for_image (const char *filename, int *width, int *height)
+/* must be called with cache_mutex held */
+static void
+evict_strip (void)
 {
-    cache_entry_t *cache_entry = get_free_cache_entry();
+    input_strip_t *strip;
+
+    g_assert(resident_strips->len > 0);
 
-    cache_entry->data = read_image(filename, width, height);
-    if (cache_entry->data == 0)
+    for (;;)
     {
-	fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), filename);
-	exit(1);
+	if (clock_hand >= resident_strips->len)
+	    clock_hand = 0;
+
+	strip = g_ptr_array_index(resident_strips, clock_hand);
+	if (!strip->referenced)
+	    break;
+
+	strip->referenced = FALSE;
+	++clock_hand;
     }
 
-    return cache_entry;
+    g_ptr_array_remove_index_fast(resident_strips, clock_hand);
+    cache_bytes -= strip_bytes(strip->image, strip->index);
+
+    g_atomic_pointer_set((gpointer*)&strip->image->strips[strip->index], NULL);
+
+    strip->retired_epoch = render_epoch;
+    retired_strips = g_slist_prepend(retired_strips, strip);
 }
 
+/* Makes room for the strip in the cache and publishes it. */
 static void
-bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *drawable, int frame)
+insert_strip (input_strip_t *strip)
 {
-    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE
-	     || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+    long bytes = strip_bytes(strip->image, strip->index);
 
-    cache_entry->drawable = drawable;
-    cache_entry->frame = frame;
-    cache_entry->timestamp = current_time;
+    g_static_mutex_lock(&cache_mutex);
 
-    drawable->v.cmdline.cache_entries[frame] = cache_entry;
+    if (resident_strips == NULL)
+	resident_strips = g_ptr_array_new();
+
+    while (cache_bytes + bytes > MAX(cache_budget, min_cache_budget) && resident_strips->len > 0)
+	evict_strip();
+
+    g_ptr_array_add(resident_strips, strip);
+    cache_bytes += bytes;
+
+    /* publish the strip only after it's completely initialized */
+    g_atomic_pointer_set((gpointer*)&strip->image->strips[strip->index], strip);
+
+    g_static_mutex_unlock(&cache_mutex);
 }
 
-color_t
-cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+/* Makes sure the cache can hold all strips of the image, or of one
+   frame if it's a movie. */
+static void
+require_cache_frame (input_image_t *image)
 {
-    guchar *p;
-    int num_frames;
-    cache_entry_t **cache_entries;
+    long bytes = (long)image->height * image->width * 3;
+
+    g_static_mutex_lock(&cache_mutex);
+    if (bytes > min_cache_budget)
+	min_cache_budget = bytes;
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+/* Must be called before starting to render anything that might
+   read input pixels.  Returns the epoch to pass to
+   end_input_render(). */
+static int
+begin_input_render (void)
+{
+    int epoch;
 
-    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+    g_static_mutex_lock(&cache_mutex);
+    epoch = ++render_epoch;
+    active_render_epochs = g_slist_prepend(active_render_epochs, GINT_TO_POINTER(epoch));
+    g_static_mutex_unlock(&cache_mutex);
 
-    num_frames = drawable->v.cmdline.num_frames;
-    cache_entries = drawable->v.cmdline.cache_entries;
+    return epoch;
+}
 
-    if (frame < 0 || frame >= num_frames)
-	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+/* Frees the retired strips that no render can still be using. */
+static void
+end_input_render (int epoch)
+{
+    GSList *list, **p;
+    int oldest_epoch = G_MAXINT;
+
+    g_static_mutex_lock(&cache_mutex);
+
+    active_render_epochs = g_slist_remove(active_render_epochs, GINT_TO_POINTER(epoch));
+    for (list = active_render_epochs; list != NULL; list = list->next)
+	oldest_epoch = MIN(oldest_epoch, GPOINTER_TO_INT(list->data));
 
-    if (cache_entries[frame] == 0)
+    p = &retired_strips;
+    while (*p != NULL)
     {
-	cache_entry_t *cache_entry;
+	input_strip_t *strip = (*p)->data;
 
-	if (drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE)
+	if (strip->retired_epoch < oldest_epoch)
 	{
-	    int width, height;
+	    list = *p;
+	    *p = list->next;
+	    free_strip(strip);
+	    g_slist_free_1(list);
+	}
+	else
+	    p = &(*p)->next;
+    }
 
-	    cache_entry = get_cache_entry_for_image(drawable->v.cmdline.image_filename, &width, &height);
+    g_static_mutex_unlock(&cache_mutex);
+}
 
-	    g_assert(width == drawable->image.pixel_width && height == drawable->image.pixel_height);
-	}
 #ifdef MOVIES
+/* Decodes all strips of the movie frame that contains the strip with
+   the given index.  Must be called with the image's decode mutex
+   held. */
+static input_strip_t*
+decode_movie_frame (input_image_t *image, int index)
+{
+    int first = index - index % image->num_strips;
+    input_strip_t **frame_strips = g_new(input_strip_t*, image->num_strips);
+    guchar **rows = g_new(guchar*, image->height);
+    input_strip_t *strip;
+    int i, y;
+
+    for (i = 0; i < image->num_strips; ++i)
+    {
+	strip = g_new0(input_strip_t, 1);
+	strip->image = image;
+	strip->index = first + i;
+	strip->data = g_malloc(strip_bytes(image, first + i));
+	strip->referenced = first + i == index;
+
+	for (y = 0; y < strip_rows(image, first + i); ++y)
+	    rows[i * INPUT_STRIP_ROWS + y] = strip->data + y * image->width * 3;
+
+	frame_strips[i] = strip;
+    }
+
+    quicktime_set_video_position(image->movie, index / image->num_strips, 0);
+    quicktime_decode_video(image->movie, rows, 0);
+
+    /* the requested strip goes in last so that making room for the
+       others can't evict it */
+    for (i = 0; i < image->num_strips; ++i)
+    {
+	strip = frame_strips[i];
+
+	if (strip->index == index)
+	    continue;
+
+	if (g_atomic_pointer_get((gpointer*)&image->strips[strip->index]) == NULL)
+	    insert_strip(strip);
 	else
+	    free_strip(strip);
+    }
+
+    strip = frame_strips[index - first];
+    insert_strip(strip);
+
+    g_free(rows);
+    g_free(frame_strips);
+
+    return strip;
+}
+#endif
+
+/* Decodes the strip with the given index, and the ones before it if
+   the reader isn't there yet.  Going back to an earlier strip means
+   decoding from the top again. */
+static input_strip_t*
+decode_strip (input_image_t *image, int index)
+{
+    input_strip_t *strip;
+
+    g_mutex_lock(image->decode_mutex);
+
+    strip = g_atomic_pointer_get((gpointer*)&image->strips[index]);
+    if (strip != NULL)
+    {
+	/* another thread decoded it in the meantime */
+	g_mutex_unlock(image->decode_mutex);
+	return strip;
+    }
+
+#ifdef MOVIES
+    if (image->movie != NULL)
+    {
+	strip = decode_movie_frame(image, index);
+	g_mutex_unlock(image->decode_mutex);
+	return strip;
+    }
+#endif
+
+    if (image->reader != NULL && image->reader->num_lines_read > index * INPUT_STRIP_ROWS)
+    {
+	free_image_reader(image->reader);
+	image->reader = NULL;
+    }
+    if (image->reader == NULL)
+    {
+	image->reader = open_image_reading(image->filename);
+	if (image->reader == NULL)
 	{
-	    guchar **rows = (guchar**)malloc(sizeof(guchar*) * invocation->img_height);
+	    fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), image->filename);
+	    exit(1);
+	}
+	g_assert(image->reader->width == image->width && image->reader->height == image->height);
+    }
 
-	    if (cache[lru_index].data == 0)
-		cache[lru_index].data = (guchar*)malloc(invocation->calc_img_width * invocation->calc_img_height * 3);
+    for (;;)
+    {
+	int i = image->reader->num_lines_read / INPUT_STRIP_ROWS;
 
-	    for (i = 0; i < invocation->calc_img_height; ++i)
-		rows[i] = cache[lru_index].data + i * invocation->calc_img_width * 3;
+	g_assert(i <= index);
 
-	    quicktime_set_video_position(drawable->v.movie, frame, 0);
-	    quicktime_decode_video(drawable->v.movie, rows, 0);
+	/* Strips we have to skip over are probably needed soon by
+	   other threads, so we keep them, but as the first ones to
+	   be evicted. */
+	strip = g_new0(input_strip_t, 1);
+	strip->image = image;
+	strip->index = i;
+	strip->data = g_malloc(strip_bytes(image, i));
+	strip->referenced = i == index;
 
-	    free(rows);
+	read_lines(image->reader, strip->data, strip_rows(image, i));
+
+	if (i == index)
+	{
+	    insert_strip(strip);
+	    break;
 	}
-#endif
 
-	bind_cache_entry_to_drawable(cache_entry, drawable, frame);
+	if (g_atomic_pointer_get((gpointer*)&image->strips[i]) == NULL)
+	    insert_strip(strip);
+	else
+	    free_strip(strip);
     }
-    else
-	cache_entries[frame]->timestamp = current_time;
 
-    p = cache_entries[frame]->data + 3 * (drawable->image.pixel_width * y + x);
+    g_mutex_unlock(image->decode_mutex);
 
-    return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+    return strip;
 }
 
-input_drawable_t*
-alloc_cmdline_image_input_drawable (const char *filename)
+#ifndef __MINGW32__
+static gboolean
+read_header_int (guchar **p, guchar *end, int *value)
 {
-    int width, height;
-    cache_entry_t *cache_entry = get_cache_entry_for_image(filename, &width, &height);
-    input_drawable_t *drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
+    /* skip whitespace and comments */
+    for (;;)
+    {
+	if (*p < end && **p == '#')
+	    while (*p < end && **p != '\n')
+		++*p;
+	else if (*p < end && isspace(**p))
+	    ++*p;
+	else
+	    break;
+    }
 
-    drawable->v.cmdline.cache_entries = g_new0(cache_entry_t*, 1);
-    drawable->v.cmdline.num_frames = 1;
-    drawable->v.cmdline.image_filename = strdup(filename);
+    if (*p >= end || !isdigit(**p))
+	return FALSE;
 
-    bind_cache_entry_to_drawable(cache_entry, drawable, 0);
+    *value = 0;
+    while (*p < end && isdigit(**p))
+    {
+	if (*value > (G_MAXINT - 9) / 10)
+	    return FALSE;
+	*value = *value * 10 + *(*p)++ - '0';
+    }
 
-    return drawable;
+    return TRUE;
 }
 
-#ifdef MOVIES
-input_drawable_t*
-alloc_cmdline_movie_input_drawable (const char *filename)
+/* Parses the header of a raw PPM (P6) or PAM (P7) file and returns
+   the offset of the pixel data, or 0 if the file is in some other
+   format or doesn't have 8 bit RGB or RGBA pixels. */
+static size_t
+parse_raw_header (guchar *data, size_t length, int *width, int *height, int *bpp)
 {
-    g_assert_not_reached();
+    guchar *p = data + 2;
+    guchar *end = data + length;
+    int maxval;
 
-    /*
-		input_drawables[num_input_drawables].type = DRAWABLE_MOVIE;
-		input_drawables[num_input_drawables].v.movie = quicktime_open(optarg, 1, 0);
-		assert(input_drawables[num_input_drawables].v.movie != 0);
-		assert(quicktime_video_tracks(input_drawables[num_input_drawables].v.movie));
-		assert(quicktime_video_depth(input_drawables[num_input_drawables].v.movie, 0) == 24);
-		input_drawables[num_input_drawables].num_frames = quicktime_video_length(input_drawables[num_input_drawables].v.movie, 0);
-		input_drawables[num_input_drawables].cache_entries
-		    = (cache_entry_t**)malloc(sizeof(cache_entry_t*) * input_drawables[num_input_drawables].num_frames);
-		for (i = 0; i < input_drawables[num_input_drawables].num_frames; ++i)
-		    input_drawables[num_input_drawables].cache_entries[i] = 0;
-    */
-}
-#endif
+    if (length < 3)
+	return 0;
 
-static int
-parse_image_size (char *str, int *width, int *height)
-{
-    char *x, *endptr;
+    if (memcmp(data, "P6", 2) == 0)
+    {
+	if (!read_header_int(&p, end, width) || !read_header_int(&p, end, height)
+	    || !read_header_int(&p, end, &maxval)
+	    || p >= end || !isspace(*p))
+	    return 0;
+	++p;
 
-    str = strdup(str);
-    assert(str != 0);
+	*bpp = 3;
+    }
+    else if (memcmp(data, "P7", 2) == 0)
+    {
+	int depth = 0;
+	gboolean tuple_type_ok = TRUE;
 
-    x = strchr(str, 'x');
-    if (x == 0)
-	return 0;
+	*width = *height = maxval = 0;
 
-    *(x++) = '\0';
+	for (;;)
+	{
+	    guchar *line, *line_end;
 
-    if (strlen(str) <= 0 || strlen(x) <= 0)
-	return 0;
+	    while (p < end && isspace(*p))
+		++p;
 
-    *width = strtol(str, &endptr, 10);
-    if (*endptr != '\0')
-	return 0;
+	    line = p;
+	    while (p < end && *p != '\n')
+		++p;
+	    if (p >= end)
+		return 0;
+	    line_end = p++;
 
-    *height = strtol(x, &endptr, 10);
-    if (*endptr != '\0')
+#define KEYWORD_IS(k)	((size_t)(line_end - line) >= strlen(k) && memcmp(line, k, strlen(k)) == 0)
+	    if (KEYWORD_IS("ENDHDR"))
+		break;
+	    else if (KEYWORD_IS("WIDTH"))
+		*width = atoi((char*)line + 5);
+	    else if (KEYWORD_IS("HEIGHT"))
+		*height = atoi((char*)line + 6);
+	    else if (KEYWORD_IS("DEPTH"))
+		depth = atoi((char*)line + 5);
+	    else if (KEYWORD_IS("MAXVAL"))
+		maxval = atoi((char*)line + 6);
+	    else if (KEYWORD_IS("TUPLTYPE"))
+	    {
+		guchar *type = line + 8;
+
+		while (type < line_end && isspace(*type))
+		    ++type;
+		tuple_type_ok = (line_end - type >= 3 && memcmp(type, "RGB", 3) == 0);
+	    }
+#undef KEYWORD_IS
+	}
+
+	if (!tuple_type_ok || (depth != 3 && depth != 4))
+	    return 0;
+
+	*bpp = depth;
+    }
+    else
 	return 0;
 
-    free(str);
+    if (*width <= 0 || *height <= 0 || maxval != 255
+	|| (size_t)(end - p) < (size_t)*width * (size_t)*height * (size_t)*bpp)
+	return 0;
 
-    return 1;
+    return p - data;
 }
 
 static gboolean
-is_ident_char (char c)
+map_raw_image (input_image_t *image, const char *filename)
 {
-    if (isalnum(c))
-	return TRUE;
-    return c == '_';
-}
+    struct stat buf;
+    size_t offset;
+    void *map;
+    int fd;
 
-static gboolean
-print_html_char (FILE *out, char c)
-{
-    /* FIXME: Implement properly */
-    if (putc(c, out) == EOF)
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return FALSE;
+
+    if (fstat(fd, &buf) != 0 || buf.st_size < 3)
+    {
+	close(fd);
+	return FALSE;
+    }
+
+    map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
 	return FALSE;
+
+    offset = parse_raw_header(map, buf.st_size, &image->width, &image->height, &image->bpp);
+    if (offset == 0)
+    {
+	munmap(map, buf.st_size);
+	return FALSE;
+    }
+
+    image->map = map;
+    image->map_length = buf.st_size;
+    image->pixels = (guchar*)map + offset;
+
     return TRUE;
 }
+#endif
 
-static gboolean
-write_filter_html_doc (FILE *out, top_level_decl_t *decl)
+static input_image_t*
+open_input_image (const char *filename)
 {
-    arg_decl_t *arg;
-    int num_args;
-    int arg_indent;
+    input_image_t *image = g_new0(input_image_t, 1);
 
-    g_assert(decl->type == TOP_LEVEL_FILTER);
+    image->refcount = 1;
+    image->num_frames = 1;
 
-    fprintf(out, "<p><a name=\"filter_%s\"></a><font size=\"+1\"><tt>filter <b>%s</b> (",
-	    decl->name, decl->name);
+#ifndef __MINGW32__
+    if (map_raw_image(image, filename))
+	return image;
+#endif
 
-    num_args = 0;
-    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
-	++num_args;
+    image->reader = open_image_reading(filename);
+    if (image->reader == NULL)
+    {
+	g_free(image);
+	return NULL;
+    }
 
-    arg_indent = strlen("filter") + strlen(decl->name) + 3;
+    image->width = image->reader->width;
+    image->height = image->reader->height;
+    image->filename = g_strdup(filename);
+    image->num_strips = (image->height + INPUT_STRIP_ROWS - 1) / INPUT_STRIP_ROWS;
+    image->strips = g_new0(input_strip_t*, image->num_strips);
+    image->decode_mutex = g_mutex_new();
 
-    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
-    {
-	static struct { int num; const char *name; } types[] =
-	    { { ARG_TYPE_INT, "int" },
-	      { ARG_TYPE_FLOAT, "float" },
-	      { ARG_TYPE_COLOR, "color" },
-	      { ARG_TYPE_GRADIENT, "gradient" },
-	      { ARG_TYPE_CURVE, "curve" },
-	      { ARG_TYPE_IMAGE, "image" },
-	      { 0, NULL } };
+    require_cache_frame(image);
 
-	int i;
+    return image;
+}
 
-	for (i = 0; types[i].name != NULL; ++i)
-	    if (types[i].num == arg->type)
-		break;
-	g_assert(types[i].name != NULL);
+#ifdef MOVIES
+static input_image_t*
+open_input_movie (const char *filename)
+{
+    quicktime_t *movie = quicktime_open((char*)filename, 1, 0);
+    input_image_t *image;
 
-	fprintf(out, "%s <b>%s</b>", types[i].name, arg->name);
+    if (movie == NULL)
+	return NULL;
+    if (quicktime_video_tracks(movie) < 1 || quicktime_video_depth(movie, 0) != 24
+	|| quicktime_video_length(movie, 0) < 1)
+    {
+	quicktime_close(movie);
+	return NULL;
+    }
 
-	switch (arg->type)
-	{
-	    case ARG_TYPE_INT :
-		if (arg->v.integer.have_limits)
-		    fprintf(out, ": %d - %d", arg->v.integer.min, arg->v.integer.max);
-		break;
+    image = g_new0(input_image_t, 1);
+    image->refcount = 1;
+    image->movie = movie;
+    image->width = quicktime_video_width(movie, 0);
+    image->height = quicktime_video_height(movie, 0);
+    image->filename = g_strdup(filename);
+    image->num_frames = quicktime_video_length(movie, 0);
+    image->num_strips = (image->height + INPUT_STRIP_ROWS - 1) / INPUT_STRIP_ROWS;
+    image->strips = g_new0(input_strip_t*, image->num_strips * image->num_frames);
+    image->decode_mutex = g_mutex_new();
 
-	    case ARG_TYPE_FLOAT :
-		if (arg->v.floating.have_limits)
-		    fprintf(out, ": %g - %g", arg->v.floating.min, arg->v.floating.max);
-		break;
+    require_cache_frame(image);
 
-	    default :
-		break;
-	}
+    return image;
+}
+#endif
 
-	if (arg->next != NULL)
-	{
-	    if (num_args > 2)
-	    {
-		int i;
+/* must only be called when no render is using the image */
+static void
+free_input_image (input_image_t *image)
+{
+#ifndef __MINGW32__
+    if (image->map != NULL)
+    {
+	munmap(image->map, image->map_length);
+	g_free(image);
+	return;
+    }
+#endif
 
-		fprintf(out, ",\n<br>");
+    g_static_mutex_lock(&cache_mutex);
+    if (resident_strips != NULL)
+    {
+	int i = 0;
 
-		for (i = 0; i < arg_indent; ++i)
-		    fprintf(out, "&nbsp;");
+	while (i < resident_strips->len)
+	{
+	    input_strip_t *strip = g_ptr_array_index(resident_strips, i);
+
+	    if (strip->image == image)
+	    {
+		g_ptr_array_remove_index_fast(resident_strips, i);
+		cache_bytes -= strip_bytes(image, strip->index);
+		free_strip(strip);
 	    }
 	    else
-		fprintf(out, ", ");
+		++i;
+	}
+    }
+    g_static_mutex_unlock(&cache_mutex);
+
+    if (image->reader != NULL)
+	free_image_reader(image->reader);
+#ifdef MOVIES
+    if (image->movie != NULL)
+	quicktime_close(image->movie);
+#endif
+    g_mutex_free(image->decode_mutex);
+    g_free(image->strips);
+    g_free(image->filename);
+    g_free(image);
+}
+
+static void
+release_input_image (input_image_t *image)
+{
+    if (g_atomic_int_dec_and_test(&image->refcount))
+	free_input_image(image);
+}
+
+/* A resident image is only used again if its file hasn't changed. */
+typedef struct
+{
+    char *filename;
+    time_t mtime;
+    off_t size;
+    input_image_t *image;
+} resident_image_t;
+
+static GStaticMutex resident_images_mutex = G_STATIC_MUTEX_INIT;
+/* most recently used first */
+static GList *resident_images = NULL;
+/* only the server keeps images resident */
+static int max_resident_images = 0;
+
+static void
+free_resident_image (resident_image_t *resident)
+{
+    release_input_image(resident->image);
+    g_free(resident->filename);
+    g_free(resident);
+}
+
+/* Returns a reference to the image in the file, or NULL if it can't
+   be read. */
+static input_image_t*
+acquire_input_image (const char *filename)
+{
+    struct stat buf;
+    resident_image_t *resident = NULL;
+    input_image_t *image;
+    GList *list;
+
+    if (max_resident_images == 0 || g_stat(filename, &buf) != 0)
+	return open_input_image(filename);
+
+    g_static_mutex_lock(&resident_images_mutex);
+
+    for (list = resident_images; list != NULL; list = list->next)
+    {
+	resident = list->data;
+	if (strcmp(resident->filename, filename) == 0)
+	    break;
+    }
+
+    if (list != NULL)
+    {
+	resident_images = g_list_remove_link(resident_images, list);
+
+	if (resident->mtime == buf.st_mtime && resident->size == buf.st_size)
+	{
+	    resident_images = g_list_concat(list, resident_images);
+
+	    image = resident->image;
+	    g_atomic_int_inc(&image->refcount);
+
+	    g_static_mutex_unlock(&resident_images_mutex);
+
+	    return image;
+	}
+
+	free_resident_image(resident);
+	g_list_free_1(list);
+    }
+
+    image = open_input_image(filename);
+    if (image != NULL)
+    {
+	resident = g_new0(resident_image_t, 1);
+	resident->filename = g_strdup(filename);
+	resident->mtime = buf.st_mtime;
+	resident->size = buf.st_size;
+	resident->image = image;
+	g_atomic_int_inc(&image->refcount);
+
+	resident_images = g_list_prepend(resident_images, resident);
+
+	while (g_list_length(resident_images) > max_resident_images)
+	{
+	    list = g_list_last(resident_images);
+	    free_resident_image(list->data);
+	    resident_images = g_list_delete_link(resident_images, list);
+	}
+    }
+
+    g_static_mutex_unlock(&resident_images_mutex);
+
+    return image;
+}
+
+/* Returns NULL if there are too many drawables. */
+static input_drawable_t*
+make_cmdline_image_input_drawable (input_image_t *image, const char *filename)
+{
+    input_drawable_t *drawable;
+    int kind = INPUT_DRAWABLE_CMDLINE_IMAGE;
+
+#ifdef MOVIES
+    if (image->movie != NULL)
+	kind = INPUT_DRAWABLE_CMDLINE_MOVIE;
+#endif
+
+    /* another thread might copy it as its default drawable */
+    lock_input_drawables();
+
+    drawable = alloc_input_drawable(kind, image->width, image->height);
+    if (drawable != NULL)
+    {
+	drawable->v.cmdline.input_image = image;
+	drawable->v.cmdline.num_frames = image->num_frames;
+	drawable->v.cmdline.image_filename = strdup(filename);
+    }
+
+    unlock_input_drawables();
+
+    return drawable;
+}
+
+color_t
+cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+{
+    input_image_t *image;
+    input_strip_t *strip;
+    guchar *p;
+    int index;
+
+    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE
+	     || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+
+    if (frame < 0 || frame >= drawable->v.cmdline.num_frames)
+	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+
+    image = drawable->v.cmdline.input_image;
+
+    if (image->map != NULL)
+    {
+	p = image->pixels + (long)image->bpp * ((long)image->width * y + x);
+	return MAKE_RGBA_COLOR(p[0], p[1], p[2], image->bpp == 4 ? p[3] : 255);
+    }
+
+    index = frame * image->num_strips + y / INPUT_STRIP_ROWS;
+    strip = g_atomic_pointer_get((gpointer*)&image->strips[index]);
+
+    if (strip == NULL)
+	strip = decode_strip(image, index);
+    else if (!strip->referenced)
+	strip->referenced = TRUE;
+
+    p = strip->data + 3 * (image->width * (y % INPUT_STRIP_ROWS) + x);
+
+    return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
+}
+
+input_drawable_t*
+alloc_cmdline_image_input_drawable (const char *filename)
+{
+    input_image_t *image;
+    input_drawable_t *drawable;
+
+    image = acquire_input_image(filename);
+    if (image == NULL)
+    {
+	fprintf(stderr, _("Error: Cannot read input image `%s'.\n"), filename);
+	exit(1);
+    }
+
+    drawable = make_cmdline_image_input_drawable(image, filename);
+    g_assert(drawable != NULL);
+
+    return drawable;
+}
+
+/* The copy shares the decoded image.  Returns NULL if there are too
+   many drawables. */
+input_drawable_t*
+copy_cmdline_image_input_drawable (input_drawable_t *drawable)
+{
+    input_image_t *image = drawable->v.cmdline.input_image;
+    input_drawable_t *copy;
+
+    g_atomic_int_inc(&image->refcount);
+
+    copy = make_cmdline_image_input_drawable(image, drawable->v.cmdline.image_filename);
+    if (copy == NULL)
+	release_input_image(image);
+
+    return copy;
+}
+
+void
+free_cmdline_input_image (input_drawable_t *drawable)
+{
+    release_input_image(drawable->v.cmdline.input_image);
+    drawable->v.cmdline.input_image = NULL;
+}
+
+#ifdef MOVIES
+input_drawable_t*
+alloc_cmdline_movie_input_drawable (const char *filename)
+{
+    input_image_t *image;
+    input_drawable_t *drawable;
+
+    image = open_input_movie(filename);
+    if (image == NULL)
+    {
+	fprintf(stderr, _("Error: Cannot read input movie `%s'.\n"), filename);
+	exit(1);
+    }
+
+    drawable = make_cmdline_image_input_drawable(image, filename);
+    g_assert(drawable != NULL);
+
+    return drawable;
+}
+#endif
+
+static int
+parse_image_size (char *str, int *width, int *height)
+{
+    char *x, *endptr;
+
+    str = strdup(str);
+    assert(str != 0);
+
+    x = strchr(str, 'x');
+    if (x == 0)
+	return 0;
+
+    *(x++) = '\0';
+
+    if (strlen(str) <= 0 || strlen(x) <= 0)
+	return 0;
+
+    *width = strtol(str, &endptr, 10);
+    if (*endptr != '\0')
+	return 0;
+
+    *height = strtol(x, &endptr, 10);
+    if (*endptr != '\0')
+	return 0;
+
+    free(str);
+
+    return 1;
+}
+
+static gboolean
+is_ident_char (char c)
+{
+    if (isalnum(c))
+	return TRUE;
+    return c == '_';
+}
+
+static gboolean
+print_html_char (FILE *out, char c)
+{
+    /* FIXME: Implement properly */
+    if (putc(c, out) == EOF)
+	return FALSE;
+    return TRUE;
+}
+
+static gboolean
+write_filter_html_doc (FILE *out, top_level_decl_t *decl)
+{
+    arg_decl_t *arg;
+    int num_args;
+    int arg_indent;
+
+    g_assert(decl->type == TOP_LEVEL_FILTER);
+
+    fprintf(out, "<p><a name=\"filter_%s\"></a><font size=\"+1\"><tt>filter <b>%s</b> (",
+	    decl->name, decl->name);
+
+    num_args = 0;
+    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
+	++num_args;
+
+    arg_indent = strlen("filter") + strlen(decl->name) + 3;
+
+    for (arg = decl->v.filter.args; arg != NULL; arg = arg->next)
+    {
+	static struct { int num; const char *name; } types[] =
+	    { { ARG_TYPE_INT, "int" },
+	      { ARG_TYPE_FLOAT, "float" },
+	      { ARG_TYPE_COLOR, "color" },
+	      { ARG_TYPE_GRADIENT, "gradient" },
+	      { ARG_TYPE_CURVE, "curve" },
+	      { ARG_TYPE_IMAGE, "image" },
+	      { 0, NULL } };
+
+	int i;
+
+	for (i = 0; types[i].name != NULL; ++i)
+	    if (types[i].num == arg->type)
+		break;
+	g_assert(types[i].name != NULL);
+
+	fprintf(out, "%s <b>%s</b>", types[i].name, arg->name);
+
+	switch (arg->type)
+	{
+	    case ARG_TYPE_INT :
+		if (arg->v.integer.have_limits)
+		    fprintf(out, ": %d - %d", arg->v.integer.min, arg->v.integer.max);
+		break;
+
+	    case ARG_TYPE_FLOAT :
+		if (arg->v.floating.have_limits)
+		    fprintf(out, ": %g - %g", arg->v.floating.min, arg->v.floating.max);
+		break;
+
+	    default :
+		break;
+	}
+
+	if (arg->next != NULL)
+	{
+	    if (num_args > 2)
+	    {
+		int i;
+
+		fprintf(out, ",\n<br>");
+
+		for (i = 0; i < arg_indent; ++i)
+		    fprintf(out, "&nbsp;");
+	    }
+	    else
+		fprintf(out, ", ");
 	}
     }
 
@@ -373,51 +1055,1049 @@ write_filter_html_doc (FILE *out, top_level_decl_t *decl)
 		    bold_mode = FALSE;
 		}
 
-		if (!print_html_char(out, *p))
-		    return FALSE;
-	    }
+		if (!print_html_char(out, *p))
+		    return FALSE;
+	    }
+	}
+	fprintf(out, "</blockquote>\n");
+    }
+
+    return TRUE;
+}
+
+static void
+append_define (const char *str, define_t **defines)
+{
+    define_t *define = g_new0(define_t, 1);
+    const char *p;
+
+    p = strchr(str, '=');
+    if (p == NULL)
+    {
+	fprintf(stderr, _("Error: Option to -D is malformed: `%s'.\n"), str);
+	exit(1);
+    }
+
+    define->name = malloc(p - str + 1);
+    memcpy(define->name, str, p - str);
+    define->name[p - str] = '\0';
+
+    define->value = strdup(p + 1);
+
+    define->next = *defines;
+    *defines = define;
+}
+
+static define_t*
+lookup_define (define_t *defines, const char *name)
+{
+    while (defines != NULL)
+    {
+	if (strcmp(name, defines->name) == 0)
+	    return defines;
+
+	defines = defines->next;
+    }
+
+    return NULL;
+}
+
+/* Gets the size of the first input image of the mathmap's main
+   filter.  Returns FALSE and sets error_string if there is none. */
+static gboolean
+get_size_from_input_images (mathmap_t *mathmap, define_t *defines, int *width, int *height)
+{
+    userval_info_t *userval_info;
+
+    for (userval_info = mathmap->main_filter->userval_infos;
+	 userval_info != NULL;
+	 userval_info = userval_info->next)
+    {
+	define_t *define;
+	input_image_t *image;
+
+	if (userval_info->type != USERVAL_IMAGE)
+	    continue;
+
+	define = lookup_define(defines, userval_info->name);
+	if (define == NULL)
+	{
+	    sprintf(error_string, _("No value defined for input image `%s'."), userval_info->name);
+	    return FALSE;
+	}
+
+	/* this only reads the header */
+	image = acquire_input_image(define->value);
+	if (image == NULL)
+	{
+	    g_snprintf(error_string, ERROR_STRING_LENGTH, _("Could not read input image `%s'."), define->value);
+	    return FALSE;
+	}
+	*width = image->width;
+	*height = image->height;
+	release_input_image(image);
+
+	return TRUE;
+    }
+
+    sprintf(error_string, _("Image size not set and no input images given."));
+    return FALSE;
+}
+
+/* Sets the invocation's user values to the defined values and
+   returns the number of input images.  Returns -1 and sets
+   error_string on failure. */
+static int
+set_uservals_from_defines (mathmap_invocation_t *invocation, define_t *defines)
+{
+    userval_info_t *userval_info;
+    int num_input_drawables = 0;
+
+    for (userval_info = invocation->mathmap->main_filter->userval_infos;
+	 userval_info != NULL;
+	 userval_info = userval_info->next)
+    {
+	userval_t *userval = &invocation->uservals[userval_info->index];
+	define_t *define = lookup_define(defines, userval_info->name);
+	input_image_t *image;
+	input_drawable_t *drawable;
+
+	if (define == NULL)
+	{
+	    if (userval_info->type == USERVAL_IMAGE)
+	    {
+		sprintf(error_string, _("No value defined for input image `%s'."), userval_info->name);
+		return -1;
+	    }
+	}
+	else
+	    switch (userval_info->type)
+	    {
+		case USERVAL_INT_CONST :
+		    userval->v.int_const = atoi(define->value);
+		    break;
+
+		case USERVAL_FLOAT_CONST :
+		    userval->v.float_const = g_ascii_strtod(define->value, NULL);
+		    break;
+
+		case USERVAL_BOOL_CONST :
+		    userval->v.bool_const = (float)atoi(define->value);
+		    break;
+
+		case USERVAL_IMAGE :
+		    image = acquire_input_image(define->value);
+		    if (image == NULL)
+		    {
+			g_snprintf(error_string, ERROR_STRING_LENGTH, _("Cannot read input image `%s'."), define->value);
+			return -1;
+		    }
+		    drawable = make_cmdline_image_input_drawable(image, define->value);
+		    if (drawable == NULL)
+		    {
+			release_input_image(image);
+			sprintf(error_string, _("Too many input images."));
+			return -1;
+		    }
+		    assign_image_userval_drawable(userval_info, userval, drawable);
+		    ++num_input_drawables;
+		    break;
+
+		default :
+		    sprintf(error_string, _("Can only define user values for types int, float, bool and image."));
+		    return -1;
+	    }
+    }
+
+    return num_input_drawables;
+}
+
+#define DEFAULT_BAND_ROWS	256
+
+/* Renders frame in bands of band_rows rows and writes each band to
+   writer as soon as it's finished.  The next band is already being
+   rendered while a band is written, so the writer's compression
+   overlaps with rendering, and only two bands are ever kept in
+   memory.  Input strips evicted while rendering a band are freed
+   after it.  The render times of all bands are added up in
+   thread_times, if it's not NULL. */
+static void
+render_and_write_bands (mathmap_frame_t *frame, image_t *closure, int width, int height,
+			int band_rows, int num_threads, image_writer_t *writer, double *thread_times)
+{
+    int row_stride = frame->invocation->row_stride;
+    guchar *bands[2];
+    double band_times[num_threads];
+    int y, i, band, prev_rows, epoch;
+
+    bands[0] = (guchar*)malloc((long)row_stride * (long)band_rows);
+    bands[1] = (guchar*)malloc((long)row_stride * (long)band_rows);
+    assert(bands[0] != NULL && bands[1] != NULL);
+
+    if (thread_times != NULL)
+	for (i = 0; i < num_threads; ++i)
+	    thread_times[i] = 0.0;
+
+    prev_rows = 0;
+    for (y = 0, band = 0; y < height; y += band_rows, band ^= 1)
+    {
+	int rows = MIN(band_rows, height - y);
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+	gpointer call;
+
+	epoch = begin_input_render();
+	call = call_invocation_parallel(frame, closure, 0, y, width, rows, bands[band], num_threads);
+
+	if (prev_rows > 0)
+	    write_lines(writer, bands[band ^ 1], prev_rows);
+
+	join_invocation_call_with_times(call, band_times);
+	end_input_render(epoch);
+#else
+	if (prev_rows > 0)
+	    write_lines(writer, bands[band ^ 1], prev_rows);
+
+	epoch = begin_input_render();
+	call_invocation_parallel_and_join_timed(frame, closure, 0, y, width, rows, bands[band],
+						num_threads, band_times);
+	end_input_render(epoch);
+#endif
+
+	if (thread_times != NULL)
+	    for (i = 0; i < num_threads; ++i)
+		thread_times[i] += band_times[i];
+
+	prev_rows = rows;
+    }
+
+    if (prev_rows > 0)
+	write_lines(writer, bands[band ^ 1], prev_rows);
+
+    free(bands[0]);
+    free(bands[1]);
+}
+
+/*
+ * Animations written as a sequence of image files are rendered with
+ * up to frame_jobs frames in flight at once, each of them rendered by
+ * all threads.  Finished frames are put into a queue from which
+ * frame_jobs encoder threads write them, so at most 2 * frame_jobs
+ * frame buffers exist at any time.  Frames are written to a temporary
+ * file which is then renamed, so a file that exists is complete,
+ * which is what --resume relies on.
+ */
+#define DEFAULT_FRAME_JOBS	2
+
+typedef struct
+{
+    int frame_num;
+    guchar *output;
+    image_t *closure;
+    mathmap_frame_t *frame;
+    int epoch;
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    gpointer call;
+#endif
+} sequence_frame_t;
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    const char *output_pattern;
+    gboolean write_files;
+
+    GAsyncQueue *queue;
+    GMutex *mutex;
+    GCond *cond;
+    int num_buffers;
+    gboolean failed;
+} sequence_t;
+
+/* Checks that pattern has exactly one integer conversion. */
+static gboolean
+is_valid_output_pattern (const char *pattern)
+{
+    int num_conversions = 0;
+    const char *p;
+
+    for (p = pattern; *p != '\0'; ++p)
+    {
+	if (*p != '%')
+	    continue;
+	if (p[1] == '%')
+	{
+	    ++p;
+	    continue;
+	}
+
+	do
+	    ++p;
+	while (*p != '\0' && strchr("0123456789-+ #", *p) != NULL);
+
+	if (*p != 'd' && *p != 'i')
+	    return FALSE;
+	++num_conversions;
+    }
+
+    return num_conversions == 1;
+}
+
+static char*
+sequence_frame_filename (const char *pattern, int frame_num)
+{
+    return g_strdup_printf(pattern, frame_num);
+}
+
+static gboolean
+write_sequence_frame (sequence_t *seq, sequence_frame_t *f)
+{
+    mathmap_invocation_t *invocation = seq->invocation;
+    char *filename = sequence_frame_filename(seq->output_pattern, f->frame_num);
+    char *dirname = g_path_get_dirname(filename);
+    char *basename = g_path_get_basename(filename);
+    /* keep the extension, which determines the format */
+    char *tmp_basename = g_strdup_printf(".partial-%s", basename);
+    char *tmp_filename = g_build_filename(dirname, tmp_basename, NULL);
+    image_writer_t *writer;
+    gboolean success = FALSE;
+
+    writer = open_image_writing(tmp_filename, invocation->img_width, invocation->img_height,
+				invocation->output_bpp, invocation->row_stride, IMAGE_FORMAT_AUTO);
+    if (writer == NULL)
+	fprintf(stderr, _("Error: Cannot write frame to file `%s'.\n"), tmp_filename);
+    else
+    {
+	write_lines(writer, f->output, invocation->img_height);
+	free_image_writer(writer);
+
+	if (g_rename(tmp_filename, filename) != 0)
+	    fprintf(stderr, _("Error: Cannot rename `%s' to `%s': %s\n"),
+		    tmp_filename, filename, strerror(errno));
+	else
+	    success = TRUE;
+    }
+
+    g_free(tmp_filename);
+    g_free(tmp_basename);
+    g_free(basename);
+    g_free(dirname);
+    g_free(filename);
+
+    return success;
+}
+
+static gpointer
+sequence_encoder_thread (gpointer data)
+{
+    sequence_t *seq = data;
+
+    for (;;)
+    {
+	sequence_frame_t *f = g_async_queue_pop(seq->queue);
+	gboolean success;
+
+	if (f->frame_num < 0)
+	{
+	    g_free(f);
+	    break;
+	}
+
+	success = !seq->write_files || write_sequence_frame(seq, f);
+
+	free(f->output);
+	g_free(f);
+
+	g_mutex_lock(seq->mutex);
+	if (!success)
+	    seq->failed = TRUE;
+	--seq->num_buffers;
+	g_cond_signal(seq->cond);
+	g_mutex_unlock(seq->mutex);
+    }
+
+    return NULL;
+}
+
+static sequence_frame_t*
+start_sequence_frame (sequence_t *seq, int frame_num, int num_frames, int num_threads)
+{
+    mathmap_invocation_t *invocation = seq->invocation;
+    sequence_frame_t *f = g_new0(sequence_frame_t, 1);
+
+    f->frame_num = frame_num;
+    f->output = (guchar*)malloc((long)invocation->row_stride * (long)invocation->img_height);
+    assert(f->output != NULL);
+
+    f->epoch = begin_input_render();
+    f->closure = closure_image_alloc(&invocation->mathfuncs,
+				     NULL,
+				     invocation->mathmap->main_filter->num_uservals,
+				     invocation->uservals,
+				     invocation->img_width, invocation->img_height);
+    f->frame = invocation_new_frame(invocation, f->closure, frame_num, (float)frame_num / (float)num_frames);
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    f->call = call_invocation_parallel(f->frame, f->closure, 0, 0, invocation->img_width, invocation->img_height,
+				       f->output, num_threads);
+#else
+    call_invocation_parallel_and_join(f->frame, f->closure, 0, 0, invocation->img_width, invocation->img_height,
+				      f->output, num_threads);
+#endif
+
+    return f;
+}
+
+/* Waits until the frame is rendered and hands it to the encoders. */
+static void
+finish_sequence_frame (sequence_t *seq, sequence_frame_t *f)
+{
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+    join_invocation_call(f->call);
+#endif
+
+    invocation_free_frame(f->frame);
+    closure_image_free(f->closure);
+    end_input_render(f->epoch);
+
+    g_async_queue_push(seq->queue, f);
+}
+
+/* Renders the frames first_frame to last_frame, inclusive, of an
+   animation of num_frames frames and writes them to the files named
+   by output_pattern.  Returns the number of pixels rendered, or -1 if
+   a frame could not be written. */
+static long
+render_frame_sequence (mathmap_invocation_t *invocation, int num_frames, int first_frame, int last_frame,
+		       const char *output_pattern, gboolean resume, gboolean write_files,
+		       int frame_jobs, int num_threads)
+{
+    sequence_t seq;
+    GQueue *in_flight = g_queue_new();
+    GThread *encoders[frame_jobs];
+    long num_pixels = 0;
+    int i, frame_num;
+
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    memset(&seq, 0, sizeof(sequence_t));
+    seq.invocation = invocation;
+    seq.output_pattern = output_pattern;
+    seq.write_files = write_files;
+    seq.queue = g_async_queue_new();
+    seq.mutex = g_mutex_new();
+    seq.cond = g_cond_new();
+
+    for (i = 0; i < frame_jobs; ++i)
+    {
+	encoders[i] = g_thread_create(sequence_encoder_thread, &seq, TRUE, NULL);
+	g_assert(encoders[i] != NULL);
+    }
+
+    for (frame_num = first_frame; frame_num <= last_frame; ++frame_num)
+    {
+	gboolean failed;
+
+	if (resume && write_files)
+	{
+	    char *filename = sequence_frame_filename(output_pattern, frame_num);
+	    gboolean exists = g_file_test(filename, G_FILE_TEST_EXISTS);
+
+	    g_free(filename);
+	    if (exists)
+		continue;
+	}
+
+	if (g_queue_get_length(in_flight) >= frame_jobs)
+	    finish_sequence_frame(&seq, g_queue_pop_head(in_flight));
+
+	g_mutex_lock(seq.mutex);
+	while (seq.num_buffers >= 2 * frame_jobs && !seq.failed)
+	    g_cond_wait(seq.cond, seq.mutex);
+	failed = seq.failed;
+	++seq.num_buffers;
+	g_mutex_unlock(seq.mutex);
+
+	if (failed)
+	    break;
+
+	g_queue_push_tail(in_flight, start_sequence_frame(&seq, frame_num, num_frames, num_threads));
+	num_pixels += (long)invocation->img_width * (long)invocation->img_height;
+    }
+
+    while (!g_queue_is_empty(in_flight))
+	finish_sequence_frame(&seq, g_queue_pop_head(in_flight));
+    g_queue_free(in_flight);
+
+    for (i = 0; i < frame_jobs; ++i)
+    {
+	sequence_frame_t *stop = g_new0(sequence_frame_t, 1);
+
+	stop->frame_num = -1;
+	g_async_queue_push(seq.queue, stop);
+    }
+    for (i = 0; i < frame_jobs; ++i)
+	g_thread_join(encoders[i]);
+
+    g_async_queue_unref(seq.queue);
+    g_mutex_free(seq.mutex);
+    g_cond_free(seq.cond);
+
+    return seq.failed ? -1 : num_pixels;
+}
+
+#ifndef __MINGW32__
+/*
+ * In server mode mathmap listens on a Unix domain socket and keeps
+ * compiled mathmaps and input images around between jobs, so
+ * rendering a script again only costs the rendering.  A client sends
+ * one or more requests over a connection, each of them a sequence of
+ * lines terminated by an empty line:
+ *
+ *   script <length>         followed by exactly <length> bytes
+ *   hash <hash>             use a script sent before
+ *   define <name>=<value>   like -D
+ *   size <width>x<height>   like -s
+ *   output <filename>       the PNG file to write
+ *
+ * Each request is answered with a single line, either
+ *
+ *   ok <hash> compile <s> input <s> render <s> total <s>
+ *
+ * with the times in seconds, or "error <message>".  Each connection
+ * is handled by one of serve_jobs threads, and their renders share
+ * the render pool.
+ *
+ * Requests name files that are read and written with the server's
+ * permissions, so the socket is only accessible to its owner.
+ */
+#define DEFAULT_SERVE_JOBS		4
+#define SERVE_MAX_MATHMAPS		64
+#define SERVE_MAX_INPUT_IMAGES		16
+#define SERVE_MAX_LINE			4096
+#define SERVE_MAX_SCRIPT_LENGTH		(1 << 20)
+
+typedef struct
+{
+    char *hash;
+    mathmap_t *mathmap;
+    volatile gint refcount;
+} served_mathmap_t;
+
+static GStaticMutex served_mathmaps_mutex = G_STATIC_MUTEX_INIT;
+/* most recently used first */
+static GList *served_mathmaps = NULL;
+
+static char **serve_support_paths;
+static int serve_threads;
+
+static void
+release_served_mathmap (served_mathmap_t *served)
+{
+    if (!g_atomic_int_dec_and_test(&served->refcount))
+	return;
+
+    free_mathmap(served->mathmap);
+    g_free(served->hash);
+    g_free(served);
+}
+
+/* Must be called with served_mathmaps_mutex locked.  Moves the
+   mathmap to the front and returns a reference to it, or NULL if it's
+   not there. */
+static served_mathmap_t*
+find_served_mathmap (const char *hash)
+{
+    GList *list;
+    served_mathmap_t *served;
+
+    for (list = served_mathmaps; list != NULL; list = list->next)
+	if (strcmp(((served_mathmap_t*)list->data)->hash, hash) == 0)
+	    break;
+    if (list == NULL)
+	return NULL;
+
+    served_mathmaps = g_list_remove_link(served_mathmaps, list);
+    served_mathmaps = g_list_concat(list, served_mathmaps);
+
+    served = list->data;
+    g_atomic_int_inc(&served->refcount);
+
+    return served;
+}
+
+static served_mathmap_t*
+lookup_served_mathmap (const char *hash)
+{
+    served_mathmap_t *served;
+
+    g_static_mutex_lock(&served_mathmaps_mutex);
+    served = find_served_mathmap(hash);
+    g_static_mutex_unlock(&served_mathmaps_mutex);
+
+    return served;
+}
+
+/* Keeps the mathmap and returns a reference to it.  If another job
+   has compiled the same script in the meantime, the mathmap is freed
+   and that job's is returned instead. */
+static served_mathmap_t*
+add_served_mathmap (const char *hash, mathmap_t *mathmap)
+{
+    served_mathmap_t *served;
+
+    g_static_mutex_lock(&served_mathmaps_mutex);
+
+    served = find_served_mathmap(hash);
+    if (served != NULL)
+    {
+	g_static_mutex_unlock(&served_mathmaps_mutex);
+	free_mathmap(mathmap);
+	return served;
+    }
+
+    served = g_new0(served_mathmap_t, 1);
+    served->hash = g_strdup(hash);
+    served->mathmap = mathmap;
+    /* one for the list, one for the caller */
+    served->refcount = 2;
+
+    served_mathmaps = g_list_prepend(served_mathmaps, served);
+
+    while (g_list_length(served_mathmaps) > SERVE_MAX_MATHMAPS)
+    {
+	GList *list = g_list_last(served_mathmaps);
+
+	release_served_mathmap(list->data);
+	served_mathmaps = g_list_delete_link(served_mathmaps, list);
+    }
+
+    g_static_mutex_unlock(&served_mathmaps_mutex);
+
+    return served;
+}
+
+typedef struct
+{
+    char *script;
+    char *hash;
+    define_t *defines;
+    int width, height;		/* 0 if not given */
+    char *output_filename;
+} serve_request_t;
+
+static void
+free_serve_request (serve_request_t *request)
+{
+    while (request->defines != NULL)
+    {
+	define_t *next = request->defines->next;
+
+	free(request->defines->name);
+	free(request->defines->value);
+	g_free(request->defines);
+
+	request->defines = next;
+    }
+
+    g_free(request->script);
+    g_free(request->hash);
+    g_free(request->output_filename);
+}
+
+/* Returns 1 if a request was read, 0 at the end of the input, and -1,
+   with error_string set, if the request is malformed. */
+static int
+read_serve_request (FILE *in, serve_request_t *request)
+{
+    char line[SERVE_MAX_LINE];
+    gboolean is_empty = TRUE;
+
+    memset(request, 0, sizeof(serve_request_t));
+
+    for (;;)
+    {
+	size_t length;
+	char *arg;
+
+	if (fgets(line, sizeof(line), in) == NULL)
+	{
+	    if (is_empty)
+		return 0;
+	    sprintf(error_string, _("The request isn't terminated by an empty line."));
+	    return -1;
+	}
+
+	length = strlen(line);
+	if (length == 0 || line[length - 1] != '\n')
+	{
+	    sprintf(error_string, _("Request line is too long."));
+	    return -1;
+	}
+	line[--length] = '\0';
+	if (length > 0 && line[length - 1] == '\r')
+	    line[--length] = '\0';
+
+	if (length == 0)
+	{
+	    if (is_empty)
+		continue;
+	    return 1;
+	}
+	is_empty = FALSE;
+
+	arg = strchr(line, ' ');
+	if (arg == NULL)
+	{
+	    g_snprintf(error_string, ERROR_STRING_LENGTH, _("Malformed request line `%s'."), line);
+	    return -1;
+	}
+	*arg++ = '\0';
+
+	if (strcmp(line, "script") == 0)
+	{
+	    long script_length = atol(arg);
+
+	    if (request->script != NULL || script_length <= 0 || script_length > SERVE_MAX_SCRIPT_LENGTH)
+	    {
+		sprintf(error_string, _("Invalid script length."));
+		return -1;
+	    }
+
+	    request->script = g_malloc(script_length + 1);
+	    if (fread(request->script, 1, script_length, in) != (size_t)script_length)
+	    {
+		sprintf(error_string, _("The script is truncated."));
+		return -1;
+	    }
+	    request->script[script_length] = '\0';
+	}
+	else if (strcmp(line, "hash") == 0)
+	{
+	    g_free(request->hash);
+	    request->hash = g_strdup(arg);
+	}
+	else if (strcmp(line, "define") == 0)
+	{
+	    if (strchr(arg, '=') == NULL)
+	    {
+		g_snprintf(error_string, ERROR_STRING_LENGTH, _("Malformed define `%s'."), arg);
+		return -1;
+	    }
+	    append_define(arg, &request->defines);
+	}
+	else if (strcmp(line, "size") == 0)
+	{
+	    if (!parse_image_size(arg, &request->width, &request->height)
+		|| request->width <= 0 || request->height <= 0)
+	    {
+		sprintf(error_string, _("Invalid image size."));
+		return -1;
+	    }
+	}
+	else if (strcmp(line, "output") == 0)
+	{
+	    g_free(request->output_filename);
+	    request->output_filename = g_strdup(arg);
+	}
+	else
+	{
+	    g_snprintf(error_string, ERROR_STRING_LENGTH, _("Unknown request keyword `%s'."), line);
+	    return -1;
+	}
+    }
+}
+
+/* Renders the invocation's first frame to a PNG file, band by band.
+   Returns FALSE and sets error_string if the file can't be written. */
+static gboolean
+render_to_file (mathmap_invocation_t *invocation, const char *filename)
+{
+    int width = invocation->img_width;
+    int height = invocation->img_height;
+    image_writer_t *writer;
+    image_t *closure;
+    mathmap_frame_t *frame;
+    int epoch;
+
+    writer = open_image_writing(filename, width, height, invocation->output_bpp,
+				width * invocation->output_bpp, IMAGE_FORMAT_PNG);
+    if (writer == NULL)
+    {
+	g_snprintf(error_string, ERROR_STRING_LENGTH, _("Cannot open file `%s' for writing."), filename);
+	return FALSE;
+    }
+
+    closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+				  invocation->mathmap->main_filter->num_uservals, invocation->uservals,
+				  width, height);
+    epoch = begin_input_render();
+    frame = invocation_new_frame(invocation, closure, 0, 0.0);
+    end_input_render(epoch);
+
+    render_and_write_bands(frame, closure, width, height, DEFAULT_BAND_ROWS,
+			   invocation->num_threads, writer, NULL);
+
+    invocation_free_frame(frame);
+    closure_image_free(closure);
+    free_image_writer(writer);
+
+    return TRUE;
+}
+
+static char*
+make_error_reply (void)
+{
+    char *reply = g_strdup_printf("error %s", error_string);
+
+    /* the reply must be a single line */
+    g_strdelimit(reply, "\r\n", ' ');
+
+    return reply;
+}
+
+/* Returns the reply line, without the newline. */
+static char*
+run_serve_job (serve_request_t *request)
+{
+    GTimer *timer = g_timer_new();
+    served_mathmap_t *served = NULL;
+    mathmap_invocation_t *invocation = NULL;
+    char *hash = NULL;
+    char *reply = NULL;
+    int width = request->width, height = request->height;
+    double compile_time, input_time, render_time;
+
+    if (request->output_filename == NULL)
+    {
+	sprintf(error_string, _("No output file given."));
+	goto done;
+    }
+
+    if (request->script != NULL)
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, request->script, -1);
+    else if (request->hash != NULL)
+	hash = g_strdup(request->hash);
+    else
+    {
+	sprintf(error_string, _("Neither a script nor a hash given."));
+	goto done;
+    }
+
+    served = lookup_served_mathmap(hash);
+    if (served == NULL)
+    {
+	mathmap_t *mathmap;
+
+	if (request->script == NULL)
+	{
+	    g_snprintf(error_string, ERROR_STRING_LENGTH, _("Unknown script hash `%s'."), hash);
+	    goto done;
+	}
+
+	mathmap = compile_mathmap(request->script, serve_support_paths, DEFAULT_OPTIMIZATION_TIMEOUT, FALSE);
+	if (mathmap == NULL)
+	    goto done;
+
+	served = add_served_mathmap(hash, mathmap);
+    }
+    compile_time = g_timer_elapsed(timer, NULL);
+
+    if (width == 0 && !get_size_from_input_images(served->mathmap, request->defines, &width, &height))
+	goto done;
+
+    invocation = invoke_mathmap(served->mathmap, NULL, width, height, TRUE);
+    invocation->num_threads = serve_threads;
+
+    if (set_uservals_from_defines(invocation, request->defines) < 0)
+	goto done;
+    input_time = g_timer_elapsed(timer, NULL) - compile_time;
+
+    if (!render_to_file(invocation, request->output_filename))
+	goto done;
+    render_time = g_timer_elapsed(timer, NULL) - compile_time - input_time;
+
+    reply = g_strdup_printf("ok %s compile %.6f input %.6f render %.6f total %.6f",
+			    hash, compile_time, input_time, render_time, g_timer_elapsed(timer, NULL));
+
+ done:
+    if (reply == NULL)
+	reply = make_error_reply();
+
+    if (invocation != NULL)
+	free_invocation(invocation);
+    if (served != NULL)
+	release_served_mathmap(served);
+    g_free(hash);
+    g_timer_destroy(timer);
+
+    return reply;
+}
+
+static gboolean
+write_reply (int fd, const char *reply)
+{
+    char *line = g_strconcat(reply, "\n", NULL);
+    size_t length = strlen(line);
+    size_t written = 0;
+
+    while (written < length)
+    {
+	ssize_t result = write(fd, line + written, length - written);
+
+	if (result < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	written += result;
+    }
+
+    g_free(line);
+
+    return written == length;
+}
+
+/* Thread pool function.  data is the connection's file descriptor
+   plus one, because the pool can't take NULL. */
+static void
+serve_connection (gpointer data, gpointer user_data)
+{
+    int fd = GPOINTER_TO_INT(data) - 1;
+    FILE *in = fdopen(fd, "r");
+    serve_request_t request;
+    int result;
+
+    if (in == NULL)
+    {
+	close(fd);
+	return;
+    }
+
+    while ((result = read_serve_request(in, &request)) != 0)
+    {
+	char *reply = result > 0 ? run_serve_job(&request) : make_error_reply();
+	gboolean written = write_reply(fd, reply);
+
+	g_free(reply);
+	free_serve_request(&request);
+
+	/* after a malformed request we can't find the next one */
+	if (result < 0 || !written)
+	    break;
+    }
+
+    fclose(in);
+}
+
+/* Only returns if the server can't run. */
+static int
+serve (const char *socket_path, int num_jobs, int num_threads, char **support_paths)
+{
+    struct sockaddr_un addr;
+    struct stat buf;
+    GThreadPool *pool;
+    int sock;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, _("Error: The socket path `%s' is too long.\n"), socket_path);
+	return 1;
+    }
+
+    serve_support_paths = support_paths;
+    serve_threads = num_threads;
+    max_resident_images = SERVE_MAX_INPUT_IMAGES;
+
+    /* a client going away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    /* A stale socket from an earlier server would make bind() fail,
+       but a socket somebody still answers on isn't stale. */
+    if (g_stat(socket_path, &buf) == 0 && S_ISSOCK(buf.st_mode))
+    {
+	int live = 0;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock >= 0)
+	{
+	    live = connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	    close(sock);
 	}
-	fprintf(out, "</blockquote>\n");
-    }
 
-    return TRUE;
-}
+	if (live)
+	{
+	    fprintf(stderr, _("Error: A server is already listening on `%s'.\n"), socket_path);
+	    return 1;
+	}
 
-static void
-append_define (const char *str, define_t **defines)
-{
-    define_t *define = g_new0(define_t, 1);
-    const char *p;
+	unlink(socket_path);
+    }
 
-    p = strchr(str, '=');
-    if (p == NULL)
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock >= 0)
     {
-	fprintf(stderr, _("Error: Option to -D is malformed: `%s'.\n"), str);
-	exit(1);
-    }
+	/* only our own user may send us requests */
+	mode_t old_umask = umask(0077);
+	int result = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
 
-    define->name = malloc(p - str + 1);
-    memcpy(define->name, str, p - str);
-    define->name[p - str] = '\0';
+	umask(old_umask);
 
-    define->value = strdup(p + 1);
+	if (result != 0 || listen(sock, num_jobs) != 0)
+	{
+	    int error = errno;
 
-    define->next = *defines;
-    *defines = define;
-}
+	    close(sock);
+	    sock = -1;
+	    errno = error;
+	}
+    }
+    if (sock < 0)
+    {
+	fprintf(stderr, _("Error: Cannot listen on socket `%s': %s\n"), socket_path, strerror(errno));
+	return 1;
+    }
 
-static define_t*
-lookup_define (define_t *defines, const char *name)
-{
-    while (defines != NULL)
+    pool = g_thread_pool_new(serve_connection, NULL, num_jobs, FALSE, NULL);
+    g_assert(pool != NULL);
+
+    for (;;)
     {
-	if (strcmp(name, defines->name) == 0)
-	    return defines;
+	int fd = accept(sock, NULL, NULL);
 
-	defines = defines->next;
+	if (fd < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, _("Error: Cannot accept connection: %s\n"), strerror(errno));
+	    break;
+	}
+
+	g_thread_pool_push(pool, GINT_TO_POINTER(fd + 1), NULL);
     }
 
-    return NULL;
+    g_thread_pool_free(pool, FALSE, TRUE);
+    close(sock);
+
+    return 1;
+}
+#endif
+
+static void
+init_support_paths (char *support_paths[4])
+{
+    support_paths[0] = g_strdup_printf("%s/mathmap", GIMPDATADIR);
+    support_paths[1] = g_strdup_printf("%s/.gimp-2.6/mathmap", getenv("HOME"));
+    support_paths[2] = g_strdup_printf("%s/.gimp-2.4/mathmap", getenv("HOME"));
+    support_paths[3] = NULL;
 }
 
 static void
@@ -431,24 +2111,78 @@ usage (void)
 	   "  mathmap [option ...] [<script>] <outfile>\n"
 	   "      transform one or more inputs with <script> and write\n"
 	   "      the result to <outfile>\n"
+	   "  mathmap --frames=NUM --output-pattern=PATTERN [option ...] [<script>]\n"
+	   "      render an animation to a sequence of image files\n"
 	   "  mathmap --htmldoc [<script>] <outfile>\n"
 	   "      outputs HTML documentation for the filters in\n"
 	   "      the script to <outfile>\n"
+#ifndef __MINGW32__
+	   "  mathmap --serve=SOCKET [option ...]\n"
+	   "      render scripts sent to the Unix domain socket SOCKET,\n"
+	   "      keeping them compiled between jobs\n"
+#endif
 	   "Options:\n"
 	   "  -f, --script-file=FILENAME  read script from FILENAME\n"
 	   "  -D<name>=<value>            define user value\n"
 #ifdef MOVIES
 	   "  -M, --movie=FILENAME        input movie FILENAME\n"
-	   "  -F, --frames=NUM            output movie has NUM frames\n"
+#endif
+	   "  -F, --frames=NUM            render an animation of NUM frames\n"
+	   "      --output-pattern=PATTERN\n"
+	   "                              write frame N to the file named by the\n"
+	   "                              printf pattern, e.g. out_%%05d.png, instead\n"
+	   "                              of to <outfile>\n"
+	   "      --frame-range=FIRST-LAST\n"
+	   "                              only render frames FIRST to LAST\n"
+	   "      --frame-jobs=NUM        render NUM frames at once (default %d)\n"
+	   "      --resume                skip frames whose files exist\n"
+#ifndef __MINGW32__
+	   "      --serve-jobs=NUM        with --serve, run NUM jobs at once\n"
+	   "                              (default %d)\n"
 #endif
 	   "  -i, --intersampling         use intersampling\n"
 	   "  -o, --oversampling          use oversampling\n"
 	   "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
-	   "  -c, --cache=NUM             cache NUM input images (default %d)\n"
+	   "  -c, --cache=SIZE            keep at most SIZE megabytes of decoded\n"
+	   "                              input images (default %d), but always\n"
+	   "                              at least the largest input image\n"
+	   "      --filter-cache=SIZE     keep at most SIZE megabytes of native\n"
+	   "                              filter results (default %d)\n"
+	   "  -t, --threads=NUM           render with NUM threads (default %d)\n"
+	   "  -T, --timing                print render times of each thread,\n"
+	   "                              memory pool and filter cache statistics\n"
+	   "      --tile-rows=NUM         render in tiles of NUM rows (default %d)\n"
+	   "      --band-rows=NUM         render and write the output in bands of\n"
+	   "                              NUM rows (default %d, 0 renders the whole\n"
+	   "                              image before writing it)\n"
 	   "  -g, --generator=GEN         generate plug-in code with GEN\n"
+	   "      --cache-dir=DIR         keep compiled filters in DIR\n"
+	   "      --no-module-cache       don't cache compiled filters\n"
+	   "      --no-vectorize          don't generate vectorized pixel code\n"
+	   "      --no-precompiled-prelude\n"
+	   "                              compile the template's prelude with\n"
+	   "                              every filter instead of only once\n"
+	   "      --no-split-tuple-phis   don't split tuple phis into element phis\n"
+	   "      --materialize           render closures that are sampled often\n"
+	   "                              once per frame, which is faster but not\n"
+	   "                              exact\n"
+	   "      --interpreter           render with the interpreter the GIMP\n"
+	   "                              preview uses until the C backend is done\n"
+#ifdef USE_LIBTCC
+	   "      --tcc                   compile filters in memory with libtcc,\n"
+	   "                              which is faster but makes slower code\n"
+#endif
+#ifdef HAVE_FFTW
+	   "      --fft-measure           measure FFT plans instead of estimating\n"
+	   "                              them, keeping the results between runs\n"
+#endif
 	   "\n"
 	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
-	   cache_size);
+	   DEFAULT_FRAME_JOBS,
+#ifndef __MINGW32__
+	   DEFAULT_SERVE_JOBS,
+#endif
+	   DEFAULT_CACHE_MEGABYTES, DEFAULT_NATIVE_FILTER_CACHE_MEGABYTES, get_num_cpus(), DEFAULT_TILE_ROWS, DEFAULT_BAND_ROWS);
 }
 
 #define OPTION_VERSION				256
@@ -459,21 +2193,41 @@ usage (void)
 #define OPTION_BENCH_NO_COMPILE_TIME_LIMIT	261
 #define OPTION_BENCH_NO_BACKEND			262
 #define OPTION_BENCH_RENDER_COUNT		263
+#define OPTION_CACHE_DIR			264
+#define OPTION_NO_MODULE_CACHE			265
+#define OPTION_TILE_ROWS			266
+#define OPTION_NO_VECTORIZE			267
+#define OPTION_BENCH_TIMING			268
+#define OPTION_NO_SPLIT_TUPLE_PHIS		269
+#define OPTION_MATERIALIZE			270
+#define OPTION_FFT_MEASURE			271
+#define OPTION_BAND_ROWS			272
+#define OPTION_OUTPUT_PATTERN			273
+#define OPTION_FRAME_RANGE			274
+#define OPTION_FRAME_JOBS			275
+#define OPTION_RESUME				276
+#define OPTION_FILTER_CACHE			277
+#define OPTION_INTERPRETER			278
+#define OPTION_TCC				279
+#define OPTION_NO_PRECOMPILED_PRELUDE		280
+#define OPTION_SERVE				281
+#define OPTION_SERVE_JOBS			282
 
 int
 cmdline_main (int argc, char *argv[])
 {
     guchar *output;
+    image_writer_t *writer;
+    gboolean stream_bands;
     int num_frames = 1;
-#ifdef MOVIES
     int generate_movie = 0;
+#ifdef MOVIES
     quicktime_t *output_movie;
     guchar **rows;
 #endif
     int antialiasing = 0, supersampling = 0;
     int img_width, img_height;
     char *generator = 0;
-    userval_info_t *userval_info;
     int num_input_drawables = 0;
     gboolean size_is_set = FALSE;
     char *script = NULL;
@@ -484,7 +2238,21 @@ cmdline_main (int argc, char *argv[])
     int render_num;
     gboolean bench_no_output = FALSE;
     gboolean bench_no_backend = FALSE;
+    gboolean bench_timing = FALSE;
+    long num_pixels_rendered = 0;
     int compile_time_limit = DEFAULT_OPTIMIZATION_TIMEOUT;
+    int num_threads = get_num_cpus();
+    int tile_rows = 0;
+    int band_rows = DEFAULT_BAND_ROWS;
+    const char *output_pattern = NULL;
+    int first_frame = -1, last_frame = -1;
+    int frame_jobs = DEFAULT_FRAME_JOBS;
+    gboolean resume = FALSE;
+    gboolean print_timing = FALSE;
+#ifndef __MINGW32__
+    const char *serve_socket = NULL;
+    int serve_jobs = DEFAULT_SERVE_JOBS;
+#endif
 
     for (;;)
     {
@@ -495,17 +2263,44 @@ cmdline_main (int argc, char *argv[])
 		{ "intersampling", no_argument, 0, 'i' },
 		{ "oversampling", no_argument, 0, 'o' },
 		{ "cache", required_argument, 0, 'c' },
+		{ "threads", required_argument, 0, 't' },
+		{ "timing", no_argument, 0, 'T' },
+		{ "tile-rows", required_argument, 0, OPTION_TILE_ROWS },
+		{ "band-rows", required_argument, 0, OPTION_BAND_ROWS },
 		{ "generator", required_argument, 0, 'g' },
 		{ "size", required_argument, 0, 's' },
 		{ "script-file", required_argument, 0, 'f' },
 		{ "htmldoc", no_argument, 0, OPTION_HTMLDOC },
+		{ "cache-dir", required_argument, 0, OPTION_CACHE_DIR },
+		{ "no-module-cache", no_argument, 0, OPTION_NO_MODULE_CACHE },
+		{ "no-vectorize", no_argument, 0, OPTION_NO_VECTORIZE },
+		{ "no-precompiled-prelude", no_argument, 0, OPTION_NO_PRECOMPILED_PRELUDE },
+		{ "no-split-tuple-phis", no_argument, 0, OPTION_NO_SPLIT_TUPLE_PHIS },
+		{ "materialize", no_argument, 0, OPTION_MATERIALIZE },
+		{ "interpreter", no_argument, 0, OPTION_INTERPRETER },
+#ifdef USE_LIBTCC
+		{ "tcc", no_argument, 0, OPTION_TCC },
+#endif
+#ifdef HAVE_FFTW
+		{ "fft-measure", no_argument, 0, OPTION_FFT_MEASURE },
+#endif
 		{ "bench-no-output", no_argument, 0, OPTION_BENCH_NO_OUTPUT },
 		{ "bench-only-compile", no_argument, 0, OPTION_BENCH_ONLY_COMPILE },
 		{ "bench-no-compile-time-limit", no_argument, 0, OPTION_BENCH_NO_COMPILE_TIME_LIMIT },
 		{ "bench-no-backend", no_argument, 0, OPTION_BENCH_NO_BACKEND },
 		{ "bench-render-count", required_argument, 0, OPTION_BENCH_RENDER_COUNT },
-#ifdef MOVIES
+		{ "bench-timing", no_argument, 0, OPTION_BENCH_TIMING },
 		{ "frames", required_argument, 0, 'F' },
+		{ "output-pattern", required_argument, 0, OPTION_OUTPUT_PATTERN },
+		{ "frame-range", required_argument, 0, OPTION_FRAME_RANGE },
+		{ "frame-jobs", required_argument, 0, OPTION_FRAME_JOBS },
+		{ "resume", no_argument, 0, OPTION_RESUME },
+		{ "filter-cache", required_argument, 0, OPTION_FILTER_CACHE },
+#ifndef __MINGW32__
+		{ "serve", required_argument, 0, OPTION_SERVE },
+		{ "serve-jobs", required_argument, 0, OPTION_SERVE_JOBS },
+#endif
+#ifdef MOVIES
 		{ "movie", required_argument, 0, 'M' },
 #endif
 		{ 0, 0, 0, 0 }
@@ -515,9 +2310,9 @@ cmdline_main (int argc, char *argv[])
 
 	option = getopt_long(argc, argv, 
 #ifdef MOVIES
-			     "f:ioF:D:M:c:g:s:", 
+			     "f:ioF:D:M:c:t:Tg:s:", 
 #else
-			     "f:ioD:c:g:s:",
+			     "f:ioF:D:c:t:Tg:s:",
 #endif
 			     long_options, &option_index);
 
@@ -571,8 +2366,43 @@ cmdline_main (int argc, char *argv[])
 		break;
 
 	    case 'c' :
-		cache_size = atoi(optarg);
-		assert(cache_size > 0);
+		cache_budget = (long)atoi(optarg) << 20;
+		if (cache_budget <= 0)
+		{
+		    fprintf(stderr, _("Error: The input cache size must be positive.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case 't' :
+		num_threads = atoi(optarg);
+		if (num_threads <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of threads must be positive.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case 'T' :
+		print_timing = TRUE;
+		break;
+
+	    case OPTION_TILE_ROWS :
+		tile_rows = atoi(optarg);
+		if (tile_rows <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of tile rows must be positive.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case OPTION_BAND_ROWS :
+		band_rows = atoi(optarg);
+		if (band_rows < 0)
+		{
+		    fprintf(stderr, _("Error: The number of band rows must not be negative.\n"));
+		    exit(1);
+		}
 		break;
 
 	    case 'D' :
@@ -596,6 +2426,57 @@ cmdline_main (int argc, char *argv[])
 		size_is_set = 1;
 		break;
 
+	    case OPTION_CACHE_DIR :
+		module_cache_set_directory(optarg);
+		break;
+
+	    case OPTION_NO_MODULE_CACHE :
+		module_cache_set_enabled(FALSE);
+		break;
+
+	    case OPTION_NO_VECTORIZE :
+		cc_set_vectorize(FALSE);
+		break;
+
+	    case OPTION_NO_PRECOMPILED_PRELUDE :
+		cc_set_precompiled_prelude(FALSE);
+		break;
+
+	    case OPTION_NO_SPLIT_TUPLE_PHIS :
+		compiler_set_tuple_phi_splitting(FALSE);
+		break;
+
+	    case OPTION_MATERIALIZE :
+		compiler_set_materialize_closures(TRUE);
+		break;
+
+	    case OPTION_INTERPRETER :
+		/* a cached module would be used instead */
+		module_cache_set_enabled(FALSE);
+		compiler_set_background_backend(TRUE);
+		break;
+
+#ifdef USE_LIBTCC
+	    case OPTION_TCC :
+		compiler_set_tcc_backend(TRUE);
+		break;
+#endif
+
+#ifdef HAVE_FFTW
+	    case OPTION_FFT_MEASURE :
+		{
+		    char *dir = g_build_filename(g_get_user_cache_dir(), "mathmap", NULL);
+		    char *wisdom_filename = g_build_filename(dir, "fftwf-wisdom", NULL);
+
+		    g_mkdir_with_parents(dir, 0755);
+		    native_filters_set_fft_planning(TRUE, wisdom_filename);
+
+		    g_free(wisdom_filename);
+		    g_free(dir);
+		}
+		break;
+#endif
+
 	    case OPTION_BENCH_RENDER_COUNT :
 		bench_render_count = atoi(optarg);
 		break;
@@ -616,13 +2497,75 @@ cmdline_main (int argc, char *argv[])
 		bench_no_backend = TRUE;
 		break;
 
-#ifdef MOVIES
+	    case OPTION_BENCH_TIMING :
+		bench_timing = TRUE;
+		break;
+
 	    case 'F' :
-		generate_movie = 1;
 		num_frames = atoi(optarg);
-		assert(num_frames > 0);
+		if (num_frames <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frames must be positive.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case OPTION_OUTPUT_PATTERN :
+		output_pattern = optarg;
+		if (!is_valid_output_pattern(output_pattern))
+		{
+		    fprintf(stderr, _("Error: The output pattern must contain exactly one integer conversion, like %%05d.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case OPTION_FRAME_RANGE :
+		if (sscanf(optarg, "%d-%d", &first_frame, &last_frame) != 2
+		    || first_frame < 0 || last_frame < first_frame)
+		{
+		    fprintf(stderr, _("Error: Invalid frame range.  Syntax is <first>-<last>.  Example: 0-99.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case OPTION_FRAME_JOBS :
+		frame_jobs = atoi(optarg);
+		if (frame_jobs <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of frame jobs must be positive.\n"));
+		    exit(1);
+		}
+		break;
+
+	    case OPTION_RESUME :
+		resume = TRUE;
+		break;
+
+#ifndef __MINGW32__
+	    case OPTION_SERVE :
+		serve_socket = optarg;
+		break;
+
+	    case OPTION_SERVE_JOBS :
+		serve_jobs = atoi(optarg);
+		if (serve_jobs <= 0)
+		{
+		    fprintf(stderr, _("Error: The number of serve jobs must be positive.\n"));
+		    exit(1);
+		}
+		break;
+#endif
+
+	    case OPTION_FILTER_CACHE :
+		if (atoi(optarg) < 0)
+		{
+		    fprintf(stderr, _("Error: The filter cache size must not be negative.\n"));
+		    exit(1);
+		}
+		native_filter_cache_set_budget((long)atoi(optarg) << 20);
 		break;
 
+#ifdef MOVIES
 	    case 'M' :
 		alloc_cmdline_movie_input_drawable(optarg);
 		break;
@@ -630,26 +2573,74 @@ cmdline_main (int argc, char *argv[])
 	}
     }
 
-    if (script != NULL)
+#ifndef __MINGW32__
+    if (serve_socket != NULL)
     {
-	if (argc - optind != 1)
+	if (argc - optind != 0 || script != NULL)
 	{
 	    usage();
 	    return 1;
 	}
-
-	output_filename = argv[optind];
     }
     else
+#endif
+    if (output_pattern != NULL && !htmldoc)
     {
-	if (argc - optind != 2)
+	/* frames go to the pattern, not to <outfile> */
+	if (argc - optind != (script != NULL ? 0 : 1))
 	{
 	    usage();
 	    return 1;
 	}
 
-	script = argv[optind];
-	output_filename = argv[optind + 1];
+	if (script == NULL)
+	    script = argv[optind];
+	output_filename = NULL;
+
+	if (first_frame < 0)
+	{
+	    first_frame = 0;
+	    last_frame = num_frames - 1;
+	}
+	else if (last_frame >= num_frames)
+	{
+	    fprintf(stderr, _("Error: The frame range must lie within the %d frames.\n"), num_frames);
+	    return 1;
+	}
+    }
+    else
+    {
+	if (script != NULL)
+	{
+	    if (argc - optind != 1)
+	    {
+		usage();
+		return 1;
+	    }
+
+	    output_filename = argv[optind];
+	}
+	else
+	{
+	    if (argc - optind != 2)
+	    {
+		usage();
+		return 1;
+	    }
+
+	    script = argv[optind];
+	    output_filename = argv[optind + 1];
+	}
+
+	if (num_frames > 1)
+	{
+#ifdef MOVIES
+	    generate_movie = 1;
+#else
+	    fprintf(stderr, _("Error: Rendering several frames needs --output-pattern.\n"));
+	    return 1;
+#endif
+	}
     }
 
     init_tags();
@@ -657,6 +2648,17 @@ cmdline_main (int argc, char *argv[])
     init_macros();
     init_compiler();
 
+#ifndef __MINGW32__
+    if (serve_socket != NULL)
+    {
+	char *support_paths[4];
+
+	init_support_paths(support_paths);
+
+	return serve(serve_socket, serve_jobs, num_threads, support_paths);
+    }
+#endif
+
     if (htmldoc)
     {
 	mathmap_t *mathmap = parse_mathmap(script);
@@ -695,15 +2697,16 @@ cmdline_main (int argc, char *argv[])
 	mathmap_invocation_t *invocation;
 	int current_frame;
 
-	support_paths[0] = g_strdup_printf("%s/mathmap", GIMPDATADIR);
-	support_paths[1] = g_strdup_printf("%s/.gimp-2.6/mathmap", getenv("HOME"));
-	support_paths[2] = g_strdup_printf("%s/.gimp-2.4/mathmap", getenv("HOME"));
-	support_paths[3] = NULL;
+	init_support_paths(support_paths);
 
 	mathmap = compile_mathmap(script, support_paths, compile_time_limit, bench_no_backend);
 
-	if (bench_no_backend)
+	if (bench_no_backend || (mathmap != 0 && bench_render_count == 0))
+	{
+	    if (bench_timing)
+		bench_print_results(stdout, 0);
 	    return 0;
+	}
 
 	if (mathmap == 0)
 	{
@@ -711,112 +2714,75 @@ cmdline_main (int argc, char *argv[])
 	    exit(1);
 	}
 
-	if (bench_render_count == 0)
-	    return 0;
-
-	if (!size_is_set)
-	    for (userval_info = mathmap->main_filter->userval_infos;
-		 userval_info != NULL;
-		 userval_info = userval_info->next)
-	    {
-		define_t *define;
-		unsigned char *image;
-
-		if (userval_info->type != USERVAL_IMAGE)
-		    continue;
-
-		define = lookup_define(defines, userval_info->name);
-		if (define == NULL)
-		{
-		    fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), userval_info->name);
-		    return 1;
-		}
-
-		image = read_image(define->value, &img_width, &img_height);
-		if (image == NULL)
-		{
-		    fprintf(stderr, _("Error: Could not read input image `%s'.\n"), define->value);
-		    return 1;
-		}
-		free(image);
-
-		size_is_set = TRUE;
-
-		break;
-	    }
-
-	if (!size_is_set)
+	if (!size_is_set && !get_size_from_input_images(mathmap, defines, &img_width, &img_height))
 	{
-	    fprintf(stderr, _("Error: Image size not set and no input images given.\n"));
+	    fprintf(stderr, _("Error: %s\n"), error_string);
 	    exit(1);
 	}
 
 	invocation = invoke_mathmap(mathmap, NULL, img_width, img_height, TRUE);
 
-	for (userval_info = mathmap->main_filter->userval_infos;
-	     userval_info != NULL;
-	     userval_info = userval_info->next)
+	num_input_drawables = set_uservals_from_defines(invocation, defines);
+	if (num_input_drawables < 0)
 	{
-	    userval_t *userval = &invocation->uservals[userval_info->index];
-	    define_t *define = lookup_define(defines, userval_info->name);
-
-	    if (define == NULL)
-	    {
-		if (userval_info->type == USERVAL_IMAGE)
-		{
-		    fprintf(stderr, _("Error: No value defined for input image `%s'.\n"), userval_info->name);
-		    return 1;
-		}
-	    }
-	    else
-		switch (userval_info->type)
-		{
-		    case USERVAL_INT_CONST :
-			userval->v.int_const = atoi(define->value);
-			break;
-
-		    case USERVAL_FLOAT_CONST :
-			userval->v.float_const = g_ascii_strtod(define->value, NULL);
-			break;
-
-		    case USERVAL_BOOL_CONST :
-			userval->v.bool_const = (float)atoi(define->value);
-			break;
-
-		    case USERVAL_IMAGE :
-			assign_image_userval_drawable(userval_info, userval,
-						      alloc_cmdline_image_input_drawable(define->value));
-			++num_input_drawables;
-			break;
-
-		    default :
-			fprintf(stderr, _("Error: Can only define user values for types int, float, bool and image.\n"));
-			return 1;
-		}
+	    fprintf(stderr, _("Error: %s\n"), error_string);
+	    return 1;
 	}
 
 	for (render_num = 0; render_num < bench_render_count; ++render_num)
 	{
-#ifdef MOVIES
-	    for (i = 0; i < num_input_drawables; ++i)
-		if (input_drawables[i].type == DRAWABLE_MOVIE)
-		{
-		    assert(quicktime_video_width(input_drawables[i].v.movie, 0) == img_width);
-		    assert(quicktime_video_height(input_drawables[i].v.movie, 0) == img_height);
-		}
-#endif
-
 	    invocation_set_antialiasing(invocation, antialiasing);
 	    invocation->supersampling = supersampling;
+	    invocation->tile_rows = tile_rows;
+	    invocation->num_threads = num_threads;
 
 	    invocation->output_bpp = 4;
 
-	    output = (guchar*)malloc((long)invocation->output_bpp * (long)img_width * (long)img_height);
-	    assert(output != 0);
+	    if (output_pattern != NULL)
+	    {
+		long num_pixels;
+
+		bench_begin_phase(BENCH_PHASE_RENDER);
+		num_pixels = render_frame_sequence(invocation, num_frames, first_frame, last_frame,
+						   output_pattern, resume, !bench_no_output,
+						   frame_jobs, num_threads);
+		bench_end_phase(BENCH_PHASE_RENDER);
+
+		if (num_pixels < 0)
+		    return 1;
+		num_pixels_rendered += num_pixels;
+
+		continue;
+	    }
+
+	    /* Still images are streamed to the file band by band, so we
+	       never need memory for the whole output. */
+	    stream_bands = band_rows > 0 && !generate_movie && !bench_no_output;
+
+	    if (stream_bands)
+	    {
+		output = NULL;
+		writer = open_image_writing(output_filename, img_width, img_height,
+					    invocation->output_bpp, img_width * invocation->output_bpp,
+					    IMAGE_FORMAT_PNG);
+		if (writer == NULL)
+		{
+		    fprintf(stderr, _("Error: Cannot open file `%s' for writing.\n"), output_filename);
+		    return 1;
+		}
+	    }
+	    else
+	    {
+		writer = NULL;
+		output = (guchar*)malloc((long)invocation->output_bpp * (long)img_width * (long)img_height);
+		assert(output != 0);
+	    }
 
 #ifdef MOVIES
 	    if (generate_movie)
 	    {
+		int i;
+
 		output_movie = quicktime_open(output_filename, 0, 1);
 		assert(output_movie != 0);
 
@@ -838,12 +2804,45 @@ cmdline_main (int argc, char *argv[])
 						       invocation->mathmap->main_filter->num_uservals,
 						       invocation->uservals,
 						       img_width, img_height);
+		int epoch = begin_input_render();
 		mathmap_frame_t *frame = invocation_new_frame(invocation, closure,
 							      current_frame, current_t);
 
-		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, 1);
+		/* the bands begin and end their own input renders */
+		if (stream_bands)
+		    end_input_render(epoch);
+
+		bench_begin_phase(BENCH_PHASE_RENDER);
+		if (print_timing)
+		{
+		    double thread_times[num_threads];
+		    long num_chunks, num_bytes;
+		    int i;
+
+		    if (stream_bands)
+			render_and_write_bands(frame, closure, img_width, img_height, band_rows, num_threads,
+					       writer, thread_times);
+		    else
+			call_invocation_parallel_and_join_timed(frame, closure, 0, 0, img_width, img_height, output,
+								num_threads, thread_times);
+
+		    for (i = 0; i < num_threads; ++i)
+			fprintf(stderr, _("frame %d thread %d: %.3f s\n"), current_frame, i, thread_times[i]);
+
+		    mathmap_pools_get_stats(&frame->pools, &num_chunks, &num_bytes);
+		    fprintf(stderr, _("frame %d pools: %ld chunks, %ld bytes\n"), current_frame, num_chunks, num_bytes);
+		}
+		else if (stream_bands)
+		    render_and_write_bands(frame, closure, img_width, img_height, band_rows, num_threads,
+					   writer, NULL);
+		else
+		    call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, num_threads);
+		bench_end_phase(BENCH_PHASE_RENDER);
+		num_pixels_rendered += (long)img_width * (long)img_height;
 
 		invocation_free_frame(frame);
+		if (!stream_bands)
+		    end_input_render(epoch);
 
 #ifdef MOVIES
 		if (generate_movie && !bench_no_output)
@@ -856,7 +2855,9 @@ cmdline_main (int argc, char *argv[])
 		closure_image_free(closure);
 	    }
 
-	    if (!bench_no_output)
+	    if (stream_bands)
+		free_image_writer(writer);
+	    else if (!bench_no_output)
 	    {
 #ifdef MOVIES
 		if (generate_movie)
@@ -867,8 +2868,21 @@ cmdline_main (int argc, char *argv[])
 				invocation->output_bpp, img_width * invocation->output_bpp, IMAGE_FORMAT_PNG);
 	    }
 
-	    free(output);
+	    if (output != NULL)
+		free(output);
+	}
+
+	if (print_timing)
+	{
+	    long hits, misses, evictions, bytes;
+
+	    native_filter_cache_get_stats(&hits, &misses, &evictions, &bytes);
+	    fprintf(stderr, _("filter cache: %ld hits, %ld misses, %ld evictions, %ld bytes\n"),
+		    hits, misses, evictions, bytes);
 	}
+
+	if (bench_timing)
+	    bench_print_results(stdout, num_pixels_rendered);
     }
     else
     {
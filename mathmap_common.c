@@ -33,6 +33,7 @@
 #endif
 #include <locale.h>
 #include <unistd.h>
+#include <sys/time.h>
 #ifdef __MINGW32__
 #include <windows.h>
 #endif
@@ -48,13 +49,14 @@
 #include "mathmap.h"
 #include "compiler-internals.h"
 #include "native-filters/native-filters.h"
+#include "bench.h"
 
 int cmd_line_mode = 0;
 
-mathmap_t *the_mathmap = 0;
+__thread mathmap_t *the_mathmap = 0;
 
 /* from parser.y */
-int yyparse (void);
+int yyparse (scanner_t *scanner);
 
 static unsigned int
 image_flags_from_options (option_t *options)
@@ -279,6 +281,13 @@ free_filters (filter_t *filter)
 void
 unload_mathmap (mathmap_t *mathmap)
 {
+#ifndef USE_LLVM
+    if (mathmap->c_code_job != NULL)
+    {
+	c_code_job_abandon(mathmap->c_code_job);
+	mathmap->c_code_job = NULL;
+    }
+#endif
     if (mathmap->module_info != 0)
     {
 #ifdef USE_LLVM
@@ -288,6 +297,13 @@ unload_mathmap (mathmap_t *mathmap)
 #endif
 	mathmap->module_info = 0;
     }
+#ifdef USE_LIBTCC
+    if (mathmap->tcc_module_info != 0)
+    {
+	unload_tcc_code(mathmap->tcc_module_info);
+	mathmap->tcc_module_info = 0;
+    }
+#endif
 }
 
 void
@@ -296,6 +312,8 @@ free_mathmap (mathmap_t *mathmap)
     if (mathmap->filters != 0)
 	free_filters(mathmap->filters);
     unload_mathmap(mathmap);
+    if (mathmap->interpreter_code != NULL)
+	interpreter_free_code(mathmap->interpreter_code);
 
     free(mathmap);
 }
@@ -311,10 +329,6 @@ free_invocation (mathmap_invocation_t *invocation)
 
     free(invocation->rows_finished);
 
-    g_mutex_free(invocation->native_filter_cache_mutex);
-    g_cond_free(invocation->native_filter_cache_cond);
-    mathmap_pools_free(&invocation->pools);
-
     free(invocation);
 }
 
@@ -411,8 +425,9 @@ does_filter_use_t (filter_t *filter)
 mathmap_t*
 parse_mathmap (char *expression)
 {
-    static mathmap_t *mathmap;	/* this is static to avoid problems with longjmp.  */
-    volatile gboolean need_end_scan = FALSE;
+    /* volatile to avoid problems with longjmp */
+    mathmap_t * volatile mathmap;
+    scanner_t * volatile scanner = NULL;
 
     mathmap = g_new0(mathmap_t, 1);
 
@@ -423,11 +438,10 @@ parse_mathmap (char *expression)
     DO_JUMP_CODE {
 	filter_t *filter;
 
-	scanFromString(expression);
-	need_end_scan = TRUE;
-	yyparse();
-	endScanningFromString();
-	need_end_scan = FALSE;
+	scanner = scanner_new_from_string(expression);
+	yyparse(scanner);
+	scanner_free(scanner);
+	scanner = NULL;
 
 	if (mathmap->filters == NULL || mathmap->filters->kind != FILTER_MATHMAP)
 	{
@@ -475,8 +489,8 @@ parse_mathmap (char *expression)
 
 	mathmap->flags = 0;
     } WITH_JUMP_HANDLER {
-	if (need_end_scan)
-	    endScanningFromString();
+	if (scanner != NULL)
+	    scanner_free(scanner);
 	free_mathmap(mathmap);
 	mathmap = 0;
     } END_JUMP_HANDLER;
@@ -500,10 +514,83 @@ check_mathmap (char *expression)
 	return 0;
 }
 
+#ifndef USE_LLVM
+/* Starts the C backend in the background.  Until
+   mathmap_finish_background_backend() swaps in the native code the
+   mathmap uses the code from libtcc or, if there is none, the
+   interpreter.  Does nothing if the main filter can't be
+   interpreted. */
+static void
+start_background_backend (mathmap_t *mathmap, filter_code_t **filter_codes,
+			  char *template_filename, char *include_path, const char *cache_key)
+{
+    if (mathmap->initfunc == 0)
+    {
+	filter_t *filter;
+	int i;
+
+	if (mathmap->main_filter->kind != FILTER_MATHMAP)
+	    return;
+
+	for (i = 0, filter = mathmap->filters; filter != mathmap->main_filter; ++i, filter = filter->next)
+	    g_assert(filter != NULL);
+
+	mathmap->interpreter_code = interpreter_compile_filter(filter_codes[i]);
+	if (mathmap->interpreter_code == NULL)
+	    return;
+    }
+
+    mathmap->c_code_job = gen_c_code_in_background(mathmap, template_filename, include_path,
+						   filter_codes, cache_key);
+    if (mathmap->c_code_job == NULL)
+    {
+	if (mathmap->interpreter_code != NULL)
+	{
+	    interpreter_free_code(mathmap->interpreter_code);
+	    mathmap->interpreter_code = NULL;
+	}
+	return;
+    }
+
+    if (mathmap->interpreter_code != NULL)
+	mathmap->mathfuncs = interpreter_mathfuncs();
+}
+#endif
+
+gboolean
+mathmap_finish_background_backend (mathmap_t *mathmap, gboolean wait)
+{
+#ifndef USE_LLVM
+    initfunc_t initfunc;
+
+    if (mathmap->c_code_job == NULL)
+	return TRUE;
+    if (!wait && !c_code_job_is_done(mathmap->c_code_job))
+	return FALSE;
+
+    initfunc = c_code_job_finish(mathmap->c_code_job, &mathmap->module_info);
+    mathmap->c_code_job = NULL;
+
+    /* if the C compiler failed we keep using what we have */
+    if (initfunc == 0)
+    {
+	g_warning("%s", error_string);
+	return TRUE;
+    }
+
+    mathmap->initfunc = initfunc;
+    mathmap->mathfuncs = NULL;
+#endif
+
+    return TRUE;
+}
+
 mathmap_t*
 compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
 {
     volatile mathmap_t *mathmap = NULL;
+    /* volatile because it's freed by the jump handler */
+    char * volatile cache_key = NULL;
     char *template_filename, *include_path;
     int i;
 
@@ -533,29 +620,83 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     DO_JUMP_CODE {
 	filter_code_t **filter_codes;
 
+	bench_begin_phase(BENCH_PHASE_PARSE);
 	mathmap = parse_mathmap(expression);
+	bench_end_phase(BENCH_PHASE_PARSE);
 
 	if (mathmap == 0)
 	{
 	    JUMP(1);
 	}
 
-	filter_codes = compiler_compile_filters((mathmap_t*)mathmap, timeout);
-
-	if (no_backend)
+#if !defined(USE_LLVM) && !defined(OPENSTEP)
+	/* The parsed mathmap is all the invocation needs, so if we
+	   have the module already we don't need to run the compiler
+	   at all. */
+	if (!no_backend)
 	{
-	    compiler_free_pools((mathmap_t*)mathmap);
-	    return NULL;
+	    cache_key = module_cache_make_key(expression, template_filename, include_path, timeout);
+	    if (cache_key != NULL)
+	    {
+		void *module_info = NULL;
+
+		bench_begin_phase(BENCH_PHASE_LOAD);
+		mathmap->initfunc = module_cache_load(cache_key, &module_info);
+		mathmap->module_info = module_info;
+		bench_end_phase(BENCH_PHASE_LOAD);
+	    }
 	}
+#endif
+
+	if (mathmap->initfunc == 0)
+	{
+	    bench_begin_phase(BENCH_PHASE_OPTIMIZE);
+	    filter_codes = compiler_compile_filters((mathmap_t*)mathmap, timeout);
+	    bench_end_phase(BENCH_PHASE_OPTIMIZE);
 
+	    if (no_backend)
+	    {
+		compiler_free_pools((mathmap_t*)mathmap);
+		return NULL;
+	    }
+
+	    /* the C backend switches to the load phase itself once the
+	       module is linked */
+	    bench_begin_phase(BENCH_PHASE_BACKEND);
 #ifdef USE_LLVM
-	gen_and_load_llvm_code((mathmap_t*)mathmap, template_filename, filter_codes);
+	    gen_and_load_llvm_code((mathmap_t*)mathmap, template_filename, filter_codes);
 #else
-	mathmap->initfunc = gen_and_load_c_code(mathmap, &mathmap->module_info,
-						template_filename, include_path, filter_codes);
+#ifdef USE_LIBTCC
+	    if (compiler_get_tcc_backend())
+	    {
+		void *tcc_module_info = NULL;
+
+		mathmap->initfunc = gen_and_load_tcc_code((mathmap_t*)mathmap, &tcc_module_info,
+							  template_filename, include_path, filter_codes);
+		mathmap->tcc_module_info = tcc_module_info;
+		/* if tcc can't do it, gcc has to, which isn't worth a
+		   warning */
+#ifdef DEBUG_OUTPUT
+		if (mathmap->initfunc == 0)
+		    printf("tcc failed, using the C compiler: %s\n", error_string);
+#endif
+	    }
+#endif
+	    if (compiler_get_background_backend())
+		start_background_backend((mathmap_t*)mathmap, filter_codes,
+					 template_filename, include_path, cache_key);
+	    if (mathmap->initfunc == 0 && mathmap->c_code_job == NULL)
+		mathmap->initfunc = gen_and_load_c_code(mathmap, &mathmap->module_info,
+							template_filename, include_path, filter_codes, cache_key);
 #endif
+	    bench_end_phase(BENCH_PHASE_BACKEND);
+	    bench_end_phase(BENCH_PHASE_LOAD);
+
+	    compiler_free_pools((mathmap_t*)mathmap);
+	}
 
-	compiler_free_pools((mathmap_t*)mathmap);
+	g_free(cache_key);
+	cache_key = NULL;
 
 	if (mathmap->initfunc == 0 && mathmap->mathfuncs == 0)
 	{
@@ -571,6 +712,7 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
 
 	delete_expression_marker();
     } WITH_JUMP_HANDLER {
+	g_free(cache_key);
 	if (mathmap != 0)
 	{
 	    free_mathmap((mathmap_t*)mathmap);
@@ -704,7 +846,7 @@ llvm_filter_calc_lines (mathmap_slice_t *slice, image_t *closure, int first_row,
 	else
 	    q = (unsigned char*)q + invocation->row_stride;
 
-	if (!invocation->supersampling)
+	if (!invocation->supersampling && !floatmap)
 	    invocation->rows_finished[row] = 1;
     }
 
@@ -729,10 +871,18 @@ init_invocation (mathmap_invocation_t *invocation)
     else
     {
 	g_assert(invocation->mathmap->initfunc != NULL);
+	bench_begin_phase(BENCH_PHASE_LOAD);
 	invocation->mathfuncs = invocation->mathmap->initfunc(invocation);
+	bench_end_phase(BENCH_PHASE_LOAD);
     }
 }
 
+void
+invocation_reload_mathfuncs (mathmap_invocation_t *invocation)
+{
+    init_invocation(invocation);
+}
+
 void
 invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialiasing)
 {
@@ -786,11 +936,6 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
     if (!g_thread_supported())
 	g_thread_init (NULL);
 
-    mathmap_pools_init_global(&invocation->pools);
-    invocation->native_filter_cache_mutex = g_mutex_new();
-    invocation->native_filter_cache_cond = g_cond_new();
-    invocation->native_filter_cache = NULL;
-
     return invocation;
 }
 
@@ -810,6 +955,8 @@ invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
 
     mathmap_pools_init_global(&frame->pools);
 
+    frame->native_filter_cache_epoch = native_filter_cache_begin_frame();
+
     closure->v.closure.funcs->init_frame(frame, closure);
 
     return frame;
@@ -819,6 +966,7 @@ void
 invocation_free_frame (mathmap_frame_t *frame)
 {
     mathmap_pools_free(&frame->pools);
+    native_filter_cache_end_frame(frame->native_filter_cache_epoch);
     g_free(frame);
 }
 
@@ -870,34 +1018,94 @@ invocation_deinit_slice (mathmap_slice_t *slice)
     mathmap_pools_free(&slice->pools);
 }
 
+/* Everything a thread needs to render rows of a region.  The slices
+   are initialized for the whole region, so one render slot can render
+   any rows of it without having to recalculate the y-constants. */
+typedef struct
+{
+    gboolean is_inited;
+    mathmap_slice_t slice;
+    /* only used for supersampling */
+    mathmap_slice_t long_slice;
+    guchar *line1, *line2, *line3;
+
+    /* only used for sampling non-closure images into a floatmap */
+    mathmap_pools_t pools;
+
+    /* only used for tiled renders - the slot renders a tile into
+       this before passing it on */
+    guchar *tile_pixels;
+
+    /* tiles [next_tile, end_tile) are this slot's to render, unless
+       stolen by another slot */
+    int next_tile, end_tile;
+    double render_time;
+} render_slot_t;
+
 static void
-call_invocation (mathmap_frame_t *frame, image_t *closure,
-		 int region_x, int region_y, int region_width, int region_height,
-		 unsigned char *q)
+init_render_slot (render_slot_t *slot, mathmap_frame_t *frame, image_t *closure,
+		  int region_x, int region_y, int region_width, int region_height)
 {
     mathmap_invocation_t *invocation = frame->invocation;
 
+    g_assert(!slot->is_inited);
+
+    invocation_init_slice(&slot->slice, closure, frame, region_x, region_y, region_width, region_height, 0.0, 0.0);
+
     if (invocation->supersampling)
     {
-	guchar *line1, *line2, *line3;
-	int row, col;
-	mathmap_slice_t short_slice, long_slice;
+	invocation_init_slice(&slot->long_slice, closure, frame, region_x, region_y,
+			      region_width + 1, region_height, -0.5, -0.5);
+
+	slot->line1 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
+	slot->line2 = (guchar*)malloc(region_width * invocation->output_bpp);
+	slot->line3 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
+    }
+
+    slot->is_inited = TRUE;
+}
+
+static void
+deinit_render_slot (render_slot_t *slot, mathmap_invocation_t *invocation)
+{
+    if (!slot->is_inited)
+	return;
 
-	line1 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
-	line2 = (guchar*)malloc(region_width * invocation->output_bpp);
-	line3 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
+    invocation_deinit_slice(&slot->slice);
 
-	invocation_init_slice(&short_slice, closure, frame, region_x, region_y, region_width, region_height, 0.0, 0.0);
-	invocation_init_slice(&long_slice, closure, frame, region_x, region_y, region_width + 1, region_height, -0.5, -0.5);
+    if (invocation->supersampling)
+    {
+	invocation_deinit_slice(&slot->long_slice);
+
+	free(slot->line1);
+	free(slot->line2);
+	free(slot->line3);
+    }
+
+    slot->is_inited = FALSE;
+}
+
+/* q points to first_row */
+static void
+render_slot_rows (render_slot_t *slot, image_t *closure, int first_row, int last_row, unsigned char *q)
+{
+    mathmap_slice_t *slice = &slot->slice;
+    mathmap_invocation_t *invocation = slice->frame->invocation;
+
+    if (invocation->supersampling)
+    {
+	guchar *line1 = slot->line1, *line2 = slot->line2, *line3 = slot->line3;
+	int region_width = slice->region_width;
+	int row, col;
 
-	calc_lines(&long_slice, closure, region_y, region_y + 1, line1);
+	calc_lines(&slot->long_slice, closure, first_row, first_row + 1, line1);
 
-	for (row = region_y; row < region_y + region_height; ++row)
+	for (row = first_row; row < last_row; ++row)
 	{
 	    unsigned char *p = q;
 
-	    calc_lines(&short_slice, closure, row, row + 1, line2);
-	    calc_lines(&long_slice, closure, row + 1, row + 2, line3);
+	    calc_lines(slice, closure, row, row + 1, line2);
+	    calc_lines(&slot->long_slice, closure, row + 1, row + 2, line3);
 
 	    for (col = 0; col < region_width; ++col)
 	    {
@@ -917,56 +1125,383 @@ call_invocation (mathmap_frame_t *frame, image_t *closure,
 
 	    invocation->rows_finished[row] = 1;
 	}
+    }
+    else
+	calc_lines(slice, closure, first_row, last_row, q);
+}
 
-	free(line1);
-	free(line2);
-	free(line3);
+/* Floatmap slots render the whole floatmap.  For closures they have
+   a slice, for other images just the pools for sampling. */
+static void
+init_floatmap_render_slot (render_slot_t *slot, mathmap_frame_t *frame, image_t *image, image_t *floatmap)
+{
+    g_assert(!slot->is_inited);
 
-	invocation_deinit_slice(&short_slice);
-	invocation_deinit_slice(&long_slice);
-    }
+    if (image->type == IMAGE_CLOSURE)
+	invocation_init_slice(&slot->slice, image, frame, 0, 0,
+			      floatmap->pixel_width, floatmap->pixel_height, 0.0, 0.0);
     else
-    {
-	mathmap_slice_t slice;
+	mathmap_pools_init_local(&slot->pools);
 
-	invocation_init_slice(&slice, closure, frame, region_x, region_y, region_width, region_height, 0.0, 0.0);
-	calc_lines(&slice, closure, region_y, region_y + region_height, q);
-	invocation_deinit_slice(&slice);
-    }
+    slot->is_inited = TRUE;
+}
+
+static void
+deinit_floatmap_render_slot (render_slot_t *slot, image_t *image)
+{
+    if (!slot->is_inited)
+	return;
+
+    if (image->type == IMAGE_CLOSURE)
+	invocation_deinit_slice(&slot->slice);
+    else
+	mathmap_pools_free(&slot->pools);
+
+    slot->is_inited = FALSE;
+}
+
+static void
+render_floatmap_slot_rows (render_slot_t *slot, mathmap_invocation_t *invocation, image_t *image, image_t *floatmap,
+			   int first_row, int last_row)
+{
+    if (image->type == IMAGE_CLOSURE)
+	image->v.closure.funcs->calc_lines(&slot->slice, image, first_row, last_row,
+					   floatmap->v.floatmap.data + first_row * floatmap->pixel_width * NUM_FLOATMAP_CHANNELS,
+					   1);
+    else
+	render_image_rows(invocation, image, floatmap, first_row, last_row, &slot->pools);
+}
+
+/* Renders a tile of a tiled render.  The slot keeps its slices
+   across tiles with the same columns, so the y-constants of a column
+   are only calculated once. */
+static void
+render_slot_tile (render_slot_t *slot, mathmap_frame_t *frame, image_t *closure,
+		  render_tile_t *tile, int max_tile_height,
+		  void (*emit) (render_tile_t *tile, unsigned char *pixels, gpointer data), gpointer data)
+{
+    mathmap_invocation_t *invocation = frame->invocation;
+
+    if (slot->is_inited && (slot->slice.region_x != tile->x || slot->slice.region_width != tile->width))
+	deinit_render_slot(slot, invocation);
+    if (!slot->is_inited)
+	init_render_slot(slot, frame, closure, tile->x, 0, tile->width, closure->pixel_height);
+
+    if (slot->tile_pixels == NULL)
+	slot->tile_pixels = g_malloc(invocation->row_stride * max_tile_height);
+
+    render_slot_rows(slot, closure, tile->y, tile->y + tile->height, slot->tile_pixels);
+
+    emit(tile, slot->tile_pixels, data);
+}
+
+static int
+max_render_tile_height (int num_tiles, render_tile_t *tiles)
+{
+    int max_height = 0;
+    int i;
+
+    for (i = 0; i < num_tiles; ++i)
+	max_height = MAX(max_height, tiles[i].height);
+
+    return max_height;
+}
+
+static void
+call_invocation (mathmap_frame_t *frame, image_t *closure,
+		 int region_x, int region_y, int region_width, int region_height,
+		 unsigned char *q)
+{
+    render_slot_t slot;
+
+    memset(&slot, 0, sizeof(render_slot_t));
+
+    init_render_slot(&slot, frame, closure, region_x, region_y, region_width, region_height);
+    render_slot_rows(&slot, closure, region_y, region_y + region_height, q);
+    deinit_render_slot(&slot, frame->invocation);
 }
 
 #if defined(USE_PTHREADS) || defined(USE_GTHREADS)
-typedef struct
+/*
+ * Parallel rendering uses a pool of persistent worker threads.  A
+ * call cuts its region into tiles of invocation->tile_rows rows,
+ * and hands each render slot (at most num_threads of them) a
+ * contiguous range of tiles.  A thread participating in a call owns
+ * one slot and renders its tiles front to back.  When it runs out,
+ * it steals the back half of the slot with the most remaining tiles,
+ * so expensive regions get spread over all threads.
+ *
+ * The thread joining a call participates in it as well, which makes
+ * it safe to issue a parallel call from within a render thread:
+ * even if all pool threads are busy, the joiner makes progress.
+ *
+ * The same machinery runs other work that can be split into
+ * independent items, like the passes of a native filter - see
+ * invocation_parallel_for_and_join().
+ *
+ * All scheduling state is protected by pool_mutex, which is never
+ * held while rendering.  Tiles are coarse, so this is no
+ * bottleneck.
+ */
+typedef struct _invocation_call_t
 {
-    thread_handle_t thread_handle;
-    mathmap_frame_t *frame;
+    mathmap_invocation_t *invocation;
+    mathmap_frame_t *frame;	/* NULL if rendering a non-closure into a floatmap */
     image_t *closure;
     int region_x, region_y;
-    int region_height, region_width;
+    int region_width, region_height;
     unsigned char *q;
+    /* if set, closure (which may be any image) is rendered into this
+       instead of q */
+    image_t *floatmap;
+    /* if set, this is called for the tiles instead of rendering, with
+       rows being items */
+    void (*func) (int first, int last, gpointer data);
+    gpointer func_data;
+    /* if set, the items are these tiles, which are passed to emit
+       with func_data after rendering */
+    render_tile_t *tiles;
+    int max_tile_height;
+    void (*emit) (render_tile_t *tile, unsigned char *pixels, gpointer data);
+
+    int tile_rows;
+    int num_tiles_unassigned;
+
+    int num_participants;
+    gboolean is_cancelled;
     gboolean is_done;
-} thread_data_t;
+    GCond *done_cond;
 
-typedef struct
-{
-    int num_threads;
-    thread_data_t datas[];
+    struct _invocation_call_t *next; /* in active_calls */
+
+    int num_slots;
+    int num_slots_taken;
+    render_slot_t slots[];
 } invocation_call_t;
 
+static GStaticMutex pool_mutex = G_STATIC_MUTEX_INIT;
+static GCond *pool_cond = NULL;
+static int num_pool_threads = 0;
+static invocation_call_t *active_calls = NULL;
+
+#define POOL_MUTEX	(g_static_mutex_get_mutex(&pool_mutex))
+
+/* pool_mutex must be held */
+static gboolean
+grab_tile (invocation_call_t *call, render_slot_t *slot, int *tile)
+{
+    if (call->is_cancelled)
+	return FALSE;
+
+    if (slot->next_tile >= slot->end_tile)
+    {
+	render_slot_t *victim = NULL;
+	int i, num_stolen;
+
+	for (i = 0; i < call->num_slots; ++i)
+	{
+	    render_slot_t *s = &call->slots[i];
+
+	    if (victim == NULL || s->end_tile - s->next_tile > victim->end_tile - victim->next_tile)
+		victim = s;
+	}
+
+	if (victim == NULL || victim->next_tile >= victim->end_tile)
+	    return FALSE;
+
+	num_stolen = (victim->end_tile - victim->next_tile + 1) / 2;
+
+	slot->end_tile = victim->end_tile;
+	slot->next_tile = victim->end_tile - num_stolen;
+	victim->end_tile -= num_stolen;
+    }
+
+    *tile = slot->next_tile++;
+    --call->num_tiles_unassigned;
+
+    return TRUE;
+}
+
+static double
+seconds_since (struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* pool_mutex must be held.  Returns with pool_mutex held. */
 static void
-call_invocation_thread_func (gpointer _data)
+participate_in_call (invocation_call_t *call)
 {
-    thread_data_t *data = (thread_data_t*)_data;
+    render_slot_t *slot = &call->slots[call->num_slots_taken++];
+    int first_row = call->region_y;
+    int last_row = call->region_y + call->region_height;
+    struct timeval start;
+    int tile;
 
-#ifdef USE_PTHREADS
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-#endif
+    ++call->num_participants;
+
+    gettimeofday(&start, NULL);
+
+    while (grab_tile(call, slot, &tile))
+    {
+	int tile_first_row = first_row + tile * call->tile_rows;
+	int tile_last_row = MIN(tile_first_row + call->tile_rows, last_row);
+
+	g_static_mutex_unlock(&pool_mutex);
+
+	if (call->func != NULL)
+	    call->func(tile_first_row, tile_last_row, call->func_data);
+	else if (call->tiles != NULL)
+	{
+	    int i;
+
+	    for (i = tile_first_row; i < tile_last_row; ++i)
+		render_slot_tile(slot, call->frame, call->closure, &call->tiles[i], call->max_tile_height,
+				 call->emit, call->func_data);
+	}
+	else if (call->floatmap != NULL)
+	{
+	    if (!slot->is_inited)
+		init_floatmap_render_slot(slot, call->frame, call->closure, call->floatmap);
+
+	    render_floatmap_slot_rows(slot, call->invocation, call->closure, call->floatmap,
+				      tile_first_row, tile_last_row);
+	}
+	else
+	{
+	    if (!slot->is_inited)
+		init_render_slot(slot, call->frame, call->closure,
+				 call->region_x, call->region_y, call->region_width, call->region_height);
+
+	    render_slot_rows(slot, call->closure, tile_first_row, tile_last_row,
+			     call->q + (tile_first_row - call->region_y) * call->invocation->row_stride);
+	}
+
+	g_static_mutex_lock(&pool_mutex);
+    }
+
+    g_static_mutex_unlock(&pool_mutex);
+    if (call->floatmap != NULL)
+	deinit_floatmap_render_slot(slot, call->closure);
+    else
+	deinit_render_slot(slot, call->invocation);
+    g_free(slot->tile_pixels);
+    slot->tile_pixels = NULL;
+    g_static_mutex_lock(&pool_mutex);
+
+    slot->render_time = seconds_since(&start);
+
+    if (--call->num_participants == 0 && (call->num_tiles_unassigned == 0 || call->is_cancelled))
+    {
+	call->is_done = TRUE;
+	g_cond_broadcast(call->done_cond);
+    }
+}
+
+/* pool_mutex must be held */
+static gboolean
+call_wants_participants (invocation_call_t *call)
+{
+    return !call->is_cancelled && call->num_tiles_unassigned > 0 && call->num_slots_taken < call->num_slots;
+}
+
+static void
+pool_thread_func (gpointer data)
+{
+    g_static_mutex_lock(&pool_mutex);
+
+    for (;;)
+    {
+	invocation_call_t *call;
+
+	for (call = active_calls; call != NULL; call = call->next)
+	    if (call_wants_participants(call))
+		break;
 
-    call_invocation(data->frame, data->closure, data->region_x, data->region_y,
-		    data->region_width, data->region_height, data->q);
+	if (call == NULL)
+	{
+	    g_cond_wait(pool_cond, POOL_MUTEX);
+	    continue;
+	}
+
+	participate_in_call(call);
+    }
+}
+
+/* pool_mutex must be held */
+static void
+ensure_pool_threads (int num_threads)
+{
+    if (pool_cond == NULL)
+	pool_cond = g_cond_new();
+
+    while (num_pool_threads < num_threads)
+    {
+	mathmap_thread_start(pool_thread_func, NULL);
+	++num_pool_threads;
+    }
+}
 
-    data->is_done = TRUE;
+static int
+invocation_tile_rows (mathmap_invocation_t *invocation)
+{
+    return invocation->tile_rows > 0 ? invocation->tile_rows : DEFAULT_TILE_ROWS;
+}
+
+static invocation_call_t*
+new_invocation_call (mathmap_invocation_t *invocation, mathmap_frame_t *frame, image_t *closure,
+		     int region_x, int region_y, int region_width, int region_height, int num_threads,
+		     int tile_rows)
+{
+    invocation_call_t *call;
+    int i, num_tiles;
+
+    g_assert(num_threads > 0 && tile_rows > 0);
+
+    call = g_malloc0(sizeof(invocation_call_t) + sizeof(render_slot_t) * num_threads);
+
+    call->invocation = invocation;
+    call->frame = frame;
+    call->closure = closure;
+    call->region_x = region_x;
+    call->region_y = region_y;
+    call->region_width = region_width;
+    call->region_height = region_height;
+
+    call->tile_rows = tile_rows;
+    num_tiles = (region_height + call->tile_rows - 1) / call->tile_rows;
+    call->num_tiles_unassigned = num_tiles;
+
+    call->num_slots = num_threads;
+    for (i = 0; i < num_threads; ++i)
+    {
+	call->slots[i].next_tile = num_tiles * i / num_threads;
+	call->slots[i].end_tile = num_tiles * (i + 1) / num_threads;
+    }
+
+    call->is_done = num_tiles == 0;
+    call->done_cond = g_cond_new();
+
+    return call;
+}
+
+static void
+start_invocation_call (invocation_call_t *call)
+{
+    g_static_mutex_lock(&pool_mutex);
+
+    ensure_pool_threads(call->num_slots);
+
+    call->next = active_calls;
+    active_calls = call;
+
+    g_cond_broadcast(pool_cond);
+
+    g_static_mutex_unlock(&pool_mutex);
 }
 
 gpointer
@@ -976,7 +1511,6 @@ call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 {
     mathmap_invocation_t *invocation = frame->invocation;
     invocation_call_t *call;
-    int i;
     int first_row = region_y;
     int last_row = region_y + region_height;
 
@@ -984,63 +1518,91 @@ call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 
     memset(invocation->rows_finished + first_row, 0, last_row - first_row);
 
-    call = g_malloc(sizeof(invocation_call_t) + sizeof(thread_data_t) * num_threads);
-
-    call->num_threads = num_threads;
+    call = new_invocation_call(invocation, frame, closure, region_x, region_y, region_width, region_height,
+			       num_threads, invocation_tile_rows(invocation));
+    call->q = q;
 
-    for (i = 0; i < num_threads; ++i)
-    {
-	call->datas[i].frame = frame;
-	call->datas[i].closure = closure;
-	call->datas[i].region_x = region_x;
-	call->datas[i].region_width = region_width;
-	call->datas[i].region_y = first_row + (last_row - first_row) * i / num_threads;
-	call->datas[i].region_height = first_row + (last_row - first_row) * (i + 1) / num_threads - call->datas[i].region_y;
-	call->datas[i].q = q + (call->datas[i].region_y - region_y) * invocation->row_stride;
-	call->datas[i].is_done = FALSE;
-
-	call->datas[i].thread_handle = mathmap_thread_start(call_invocation_thread_func, &call->datas[i]);
-    }
+    start_invocation_call(call);
 
     return call;
 }
 
 void
-join_invocation_call (gpointer *_call)
+join_invocation_call_with_times (gpointer *_call, double *thread_times)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
+    invocation_call_t **p;
     int i;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_join(call->datas[i].thread_handle);
+    g_static_mutex_lock(&pool_mutex);
+
+    if (call_wants_participants(call))
+	participate_in_call(call);
+
+    while (!call->is_done)
+	g_cond_wait(call->done_cond, POOL_MUTEX);
+
+    for (p = &active_calls; *p != call; p = &(*p)->next)
+	g_assert(*p != NULL);
+    *p = call->next;
+
+    g_static_mutex_unlock(&pool_mutex);
+
+    if (thread_times != NULL)
+	for (i = 0; i < call->num_slots; ++i)
+	    thread_times[i] = call->slots[i].render_time;
 
+    g_cond_free(call->done_cond);
     g_free(call);
 }
 
-#ifdef USE_PTHREADS
+void
+join_invocation_call (gpointer *_call)
+{
+    join_invocation_call_with_times(_call, NULL);
+}
+
+/* Stops handing out tiles, waits for the ones in progress to finish
+   and frees the call. */
 void
 kill_invocation_call (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_kill(call->datas[i].thread_handle);
+    g_static_mutex_lock(&pool_mutex);
+    call->is_cancelled = TRUE;
+    if (call->num_participants == 0)
+    {
+	call->is_done = TRUE;
+	g_cond_broadcast(call->done_cond);
+    }
+    g_static_mutex_unlock(&pool_mutex);
 
-    g_free(call);
+    join_invocation_call(_call);
 }
-#endif
 
 gboolean
 invocation_call_is_done (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
+    gboolean is_done;
 
-    for (i = 0; i < call->num_threads; ++i)
-	if (!call->datas[i].is_done)
-	    return FALSE;
-    return TRUE;
+    g_static_mutex_lock(&pool_mutex);
+    is_done = call->is_done;
+    g_static_mutex_unlock(&pool_mutex);
+
+    return is_done;
+}
+
+void
+call_invocation_parallel_and_join_timed (mathmap_frame_t *frame, image_t *closure,
+					 int region_x, int region_y, int region_width, int region_height,
+					 unsigned char *q, int num_threads, double *thread_times)
+{
+    gpointer call = call_invocation_parallel(frame, closure, region_x, region_y,
+					     region_width, region_height, q, num_threads);
+
+    join_invocation_call_with_times(call, thread_times);
 }
 
 void
@@ -1048,10 +1610,61 @@ call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
 				   unsigned char *q, int num_threads)
 {
-    gpointer call = call_invocation_parallel(frame, closure, region_x, region_y,
-					     region_width, region_height, q, num_threads);
+    call_invocation_parallel_and_join_timed(frame, closure, region_x, region_y, region_width, region_height,
+					    q, num_threads, NULL);
+}
 
-    join_invocation_call(call);
+void
+render_floatmap_parallel_and_join (mathmap_invocation_t *invocation, mathmap_frame_t *frame,
+				   image_t *image, image_t *floatmap)
+{
+    int num_threads = invocation->num_threads > 0 ? invocation->num_threads : get_num_cpus();
+    invocation_call_t *call;
+
+    g_assert(floatmap->type == IMAGE_FLOATMAP);
+
+    call = new_invocation_call(invocation, frame, image, 0, 0, floatmap->pixel_width, floatmap->pixel_height,
+			       num_threads, invocation_tile_rows(invocation));
+    call->floatmap = floatmap;
+
+    start_invocation_call(call);
+
+    join_invocation_call((gpointer*)call);
+}
+
+void
+invocation_parallel_for_and_join (mathmap_invocation_t *invocation, int num_items, int chunk_size,
+				  void (*func) (int first, int last, gpointer data), gpointer data)
+{
+    int num_threads = invocation->num_threads > 0 ? invocation->num_threads : get_num_cpus();
+    invocation_call_t *call;
+
+    call = new_invocation_call(invocation, NULL, NULL, 0, 0, 0, num_items, num_threads, chunk_size);
+    call->func = func;
+    call->func_data = data;
+
+    start_invocation_call(call);
+
+    join_invocation_call((gpointer*)call);
+}
+
+void
+call_invocation_tiles_and_join (mathmap_frame_t *frame, image_t *closure,
+				int num_tiles, render_tile_t *tiles, int num_threads,
+				void (*emit) (render_tile_t *tile, unsigned char *pixels, gpointer data),
+				gpointer data)
+{
+    invocation_call_t *call;
+
+    call = new_invocation_call(frame->invocation, frame, closure, 0, 0, 0, num_tiles, num_threads, 1);
+    call->tiles = tiles;
+    call->max_tile_height = max_render_tile_height(num_tiles, tiles);
+    call->emit = emit;
+    call->func_data = data;
+
+    start_invocation_call(call);
+
+    join_invocation_call((gpointer*)call);
 }
 
 #ifdef USE_PTHREAD
@@ -1112,6 +1725,27 @@ mathmap_thread_kill (thread_handle_t thread)
 }
 #endif
 #else
+void
+call_invocation_parallel_and_join_timed (mathmap_frame_t *frame, image_t *closure,
+					 int region_x, int region_y, int region_width, int region_height,
+					 unsigned char *q, int num_threads, double *thread_times)
+{
+    struct timeval start;
+    int i;
+
+    gettimeofday(&start, NULL);
+
+    call_invocation(frame, closure, region_x, region_y, region_width, region_height, q);
+
+    if (thread_times != NULL)
+    {
+	/* we rendered everything in the first "thread" */
+	thread_times[0] = seconds_since(&start);
+	for (i = 1; i < num_threads; ++i)
+	    thread_times[i] = 0.0;
+    }
+}
+
 void
 call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
@@ -1119,6 +1753,47 @@ call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 {
     call_invocation(frame, closure, region_x, region_y, region_width, region_height, q);
 }
+
+void
+render_floatmap_parallel_and_join (mathmap_invocation_t *invocation, mathmap_frame_t *frame,
+				   image_t *image, image_t *floatmap)
+{
+    render_slot_t slot;
+
+    g_assert(floatmap->type == IMAGE_FLOATMAP);
+
+    memset(&slot, 0, sizeof(render_slot_t));
+
+    init_floatmap_render_slot(&slot, frame, image, floatmap);
+    render_floatmap_slot_rows(&slot, invocation, image, floatmap, 0, floatmap->pixel_height);
+    deinit_floatmap_render_slot(&slot, image);
+}
+
+void
+invocation_parallel_for_and_join (mathmap_invocation_t *invocation, int num_items, int chunk_size,
+				  void (*func) (int first, int last, gpointer data), gpointer data)
+{
+    func(0, num_items, data);
+}
+
+void
+call_invocation_tiles_and_join (mathmap_frame_t *frame, image_t *closure,
+				int num_tiles, render_tile_t *tiles, int num_threads,
+				void (*emit) (render_tile_t *tile, unsigned char *pixels, gpointer data),
+				gpointer data)
+{
+    int max_tile_height = max_render_tile_height(num_tiles, tiles);
+    render_slot_t slot;
+    int i;
+
+    memset(&slot, 0, sizeof(render_slot_t));
+
+    for (i = 0; i < num_tiles; ++i)
+	render_slot_tile(&slot, frame, closure, &tiles[i], max_tile_height, emit, data);
+
+    deinit_render_slot(&slot, frame->invocation);
+    g_free(slot.tile_pixels);
+}
 #endif
 
 void
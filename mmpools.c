@@ -20,15 +20,25 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <string.h>
+
 #include <glib.h>
 
 #include "mmpools.h"
 
+/* Allocations are rounded up to this. */
+#define BLOCK_GRANULARITY	sizeof(double)
+
+static GStaticPrivate arena_index_key = G_STATIC_PRIVATE_INIT;
+static volatile gint next_arena_index = 0;
+
 void
 mathmap_pools_init_global (mathmap_pools_t *pools)
 {
     pools->is_global = 1;
     pools->chunks = NULL;
+    pools->arenas = NULL;
+    pools->arenas_memory = NULL;
 }
 
 void
@@ -51,33 +61,153 @@ mathmap_pools_free (mathmap_pools_t *pools)
     if (pools->is_global)
     {
 	mathmap_pools_chunk_t *chunk = pools->chunks;
-	int num_chunks = 0;
 
 	while (chunk != NULL)
 	{
 	    mathmap_pools_chunk_t *next = chunk->next;
 	    free(chunk);
 	    chunk = next;
-	    ++num_chunks;
 	}
 
-	//g_print("%d chunks freed\n", num_chunks);
+	pools->chunks = NULL;
+
+	g_free(pools->arenas_memory);
+	pools->arenas = NULL;
+	pools->arenas_memory = NULL;
     }
     else
 	free_pools(&pools->pools);
 }
 
+void
+mathmap_pools_get_stats (mathmap_pools_t *pools, long *num_chunks, long *num_bytes)
+{
+    mathmap_pools_chunk_t *chunk;
+
+    *num_chunks = 0;
+    *num_bytes = 0;
+
+    g_assert(pools->is_global);
+
+    for (chunk = g_atomic_pointer_get((gpointer*)&pools->chunks); chunk != NULL; chunk = chunk->next)
+    {
+	++*num_chunks;
+	*num_bytes += g_atomic_int_get(&chunk->used);
+    }
+}
+
+static mathmap_pools_chunk_t*
+alloc_chunk (size_t size, int used)
+{
+    mathmap_pools_chunk_t *chunk = malloc(sizeof(mathmap_pools_chunk_t) + size);
+
+    g_assert(chunk != NULL);
+
+    chunk->size = size;
+    chunk->used = used;
+
+    return chunk;
+}
+
+static void
+push_chunk (mathmap_pools_t *pools, mathmap_pools_chunk_t *chunk)
+{
+    do
+    {
+	chunk->next = pools->chunks;
+    } while (!g_atomic_pointer_compare_and_exchange((gpointer*)&pools->chunks, chunk->next, chunk));
+}
+
+static mathmap_pools_arena_t*
+get_arenas (mathmap_pools_t *pools)
+{
+    mathmap_pools_arena_t *arenas = g_atomic_pointer_get((gpointer*)&pools->arenas);
+    void *memory;
+
+    if (arenas != NULL)
+	return arenas;
+
+    memory = g_malloc0(sizeof(mathmap_pools_arena_t) * (MATHMAP_POOLS_NUM_ARENAS + 1));
+    arenas = (mathmap_pools_arena_t*)(((gsize)memory + sizeof(mathmap_pools_arena_t) - 1)
+				      / sizeof(mathmap_pools_arena_t) * sizeof(mathmap_pools_arena_t));
+
+    if (!g_atomic_pointer_compare_and_exchange((gpointer*)&pools->arenas, NULL, arenas))
+    {
+	/* another thread was quicker */
+	g_free(memory);
+	return g_atomic_pointer_get((gpointer*)&pools->arenas);
+    }
+
+    /* only read by mathmap_pools_free(), when no thread allocates */
+    pools->arenas_memory = memory;
+
+    return arenas;
+}
+
+static mathmap_pools_arena_t*
+get_arena (mathmap_pools_t *pools)
+{
+    mathmap_pools_arena_t *arenas = get_arenas(pools);
+    int index = GPOINTER_TO_INT(g_static_private_get(&arena_index_key));
+
+    if (index == 0)
+    {
+	index = g_atomic_int_exchange_and_add(&next_arena_index, 1) % MATHMAP_POOLS_NUM_ARENAS + 1;
+	g_static_private_set(&arena_index_key, GINT_TO_POINTER(index), NULL);
+    }
+
+    return &arenas[index - 1];
+}
+
+/* Arenas are usually only used by one thread, but if there are more
+   threads than arenas they are shared, so blocks are bumped and
+   installed atomically. */
 void*
 _mathmap_pools_alloc (mathmap_pools_t *pools, size_t size)
 {
     if (pools->is_global)
     {
-	mathmap_pools_chunk_t *chunk = malloc(sizeof(mathmap_pools_chunk_t) + size);
-	do
+	mathmap_pools_arena_t *arena;
+	mathmap_pools_chunk_t *block, *new_block;
+
+	size = (size + BLOCK_GRANULARITY - 1) / BLOCK_GRANULARITY * BLOCK_GRANULARITY;
+
+	if (size > MATHMAP_POOLS_BLOCK_SIZE / 4)
+	{
+	    mathmap_pools_chunk_t *chunk = alloc_chunk(size, size);
+	    push_chunk(pools, chunk);
+	    return chunk->data;
+	}
+
+	arena = get_arena(pools);
+
+	for (;;)
 	{
-	    chunk->next = pools->chunks;
-	} while (!g_atomic_pointer_compare_and_exchange((gpointer*)&pools->chunks, chunk->next, chunk));
-	return chunk->data;
+	    block = g_atomic_pointer_get((gpointer*)&arena->block);
+	    if (block != NULL)
+	    {
+		/* a bump that doesn't fit must not count as used */
+		for (;;)
+		{
+		    int offset = g_atomic_int_get(&block->used);
+
+		    if (offset + size > block->size)
+			break;
+		    if (g_atomic_int_compare_and_exchange(&block->used, offset, offset + size))
+			return (char*)block->data + offset;
+		}
+	    }
+
+	    new_block = alloc_chunk(MATHMAP_POOLS_BLOCK_SIZE, size);
+	    if (g_atomic_pointer_compare_and_exchange((gpointer*)&arena->block, block, new_block))
+	    {
+		push_chunk(pools, new_block);
+		return new_block->data;
+	    }
+
+	    /* another thread installed a block in the meantime */
+	    free(new_block);
+	}
     }
 
     return pools_alloc(&pools->pools, size);
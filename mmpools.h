@@ -27,15 +27,33 @@
 
 /* TEMPLATE mmpools */
 
+/* Global pools hand out memory from blocks of this size.  Larger
+   allocations get a chunk of their own. */
+#define MATHMAP_POOLS_BLOCK_SIZE	((size_t)64 * 1024)
+#define MATHMAP_POOLS_NUM_ARENAS	16
+
 typedef struct _mathmap_pools_chunk_t {
     struct _mathmap_pools_chunk_t *next;
+    size_t size;
+    volatile int used;		/* only for blocks */
     double data[];		/* double for alignment */
 } mathmap_pools_chunk_t;
 
+/* Each thread allocates from the block of its own arena.  Arenas are
+   padded to avoid false sharing. */
+typedef union {
+    mathmap_pools_chunk_t *block;
+    char padding[64];
+} mathmap_pools_arena_t;
+
+/* The arenas of a global pool are only allocated with its first
+   block, so pools that are never used stay small. */
 typedef struct {
     int is_global;
     pools_t pools;			 /* only for local pools */
     mathmap_pools_chunk_t *chunks; /* only for global pools */
+    mathmap_pools_arena_t *arenas; /* only for global pools, cache line aligned */
+    void *arenas_memory;		 /* what arenas was allocated as */
 } mathmap_pools_t;
 
 void mathmap_pools_init_global (mathmap_pools_t *pools);
@@ -45,6 +63,10 @@ void mathmap_pools_reset (mathmap_pools_t *pools);
 
 void mathmap_pools_free (mathmap_pools_t *pools);
 
+/* Gets the number of chunks a global pool holds and the number of
+   bytes allocated from them. */
+void mathmap_pools_get_stats (mathmap_pools_t *pools, long *num_chunks, long *num_bytes);
+
 void* _mathmap_pools_alloc (mathmap_pools_t *pools, size_t size);
 
 static inline void*
@@ -22,7 +22,48 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <string.h>
+
 #include "../mathmap.h"
+#include "../drawable.h"
+
+/*
+ * Results of native filters are cached across frames and
+ * invocations.  The same native filter is often applied to the same
+ * input over and over again, e.g. in every frame of an animation or
+ * on every preview update.
+ *
+ * The key of an entry consists of the filter function, the
+ * invocation's render parameters and the filter's arguments.  Images
+ * are represented by their identity: drawables by their content id,
+ * which changes whenever the drawable's pixels might have changed,
+ * all other images by their id.
+ *
+ * Entries that are done are kept in LRU order, and the least recently
+ * used ones are evicted when the results take more than cache_budget
+ * bytes.  A result might still be used by a frame when its entry is
+ * evicted, so evicted entries are only freed once all frames that
+ * were active when the entry was last used are freed.
+ */
+
+#define NUM_INVOCATION_KEYS	8
+
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
+#define CACHE_MUTEX	(g_static_mutex_get_mutex(&cache_mutex))
+static GCond *cache_cond = NULL;
+static GHashTable *cache_table = NULL;
+/* most recently used first */
+static GQueue *lru_entries = NULL;
+static GSList *retired_entries = NULL;
+static long cache_budget = (long)DEFAULT_NATIVE_FILTER_CACHE_MEGABYTES << 20;
+static long cache_size = 0;
+
+static int frame_epoch = 0;
+static GSList *active_frame_epochs = NULL;
+
+static long num_hits = 0;
+static long num_misses = 0;
+static long num_evictions = 0;
 
 static filter_t*
 get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
@@ -35,12 +76,46 @@ get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
     g_assert_not_reached();
 }
 
-static gboolean
-uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
+static gint64
+image_identity (image_t *image)
 {
-    int i;
+    int id;
+
+    if (image->type == IMAGE_DRAWABLE)
+	id = image->v.drawable->content_id;
+    else
+	id = image->id;
+
+    return ((gint64)image->type << 32) | (guint32)id;
+}
+
+static gint64
+float_bits (float f)
+{
+    union { float f; guint32 i; } u;
+
+    u.f = f;
+    return u.i;
+}
+
+/* Fills in key and returns its length, which is at most
+   NUM_INVOCATION_KEYS + filter->num_uservals. */
+static int
+make_key (mathmap_invocation_t *invocation, filter_t *filter, userval_t *args, gint64 *key)
+{
+    int i, n = 0;
     userval_info_t *info;
 
+    key[n++] = invocation->render_width;
+    key[n++] = invocation->render_height;
+    key[n++] = invocation->antialiasing;
+    key[n++] = invocation->supersampling;
+    key[n++] = invocation->edge_behaviour_x;
+    key[n++] = invocation->edge_behaviour_y;
+    key[n++] = invocation->edge_color_x;
+    key[n++] = invocation->edge_color_y;
+    g_assert(n == NUM_INVOCATION_KEYS);
+
     for (i = 0, info = filter->userval_infos;
 	 i < filter->num_uservals;
 	 ++i, info = info->next)
@@ -48,23 +123,19 @@ uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
 	switch (info->type)
 	{
 	    case USERVAL_INT_CONST :
-		if (entry_args[i].v.int_const != filter_args[i].v.int_const)
-		    return FALSE;
+		key[n++] = args[i].v.int_const;
 		break;
 
 	    case USERVAL_FLOAT_CONST :
-		if (entry_args[i].v.float_const != filter_args[i].v.float_const)
-		    return FALSE;
+		key[n++] = float_bits(args[i].v.float_const);
 		break;
 
 	    case USERVAL_BOOL_CONST :
-		if (entry_args[i].v.bool_const != filter_args[i].v.bool_const)
-		    return FALSE;
+		key[n++] = args[i].v.bool_const;
 		break;
 
 	    case USERVAL_IMAGE :
-		if (GPOINTER_TO_INT(entry_args[i].v.image) != filter_args[i].v.image->id)
-		    return FALSE;
+		key[n++] = image_identity(args[i].v.image);
 		break;
 
 	    default :
@@ -73,38 +144,145 @@ uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
     }
     g_assert(info == NULL);
 
-    return TRUE;
+    return n;
 }
 
-static userval_t*
-uservals_copy (filter_t *filter, userval_t *args, mathmap_pools_t *pools)
+static guint
+entry_hash (gconstpointer _entry)
 {
+    const native_filter_cache_entry_t *entry = _entry;
+
+    return entry->hash;
+}
+
+static gboolean
+entry_equal (gconstpointer _a, gconstpointer _b)
+{
+    const native_filter_cache_entry_t *a = _a;
+    const native_filter_cache_entry_t *b = _b;
+
+    return a->hash == b->hash && a->func == b->func && a->key_length == b->key_length
+	&& memcmp(a->key, b->key, sizeof(gint64) * a->key_length) == 0;
+}
+
+static guint
+compute_hash (native_filter_func_t func, gint64 *key, int key_length)
+{
+    guint hash = GPOINTER_TO_UINT(func);
     int i;
-    userval_info_t *info;
-    userval_t *copy = mathmap_pools_alloc(pools, sizeof(userval_t) * filter->num_uservals);
 
-    for (i = 0, info = filter->userval_infos;
-	 i < filter->num_uservals;
-	 ++i, info = info->next)
+    for (i = 0; i < key_length; ++i)
+	hash = hash * 31 + (guint)(key[i] ^ (key[i] >> 32));
+
+    return hash;
+}
+
+/* must be called with cache_mutex held */
+static void
+init_cache (void)
+{
+    if (cache_table != NULL)
+	return;
+
+    cache_cond = g_cond_new();
+    cache_table = g_hash_table_new(entry_hash, entry_equal);
+    lru_entries = g_queue_new();
+}
+
+static void
+free_entry (native_filter_cache_entry_t *entry)
+{
+    mathmap_pools_free(&entry->pools);
+    g_free(entry->key);
+    g_free(entry);
+}
+
+/* must be called with cache_mutex held */
+static void
+evict_entries (native_filter_cache_entry_t *keep)
+{
+    while (cache_size > cache_budget && lru_entries->tail != NULL && lru_entries->tail->data != keep)
     {
-	switch (info->type)
-	{
-	    case USERVAL_INT_CONST :
-	    case USERVAL_FLOAT_CONST :
-	    case USERVAL_BOOL_CONST :
-		copy_userval(&copy[i], &args[i], info->type);
-		break;
+	native_filter_cache_entry_t *entry = g_queue_pop_tail(lru_entries);
 
-	    case USERVAL_IMAGE :
-		copy[i].v.image = GINT_TO_POINTER(args[i].v.image->id);
-		break;
+	entry->lru_link = NULL;
+	g_hash_table_remove(cache_table, entry);
+	cache_size -= entry->size;
+	++num_evictions;
 
-	    default :
-		g_assert_not_reached();
+	retired_entries = g_slist_prepend(retired_entries, entry);
+    }
+}
+
+/* must be called with cache_mutex held */
+static void
+free_retired_entries (void)
+{
+    GSList *list, **p;
+    int oldest_epoch = G_MAXINT;
+
+    for (list = active_frame_epochs; list != NULL; list = list->next)
+	oldest_epoch = MIN(oldest_epoch, GPOINTER_TO_INT(list->data));
+
+    p = &retired_entries;
+    while (*p != NULL)
+    {
+	native_filter_cache_entry_t *entry = (*p)->data;
+
+	if (entry->last_used_epoch < oldest_epoch)
+	{
+	    list = *p;
+	    *p = list->next;
+	    free_entry(entry);
+	    g_slist_free_1(list);
 	}
+	else
+	    p = &(*p)->next;
     }
+}
+
+int
+native_filter_cache_begin_frame (void)
+{
+    int epoch;
+
+    g_static_mutex_lock(&cache_mutex);
+    epoch = ++frame_epoch;
+    active_frame_epochs = g_slist_prepend(active_frame_epochs, GINT_TO_POINTER(epoch));
+    g_static_mutex_unlock(&cache_mutex);
+
+    return epoch;
+}
 
-    return copy;
+void
+native_filter_cache_end_frame (int epoch)
+{
+    g_static_mutex_lock(&cache_mutex);
+    active_frame_epochs = g_slist_remove(active_frame_epochs, GINT_TO_POINTER(epoch));
+    free_retired_entries();
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+void
+native_filter_cache_set_budget (long bytes)
+{
+    g_static_mutex_lock(&cache_mutex);
+    cache_budget = bytes;
+    if (cache_table != NULL)
+	evict_entries(NULL);
+    free_retired_entries();
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+void
+native_filter_cache_get_stats (long *hits, long *misses, long *evictions, long *bytes)
+{
+    g_static_mutex_lock(&cache_mutex);
+    *hits = num_hits;
+    *misses = num_misses;
+    *evictions = num_evictions;
+    *bytes = cache_size;
+    g_static_mutex_unlock(&cache_mutex);
 }
 
 native_filter_cache_entry_t*
@@ -112,35 +290,51 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 					    native_filter_func_t filter_func)
 {
     filter_t *filter = get_native_filter_for_func(invocation->mathmap, filter_func);
+    gint64 key[NUM_INVOCATION_KEYS + filter->num_uservals];
+    native_filter_cache_entry_t probe;
     native_filter_cache_entry_t *entry;
 
-    g_mutex_lock(invocation->native_filter_cache_mutex);
+    probe.func = filter_func;
+    probe.key = key;
+    probe.key_length = make_key(invocation, filter, args, key);
+    probe.hash = compute_hash(filter_func, key, probe.key_length);
 
-    for (entry = invocation->native_filter_cache; entry != NULL; entry = entry->next)
-    {
-	if (entry->filter != filter)
-	    continue;
+    g_static_mutex_lock(&cache_mutex);
 
-	if (uservals_match(filter, entry->args, args))
-	    break;
-    }
+    init_cache();
 
-    if (entry)
+    entry = g_hash_table_lookup(cache_table, &probe);
+    if (entry != NULL)
     {
+	++num_hits;
+
+	/* another thread might still be computing it */
 	while (entry->image == NULL)
-	    g_cond_wait(invocation->native_filter_cache_cond, invocation->native_filter_cache_mutex);
+	    g_cond_wait(cache_cond, CACHE_MUTEX);
+
+	if (entry->lru_link != NULL)
+	{
+	    g_queue_unlink(lru_entries, entry->lru_link);
+	    g_queue_push_head_link(lru_entries, entry->lru_link);
+	}
     }
     else
     {
-	entry = mathmap_pools_alloc(&invocation->pools, sizeof(native_filter_cache_entry_t));
-	entry->filter = filter;
-	entry->args = uservals_copy(filter, args, &invocation->pools);
-	entry->image = NULL;
-	entry->next = invocation->native_filter_cache;
-	invocation->native_filter_cache = entry;
+	++num_misses;
+
+	entry = g_new0(native_filter_cache_entry_t, 1);
+	entry->func = filter_func;
+	entry->key_length = probe.key_length;
+	entry->key = g_memdup(key, sizeof(gint64) * probe.key_length);
+	entry->hash = probe.hash;
+	mathmap_pools_init_global(&entry->pools);
+
+	g_hash_table_insert(cache_table, entry, entry);
     }
 
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+    entry->last_used_epoch = frame_epoch;
+
+    g_static_mutex_unlock(&cache_mutex);
 
     return entry;
 }
@@ -148,9 +342,23 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 void
 native_filter_cache_entry_set_image (mathmap_invocation_t *invocation, native_filter_cache_entry_t *cache_entry, image_t *image)
 {
-    g_mutex_lock(invocation->native_filter_cache_mutex);
+    long num_chunks, num_bytes;
+
+    mathmap_pools_get_stats(&cache_entry->pools, &num_chunks, &num_bytes);
+
+    g_static_mutex_lock(&cache_mutex);
+
     g_assert(cache_entry->image == NULL);
     cache_entry->image = image;
-    g_cond_broadcast(invocation->native_filter_cache_cond);
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+    cache_entry->size = num_bytes;
+
+    g_queue_push_head(lru_entries, cache_entry);
+    cache_entry->lru_link = lru_entries->head;
+    cache_size += num_bytes;
+
+    evict_entries(cache_entry);
+
+    g_cond_broadcast(cache_cond);
+
+    g_static_mutex_unlock(&cache_mutex);
 }
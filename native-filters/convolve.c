@@ -25,43 +25,268 @@
 #include <complex.h>
 #include <fftw3.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
 
 #include "../drawable.h"
 #include "../mmpools.h"
 
 #include "native-filters.h"
 
+/*
+ * All transforms of a filter are done in one go with the batched
+ * interface, straight from an interleaved copy of the floatmap, with
+ * one transform per channel.
+ *
+ * Plans are cached across invocations, keyed by the transform's
+ * size, since planning is expensive, in particular with
+ * FFTW_MEASURE.  Plans are created on scratch arrays and executed
+ * with the new-array interface, which is thread-safe, on arrays
+ * allocated with fftwf_malloc(), so they have the same alignment.
+ * The planner itself isn't thread-safe, so it's only called with
+ * plan_mutex held.
+ */
+
+#define PLAN_CACHE_SIZE		8
+
+typedef struct _fft_plan_t
+{
+    gboolean inverse;
+    int width, height;
+    int num_channels;
+    int num_threads;
+
+    fftwf_plan plan;
+    int num_users;
+
+    struct _fft_plan_t *next;
+} fft_plan_t;
+
+static GStaticMutex plan_mutex = G_STATIC_MUTEX_INIT;
+/* most recently used first */
+static fft_plan_t *plans = NULL;
+static gboolean planner_is_inited = FALSE;
+
+static gboolean measure_plans = FALSE;
+static char *wisdom_filename = NULL;
+
+void
+native_filters_set_fft_planning (gboolean measure, const char *_wisdom_filename)
+{
+    g_static_mutex_lock(&plan_mutex);
+
+    g_assert(!planner_is_inited);
+
+    measure_plans = measure;
+    g_free(wisdom_filename);
+    wisdom_filename = g_strdup(_wisdom_filename);
+
+    g_static_mutex_unlock(&plan_mutex);
+}
+
+/* plan_mutex must be held */
 static void
-copy (double *dest, float *src, int n)
+init_planner (void)
 {
-    int i;
+    if (planner_is_inited)
+	return;
 
-    for (i = 0; i < n; ++i)
-	dest[i] = src[i * NUM_FLOATMAP_CHANNELS];
+    fftwf_init_threads();
+
+    if (wisdom_filename != NULL && !fftwf_import_wisdom_from_filename(wisdom_filename))
+    {
+#ifdef DEBUG_OUTPUT
+	g_print("could not import FFTW wisdom from %s\n", wisdom_filename);
+#endif
+    }
+
+    planner_is_inited = TRUE;
 }
 
-static double
-copy_and_add (double *dest, float *src, int n)
+/* plan_mutex must be held */
+static void
+save_wisdom (void)
 {
-    int half;
+    char *tmp_filename;
+
+    if (wisdom_filename == NULL)
+	return;
+
+    /* other processes might be reading it */
+    tmp_filename = g_strdup_printf("%s.%d", wisdom_filename, (int)getpid());
+    if (fftwf_export_wisdom_to_filename(tmp_filename))
+	g_rename(tmp_filename, wisdom_filename);
+    else
+	g_unlink(tmp_filename);
+    g_free(tmp_filename);
+}
+
+/* plan_mutex must be held */
+static fftwf_plan
+make_plan (gboolean inverse, int width, int height, int num_channels, int num_threads)
+{
+    int dims[2] = { height, width };
+    int cn = height * (width / 2 + 1);
+    float *real = fftwf_malloc(sizeof(float) * width * height * NUM_FLOATMAP_CHANNELS);
+    fftwf_complex *freq = fftwf_malloc(sizeof(fftwf_complex) * cn * num_channels);
+    unsigned flags = (measure_plans ? FFTW_MEASURE : FFTW_ESTIMATE) | FFTW_DESTROY_INPUT;
+    fftwf_plan plan;
+
+    init_planner();
+
+    fftwf_plan_with_nthreads(num_threads);
+
+    if (inverse)
+	plan = fftwf_plan_many_dft_c2r(2, dims, num_channels,
+				       freq, NULL, 1, cn,
+				       real, NULL, NUM_FLOATMAP_CHANNELS, 1,
+				       flags);
+    else
+	plan = fftwf_plan_many_dft_r2c(2, dims, num_channels,
+				       real, NULL, NUM_FLOATMAP_CHANNELS, 1,
+				       freq, NULL, 1, cn,
+				       flags);
+    g_assert(plan != NULL);
+
+    fftwf_free(real);
+    fftwf_free(freq);
+
+    if (measure_plans)
+	save_wisdom();
 
-    if (n <= 0)
-	return 0.0;
-    if (n == 1)
-	return dest[0] = src[0];
-    if (n == 2)
+    return plan;
+}
+
+/* plan_mutex must be held */
+static void
+evict_plans (void)
+{
+    fft_plan_t **p = &plans;
+    int num_plans = 0;
+
+    while (*p != NULL)
     {
-	double d1, d2;
+	fft_plan_t *plan = *p;
 
-	d1 = dest[0] = src[0];
-	d2 = dest[1] = src[NUM_FLOATMAP_CHANNELS];
+	if (++num_plans > PLAN_CACHE_SIZE && plan->num_users == 0)
+	{
+	    *p = plan->next;
+	    fftwf_destroy_plan(plan->plan);
+	    g_free(plan);
+	}
+	else
+	    p = &plan->next;
+    }
+}
+
+/* Returns a plan for transforming the first num_channels channels
+   of a floatmap of the given size, or the inverse.  The plan must
+   be given back with release_plan(). */
+static fft_plan_t*
+get_plan (mathmap_invocation_t *invocation, gboolean inverse, int width, int height, int num_channels)
+{
+    int num_threads = invocation->num_threads > 0 ? invocation->num_threads : get_num_cpus();
+    fft_plan_t **p, *plan;
+
+    g_static_mutex_lock(&plan_mutex);
 
-	return d1 + d2;
+    for (p = &plans; *p != NULL; p = &(*p)->next)
+    {
+	plan = *p;
+
+	if (plan->inverse == inverse && plan->width == width && plan->height == height
+	    && plan->num_channels == num_channels && plan->num_threads == num_threads)
+	{
+	    /* move to front */
+	    *p = plan->next;
+	    break;
+	}
     }
 
-    half = n / 2;
-    return copy_and_add(dest, src, half)
-	+ copy_and_add(dest + half, src + half * NUM_FLOATMAP_CHANNELS, n - half);
+    if (*p == NULL)
+    {
+	plan = g_new0(fft_plan_t, 1);
+
+	plan->inverse = inverse;
+	plan->width = width;
+	plan->height = height;
+	plan->num_channels = num_channels;
+	plan->num_threads = num_threads;
+	plan->plan = make_plan(inverse, width, height, num_channels, num_threads);
+    }
+
+    plan->next = plans;
+    plans = plan;
+
+    ++plan->num_users;
+
+    evict_plans();
+
+    g_static_mutex_unlock(&plan_mutex);
+
+    return plan;
+}
+
+static void
+release_plan (fft_plan_t *plan)
+{
+    g_static_mutex_lock(&plan_mutex);
+    g_assert(plan->num_users > 0);
+    --plan->num_users;
+    g_static_mutex_unlock(&plan_mutex);
+}
+
+static float*
+alloc_real (image_t *floatmap)
+{
+    return fftwf_malloc(sizeof(float) * floatmap->pixel_width * floatmap->pixel_height * NUM_FLOATMAP_CHANNELS);
+}
+
+static fftwf_complex*
+alloc_freq (image_t *floatmap, int num_channels)
+{
+    return fftwf_malloc(sizeof(fftwf_complex) * floatmap->pixel_height * (floatmap->pixel_width / 2 + 1)
+			* num_channels);
+}
+
+/* Stores the transform of the floatmap's first num_channels channels
+   in freq.  real is used as scratch space. */
+static void
+forward_transform (fft_plan_t *plan, image_t *floatmap, float *real, fftwf_complex *freq)
+{
+    memcpy(real, floatmap->v.floatmap.data,
+	   sizeof(float) * floatmap->pixel_width * floatmap->pixel_height * NUM_FLOATMAP_CHANNELS);
+    fftwf_execute_dft_r2c(plan->plan, real, freq);
+}
+
+/* Transforms freq back, destroying it, and stores the result,
+   normalized, in the first num_channels channels of out_image. */
+static void
+inverse_transform (fft_plan_t *plan, fftwf_complex *freq, float *real, image_t *out_image, int num_channels)
+{
+    int n = out_image->pixel_width * out_image->pixel_height;
+    float factor = 1.0 / n;
+    int i, channel;
+
+    fftwf_execute_dft_c2r(plan->plan, freq, real);
+
+    for (i = 0; i < n; ++i)
+	for (channel = 0; channel < num_channels; ++channel)
+	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel]
+		= real[i * NUM_FLOATMAP_CHANNELS + channel] * factor;
+}
+
+static void
+copy_alpha_channel (image_t *out_image, image_t *in_image)
+{
+    int n = in_image->pixel_width * in_image->pixel_height;
+    int i;
+
+    for (i = 0; i < n; ++i)
+	out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
+	    = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
 }
 
 CALLBACK_SYMBOL
@@ -74,9 +299,9 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
     gboolean normalize = args[2].v.bool_const != 0.0;
     gboolean copy_alpha = args[3].v.bool_const != 0.0;
     image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out, *filter_out;
-    fftw_plan in_plan, filter_plan, inverse_plan;
+    float *real;
+    fftwf_complex *image_freq, *filter_freq;
+    fft_plan_t *forward_plan, *inverse_plan;
     int i, n, nhalf, cn, channel, num_channels;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_convolve);
@@ -92,81 +317,66 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     cn = in_image->pixel_height * (in_image->pixel_width / 2 + 1);
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-    filter_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    filter_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-					fftw_in, filter_out,
-					FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
-
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
+
+    forward_plan = get_plan(invocation, FALSE, in_image->pixel_width, in_image->pixel_height, num_channels);
+    inverse_plan = get_plan(invocation, TRUE, in_image->pixel_width, in_image->pixel_height, num_channels);
+
+    real = alloc_real(in_image);
+    image_freq = alloc_freq(in_image, num_channels);
+    filter_freq = alloc_freq(in_image, num_channels);
+
+    // FFT of input image
+    forward_transform(forward_plan, in_image, real, image_freq);
+
+    // FFT of kernel image, with its center moved to the origin
+    memcpy(real, filter_image->v.floatmap.data + (n - nhalf) * NUM_FLOATMAP_CHANNELS,
+	   sizeof(float) * nhalf * NUM_FLOATMAP_CHANNELS);
+    memcpy(real + nhalf * NUM_FLOATMAP_CHANNELS, filter_image->v.floatmap.data,
+	   sizeof(float) * (n - nhalf) * NUM_FLOATMAP_CHANNELS);
+    if (normalize)
     {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
+	double sums[NUM_FLOATMAP_CHANNELS] = { 0.0, 0.0, 0.0, 0.0 };
+	float factors[NUM_FLOATMAP_CHANNELS];
 
-	// FFT of kernel image
-	if (normalize)
-	{
-	    double d1 = copy_and_add(fftw_in,
-				     filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS,
-				     nhalf);
-	    double d2 = copy_and_add(fftw_in + nhalf,
-				     filter_image->v.floatmap.data + channel,
-				     n - nhalf);
-	    double factor = 1.0 / (d1 + d2);
-
-	    for (i = 0; i < n; ++i)
-		fftw_in[i] *= factor;
-	}
-	else
-	{
-	    copy(fftw_in, filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf);
-	    copy(fftw_in + nhalf, filter_image->v.floatmap.data + channel, n - nhalf);
-	}
-	fftw_execute(filter_plan);
+	for (i = 0; i < n; ++i)
+	    for (channel = 0; channel < num_channels; ++channel)
+		sums[channel] += real[i * NUM_FLOATMAP_CHANNELS + channel];
 
-	// multiply in frequency domain
-	for (i = 0; i < cn; ++i)
-	    image_out[i] *= filter_out[i];
+	for (channel = 0; channel < num_channels; ++channel)
+	    factors[channel] = 1.0 / sums[channel];
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
 	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
+	    for (channel = 0; channel < num_channels; ++channel)
+		real[i * NUM_FLOATMAP_CHANNELS + channel] *= factors[channel];
     }
+    fftwf_execute_dft_r2c(forward_plan->plan, real, filter_freq);
+
+    // multiply in frequency domain
+    for (i = 0; i < cn * num_channels; ++i)
+	image_freq[i] *= filter_freq[i];
+
+    // reverse FFT
+    inverse_transform(inverse_plan, image_freq, real, out_image, num_channels);
 
-    // copy alpha channel
     if (copy_alpha)
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
+	copy_alpha_channel(out_image, in_image);
 
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(filter_plan);
-    fftw_destroy_plan(inverse_plan);
+    release_plan(forward_plan);
+    release_plan(inverse_plan);
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
-    fftw_free(filter_out);
+    fftwf_free(real);
+    fftwf_free(image_freq);
+    fftwf_free(filter_freq);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
@@ -182,10 +392,11 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
     image_t *filter_image = args[1].v.image;
     gboolean copy_alpha = args[2].v.bool_const != 0.0;
     image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out;
-    fftw_plan in_plan, inverse_plan;
-    int i, n, nhalf, cn, cw, channel, num_channels;
+    float *real;
+    fftwf_complex *image_freq;
+    fft_plan_t *forward_plan, *inverse_plan;
+    int n, nhalf, cn, cw, channel, num_channels;
+    int x, y;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_half_convolve);
     if (cache_entry->image != NULL)
@@ -200,66 +411,55 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
 	filter_image = render_image(invocation, filter_image,
 				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
-
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
-    {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
 
-	// multiply in frequency domain
-	int x, y;
+    forward_plan = get_plan(invocation, FALSE, in_image->pixel_width, in_image->pixel_height, num_channels);
+    inverse_plan = get_plan(invocation, TRUE, in_image->pixel_width, in_image->pixel_height, num_channels);
 
-	for (y = 0; y < in_image->pixel_height; ++y)
-	    for (x = 0; x < cw; ++x)
-	    {
-		int out_idx = x + y * in_image->pixel_width;
-		int in_idx = out_idx + nhalf;
+    real = alloc_real(in_image);
+    image_freq = alloc_freq(in_image, num_channels);
 
-		if (in_idx >= n)
-		    in_idx -= n;
+    // FFT of input image
+    forward_transform(forward_plan, in_image, real, image_freq);
 
-		image_out[x + y * cw] *= filter_image->v.floatmap.data[in_idx * NUM_FLOATMAP_CHANNELS + channel];
-	    }
+    // multiply in frequency domain
+    for (y = 0; y < in_image->pixel_height; ++y)
+	for (x = 0; x < cw; ++x)
+	{
+	    int out_idx = x + y * in_image->pixel_width;
+	    int in_idx = out_idx + nhalf;
+	    float *filter_pixel;
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
-    }
+	    if (in_idx >= n)
+		in_idx -= n;
+
+	    filter_pixel = filter_image->v.floatmap.data + in_idx * NUM_FLOATMAP_CHANNELS;
+
+	    for (channel = 0; channel < num_channels; ++channel)
+		image_freq[channel * cn + x + y * cw] *= filter_pixel[channel];
+	}
+
+    // reverse FFT
+    inverse_transform(inverse_plan, image_freq, real, out_image, num_channels);
 
-    // copy alpha channel
     if (copy_alpha)
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
+	copy_alpha_channel(out_image, in_image);
 
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(inverse_plan);
+    release_plan(forward_plan);
+    release_plan(inverse_plan);
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
+    fftwf_free(real);
+    fftwf_free(image_freq);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
@@ -274,10 +474,11 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
     image_t *in_image = args[0].v.image;
     gboolean ignore_alpha = args[1].v.bool_const != 0.0;
     image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out;
-    fftw_plan in_plan;
-    int i, n, nhalf, cn, cw, channel, num_channels;
+    float *real;
+    fftwf_complex *image_freq;
+    fft_plan_t *forward_plan;
+    int i, n, cn, cw, channel, num_channels;
+    int x, y;
     double sqrtn;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_visualize_fft);
@@ -288,37 +489,32 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	in_image = render_image(invocation, in_image,
 				invocation->render_width, invocation->render_height, pools, TRUE);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &cache_entry->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
-    nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     sqrtn = sqrt(n);
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
+    if (ignore_alpha)
+	num_channels = 3;
+    else
+	num_channels = 4;
+
+    forward_plan = get_plan(invocation, FALSE, in_image->pixel_width, in_image->pixel_height, num_channels);
 
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
+    real = alloc_real(in_image);
+    image_freq = alloc_freq(in_image, num_channels);
 
     memset(out_image->v.floatmap.data, 0,
 	   sizeof(float) * in_image->pixel_width * in_image->pixel_height * NUM_FLOATMAP_CHANNELS);
 
-    if (ignore_alpha)
-	num_channels = 3;
-    else
-	num_channels = 4;
+    // FFT of input image
+    forward_transform(forward_plan, in_image, real, image_freq);
+
     for (channel = 0; channel < num_channels; ++channel)
     {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
-
-	// multiply in frequency domain
-	int x, y;
+	fftwf_complex *channel_freq = image_freq + channel * cn;
 
 	for (y = 0; y < in_image->pixel_height; ++y)
 	{
@@ -331,7 +527,7 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	    {
 		int out_x1 = cw - 1 - x;
 		int out_x2 = x + in_image->pixel_width - cw;
-		double val = cabs(image_out[x + y * cw]) / sqrtn;
+		double val = cabsf(channel_freq[x + y * cw]) / sqrtn;
 
 		out_image->v.floatmap.data[(out_x1 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
 		    = val;
@@ -346,10 +542,10 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	for (i = 0; i < n; ++i)
 	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3] = 1.0;
 
-    fftw_destroy_plan(in_plan);
+    release_plan(forward_plan);
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
+    fftwf_free(real);
+    fftwf_free(image_freq);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
@@ -35,8 +35,24 @@
 
 #include "native-filters.h"
 
+/* The recursive filter runs on blocks of this many pixels at a time,
+   with all their channels interleaved. */
+#define IIR_BLOCK_PIXELS	16
+#define IIR_MAX_LANES		(IIR_BLOCK_PIXELS * NUM_FLOATMAP_CHANNELS)
+/* number of blocks a render thread grabs at once */
+#define IIR_BLOCKS_PER_TILE	4
+
+typedef struct
+{
+    double n_p[5], n_m[5];
+    double d_p[5], d_m[5];
+    /* the output of the causal and the anti-causal filter for a
+       constant input of 1 */
+    double steady_p, steady_m;
+} iir_constants_t;
+
 static void
-find_iir_constants (double *n_p, double *n_m, double *d_p, double *d_m, double *bd_p, double *bd_m, float std_dev)
+find_iir_constants (iir_constants_t *c, float std_dev)
 {
     int i;
     double x0;
@@ -63,34 +79,33 @@ find_iir_constants (double *n_p, double *n_m, double *d_p, double *d_m, double *
     x6 = -0.6803 / div;
     x7 = -0.2598 / div;
 
-    n_p [0] = x4 + x6;
-    n_p [1] = (exp(x1)*(x7*sin(x3)-(x6+2*x4)*cos(x3)) +
-	       exp(x0)*(x5*sin(x2) - (2*x6+x4)*cos (x2)));
-    n_p [2] = (2 * exp(x0+x1) *
-	       ((x4+x6)*cos(x3)*cos(x2) - x5*cos(x3)*sin(x2) -
-		x7*cos(x2)*sin(x3)) +
-	       x6*exp(2*x0) + x4*exp(2*x1));
-    n_p [3] = (exp(x1+2*x0) * (x7*sin(x3) - x6*cos(x3)) +
-	       exp(x0+2*x1) * (x5*sin(x2) - x4*cos(x2)));
-    n_p [4] = 0.0;
-
-    d_p [0] = 0.0;
-    d_p [1] = -2 * exp(x1) * cos(x3) -  2 * exp(x0) * cos (x2);
-    d_p [2] = 4 * cos(x3) * cos(x2) * exp(x0 + x1) +  exp(2 * x1) + exp(2 * x0);
-    d_p [3] = -2 * cos(x2) * exp(x0 + 2*x1) -  2*cos(x3) * exp(x1 + 2*x0);
-    d_p [4] = exp(2*x0 + 2*x1);
+    c->n_p [0] = x4 + x6;
+    c->n_p [1] = (exp(x1)*(x7*sin(x3)-(x6+2*x4)*cos(x3)) +
+		  exp(x0)*(x5*sin(x2) - (2*x6+x4)*cos (x2)));
+    c->n_p [2] = (2 * exp(x0+x1) *
+		  ((x4+x6)*cos(x3)*cos(x2) - x5*cos(x3)*sin(x2) -
+		   x7*cos(x2)*sin(x3)) +
+		  x6*exp(2*x0) + x4*exp(2*x1));
+    c->n_p [3] = (exp(x1+2*x0) * (x7*sin(x3) - x6*cos(x3)) +
+		  exp(x0+2*x1) * (x5*sin(x2) - x4*cos(x2)));
+    c->n_p [4] = 0.0;
+
+    c->d_p [0] = 0.0;
+    c->d_p [1] = -2 * exp(x1) * cos(x3) -  2 * exp(x0) * cos (x2);
+    c->d_p [2] = 4 * cos(x3) * cos(x2) * exp(x0 + x1) +  exp(2 * x1) + exp(2 * x0);
+    c->d_p [3] = -2 * cos(x2) * exp(x0 + 2*x1) -  2*cos(x3) * exp(x1 + 2*x0);
+    c->d_p [4] = exp(2*x0 + 2*x1);
 
     for (i = 0; i <= 4; i++)
-	d_m[i] = d_p[i];
+	c->d_m[i] = c->d_p[i];
 
-    n_m[0] = 0.0;
+    c->n_m[0] = 0.0;
 
     for (i = 1; i <= 4; i++)
-	n_m[i] = n_p[i] - d_p[i] * n_p[0];
+	c->n_m[i] = c->n_p[i] - c->d_p[i] * c->n_p[0];
 
     {
 	double sum_n_p, sum_n_m, sum_d;
-	double a, b;
 
 	sum_n_p = 0.0;
 	sum_n_m = 0.0;
@@ -98,167 +113,207 @@ find_iir_constants (double *n_p, double *n_m, double *d_p, double *d_m, double *
 
 	for (i = 0; i <= 4; i++)
 	{
-	    sum_n_p += n_p[i];
-	    sum_n_m += n_m[i];
-	    sum_d += d_p[i];
+	    sum_n_p += c->n_p[i];
+	    sum_n_m += c->n_m[i];
+	    sum_d += c->d_p[i];
 	}
 
-	a = sum_n_p / (1.0 + sum_d);
-	b = sum_n_m / (1.0 + sum_d);
-
-	for (i = 0; i <= 4; i++)
-	{
-	    bd_p[i] = d_p[i] * a;
-	    bd_m[i] = d_m[i] * b;
-	}
+	c->steady_p = sum_n_p / (1.0 + sum_d);
+	c->steady_m = sum_n_m / (1.0 + sum_d);
     }
 }
 
+/*
+ * Filters num_lanes independent signals of length n.  Element i of
+ * signal l is src[i * stride + l], and its result is stored at the
+ * same place in dest, which must not overlap src.  Beyond its ends a
+ * signal continues with its first and last element, respectively.
+ *
+ * The inner loops go over the lanes, which are adjacent in memory,
+ * so they vectorize, and each element is read from memory in the
+ * order it's stored in.
+ */
 static void
-transfer_pixels (const double *src1, const double *src2, float *dest, int width)
+iir_filter_lanes (const iir_constants_t *c, const float *src, float *dest, int stride, int n, int num_lanes)
 {
-    int b;
+    double x1[IIR_MAX_LANES], x2[IIR_MAX_LANES], x3[IIR_MAX_LANES], x4[IIR_MAX_LANES];
+    double y1[IIR_MAX_LANES], y2[IIR_MAX_LANES], y3[IIR_MAX_LANES], y4[IIR_MAX_LANES];
+    const float *s;
+    float *d;
+    int i, l;
 
-    for (b = 0; b < width; b++)
-	*dest++ = *src1++ + *src2++;
-}
-
-static image_t*
-gauss_iir (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
-{
-    image_t *out;
-    int width = floatmap->pixel_width;
-    int height = floatmap->pixel_height;
-    float *dest;
-    float *src, *sp_p, *sp_m;
-    double n_p[5], n_m[5];
-    double d_p[5], d_m[5];
-    double bd_p[5], bd_m[5];
-    double *val_p;
-    double *val_m;
-    double *vp, *vm;
-    int i, j;
-    int row, col;
-    int terms;
-    float initial_p;
-    float initial_m;
-    int channel;
+    g_assert(num_lanes <= IIR_MAX_LANES);
 
-    out = floatmap_copy(floatmap, pools);
+    /* the causal pass stores its result in dest */
+    for (l = 0; l < num_lanes; ++l)
+    {
+	x1[l] = x2[l] = x3[l] = src[l];
+	y1[l] = y2[l] = y3[l] = y4[l] = c->steady_p * src[l];
+    }
 
-    val_p = g_malloc(MAX(width, height) * sizeof(double));
-    val_m = g_malloc(MAX(width, height) * sizeof(double));
+    for (i = 0, s = src, d = dest; i < n; ++i, s += stride, d += stride)
+	for (l = 0; l < num_lanes; ++l)
+	{
+	    double x0 = s[l];
+	    double y0 = c->n_p[0] * x0 + c->n_p[1] * x1[l] + c->n_p[2] * x2[l] + c->n_p[3] * x3[l]
+		- c->d_p[1] * y1[l] - c->d_p[2] * y2[l] - c->d_p[3] * y3[l] - c->d_p[4] * y4[l];
 
-    src = g_malloc(MAX(width, height) * sizeof(float));
-    dest = g_malloc(MAX(width, height) * sizeof(float));
+	    x3[l] = x2[l];
+	    x2[l] = x1[l];
+	    x1[l] = x0;
 
-    /*  First the vertical pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, vertical_std_dev);
+	    y4[l] = y3[l];
+	    y3[l] = y2[l];
+	    y2[l] = y1[l];
+	    y1[l] = y0;
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (col = 0; col < width; col++)
-	{
-	    memset (val_p, 0, height * sizeof (double));
-	    memset (val_m, 0, height * sizeof (double));
+	    d[l] = y0;
+	}
 
-	    floatmap_get_channel_column(src, out, col, channel);
+    /* the anti-causal pass adds to it */
+    s = src + (long)(n - 1) * stride;
+    d = dest + (long)(n - 1) * stride;
 
-	    sp_p = src;
-	    sp_m = src + (height - 1);
-	    vp = val_p;
-	    vm = val_m + (height - 1);
+    for (l = 0; l < num_lanes; ++l)
+    {
+	x1[l] = x2[l] = x3[l] = x4[l] = s[l];
+	y1[l] = y2[l] = y3[l] = y4[l] = c->steady_m * s[l];
+    }
 
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
+    for (i = 0; i < n; ++i, s -= stride, d -= stride)
+	for (l = 0; l < num_lanes; ++l)
+	{
+	    double y0 = c->n_m[1] * x1[l] + c->n_m[2] * x2[l] + c->n_m[3] * x3[l] + c->n_m[4] * x4[l]
+		- c->d_m[1] * y1[l] - c->d_m[2] * y2[l] - c->d_m[3] * y3[l] - c->d_m[4] * y4[l];
 
-	    for (row = 0; row < height; row++)
-	    {
-		double *vpptr, *vmptr;
-		terms = (row < 4) ? row : 4;
+	    x4[l] = x3[l];
+	    x3[l] = x2[l];
+	    x2[l] = x1[l];
+	    x1[l] = s[l];
 
-		vpptr = vp; vmptr = vm;
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
+	    y4[l] = y3[l];
+	    y3[l] = y2[l];
+	    y2[l] = y1[l];
+	    y1[l] = y0;
 
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
-	    }
+	    d[l] += y0;
+	}
+}
 
-	    transfer_pixels (val_p, val_m, dest, height);
+typedef struct
+{
+    iir_constants_t constants;
+    image_t *in;
+    image_t *out;
+} iir_pass_t;
 
-	    floatmap_set_channel_column(out, col, channel, dest);
-	}
+/* Blocks of columns are filtered right in the floatmaps - the
+   pixels of a row of a block are adjacent. */
+static void
+iir_vertical_blocks (int first_block, int last_block, gpointer data)
+{
+    iir_pass_t *pass = data;
+    int width = pass->in->pixel_width;
+    int height = pass->in->pixel_height;
+    int block;
 
-    /*  Now the horizontal pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, horizontal_std_dev);
+    for (block = first_block; block < last_block; ++block)
+    {
+	int col = block * IIR_BLOCK_PIXELS;
+	int num_pixels = MIN(IIR_BLOCK_PIXELS, width - col);
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (row = 0; row < height; row++)
-	{
-	    memset (val_p, 0, width * sizeof (double));
-	    memset (val_m, 0, width * sizeof (double));
+	iir_filter_lanes(&pass->constants,
+			 pass->in->v.floatmap.data + col * NUM_FLOATMAP_CHANNELS,
+			 pass->out->v.floatmap.data + col * NUM_FLOATMAP_CHANNELS,
+			 width * NUM_FLOATMAP_CHANNELS, height, num_pixels * NUM_FLOATMAP_CHANNELS);
+    }
+}
 
-	    floatmap_get_channel_row(src, out, row, channel);
+/* Copies num_rows rows of the floatmap, starting at first_row, to or
+   from buf, where the pixels of a column are adjacent.  We go
+   through the image in blocks so that both sides stay in the
+   cache. */
+static void
+transpose_rows (image_t *floatmap, float *buf, int first_row, int num_rows, gboolean to_buf)
+{
+    int width = floatmap->pixel_width;
+    int lanes = num_rows * NUM_FLOATMAP_CHANNELS;
+    int col0, row, col;
 
-	    sp_p = src;
-	    sp_m = src + (width - 1);
-	    vp = val_p;
-	    vm = val_m + (width - 1);
+    for (col0 = 0; col0 < width; col0 += IIR_BLOCK_PIXELS)
+    {
+	int num_cols = MIN(IIR_BLOCK_PIXELS, width - col0);
 
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
+	for (row = 0; row < num_rows; ++row)
+	{
+	    float *p = floatmap->v.floatmap.data + ((first_row + row) * width + col0) * NUM_FLOATMAP_CHANNELS;
+	    float *q = buf + col0 * lanes + row * NUM_FLOATMAP_CHANNELS;
 
-	    for (col = 0; col < width; col++)
+	    for (col = 0; col < num_cols; ++col, p += NUM_FLOATMAP_CHANNELS, q += lanes)
 	    {
-		double *vpptr, *vmptr;
+		if (to_buf)
+		    memcpy(q, p, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+		else
+		    memcpy(p, q, sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	    }
+	}
+    }
+}
 
-		terms = (col < 4) ? col : 4;
+/* Blocks of rows are transposed into a buffer, filtered there and
+   transposed back. */
+static void
+iir_horizontal_blocks (int first_block, int last_block, gpointer data)
+{
+    iir_pass_t *pass = data;
+    int width = pass->out->pixel_width;
+    int height = pass->out->pixel_height;
+    float *src = g_new(float, width * IIR_MAX_LANES);
+    float *dest = g_new(float, width * IIR_MAX_LANES);
+    int block;
+
+    for (block = first_block; block < last_block; ++block)
+    {
+	int row = block * IIR_BLOCK_PIXELS;
+	int num_rows = MIN(IIR_BLOCK_PIXELS, height - row);
+	int lanes = num_rows * NUM_FLOATMAP_CHANNELS;
 
-		vpptr = vp;
-		vmptr = vm;
+	transpose_rows(pass->out, src, row, num_rows, TRUE);
+	iir_filter_lanes(&pass->constants, src, dest, lanes, width, lanes);
+	transpose_rows(pass->out, dest, row, num_rows, FALSE);
+    }
 
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
+    g_free(src);
+    g_free(dest);
+}
 
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
-	    }
+static image_t*
+gauss_iir (mathmap_invocation_t *invocation, image_t *floatmap, float horizontal_std_dev, float vertical_std_dev,
+	   mathmap_pools_t *pools)
+{
+    int width = floatmap->pixel_width;
+    int height = floatmap->pixel_height;
+    iir_pass_t pass;
 
-	    transfer_pixels (val_p, val_m, dest, width);
+    pass.in = floatmap;
+    pass.out = floatmap_alloc(width, height, pools);
 
-	    floatmap_set_channel_row(out, row, channel, dest);
-	}
+    pass.out->v.floatmap.ax = floatmap->v.floatmap.ax;
+    pass.out->v.floatmap.bx = floatmap->v.floatmap.bx;
+    pass.out->v.floatmap.ay = floatmap->v.floatmap.ay;
+    pass.out->v.floatmap.by = floatmap->v.floatmap.by;
 
-    /*  free up buffers  */
-    g_free (val_p);
-    g_free (val_m);
+    /*  First the vertical pass  */
+    find_iir_constants(&pass.constants, vertical_std_dev);
+    invocation_parallel_for_and_join(invocation, (width + IIR_BLOCK_PIXELS - 1) / IIR_BLOCK_PIXELS,
+				     IIR_BLOCKS_PER_TILE, iir_vertical_blocks, &pass);
 
-    g_free (src);
-    g_free (dest);
+    /*  Now the horizontal pass  */
+    find_iir_constants(&pass.constants, horizontal_std_dev);
+    invocation_parallel_for_and_join(invocation, (height + IIR_BLOCK_PIXELS - 1) / IIR_BLOCK_PIXELS,
+				     IIR_BLOCKS_PER_TILE, iir_horizontal_blocks, &pass);
 
-    return out;
+    return pass.out;
 }
 
 static void
@@ -660,9 +715,9 @@ native_filter_gaussian_blur (mathmap_invocation_t *invocation, userval_t *args,
     vertical_std_dev = fabs(vertical_std_dev * floatmap->v.floatmap.ay);
 
     if (horizontal_std_dev < 0.5 || vertical_std_dev < 0.5)
-	result = gauss_rle(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_rle(floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
     else
-	result = gauss_iir(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_iir(invocation, floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, result);
 
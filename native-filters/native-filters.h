@@ -35,4 +35,9 @@ extern image_t* native_filter_half_convolve (mathmap_invocation_t *invocation, u
 extern image_t* native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args, mathmap_pools_t *pools);
 /* END */
 
+/* Must be called before the first FFT filter is run.  If measure is
+   set, FFTW measures plans instead of estimating them.  Wisdom is
+   read from and saved to wisdom_filename if it's not NULL. */
+void native_filters_set_fft_planning (gboolean measure, const char *wisdom_filename);
+
 #endif
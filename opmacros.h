@@ -172,12 +172,22 @@
 #define TUPLE_SET(t,n,x)		((t)[(n)] = (x))
 #define TUPLE_NTH(t,n)			((t)[(n)])
 #define OUTPUT_TUPLE(t)			((return_tuple = (t)), 0)
+/* outputs a tuple in local storage - the template redefines this
+   where the tuple has to outlive the pixel code */
+#define OUTPUT_LOCAL_TUPLE(t)		OUTPUT_TUPLE((t))
+
+#define TUPLE_SET_COLOR(t,c)	(TUPLE_SET((t), 0, RED_FLOAT((c))), \
+	    			 TUPLE_SET((t), 1, GREEN_FLOAT((c))), \
+	    			 TUPLE_SET((t), 2, BLUE_FLOAT((c))), \
+	    			 TUPLE_SET((t), 3, ALPHA_FLOAT((c))))
+#define TUPLE_COPY_4(t,s)	({ float *__src = (s); \
+				   TUPLE_SET((t), 0, __src[0]); \
+				   TUPLE_SET((t), 1, __src[1]); \
+				   TUPLE_SET((t), 2, __src[2]); \
+				   TUPLE_SET((t), 3, __src[3]); })
 
 #define TUPLE_FROM_COLOR(c)	({ float *tuple = ALLOC_TUPLE(4); \
-	    			   TUPLE_SET(tuple, 0, RED_FLOAT((c))); \
-	    			   TUPLE_SET(tuple, 1, GREEN_FLOAT((c))); \
-	    			   TUPLE_SET(tuple, 2, BLUE_FLOAT((c))); \
-	    			   TUPLE_SET(tuple, 3, ALPHA_FLOAT((c))); \
+				   TUPLE_SET_COLOR(tuple, (c)); \
 				   tuple; })
 
 #define TUPLE_RED(t)		CLAMP01(TUPLE_NTH((t),0))
@@ -192,6 +202,8 @@
 #define APPLY_CURVE(c,p)	((c)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))])
 #define APPLY_GRADIENT(g,p)	({ color_t color = (g)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))]; \
 	    			   TUPLE_FROM_COLOR(color); })
+#define APPLY_GRADIENT_INTO(t,g,p)	({ color_t color = (g)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))]; \
+					   TUPLE_SET_COLOR((t), color); })
 
 #define RESIZE_IMAGE(i,xf,yf)	(make_resize_image((i), (xf), (yf), pools))
 #define STRIP_RESIZE(i)		((i)->type == IMAGE_RESIZE ? (i)->v.resize.original : (i))
@@ -215,6 +227,27 @@
 				   }					\
 				   result; })
 
+/* Like ORIG_VAL, but stores the pixel in the local tuple t instead
+   of allocating one.  See compiler_local_tuple_length(). */
+#define ORIG_VAL_INTO(t,ix,iy,i,f)	({ float x = (ix);		\
+					   float y = (iy);		\
+					   image_t *img = (i);		\
+					   if (img->type == IMAGE_RESIZE) { \
+					       x *= img->v.resize.x_factor; \
+					       y *= img->v.resize.y_factor; \
+					       img = img->v.resize.original; \
+					   }				\
+					   if (img->type == IMAGE_CLOSURE) \
+					       TUPLE_COPY_4((t), img->v.closure.func(invocation, img, (x), (y), (f), pools)); \
+					   else if (img->type == IMAGE_FLOATMAP) \
+					       TUPLE_COPY_4((t), get_floatmap_pixel(invocation, img, (x), (y), (f))); \
+					   else {			\
+					       color_t color = get_orig_val_pixel_func(invocation, (x), (y), img, (f)); \
+					       TUPLE_SET_COLOR((t), color); \
+					   }				\
+					   0; })
+
 #define RENDER(i,w,h)	      (render_image(invocation, (i), (w), (h), pools, 0))
+#define RENDER_FRAME(i,w,h,t) (render_image_frame(invocation, (i), (w), (h), (t), pools, 0))
 
 #endif
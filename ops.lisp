@@ -175,6 +175,8 @@
 
 (defop 'render 3 "RENDER" :interpreter-c-name "RENDER_INTERPRETER" :type 'image
        :arg-types '(image int int) :foldable nil)
+(defop 'render-frame 4 "RENDER_FRAME" :interpreter-c-name "RENDER_FRAME_INTERPRETER" :type 'image
+       :arg-types '(image int int float) :foldable nil)
 
 (defop 'image-pixel-width 1 "IMAGE_PIXEL_WIDTH" :type 'int :arg-type 'image :foldable nil)
 (defop 'image-pixel-height 1 "IMAGE_PIXEL_HEIGHT" :type 'int :arg-type 'image :foldable nil)
@@ -463,6 +465,36 @@
 	  (dolist (type (op-instantiation-type-prop-types op))
 	    (print-op op type)))))))
 
+;; For each op instantiation, the interpreter gets a function that
+;; applies it to registers, plus a switch that looks up the function
+;; for an op and its promotion type.
+(defun make-interpreter-ops-file ()
+  (labels ((print-op (op type)
+	     (let ((op-type (op-instantiation-type op type))
+		   (arg-types (op-instantiation-arg-types op type)))
+	       (format t "static void~%interpreter_~A (interpreter_context_t *ctx, runtime_value_t *result, runtime_value_t *regs, int *args)~%{~%INTERPRETER_OP_PROLOGUE;~%result->~A_value = ~A(~{regs[args[~A]].~A_value~^, ~});~%}~%~%"
+		       (op-instantiation-name op type)
+		       (dcs (rt-type-name op-type))
+		       (op-interpreter-c-name op)
+		       (mappend #'(lambda (i)
+				    (list i (dcs (rt-type-name (nth i arg-types)))))
+				(integers-upto (op-arity op)))))))
+    (with-open-file (out "interpreter-ops.h" :direction :output :if-exists :supersede)
+      (let ((*standard-output* out))
+	(dolist (op (reverse *operators*))
+	  (dolist (type (op-instantiation-type-prop-types op))
+	    (print-op op type)))
+	(format t "static interpreter_op_func_t~%interpreter_op_func (int op_index, int type)~%{~%switch (op_index)~%{~%")
+	(dolist (op (reverse *operators*))
+	  (format t "case ~A :~%" (op-c-define op))
+	  (if (eq (op-type-prop op) 'const)
+	      (format t "return interpreter_~A;~%" (op-instantiation-name op nil))
+	      (format t "switch (type)~%{~%~{case ~A : return interpreter_~A;~%~}default : g_assert_not_reached();~%}~%"
+		      (mappend #'(lambda (type)
+				   (list (rt-type-c-define type) (op-instantiation-name op type)))
+			       (max-type-prop-types (op-type-prop op))))))
+	(format t "default : g_assert_not_reached();~%}~%}~%")))))
+
 (defun make-op-names-switch ()
   (make-rhs-op-switch #'(lambda (op)
 			  (format nil "return \"builtin_~A\";" (op-instantiation-name op nil)))
@@ -25,6 +25,8 @@
 #include <assert.h>
 #include <ctype.h>
 
+#include <glib.h>
+
 #include "lispreader/lispreader.h"
 #include "tags.h"
 
@@ -37,6 +39,9 @@ extern int oaparse (void);
 static overload_entry_t *first_overload_entry = 0, *last_overload_entry = 0;
 static named_binding_t *first_named_binding = 0;
 
+/* resolving binds the free variables of the entries while matching */
+static GStaticMutex resolve_mutex = G_STATIC_MUTEX_INIT;
+
 binding_t*
 new_free_variable_binding (void)
 {
@@ -223,6 +228,8 @@ resolve_function_call (const char *name, function_arg_info_t *args, tuple_info_t
 
     undo_array = (binding_t**)malloc(2 * num_args * sizeof(binding_t*));
 
+    g_static_mutex_lock(&resolve_mutex);
+
     for (entry = first_overload_entry; entry != 0; entry = entry->next)
 	if (strcmp(entry->name, name) == 0 && entry->num_args == num_args)
 	{
@@ -269,11 +276,14 @@ resolve_function_call (const char *name, function_arg_info_t *args, tuple_info_t
 
 	    if (match)
 	    {
+		g_static_mutex_unlock(&resolve_mutex);
 		free(undo_array);
 		return entry;
 	    }
 	}
 
+    g_static_mutex_unlock(&resolve_mutex);
+
     free(undo_array);
     return 0;
 }
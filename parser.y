@@ -32,6 +32,10 @@
 #include "scanner.h"
 %}
 
+%define api.pure
+%parse-param { scanner_t *scanner }
+%lex-param { scanner_t *scanner }
+
 %union {
     scanner_ident_t *ident;
     int arg_type;
@@ -42,6 +46,11 @@
     option_t *options;
 }
 
+%{
+int yylex (YYSTYPE *lvalp, scanner_t *scanner);
+int yyerror (scanner_t *scanner, char *s);
+%}
+
 %token T_IDENT T_STRING T_INT T_FLOAT T_RANGE
 %token T_FILTER
 %token T_FLOAT_TYPE T_INT_TYPE T_BOOL_TYPE T_COLOR_TYPE T_GRADIENT_TYPE T_CURVE_TYPE T_IMAGE_TYPE
@@ -273,10 +282,10 @@ end : T_END
 %%
 
 int
-yyerror (char *s)
+yyerror (scanner_t *scanner, char *s)
 {
     sprintf(error_string, _("Parse error."));
-    error_region = scanner_last_token_region();
+    error_region = scanner_last_token_region(scanner);
     JUMP(1);
 
     return 0;
@@ -130,6 +130,7 @@ write_lines (image_writer_t *writer, unsigned char *lines, int num_lines)
     assert(writer->num_lines_written + num_lines <= writer->height);
 
     writer->write_func(writer->data, lines, num_lines);
+    writer->num_lines_written += num_lines;
 }
 
 void
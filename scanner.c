@@ -404,31 +404,35 @@ next_highlight (const char *expr, int start, int *first, int *last)
     return highlight;
 }
 
-static scanner_state_t global_state;
-static scanner_region_t last_token_region;
+struct _scanner_t
+{
+    scanner_state_t state;
+    scanner_region_t last_token_region;
+};
 
-void
-scanFromString (const char *string)
+scanner_t*
+scanner_new_from_string (const char *string)
 {
-    g_assert(global_state.text == NULL);
-    global_state.text = g_strdup(string);
-    global_state.location.row = global_state.location.column = global_state.location.pos = 0;
-    last_token_region = scanner_null_region;
+    scanner_t *scanner = g_new0(scanner_t, 1);
+
+    scanner->state.text = g_strdup(string);
+    scanner->state.location.row = scanner->state.location.column = scanner->state.location.pos = 0;
+    scanner->last_token_region = scanner_null_region;
+
+    return scanner;
 }
 
 void
-endScanningFromString (void)
+scanner_free (scanner_t *scanner)
 {
-    g_assert(global_state.text != NULL);
-    g_free(global_state.text);
-    global_state.text = NULL;
-    last_token_region = scanner_null_region;
+    g_free(scanner->state.text);
+    g_free(scanner);
 }
 
 scanner_location_t
-scanner_location (void)
+scanner_location (scanner_t *scanner)
 {
-    return global_state.location;
+    return scanner->state.location;
 }
 
 static scanner_ident_t*
@@ -450,54 +454,54 @@ scanner_make_ident (scanner_region_t region, const char *str)
 }
 
 int
-yylex (void)
+yylex (YYSTYPE *lvalp, scanner_t *scanner)
 {
+    scanner_state_t *state = &scanner->state;
     scanner_token_t token;
 
-    g_assert(global_state.text != NULL);
-    switch (scan_token(&global_state, &token, NULL))
+    switch (scan_token(state, &token, NULL))
     {
 	case RESULT_ERROR :
 	    sprintf(error_string, "Invalid characters.");
 	    error_region.start = token.region.start;
-	    error_region.end = global_state.location;
+	    error_region.end = state->location;
 	    JUMP(1);
 	    break;
 
 	case RESULT_SUCCESS :
-	    token.region.end = global_state.location;
+	    token.region.end = state->location;
 	    switch (token.token)
 	    {
 		case T_IDENT :
-		    yylval.ident = make_ident(token.region,
-					      global_state.text + token.region.start.pos,
+		    lvalp->ident = make_ident(token.region,
+					      state->text + token.region.start.pos,
 					      token.region.end.pos - token.region.start.pos);
 		    break;
 
 		case T_STRING :
-		    yylval.ident = make_ident(token.region,
-					      global_state.text + token.region.start.pos + 1,
+		    lvalp->ident = make_ident(token.region,
+					      state->text + token.region.start.pos + 1,
 					      token.region.end.pos - token.region.start.pos - 2);
-		    ++yylval.ident->region.start.column;
-		    ++yylval.ident->region.start.pos;
-		    --yylval.ident->region.end.column;
-		    --yylval.ident->region.end.pos;
+		    ++lvalp->ident->region.start.column;
+		    ++lvalp->ident->region.start.pos;
+		    --lvalp->ident->region.end.column;
+		    --lvalp->ident->region.end.pos;
 		    break;
 
 		case T_INT :
 		    {
-			char *str = g_strndup(global_state.text + token.region.start.pos,
+			char *str = g_strndup(state->text + token.region.start.pos,
 					      token.region.end.pos - token.region.start.pos);
-			yylval.exprtree = make_int_number(atoi(str), token.region);
+			lvalp->exprtree = make_int_number(atoi(str), token.region);
 			g_free(str);
 		    }
 		    break;
 
 		case T_FLOAT :
 		    {
-			char *str = g_strndup(global_state.text + token.region.start.pos,
+			char *str = g_strndup(state->text + token.region.start.pos,
 					      token.region.end.pos - token.region.start.pos);
-			yylval.exprtree = make_float_number(g_ascii_strtod(str, NULL), token.region);
+			lvalp->exprtree = make_float_number(g_ascii_strtod(str, NULL), token.region);
 			g_free(str);
 		    }
 		    break;
@@ -518,13 +522,13 @@ yylex (void)
 		case '%' :
 		case '^' :
 		case '!' :
-		    yylval.ident = make_ident(token.region,
-					      global_state.text + token.region.start.pos,
+		    lvalp->ident = make_ident(token.region,
+					      state->text + token.region.start.pos,
 					      token.region.end.pos - token.region.start.pos);
 		    break;
 	    }
 
-	    last_token_region = token.region;
+	    scanner->last_token_region = token.region;
 
 	    return token.token;
 
@@ -572,7 +576,7 @@ scanner_region_merge (scanner_region_t r1, scanner_region_t r2)
 }
 
 scanner_region_t
-scanner_last_token_region (void)
+scanner_last_token_region (scanner_t *scanner)
 {
-    return last_token_region;
+    return scanner->last_token_region;
 }
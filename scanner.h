@@ -46,16 +46,18 @@ typedef struct
     char str[];
 } scanner_ident_t;
 
-void scanFromString (const char *string);
-void endScanningFromString (void);
+/* The state of scanning one string.  The parser gets the scanner
+   passed in, so several expressions can be parsed at the same time. */
+typedef struct _scanner_t scanner_t;
+
+scanner_t* scanner_new_from_string (const char *string);
+void scanner_free (scanner_t *scanner);
 
 /* This is updated by the scanner for each character scanned. */
-scanner_location_t scanner_location (void);
+scanner_location_t scanner_location (scanner_t *scanner);
 
 /* The region of the last successfully scanned token. */
-scanner_region_t scanner_last_token_region (void);
-
-int yylex (void);
+scanner_region_t scanner_last_token_region (scanner_t *scanner);
 
 #define HIGHLIGHT_EOS            0      /* end of string */
 #define HIGHLIGHT_ERROR          1
@@ -26,6 +26,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include <glib.h>
+
 #include "tags.h"
 #include "exprtree.h"
 
@@ -46,6 +48,8 @@ typedef struct _tag_entry
     struct _tag_entry *next;
 } tag_entry;
 
+/* new tags can be defined while parsing */
+static GStaticMutex tags_mutex = G_STATIC_MUTEX_INIT;
 static tag_entry *first = 0;
 static int num_tags = 0;
 
@@ -66,11 +70,18 @@ int
 tag_number_for_name (const char *name)
 {
     tag_entry *entry;
+    int number;
+
+    g_static_mutex_lock(&tags_mutex);
 
     for (entry = first; entry != 0; entry = entry->next)
     {
 	if (strcmp(name, entry->name) == 0)
-	    return entry->number;
+	{
+	    number = entry->number;
+	    g_static_mutex_unlock(&tags_mutex);
+	    return number;
+	}
     }
 
     entry = (tag_entry*)malloc(sizeof(tag_entry));
@@ -78,23 +89,33 @@ tag_number_for_name (const char *name)
     entry->name = strdup(name);
     assert(entry->name != 0);
 
-    entry->number = ++num_tags;
+    entry->number = number = ++num_tags;
     entry->next = first;
     first = entry;
 
-    return entry->number;
+    g_static_mutex_unlock(&tags_mutex);
+
+    return number;
 }
 
 const char*
 tag_name_for_number (int num)
 {
     tag_entry *entry;
+    const char *name = 0;
+
+    g_static_mutex_lock(&tags_mutex);
 
     for (entry = first; entry != 0; entry = entry->next)
     {
 	if (entry->number == num)
-	    return entry->name;
+	{
+	    name = entry->name;
+	    break;
+	}
     }
 
-    return 0;
+    g_static_mutex_unlock(&tags_mutex);
+
+    return name;
 }
@@ -0,0 +1,225 @@
+#!/usr/bin/perl
+
+# Benchmarks all scripts in ../examples and in this directory and
+# optionally compares the results against a stored baseline.  Run it
+# from the tests directory after building MathMap:
+#
+#   ./run_bench.pl --save-baseline=baseline.csv
+#   ... change things ...
+#   ./run_bench.pl --baseline=baseline.csv --threshold=10
+#
+# To see how much the precompiled prelude saves, compare the backend
+# times against a run with --no-precompiled-prelude.  The prelude is
+# built only once, by the first script that needs it, and its time is
+# reported separately and not counted as compile time.
+#
+# Every image input is fed marlene.png.  Scripts that fail to compile
+# or render are reported and skipped.  The exit code is 1 if any
+# script got slower than the baseline by more than the threshold, in
+# either compile time or pixels per second.
+
+use strict;
+use warnings;
+
+use File::Find;
+use Getopt::Long;
+
+my @phases = ("parse", "optimize", "prelude", "backend", "load", "render");
+
+my $mathmap = "../mathmap";
+my $renders = 3;
+my $size = "256x256";
+my $threshold = 10;
+my $input = "marlene.png";
+my ($json_file, $csv_file, $baseline_file, $save_baseline_file);
+my $no_precompiled_prelude = 0;
+
+# compile times below this many seconds are too noisy to compare
+my $min_compare_time = 0.01;
+
+GetOptions("mathmap=s" => \$mathmap,
+	   "renders=i" => \$renders,
+	   "size=s" => \$size,
+	   "input=s" => \$input,
+	   "threshold=f" => \$threshold,
+	   "json=s" => \$json_file,
+	   "csv=s" => \$csv_file,
+	   "baseline=s" => \$baseline_file,
+	   "save-baseline=s" => \$save_baseline_file,
+	   "no-precompiled-prelude" => \$no_precompiled_prelude)
+    or die "Usage: $0 [--mathmap=BINARY] [--renders=N] [--size=WxH] [--input=IMAGE]\n"
+	. "          [--json=FILE] [--csv=FILE] [--baseline=FILE] [--save-baseline=FILE]\n"
+	. "          [--threshold=PERCENT] [--no-precompiled-prelude] [SCRIPT ...]\n";
+
+my @scripts = @ARGV;
+if (!@scripts) {
+    find(sub { push @scripts, $File::Find::name if /\.mm$/; }, "../examples");
+    push @scripts, glob("*.mm");
+    @scripts = sort @scripts;
+}
+
+sub image_inputs {
+    my ($script) = @_;
+    my %names = ();
+
+    open my $in, "<", $script or return ();
+    while (<$in>) {
+	$names{$1} = 1 while /\bimage\s+(\w+)/g;
+    }
+    close $in;
+
+    return sort keys %names;
+}
+
+sub run_script {
+    my ($script) = @_;
+    my @args = ($mathmap, "--bench-timing", "--bench-no-output",
+		"--bench-no-compile-time-limit", "--no-module-cache",
+		"--bench-render-count=$renders", "-s", $size);
+    my %result = (script => $script);
+
+    push @args, "--no-precompiled-prelude" if $no_precompiled_prelude;
+    push @args, map { "-D$_=$input" } image_inputs($script);
+    push @args, "-f", $script, "/dev/null";
+
+    open my $out, "-|", @args or return undef;
+    while (<$out>) {
+	if (/^bench (\w+) ([0-9.]+) ([0-9.]+)$/) {
+	    $result{"${1}_wall"} = $2;
+	    $result{"${1}_cpu"} = $3;
+	} elsif (/^bench pixels (\d+)$/) {
+	    $result{pixels} = $1;
+	}
+    }
+    close $out;
+
+    return undef if $? != 0 || !defined($result{pixels});
+
+    $result{compile_wall} = 0;
+    $result{compile_wall} += $result{"${_}_wall"} foreach ("parse", "optimize", "backend", "load");
+    $result{pixels_per_sec} = $result{render_wall} > 0 ? $result{pixels} / $result{render_wall} : 0;
+
+    return \%result;
+}
+
+my @columns = ("script", (map { ("${_}_wall", "${_}_cpu") } @phases),
+	       "compile_wall", "pixels", "pixels_per_sec");
+
+sub csv_quote {
+    my ($value) = @_;
+    $value =~ s/"/""/g;
+    return "\"$value\"";
+}
+
+sub write_csv {
+    my ($filename, @results) = @_;
+
+    open my $out, ">", $filename or die "Cannot write `$filename': $!\n";
+    print $out join(",", @columns), "\n";
+    foreach my $result (@results) {
+	print $out join(",", csv_quote($result->{script}), map { $result->{$_} } @columns[1..$#columns]), "\n";
+    }
+    close $out;
+}
+
+sub read_csv {
+    my ($filename) = @_;
+    my %results = ();
+
+    open my $in, "<", $filename or die "Cannot read `$filename': $!\n";
+    my $header = <$in>;
+    chomp $header;
+    my @names = split /,/, $header;
+    while (<$in>) {
+	chomp;
+	next unless /^"((?:[^"]|"")*)",(.*)$/;
+	my $script = $1;
+	my @values = split /,/, $2;
+	$script =~ s/""/"/g;
+	my %result = (script => $script);
+	@result{@names[1..$#names]} = @values;
+	$results{$script} = \%result;
+    }
+    close $in;
+
+    return \%results;
+}
+
+sub json_quote {
+    my ($value) = @_;
+    $value =~ s/(["\\])/\\$1/g;
+    return "\"$value\"";
+}
+
+sub write_json {
+    my ($filename, @results) = @_;
+
+    open my $out, ">", $filename or die "Cannot write `$filename': $!\n";
+    print $out "[\n";
+    for (my $i = 0; $i < @results; ++$i) {
+	my $result = $results[$i];
+	print $out "  { \"script\": ", json_quote($result->{script});
+	print $out ", \"$_\": $result->{$_}" foreach @columns[1..$#columns];
+	print $out " }", ($i < $#results ? "," : ""), "\n";
+    }
+    print $out "]\n";
+    close $out;
+}
+
+my @results = ();
+my @failed = ();
+
+foreach my $script (@scripts) {
+    my $result = run_script($script);
+
+    if (!defined($result)) {
+	print "FAILED  $script\n";
+	push @failed, $script;
+	next;
+    }
+
+    printf "%8.3f s compile %12.0f pixels/s  %s\n",
+	$result->{compile_wall}, $result->{pixels_per_sec}, $script;
+    push @results, $result;
+}
+
+write_csv($csv_file, @results) if defined($csv_file);
+write_csv($save_baseline_file, @results) if defined($save_baseline_file);
+write_json($json_file, @results) if defined($json_file);
+
+if (@failed) {
+    print "\nThe following scripts failed and were skipped:\n";
+    print "  $_\n" foreach @failed;
+}
+
+exit 0 unless defined($baseline_file);
+
+my $baseline = read_csv($baseline_file);
+my @regressions = ();
+my $factor = 1 + $threshold / 100;
+
+foreach my $result (@results) {
+    my $base = $baseline->{$result->{script}};
+
+    next unless defined($base);
+
+    if ($base->{compile_wall} >= $min_compare_time
+	&& $result->{compile_wall} > $base->{compile_wall} * $factor) {
+	push @regressions, sprintf("%s: compile time %.3f s -> %.3f s",
+				   $result->{script}, $base->{compile_wall}, $result->{compile_wall});
+    }
+    if ($base->{pixels_per_sec} > 0
+	&& $result->{pixels_per_sec} * $factor < $base->{pixels_per_sec}) {
+	push @regressions, sprintf("%s: render speed %.0f -> %.0f pixels/s",
+				   $result->{script}, $base->{pixels_per_sec}, $result->{pixels_per_sec});
+    }
+}
+
+if (@regressions) {
+    print "\nRegressions beyond $threshold%:\n";
+    print "  $_\n" foreach @regressions;
+    exit 1;
+}
+
+print "\nNo regressions beyond $threshold%.\n";
+exit 0;
@@ -5,6 +5,11 @@ FAILEDFILE=/tmp/mathtest_failed_$$
 
 TESTS_FAILED=0
 
+# The configuration being tested and the arguments that select it.
+# The references are always made with the default configuration.
+CONFIG=default
+CONFIG_ARGS=
+
 rm -f $FAILEDFILE
 
 # Some versions of perceptualdiff are broken - they return 0 on
@@ -18,9 +23,9 @@ fi
 
 test_failed () {
     SCRIPT=$1
-    echo "Error: Script $SCRIPT failed."
+    echo "Error: Script $SCRIPT failed ($CONFIG)."
     TESTS_FAILED=1
-    echo "$SCRIPT" >>$FAILEDFILE
+    echo "$SCRIPT ($CONFIG)" >>$FAILEDFILE
 }
 
 run_test () {
@@ -28,7 +33,7 @@ run_test () {
     REFERENCE=$2
     INPUT_ARGS=$3
 
-    echo "Running $SCRIPT"
+    echo "Running $SCRIPT ($CONFIG)"
 
     if [ ! -f "$REFERENCE" ] ; then
 	echo "Reference file doesn't exist - creating it."
@@ -40,7 +45,7 @@ run_test () {
     fi
 
     rm -f "$OUTFILE"
-    ../mathmap -i -f "$SCRIPT" $INPUT_ARGS "$OUTFILE" >&/dev/null
+    ../mathmap -i $CONFIG_ARGS -f "$SCRIPT" $INPUT_ARGS "$OUTFILE" >&/dev/null
     if [ ! -f "$OUTFILE" ] ; then
 	echo "Error: MathMap did not produce an output image."
 	exit 1
@@ -67,8 +72,7 @@ run_modify_test () {
     run_test "$1" "$2" "-Din=marlene.png $3"
 }
 
-
-
+run_all_tests () {
 run_render_test Apply.mm apply.png
 run_modify_test Circle.mm circle.png
 run_modify_test Closure.mm closure.png
@@ -183,6 +187,31 @@ run_modify_test "../examples/Utilities/Render.mm" utilities_render.png
 run_modify_test "../examples/Utilities/Visualize FFT.mm" utilities_visualize_fft.png
 run_modify_test "../examples/Utilities/Visualize Magnitude.mm" utilities_visualize_magnitude.png
 run_modify_test "../examples/Utilities/Visualize Sum.mm" utilities_visualize_sum.png
+}
+
+# The default configuration uses the C backend with vectorized pixel
+# code and split tuple phis.  The other configurations must render the
+# same images.
+
+run_all_tests
+
+CONFIG="scalar code"
+CONFIG_ARGS="--no-module-cache --no-vectorize"
+run_all_tests
+
+CONFIG="unsplit tuple phis"
+CONFIG_ARGS="--no-module-cache --no-split-tuple-phis"
+run_all_tests
+
+CONFIG=interpreter
+CONFIG_ARGS="--interpreter"
+run_all_tests
+
+if ../mathmap --help | grep -q -e --tcc ; then
+    CONFIG=tcc
+    CONFIG_ARGS="--no-module-cache --tcc"
+    run_all_tests
+fi
 
 if [ $TESTS_FAILED -ne 0 ] ; then
     echo "The following tests failed:"
@@ -396,11 +396,10 @@ set_userval_to_default (userval_t *val, userval_info_t *info, mathmap_invocation
 
 	case USERVAL_IMAGE :
 	    {
-		input_drawable_t *drawable = get_default_input_drawable();
+		input_drawable_t *drawable = copy_default_input_drawable();
 
 		if (drawable != NULL)
-		    assign_image_userval_drawable(info, val,
-						  copy_input_drawable(drawable));
+		    assign_image_userval_drawable(info, val, drawable);
 		else
 		    val->v.image = NULL;
 	    }
@@ -512,7 +511,7 @@ copy_userval (userval_t *dst, userval_t *src, int type)
 		{
 		    input_drawable_t *copy = copy_input_drawable(src->v.image->v.drawable);
 
-		    dst->v.image = &copy->image;
+		    dst->v.image = copy != 0 ? &copy->image : 0;
 		}
 		else
 		    dst->v.image = 0;
@@ -25,13 +25,14 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <glib.h>
+
 #include "vars.h"
 
 variable_t*
 alloc_variable (tuple_info_t type)
 {
     variable_t *var;
-    int i;
 
     var = (variable_t*)malloc(sizeof(variable_t));
 
@@ -39,18 +40,6 @@ alloc_variable (tuple_info_t type)
     var->type = type;
     var->next = 0;
 
-    var->compvar = (struct _compvar_t**)malloc(sizeof(struct _compvar_t*) * type.length);
-    assert(var->compvar != 0);
-
-    var->last_index = (int*)malloc(sizeof(int) * type.length);
-    assert(var->last_index != 0);
-
-    for (i = 0; i < type.length; ++i)
-    {
-	var->compvar[i] = 0;
-	var->last_index[i] = 0;
-    }
-
     return var;
 }
 
@@ -91,12 +80,12 @@ lookup_variable (variable_t *vars, const char *name, tuple_info_t *type)
 variable_t*
 new_temporary_variable (variable_t **vars, tuple_info_t type)
 {
-    static int num = 0;
-    static char buf[64];
+    static volatile gint num = 0;
 
+    char buf[64];
     variable_t *var = alloc_variable(type);
 
-    sprintf(buf, "tmp____%d", ++num);
+    sprintf(buf, "tmp____%d", g_atomic_int_exchange_and_add(&num, 1) + 1);
     var->name = strdup(buf);
     assert(var->name != 0);
 
@@ -111,23 +100,6 @@ new_temporary_variable (variable_t **vars, tuple_info_t type)
     return var;
 }
 
-void
-compiler_reset_variables (variable_t *vars)
-{
-    while (vars != 0)
-    {
-	int i;
-
-	for (i = 0; i < vars->type.length; ++i)
-	{
-	    vars->compvar[i] = 0;
-	    vars->last_index[i] = 0;
-	}
-
-	vars = vars->next;
-    }
-}
-
 void
 free_variables (variable_t *vars)
 {
@@ -136,8 +108,6 @@ free_variables (variable_t *vars)
 	variable_t *next = vars->next;
 
 	free(vars->name);
-	free(vars->compvar);
-	free(vars->last_index);
 	free(vars);
 
 	vars = next;